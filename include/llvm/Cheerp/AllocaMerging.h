@@ -18,6 +18,9 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace cheerp {
 
@@ -58,12 +61,38 @@ public:
 	void getAnalysisUsage(llvm::AnalysisUsage & AU) const;
 };
 
+// This class moves the allocas of functions which can't have more than one active frame
+// to preallocated globals, so that they are not allocated again on every call.
+// A function may have more than one active frame if it is recursive or if it may call JavaScript code
+// which calls it back, either as a callback or as an exported method.
+// Functions which are never active at the same time share the same globals.
+class AllocaStaticFrames: public llvm::ModulePass
+{
+private:
+	typedef std::unordered_map<const llvm::Function*, std::vector<const llvm::Function*>> CallGraph;
+	typedef std::unordered_set<const llvm::Function*> FunctionSet;
+	/**
+	 * Build the graph of direct calls, calls to unknown code are assumed to reach every function in reentryPoints
+	 */
+	static void buildCallGraph(llvm::Module& M, const std::vector<const llvm::Function*>& reentryPoints, CallGraph& callGraph);
+	/**
+	 * Collect the functions which may be called, directly or not, while F is active
+	 */
+	static void collectReachable(const CallGraph& callGraph, const llvm::Function* F, FunctionSet& reachable);
+public:
+	static char ID;
+	explicit AllocaStaticFrames() : ModulePass(ID) { }
+	bool runOnModule(llvm::Module& M);
+	const char *getPassName() const;
+};
+
 //===----------------------------------------------------------------------===//
 //
 // AllocaMerging - This pass merges allocas which are not used at the same time
 //
 llvm::FunctionPass *createAllocaMergingPass();
 llvm::FunctionPass *createAllocaArraysMergingPass();
+llvm::ModulePass *createAllocaStaticFramesPass();
 }
 
 #endif //_CHEERP_ALLOCA_MERGING_H
@@ -0,0 +1,70 @@
+//===-- Cheerp/CompressedStream.h - Cheerp gzip compressed output ---------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_COMPRESSED_STREAM_H
+#define _CHEERP_COMPRESSED_STREAM_H
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/raw_ostream.h"
+#include <deque>
+#include <string>
+#if LLVM_ENABLE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace cheerp
+{
+
+/**
+ * CompressedOutputStream - Compress the data written to it in the gzip format, and write the result to another stream.
+ *
+ * The data is compressed by a separate thread, so that compression overlaps with code generation. When too many
+ * buffers are waiting, writing blocks until the compression catches up, so the memory used stays bounded.
+ * The position returned by tell() is the one in the uncompressed data.
+ */
+class CompressedOutputStream: public llvm::raw_ostream
+{
+public:
+	explicit CompressedOutputStream(llvm::raw_ostream& output);
+	~CompressedOutputStream();
+	/**
+	 * Compress the remaining data and write the end of the gzip stream. Nothing can be written afterwards
+	 */
+	void close();
+private:
+	void write_impl(const char* ptr, size_t size) override;
+	uint64_t current_pos() const override
+	{
+		return pos;
+	}
+	void compressChunk(llvm::StringRef chunk);
+
+	llvm::zlib::GzipCompressor compressor;
+	llvm::zlib::Status status;
+	uint64_t pos;
+	bool closed;
+#if LLVM_ENABLE_THREADS
+	void compressPendingChunks();
+
+	std::deque<std::string> pendingChunks;
+	std::mutex pendingChunksMutex;
+	std::condition_variable chunkAdded;
+	std::condition_variable chunkRemoved;
+	std::thread compressionThread;
+#endif
+};
+
+}
+
+#endif
@@ -89,6 +89,38 @@ public:
 	 * Determine if we need to compile a createPointerArrays function
 	 */
 	bool needCreatePointerArray() const { return hasPointerArrays; }
+
+	/**
+	 * Determine if we need to compile a cheerpMemCopy function, used by memcpy and memmove with a variable size
+	 */
+	bool needMemCopy() const { return hasVariableMemCopies; }
+
+	/**
+	 * Get the globals which can be initialized lazily on first access.
+	 *
+	 * Their initializer does not depend on other global variables and they are only used by code,
+	 * so evaluating it at the first use cannot be observed by the program.
+	 */
+	const std::unordered_set<const llvm::GlobalVariable*> & lazyGlobals() const { return lazyGlobalsSet; }
+
+	/**
+	 * Partition the functions of the module for code splitting.
+	 *
+	 * Functions which are reachable from the roots of the program only through one of the entryPoints
+	 * are moved to the secondary chunk. All the globals and the remaining functions stay in the core chunk.
+	 * It must be called after all the passes which may add functions to the module.
+	 */
+	void splitFunctions( const llvm::Module &, const std::vector<const llvm::Function*>& entryPoints );
+
+	/**
+	 * Get the functions compiled in the secondary chunk, they are empty unless splitFunctions is called
+	 */
+	const std::unordered_set<const llvm::Function*> & secondaryFunctions() const { return secondaryChunkFunctions; }
+
+	/**
+	 * Get the entry points of the secondary chunk, the core chunk only contains stubs for them
+	 */
+	const std::vector<const llvm::Function*> & secondaryEntryPoints() const { return secondaryChunkEntryPoints; }
 	
 	bool runOnModule( llvm::Module & ) override;
 
@@ -141,6 +173,11 @@ private:
 	 */
 	int filterModule( llvm::Module & );
 
+	/**
+	 * Fill lazyGlobalsSet, it must be called after filterModule
+	 */
+	void computeLazyGlobals( const llvm::Module & );
+
 	std::unordered_set< const llvm::GlobalValue * > reachableGlobals; // Set of all the reachable globals
 	
 	FixupMap varsFixups;
@@ -152,9 +189,14 @@ private:
 	std::vector< const llvm::GlobalVariable * > varsOrder;
 	std::vector< llvm::GlobalValue * > externals;
 	
+	std::unordered_set< const llvm::GlobalVariable* > lazyGlobalsSet;
+	std::unordered_set< const llvm::Function* > secondaryChunkFunctions;
+	std::vector< const llvm::Function* > secondaryChunkEntryPoints;
+
 	bool hasCreateClosureUsers;
 	bool hasVAArgs;
 	bool hasPointerArrays;
+	bool hasVariableMemCopies;
 };
 
 inline llvm::Pass * createGlobalDepsAnalyzerPass()
@@ -0,0 +1,120 @@
+//===-- Cheerp/I64Lowering.h - Cheerp utility code ------------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2014 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_I64_LOWERING_H
+#define _CHEERP_I64_LOWERING_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <vector>
+
+namespace llvm
+{
+
+/**
+ * I64Lowering - Replace every i64 value with a pair of i32 values, the low and the high word.
+ *
+ * i64 memory is stored as pairs of i32 words, low word first. Pointers to i64 memory always
+ * point to i32 words, so they can be used with typed arrays and DataViews.
+ * Functions taking i64 arguments receive them as two i32 arguments, the high word of
+ * an i64 return value is passed in a global slot.
+ * Multiplication, shifts and comparisons are expanded inline, division and remainder
+ * use helper functions generated by the pass.
+ */
+class I64Lowering: public ModulePass
+{
+public:
+	static char ID;
+	explicit I64Lowering() : ModulePass(ID), highSlot(NULL), udivHelper(NULL), uremHelper(NULL) { }
+
+	bool runOnModule( Module & ) override;
+
+	const char *getPassName() const override;
+private:
+	typedef std::pair<Value*, Value*> LoHi;
+	typedef IRBuilder<> Builder;
+
+	/**
+	 * Return the number of i32 words used to store t, or 0 if t does not need to be lowered.
+	 * Only i64 and arrays of them are supported.
+	 */
+	static uint32_t getWordCount(Type* t);
+	static bool needsLowering(FunctionType* FT);
+	/**
+	 * Return true if I has i64 operands or results, or uses pointers to i64 memory
+	 */
+	static bool usesI64(const Instruction& I);
+
+	GlobalVariable* getHighSlot(Module& M);
+	Function* getDivRemHelper(Module& M, bool isRem);
+
+	void lowerGlobals(Module& M);
+	void lowerSignature(Function& F);
+	void lowerStorage(Function& F);
+	void lowerFunction(Function& F);
+	void lowerInstruction(Instruction& I);
+	/**
+	 * Replace a switch on an i64 value with a switch on the high word, which jumps to a switch on the low word
+	 */
+	void lowerSwitch(SwitchInst* SI);
+	/**
+	 * Return C with every pointer to i64 memory rewritten to point to words, at any depth of
+	 * constant expressions and aggregates. C is returned unchanged if it does not use i64 memory.
+	 */
+	Constant* lowerConstant(Constant* C);
+	/**
+	 * Return true if some constant operand of I must be rewritten by lowerConstant
+	 */
+	bool usesI64Constants(Instruction& I);
+
+	/**
+	 * Return a i32* pointer to the first word of the memory pointed by p
+	 */
+	Value* getWordPointer(Builder& IRB, Value* p);
+	LoHi getLoHi(Value* v);
+
+	LoHi createAdd(Builder& IRB, const LoHi& a, const LoHi& b);
+	LoHi createSub(Builder& IRB, const LoHi& a, const LoHi& b);
+	LoHi createMul(Builder& IRB, const LoHi& a, const LoHi& b);
+	LoHi createNeg(Builder& IRB, const LoHi& a);
+	LoHi createShift(Builder& IRB, unsigned opcode, const LoHi& a, Value* amount);
+	LoHi createDivRem(Builder& IRB, unsigned opcode, const LoHi& a, const LoHi& b);
+	LoHi createSelect(Builder& IRB, Value* cond, const LoHi& a, const LoHi& b);
+	Value* createICmp(Builder& IRB, CmpInst::Predicate pred, const LoHi& a, const LoHi& b);
+	Value* createToFP(Builder& IRB, bool isSigned, const LoHi& a, Type* destType);
+	LoHi createFromFP(Builder& IRB, bool isSigned, Value* v);
+
+	GlobalVariable* highSlot;
+	Function* udivHelper;
+	Function* uremHelper;
+	// Original functions with i64 in their signature, mapped to the lowered ones
+	DenseMap<Function*, Function*> loweredFunctions;
+	// Low and high words of every lowered i64 value
+	DenseMap<Value*, LoHi> loweredValues;
+	// Instructions which have been replaced, they are erased after the whole function is lowered
+	std::vector<Instruction*> deadInsts;
+	// PHIs of the original i64 values are filled after all the incoming values are lowered
+	std::vector<std::pair<PHINode*, LoHi>> pendingPHIs;
+	// Results of lowerConstant
+	DenseMap<Constant*, Constant*> loweredConstants;
+};
+
+//===----------------------------------------------------------------------===//
+//
+// I64Lowering
+//
+ModulePass *createI64LoweringPass();
+
+}
+
+#endif
@@ -25,14 +25,43 @@ class GlobalDepsAnalyzer;
 
 // This class is responsible for generate unique names for a llvm::Value
 // The class is dependent on registerize to work properly
+// After construction the names are immutable, so it is safe to query them from multiple threads
 class NameGenerator
 {
 public:
 	/**
 	 * This initialize the namegenerator by collecting
-	 * all the global variable names
+	 * all the global variable names.
+	 * If makeStableNames is set the compressed names of each function only depend on the function itself,
+	 * and the globals keep the names derived from their symbols. Readable names are always stable.
 	 */
-	explicit NameGenerator( const llvm::Module&, const GlobalDepsAnalyzer &, const Registerize &, const PointerAnalyzer& PA, bool makeReadableNames = true );
+	explicit NameGenerator( const llvm::Module&, const GlobalDepsAnalyzer &, const Registerize &, const PointerAnalyzer& PA,
+				bool makeReadableNames = true, bool makeStableNames = false );
+
+	/**
+	 * Context used to compile the PHIs on an edge between two blocks.
+	 * It is owned by the caller so that names can be queried concurrently.
+	 */
+	struct EdgeContext
+	{
+		const llvm::BasicBlock* fromBB;
+		const llvm::BasicBlock* toBB;
+		EdgeContext():fromBB(NULL), toBB(NULL)
+		{
+		}
+		EdgeContext(const llvm::BasicBlock* f, const llvm::BasicBlock* t):fromBB(f), toBB(t)
+		{
+		}
+		bool isNull() const
+		{
+			return fromBB==NULL;
+		}
+		void clear()
+		{
+			fromBB=NULL;
+			toBB=NULL;
+		}
+	};
 
 	/**
 	 * Return the computed name for the given variable.
@@ -42,13 +71,12 @@ public:
 	{
 		assert(namemap.count(v) );
 		assert(! namemap.at(v).empty() );
-		if(!edgeContext.isNull())
-			return getNameForEdge(v);
 		return namemap.at(v);
 	}
 
 	/**
-	 * Some values, such as arguments which are REGULAR pointers needs two names
+	 * Some values, such as arguments which are REGULAR pointers needs two names.
+	 * REGULAR pointers returned by calls also need two names, the second one holds the offset read from oSlot.
 	 */
 	llvm::StringRef getSecondaryName(const llvm::Value* v) const
 	{
@@ -57,6 +85,16 @@ public:
 		return secondaryNamemap.at(v);
 	}
 
+	bool hasSecondaryName(const llvm::Value* v) const
+	{
+		return secondaryNamemap.count(v);
+	}
+
+	bool hasName(const llvm::Value* v) const
+	{
+		return namemap.count(v);
+	}
+
 	/**
 	 * Return a JS compatible name for the StructType, potentially minimized
 	 * A name is guaranteed also for literal structs which have otherwise no name
@@ -67,22 +105,25 @@ public:
 		return typemap.at(T);
 	}
 
+	bool hasTypeName(llvm::Type* T) const
+	{
+		return typemap.count(T);
+	}
+
 	/**
 	 * Same as getName, but supports the required temporary variables in edges between blocks
-	 * It uses the current edge context.
+	 * It uses the passed edge context.
 	*/
-	llvm::StringRef getNameForEdge(const llvm::Value* v) const;
-
-	void setEdgeContext(const llvm::BasicBlock* fromBB, const llvm::BasicBlock* toBB)
-	{
-		assert(edgeContext.isNull());
-		edgeContext.fromBB=fromBB;
-		edgeContext.toBB=toBB;
-	}
+	llvm::StringRef getNameForEdge(const llvm::Value* v, const EdgeContext& edgeContext) const;
 
-	void clearEdgeContext()
+	/**
+	 * Like getName, but use the edge names if a valid edge context is passed
+	 */
+	llvm::StringRef getName(const llvm::Value* v, const EdgeContext& edgeContext) const
 	{
-		edgeContext.clear();
+		if(!edgeContext.isNull())
+			return getNameForEdge(v, edgeContext);
+		return getName(v);
 	}
 
 	enum NAME_FILTER_MODE { GLOBAL = 0, LOCAL, LOCAL_SECONDARY };
@@ -91,6 +132,7 @@ public:
 
 private:
 	void generateCompressedNames( const llvm::Module& M, const GlobalDepsAnalyzer & );
+	void generateStableNames( const llvm::Module& M, const GlobalDepsAnalyzer & );
 	void generateReadableNames( const llvm::Module& M, const GlobalDepsAnalyzer & );
 	void generateTypeNames( const GlobalDepsAnalyzer& );
 	
@@ -127,24 +169,17 @@ private:
 	};
 	typedef std::unordered_map<InstOnEdge, llvm::SmallString<8>, InstOnEdge::Hash > EdgeNameMapTy;
 	EdgeNameMapTy edgeNamemap;
-	struct EdgeContext
-	{
-		const llvm::BasicBlock* fromBB;
-		const llvm::BasicBlock* toBB;
-		EdgeContext():fromBB(NULL), toBB(NULL)
-		{
-		}
-		bool isNull() const
-		{
-			return fromBB==NULL;
-		}
-		void clear()
-		{
-			fromBB=NULL;
-			toBB=NULL;
-		}
-	};
-	EdgeContext edgeContext;
+
+	typedef std::pair<unsigned, std::vector<const llvm::Value *> > useValuesPair;
+	typedef std::vector<useValuesPair> useValuesVec;
+	typedef std::pair<unsigned, std::vector<InstOnEdge> > useInstsOnEdgePair;
+	typedef std::vector<useInstsOnEdgePair> useInstsOnEdgeVec;
+	class CompressedPHIHandler;
+	/**
+	 * Collect the values of f which need a name, grouped by register, followed by the arguments.
+	 * The temporary PHIs of the edges are added to allTmpPHIs, grouped by their position in the edge.
+	 */
+	void collectLocalValues( const llvm::Function& f, useValuesVec& thisFunctionLocals, useInstsOnEdgeVec& allTmpPHIs );
 };
 
 }
@@ -0,0 +1,61 @@
+//===-- Cheerp/OutputCache.h - Cheerp cache of the compiled functions -----===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_OUTPUT_CACHE_H
+#define _CHEERP_OUTPUT_CACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include <string>
+
+namespace cheerp
+{
+
+/**
+ * FunctionOutputCache - Store the JavaScript code of the compiled functions in a directory,
+ * so that the functions which did not change can be reused by the next compilation.
+ *
+ * The key of each function is computed by CheerpWriter::getFunctionCacheKey, it identifies both the IR
+ * of the function and all the analysis results and names which are used to compile it.
+ * Each entry is stored in its own file, so the cache can be safely used by several threads and processes.
+ *
+ * The entries are stored in a subdirectory named after the cache format version and the MD5 of the executable
+ * which contains the writer, so that a different build of the compiler never reuses them. Entries are never
+ * removed: the directory grows with every changed function and every new build of the compiler, the
+ * subdirectories of old builds can be deleted at any time.
+ */
+class FunctionOutputCache
+{
+public:
+	/**
+	 * The cache is disabled if the executable of the compiler cannot be read
+	 */
+	explicit FunctionOutputCache(const std::string& directory);
+	/**
+	 * Return false if the key is not in the cache, or if the entry cannot be read
+	 */
+	bool lookup(llvm::StringRef key, std::string& output) const;
+	/**
+	 * Errors are ignored, the function will be compiled again the next time
+	 */
+	void store(llvm::StringRef key, llvm::StringRef output) const;
+private:
+	// Empty if the cache is disabled
+	std::string directory;
+	std::string getEntryPath(llvm::StringRef key) const;
+	/**
+	 * Return the MD5 of the executable which contains the writer, or an empty string on failure
+	 */
+	static std::string getCompilerId();
+};
+
+}
+
+#endif
@@ -14,12 +14,15 @@
 
 #include "llvm/Pass.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/Timer.h"
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 namespace cheerp {
 
@@ -89,14 +92,16 @@ struct IndirectPointerKindConstraint
 	};
 	uint32_t i;
 	INDIRECT_POINTER_KIND_CONSTRAINT kind;
-	mutable bool isBeingVisited;
-	IndirectPointerKindConstraint(INDIRECT_POINTER_KIND_CONSTRAINT k, const void* p):ptr(p),i(0xffffffff),kind(k),isBeingVisited(false)
+	// Identifier assigned when the constraint is made unique by PointerData::getConstraintPtr
+	mutable uint32_t id;
+	enum { NO_ID = 0xffffffff };
+	IndirectPointerKindConstraint(INDIRECT_POINTER_KIND_CONSTRAINT k, const void* p):ptr(p),i(0xffffffff),kind(k),id(NO_ID)
 	{
 		assert(k == RETURN_CONSTRAINT || k == DIRECT_ARG_CONSTRAINT || k == STORED_TYPE_CONSTRAINT ||
 			k == RETURN_TYPE_CONSTRAINT || k == DIRECT_ARG_CONSTRAINT_IF_ADDRESS_TAKEN);
 	}
 	IndirectPointerKindConstraint(INDIRECT_POINTER_KIND_CONSTRAINT k, const TypeAndIndex& typeAndIndex):ptr(typeAndIndex.type),i(typeAndIndex.index),
-														kind(k),isBeingVisited(false)
+														kind(k),id(NO_ID)
 	{
 		assert(k == BASE_AND_INDEX_CONSTRAINT || k == INDIRECT_ARG_CONSTRAINT);
 	}
@@ -114,6 +119,33 @@ struct IndirectPointerKindConstraint
 	};
 };
 
+/**
+ * ConstraintsSet - A set of unique constraints, sorted by their identifiers
+ *
+ * Most pointers only depend on a few constraints, a sorted vector is smaller and faster than a hash set
+ * and it also makes the order of visit deterministic.
+ */
+class ConstraintsSet
+{
+private:
+	typedef llvm::SmallVector<const IndirectPointerKindConstraint*, 2> VectorTy;
+	VectorTy constraints;
+	static bool compareById(const IndirectPointerKindConstraint* l, const IndirectPointerKindConstraint* r)
+	{
+		return l->id < r->id;
+	}
+public:
+	typedef VectorTy::const_iterator const_iterator;
+	const_iterator begin() const { return constraints.begin(); }
+	const_iterator end() const { return constraints.end(); }
+	bool empty() const { return constraints.empty(); }
+	size_t size() const { return constraints.size(); }
+	void clear() { constraints.clear(); }
+	void swap(ConstraintsSet& rhs) { constraints.swap(rhs.constraints); }
+	void insert(const IndirectPointerKindConstraint* c);
+	void insert(const ConstraintsSet& rhs);
+};
+
 class PointerKindWrapper
 {
 private:
@@ -128,7 +160,7 @@ private:
 	}
 public:
 	// We can store pointers to constraint as they are made unique by PointerData::getConstraintPtr
-	std::unordered_set<const IndirectPointerKindConstraint*> constraints;
+	ConstraintsSet constraints;
 	PointerKindWrapper():kind(COMPLETE_OBJECT)
 	{
 	}
@@ -206,7 +238,7 @@ private:
 		constraints.clear();
 	}
 public:
-	std::unordered_set<const IndirectPointerKindConstraint*> constraints;
+	ConstraintsSet constraints;
 	PointerConstantOffsetWrapper():offset(NULL),status(UNINITALIZED)
 	{
 	}
@@ -274,7 +306,8 @@ class PointerAnalyzer : public llvm::ModulePass
 {
 public:
 	PointerAnalyzer() : 
-		ModulePass(ID)
+		ModulePass(ID),
+		concurrentQueries(false)
 #ifndef NDEBUG
 		,fullyResolved(false),
 		timerGroup("Pointer Analyzer"),
@@ -316,6 +349,16 @@ public:
 	void fullResolve();
 	// Compute all the offsets for REGULAR pointer which may be assumed constant
 	void computeConstantOffsets(const llvm::Module& M );
+	// Cache and resolve everything which may be queried while compiling the functions of the module.
+	// After this call all the const methods are plain lookups and can be called from multiple threads.
+	// It must be called after computeConstantOffsets.
+	void prepareForConcurrentQueries(const llvm::Module& M );
+
+	/**
+	 * Sizes of the internal caches, used for reporting
+	 */
+	uint32_t getNumAnalyzedPointers() const { return pointerKindData.valueMap.size(); }
+	uint32_t getNumConstraints() const { return pointerKindData.constraintsMap.size(); }
 
 #ifndef NDEBUG
 	mutable bool fullyResolved;
@@ -324,11 +367,18 @@ public:
 #endif //NDEBUG
 	struct AddressTakenMap: public llvm::DenseMap<const llvm::Function*, bool>
 	{
+		AddressTakenMap():concurrentQueries(false)
+		{
+		}
+		// Set by prepareForConcurrentQueries, the map must not be modified afterwards
+		bool concurrentQueries;
 		bool checkAddressTaken(const llvm::Function* F)
 		{
 			auto it=find(F);
 			if(it==end())
 			{
+				if(concurrentQueries)
+					llvm::report_fatal_error("Function not cached by prepareForConcurrentQueries");
 				bool ret=F->hasAddressTaken();
 				insert(std::make_pair(F, ret));
 				return ret;
@@ -344,11 +394,30 @@ public:
 		typedef std::map<TypeAndIndex, T> TypeAndIndexMap;
 		typedef std::unordered_map<IndirectPointerKindConstraint, T, IndirectPointerKindConstraint::Hash> ConstraintsMap;
 		ConstraintsMap constraintsMap;
+		// Number of identifiers assigned to unique constraints
+		uint32_t numConstraintIds;
+		PointerData():numConstraintIds(0)
+		{
+		}
 		// Helper function to make constraints unique, they are stored as the key field into constraintsMap
 		// and may or may not hold any actual pointer data as the corresponding valiue
 		const IndirectPointerKindConstraint* getConstraintPtr(const IndirectPointerKindConstraint& c)
 		{
-			return &constraintsMap.insert(std::make_pair(c, T())).first->first;
+			const IndirectPointerKindConstraint& ret = constraintsMap.insert(std::make_pair(c, T())).first->first;
+			if(ret.id == IndirectPointerKindConstraint::NO_ID)
+				ret.id = numConstraintIds++;
+			return &ret;
+		}
+		// Return the unique constraints indexed by their identifiers
+		std::vector<const IndirectPointerKindConstraint*> getConstraintsById() const
+		{
+			std::vector<const IndirectPointerKindConstraint*> ret(numConstraintIds);
+			for(const auto& it: constraintsMap)
+			{
+				if(it.first.id != IndirectPointerKindConstraint::NO_ID)
+					ret[it.first.id] = &it.first;
+			}
+			return ret;
 		}
 
 		ValueKindMap valueMap;
@@ -366,6 +435,9 @@ private:
 	mutable PointerOffsetData pointerOffsetData;
 	mutable AddressTakenMap addressTakenCache;
 
+	// Set by prepareForConcurrentQueries, the caches must not be modified afterwards.
+	// Timers are not thread safe, they are disabled too
+	bool concurrentQueries;
 #ifndef NDEBUG
 	mutable llvm::TimerGroup timerGroup;
 	mutable llvm::Timer gpkTimer, gpkfrTimer;
@@ -15,6 +15,9 @@
 #include "llvm/Pass.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include <map>
+#include <set>
+#include <vector>
 
 namespace llvm
 {
@@ -79,6 +82,52 @@ public:
 //
 ModulePass *createIndirectCallOptimizerPass();
 
+/**
+ * Replace indirect calls which have few possible targets with guarded direct calls.
+ *
+ * The possible targets of a call are the functions whose address is taken with the type of the callee,
+ * either directly or through a bitcast, as in vtables. When all the targets are known the last one
+ * is called without a guard, so that a call with a single target becomes a plain direct call.
+ * JavaScript engines can inline calls to a function by name, but not calls through a function value.
+ *
+ * A type is only closed if no function pointer of that type may be read from memory of another type,
+ * so any cast involving a pointer to it, or to an aggregate containing it, makes it open.
+ */
+class IndirectCallSpeculation: public ModulePass
+{
+public:
+	static char ID;
+	explicit IndirectCallSpeculation(uint32_t maxTargets) : ModulePass(ID), maxTargets(maxTargets) { }
+	bool runOnModule(Module &);
+	const char *getPassName() const;
+
+	virtual void getAnalysisUsage(AnalysisUsage&) const override;
+private:
+	typedef std::map<Type*, std::vector<Constant*>> TargetsMap;
+	/**
+	 * Collect the possible targets of each function pointer type. openTypes is filled with the types
+	 * of the function pointers which may come from outside the module, they may have other targets.
+	 */
+	static void collectTargets(Module& M, TargetsMap& targets, std::set<Type*>& openTypes);
+	/**
+	 * Add to openTypes the function pointer types which are t or can be reached from t through pointers and aggregates
+	 */
+	static void addReachableFunctionPointers(Type* t, std::set<Type*>& openTypes, std::set<Type*>& visitedTypes);
+	/**
+	 * Add to openTypes the function pointer types reachable from the casts in the constant expressions of c
+	 */
+	static void visitConstant(const Constant* c, std::set<Type*>& openTypes, std::set<Type*>& visitedTypes,
+	                          std::set<const Constant*>& visitedConstants);
+	static void speculateCall(CallInst* ci, const std::vector<Constant*>& targets, bool isClosed);
+	uint32_t maxTargets;
+};
+
+//===----------------------------------------------------------------------===//
+//
+// IndirectCallSpeculation - Speculate the targets of indirect calls
+//
+ModulePass *createIndirectCallSpeculationPass(uint32_t maxTargets);
+
 /**
  * This pass will convert PHIs of pointers inside the same array to PHIs of the corresponding indexes
  * It is useful to avoid generating tons of small pointer objects in tight loops.
@@ -123,15 +172,17 @@ public:
 FunctionPass *createPointerToImmutablePHIRemovalPass();
 
 /**
- * This pass removes all free/delete/delete[] calls as their are no-op in Cheerp
+ * This pass removes all free/delete/delete[] calls as their are no-op in Cheerp.
+ * When the arena heap is used the calls which may release typed arrays and byte layout objects are kept.
  */
 class FreeAndDeleteRemoval: public FunctionPass
 {
 private:
 	void deleteInstructionAndUnusedOperands(Instruction* I);
+	bool keepArenaHeapFrees;
 public:
 	static char ID;
-	explicit FreeAndDeleteRemoval() : FunctionPass(ID) { }
+	explicit FreeAndDeleteRemoval(bool keepArenaHeapFrees = false) : FunctionPass(ID), keepArenaHeapFrees(keepArenaHeapFrees) { }
 	bool runOnFunction(Function &F);
 	const char *getPassName() const;
 
@@ -142,7 +193,7 @@ public:
 //
 // FreeAndDeleteRemoval
 //
-FunctionPass *createFreeAndDeleteRemovalPass();
+FunctionPass *createFreeAndDeleteRemovalPass(bool keepArenaHeapFrees = false);
 
 }
 
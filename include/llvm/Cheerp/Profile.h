@@ -0,0 +1,72 @@
+//===-- Cheerp/Profile.h - Cheerp execution profiles ----------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_PROFILE_H
+#define _CHEERP_PROFILE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Function.h"
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * ProfileCounters - Describe the counters used to profile a function
+ *
+ * There is a counter for each basic block, the one of the entry block counts the calls to the function.
+ * They are followed by a counter for each distinct successor of the blocks having more than one.
+ * The layout only depends on the IR, so it is the same when instrumenting and when using the profile.
+ */
+class ProfileCounters
+{
+public:
+	explicit ProfileCounters(const llvm::Function& F);
+	uint32_t getNumCounters() const { return numCounters; }
+	uint32_t getBlockCounter(const llvm::BasicBlock* BB) const;
+	/**
+	 * Return -1 if the edge has no counter, the count is then the one of the source block
+	 */
+	int32_t getEdgeCounter(const llvm::BasicBlock* from, const llvm::BasicBlock* to) const;
+private:
+	std::unordered_map<const llvm::BasicBlock*, uint32_t> blockCounters;
+	std::map<std::pair<const llvm::BasicBlock*, const llvm::BasicBlock*>, uint32_t> edgeCounters;
+	uint32_t numCounters;
+};
+
+/**
+ * ProfileData - The counters collected by running a program compiled with -cheerp-instrument
+ *
+ * They are stored in the text format of llvm-profdata, so that the profiles of several runs
+ * can be merged. Each function is described by a line with its name and the number of counters,
+ * followed by a line for each counter and by an empty line.
+ */
+class ProfileData
+{
+public:
+	/**
+	 * Load the profile, return false and set ErrorString on failure
+	 */
+	bool load(const std::string& fileName, std::string& ErrorString);
+	/**
+	 * Return the counters of F, or NULL if F has not been profiled or the profile does not match its code
+	 */
+	const std::vector<uint64_t>* getCounters(const llvm::Function& F, const ProfileCounters& layout) const;
+private:
+	llvm::StringMap<std::vector<uint64_t>> functions;
+};
+
+}
+
+#endif
@@ -12,11 +12,13 @@
 #ifndef _CHEERP_REGISTERIZE_H
 #define _CHEERP_REGISTERIZE_H
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Cheerp/PointerAnalyzer.h"
 #include <set>
 #include <unordered_map>
+#include <vector>
 
 namespace cheerp
 {
@@ -53,7 +55,13 @@ public:
 		LiveRange(const Iterator& begin, const Iterator& end):llvm::SmallVector<LiveRangeChunk, 4>(begin,end)
 		{
 		}
+		/**
+		 * Both ranges must be sorted and made of non overlapping chunks
+		 */
 		bool doesInterfere(const LiveRange& other) const;
+		/**
+		 * Add the chunks of a non interfering range, keeping the chunks sorted
+		 */
 		void merge(const LiveRange& other);
 		void dump() const;
 	};
@@ -73,6 +81,7 @@ public:
 	const char *getPassName() const override;
 
 	uint32_t getRegisterId(const llvm::Instruction* I) const;
+	uint32_t getNumRegisteredInstructions() const { return registersMap.size(); }
 
 	void assignRegisters(llvm::Module& M, cheerp::PointerAnalyzer& PA);
 	void computeLiveRangeForAllocas(llvm::Function& F);
@@ -85,7 +94,7 @@ public:
 	}
 private:
 	// Final data structures
-	std::unordered_map<const llvm::Instruction*, uint32_t> registersMap;
+	llvm::DenseMap<const llvm::Instruction*, uint32_t> registersMap;
 	std::unordered_map<const llvm::AllocaInst*, LiveRange> allocaLiveRanges;
 	bool NoRegisterize;
 #ifndef NDEBUG
@@ -94,16 +103,18 @@ private:
 	// Temporary data structure used to compute the live range of an instruction
 	struct InstructionLiveRange
 	{
+		// The instruction is NULL if it does not need a register
+		llvm::Instruction* inst;
 		// codePathId is used to efficently coalesce uses in a sequential range when possible
 		uint32_t codePathId;
 		LiveRange range;
-		InstructionLiveRange(uint32_t c): codePathId(c)
+		InstructionLiveRange(): inst(NULL), codePathId(0)
 		{
 		}
 		void addUse(uint32_t codePathId, uint32_t thisIndex);
 	};
 	// Map from instructions to their unique identifier
-	typedef std::unordered_map<const llvm::Instruction*, uint32_t> InstIdMapTy;
+	typedef llvm::DenseMap<const llvm::Instruction*, uint32_t> InstIdMapTy;
 	struct CompareInstructionByID
 	{
 	private:
@@ -118,8 +129,8 @@ private:
 			return instIdMap.find(l)->second < instIdMap.find(r)->second;
 		}
 	};
-	// Map from instructions to their live ranges
-	typedef std::map<llvm::Instruction*, InstructionLiveRange, CompareInstructionByID> LiveRangesTy;
+	// Live ranges indexed by the instruction identifiers, so they are visited in the same order of the instructions
+	typedef std::vector<InstructionLiveRange> LiveRangesTy;
 	// Registers should have a consistent JS type
 	enum REGISTER_KIND { OBJECT=0, INTEGER, FLOAT, DOUBLE };
 	struct RegisterRange
@@ -130,9 +141,12 @@ private:
 		{
 		}
 	};
-	// Temporary data structures used while exploring the CFG
+	// Temporary data structures used while exploring the CFG, blocks are identified by their index in the function
 	struct BlockState
 	{
+		llvm::BasicBlock* BB;
+		llvm::SmallVector<uint32_t, 2> predecessors;
+		llvm::SmallVector<uint32_t, 2> successors;
 		llvm::Instruction* inInst;
 		llvm::SmallVector<llvm::Instruction*, 4> outSet;
 		void addLiveOut(llvm::Instruction* I)
@@ -153,11 +167,11 @@ private:
 			return inInst==I;
 		}
 		bool completed;
-		BlockState():inInst(NULL),completed(false)
+		BlockState():BB(NULL),inInst(NULL),completed(false)
 		{
 		}
 	};
-	typedef std::unordered_map<llvm::BasicBlock*, BlockState> BlocksState;
+	typedef std::vector<BlockState> BlocksState;
 	// Temporary data used to registerize allocas
 	typedef std::vector<const llvm::AllocaInst*> AllocaSetTy;
 	typedef std::map<uint32_t, uint32_t> RangeChunksTy;
@@ -209,14 +223,16 @@ private:
 	};
 
 	LiveRangesTy computeLiveRanges(llvm::Function& F, const InstIdMapTy& instIdMap, cheerp::PointerAnalyzer& PA);
-	void doUpAndMark(BlocksState& blocksState, llvm::BasicBlock* BB, llvm::Instruction* I);
+	static void doUpAndMark(BlocksState& blocksState, uint32_t blockIndex, llvm::Instruction* I, std::vector<uint32_t>& worklist);
 	static void assignInstructionsIds(InstIdMapTy& instIdMap, const llvm::Function& F, AllocaSetTy& allocaSet);
-	uint32_t dfsLiveRangeInBlock(BlocksState& blockState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
-					llvm::BasicBlock& BB, cheerp::PointerAnalyzer& PA, uint32_t nextIndex, uint32_t codePathId);
-	void extendRangeForUsedOperands(llvm::Instruction& I, LiveRangesTy& liveRanges, cheerp::PointerAnalyzer& PA,
-					uint32_t thisIndex, uint32_t codePathId);
-	uint32_t assignToRegisters(const LiveRangesTy& F, const PointerAnalyzer& PA);
-	void handlePHI(llvm::Instruction& I, const LiveRangesTy& liveRanges, llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA);
+	void dfsLiveRanges(BlocksState& blockState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap, cheerp::PointerAnalyzer& PA);
+	uint32_t computeLiveRangeInBlock(BlockState& blockState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+					cheerp::PointerAnalyzer& PA, uint32_t nextIndex, uint32_t codePathId);
+	void extendRangeForUsedOperands(llvm::Instruction& I, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+					cheerp::PointerAnalyzer& PA, uint32_t thisIndex, uint32_t codePathId);
+	uint32_t assignToRegisters(const LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap, const PointerAnalyzer& PA);
+	void handlePHI(const InstructionLiveRange& PHIrange, const LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+					llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA);
 	uint32_t findOrCreateRegister(llvm::SmallVector<RegisterRange, 4>& registers, const InstructionLiveRange& range,
 					REGISTER_KIND kind);
 	static REGISTER_KIND getRegKindFromType(llvm::Type*);
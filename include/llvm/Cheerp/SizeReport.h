@@ -0,0 +1,115 @@
+//===-- Cheerp/SizeReport.h - Cheerp output size attribution --------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_SIZE_REPORT_H
+#define _CHEERP_SIZE_REPORT_H
+
+#include "llvm/ADT/StringRef.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * SizeReport - Attribute the bytes of the generated JavaScript to the functions, globals and types they come from,
+ * and count how many times some costly constructs are generated
+ *
+ * The report is written as JSON. It contains a flat list of entities sorted by name, which is meant to be diffed
+ * between builds, and the same sizes as a tree of kinds and C++ scopes in the { name, children, value } form used
+ * by treemap visualizations.
+ *
+ * The construct counts are also reported by the time report. When only the counts are needed, the report can be
+ * created without attributing the bytes to the entities.
+ */
+class SizeReport
+{
+public:
+	enum EntityKind
+	{
+		FUNCTION = 0,
+		// Functions moved to the secondary chunk, they are not part of the total
+		SECONDARY_FUNCTION,
+		GLOBAL,
+		CLASS_TYPE,
+		ARRAY_CLASS_TYPE,
+		STRUCT_CONSTRUCTOR,
+		// Runtime support code, identified by a fixed name
+		HELPER,
+		NUM_ENTITY_KINDS
+	};
+	enum Construct
+	{
+		CREATE_POINTER_ARRAY = 0,
+		CREATE_CLOSURE,
+		HANDLE_VAARG,
+		// {d:,o:} objects for REGULAR pointers
+		POINTER_OBJECT,
+		// Byte layout loads and stores, through the typed array views or through the DataView methods
+		TYPED_ARRAY_VIEW_ACCESS,
+		DATAVIEW_ACCESS,
+		// Functions which need the label variable
+		LABEL_VARIABLE,
+		LABEL_ASSIGNMENT,
+		LABEL_CHECK,
+		NUM_CONSTRUCTS
+	};
+	explicit SizeReport(bool attributeEntities = true);
+	bool attributesEntities() const
+	{
+		return attributeEntities;
+	}
+	/**
+	 * Attribute bytes to a symbol, mangled names are demangled in the report. Empty entities are ignored
+	 */
+	void addEntity(EntityKind kind, llvm::StringRef symbol, uint64_t bytes);
+	/**
+	 * Safe to call from the threads which compile functions in parallel
+	 */
+	void countConstruct(Construct c)
+	{
+		constructCounts[c]++;
+	}
+	uint64_t getConstructCount(Construct c) const
+	{
+		return constructCounts[c].load();
+	}
+	static const char* getConstructName(Construct c);
+	/**
+	 * The size of the main output. The bytes which are not attributed to any entity are reported as other code
+	 */
+	void setTotalBytes(uint64_t bytes)
+	{
+		totalBytes = bytes;
+	}
+	/**
+	 * Write the report as JSON, return false and set ErrorString on failure
+	 */
+	bool writeJSON(const std::string& fileName, std::string& ErrorString) const;
+private:
+	struct Entity
+	{
+		EntityKind kind;
+		std::string symbol;
+		std::string name;
+		uint64_t bytes;
+	};
+	static std::string getReadableName(EntityKind kind, llvm::StringRef symbol);
+	std::vector<Entity> entities;
+	std::atomic<uint64_t> constructCounts[NUM_CONSTRUCTS];
+	uint64_t totalBytes;
+	bool attributeEntities;
+};
+
+}
+
+#endif
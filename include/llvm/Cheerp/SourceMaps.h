@@ -12,6 +12,8 @@
 #ifndef _CHEERP_SOURCE_MAPS_H
 #define _CHEERP_SOURCE_MAPS_H
 
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Cheerp/CompressedStream.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Support/ToolOutputFile.h"
@@ -20,24 +22,60 @@
 namespace cheerp
 {
 
+/**
+ * SourceMapGenerator - Write the source map of the generated code while the code itself is being written.
+ *
+ * The mappings are encoded as soon as each line is complete and go straight to the buffered output file, only the
+ * tables of the source files and of the function names are kept until the end.
+ */
 class SourceMapGenerator
 {
 private:
+	struct Segment
+	{
+		uint32_t generatedColoumn;
+		uint32_t file;
+		uint32_t line;
+		uint32_t coloumn;
+		// Index in the names table, or -1
+		int32_t name;
+	};
 	llvm::tool_output_file sourceMap;
+	// Only used if the source map is compressed
+	std::unique_ptr<CompressedOutputStream> compressedSourceMap;
+	llvm::raw_ostream* sourceMapStream;
 	const std::string& sourceMapName;
 	const std::string& sourceMapPrefix;
 	llvm::LLVMContext& Ctx;
 	std::map<llvm::MDString*, uint32_t> fileMap;
+	llvm::StringMap<uint32_t> nameMap;
 	uint32_t lastFile;
 	uint32_t lastLine;
 	uint32_t lastColoumn;
+	uint32_t lastName;
+	uint32_t lastGeneratedColoumn;
+	// The last segment of the line is only written when the code after it starts at another coloumn,
+	// so instructions which do not generate any code do not add segments
+	Segment pendingSegment;
+	bool hasPendingSegment;
 	bool validInfo;
 	bool lineStart;
-	void writeBase64VLQInt(int32_t i);
+	static char* writeBase64VLQInt(char* out, int32_t i);
+	uint32_t getFileIndex(llvm::MDNode* scope);
+	void addSegment(const Segment& segment);
+	void writeSegment(const Segment& segment);
 public:
 	// sourceMapName and sourceMapPrefix life spans should be longer than the one of the SourceMapGenerator
-	SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, llvm::LLVMContext& C, std::string& ErrorString);
-	void setDebugLoc(const llvm::DebugLoc& debugLoc);
+	SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, llvm::LLVMContext& C,
+	                   bool compress, std::string& ErrorString);
+	/**
+	 * Map the code starting at generatedColoumn of the current line to debugLoc
+	 */
+	void setDebugLoc(const llvm::DebugLoc& debugLoc, uint32_t generatedColoumn);
+	/**
+	 * Map the name of a function starting at generatedColoumn to the definition of the function which contains debugLoc
+	 */
+	void setFunctionName(const llvm::DebugLoc& debugLoc, uint32_t generatedColoumn);
 	void clearDebugInfo()
 	{
 		validInfo = false;
@@ -0,0 +1,62 @@
+//===-- Cheerp/SwitchLowering.h - Cheerp switch lowering ------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_SWITCH_LOWERING_H
+#define _CHEERP_SWITCH_LOWERING_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Pass.h"
+
+namespace llvm
+{
+
+/**
+ * SwitchToLookupTable - Replace the switches which only select constant values for the PHIs of a common
+ * successor with loads from constant arrays, which become typed arrays in the JavaScript output.
+ *
+ * Only dense switches with several cases are converted, the holes of the table are filled with the
+ * results of the default destination. The other dense switches are compiled by the writer as
+ * JavaScript switch statements, see cheerp::isJumpTableSwitch.
+ */
+class SwitchToLookupTable: public FunctionPass
+{
+public:
+	static char ID;
+	explicit SwitchToLookupTable() : FunctionPass(ID) { }
+
+	bool runOnFunction( Function & F ) override;
+
+	const char *getPassName() const override;
+private:
+	/**
+	 * Collect the values of the PHIs of the destination reached from the switch through succ.
+	 * succ may be the destination itself or an empty block which jumps to it.
+	 * Return false if the destination is not commonDest, when it is set, or if some value is not a constant
+	 * which can be stored in a typed array.
+	 */
+	static bool getCaseResults(SwitchInst* si, BasicBlock* succ, BasicBlock*& commonDest, SmallVectorImpl<Constant*>& results);
+	/**
+	 * Keep exactly numEdges incoming values from pred in the PHIs of BB
+	 */
+	static void setIncomingEdges(BasicBlock* BB, BasicBlock* pred, uint32_t numEdges);
+	bool convertSwitch(SwitchInst* si);
+};
+
+//===----------------------------------------------------------------------===//
+//
+// SwitchToLookupTable - Replace switches selecting constants with lookup tables
+//
+FunctionPass *createSwitchToLookupTablePass();
+
+}
+
+#endif
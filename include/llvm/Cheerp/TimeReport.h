@@ -0,0 +1,85 @@
+//===-- Cheerp/TimeReport.h - Cheerp per pass timing report ---------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _CHEERP_TIME_REPORT_H
+#define _CHEERP_TIME_REPORT_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cheerp
+{
+
+/**
+ * TimeReport - Collect the wall time, the peak RSS growth and a few counters for each phase of the Cheerp pipeline
+ *
+ * It is available in release builds, unlike the LLVM timers used by PointerAnalyzer.
+ * A phase spans from the previous call to endPhase, or from the creation of the report, to the current one.
+ */
+class TimeReport
+{
+public:
+	TimeReport();
+	/**
+	 * Close the current phase and start a new one. The number of defined functions is always recorded.
+	 */
+	void endPhase(const char* name, const llvm::Module& M);
+	/**
+	 * Add a counter to the last closed phase
+	 */
+	void addCounter(const char* name, uint64_t value);
+	/**
+	 * Write the report as JSON, return false and set ErrorString on failure
+	 */
+	bool writeJSON(const std::string& fileName, std::string& ErrorString) const;
+private:
+	struct Phase
+	{
+		const char* name;
+		double wallTime;
+		// In kilobytes, 0 where it cannot be measured
+		uint64_t peakRSSDelta;
+		std::vector<std::pair<const char*, uint64_t>> counters;
+	};
+	static uint64_t getPeakRSS();
+	std::vector<Phase> phases;
+	double lastWallTime;
+	uint64_t lastPeakRSS;
+};
+
+/**
+ * TimeReportPass - Close a phase of the TimeReport when it runs, it is added after each pass of the pipeline
+ */
+class TimeReportPass : public llvm::ModulePass
+{
+public:
+	static char ID;
+
+	explicit TimeReportPass(TimeReport& r, const char* n) : ModulePass(ID), report(r), phaseName(n) { }
+
+	bool runOnModule( llvm::Module & ) override;
+
+	void getAnalysisUsage(llvm::AnalysisUsage & AU) const override;
+
+	const char *getPassName() const override;
+private:
+	TimeReport& report;
+	const char* phaseName;
+};
+
+llvm::ModulePass *createTimeReportPass(TimeReport& report, const char* phaseName);
+
+}
+
+#endif
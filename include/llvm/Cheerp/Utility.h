@@ -37,6 +37,33 @@ inline bool isValidVoidPtrSource(const llvm::Value* val)
 
 bool isInlineable(const llvm::Instruction& I, const PointerAnalyzer& PA);
 
+/**
+ * Returns true if v is a REGULAR pointer returned by a compiled function.
+ * The function returns the base and passes the offset in the oSlot global,
+ * so that no {d,o} object is created.
+ */
+bool isOffsetReturnedInSlot(const llvm::Value* v, const PointerAnalyzer& PA);
+
+/**
+ * Returns true if numCases values spread over rangeSize consecutive values are dense enough
+ * to be looked up by index, either in a typed array or in the jump table of a JavaScript switch
+ */
+inline bool isDenseSwitch(uint64_t numCases, uint64_t rangeSize)
+{
+	return numCases * 10 >= rangeSize * 4;
+}
+
+/**
+ * Returns the value of a case as it is compiled in comparisons, i32 is signed and smaller types are unsigned
+ */
+int64_t getSwitchCaseValue(const llvm::ConstantInt* c);
+
+/**
+ * Returns true if the switch should be compiled as a JavaScript switch on the normalized index (x-min)|0
+ * instead of a chain of comparisons. It must have many dense cases, so that engines can use a jump table.
+ */
+bool isJumpTableSwitch(const llvm::SwitchInst* si);
+
 inline bool isBitCast(const llvm::Value* v)
 {
 	if( llvm::isa< llvm::BitCastInst>(v) )
@@ -60,6 +87,9 @@ uint32_t getIntFromValue(const llvm::Value* v);
 // Printable name of the llvm type - useful only for debugging
 std::string valueObjectName(const llvm::Value * v);
 
+// Write str as a quoted JSON string, escaping quotes, backslashes and control characters
+void writeJSONString(llvm::raw_ostream& out, llvm::StringRef str);
+
 class TypeSupport
 {
 public:
@@ -109,6 +139,15 @@ public:
 			return false;
 	}
 
+	/**
+	 * Return true if a pointer to t may point to memory allocated from the arena heap,
+	 * which only holds typed arrays and byte layout objects
+	 */
+	static bool mayUseArenaHeap(llvm::Type* t)
+	{
+		return isTypedArrayType(t, /*forceTypedArray*/ false) || hasByteLayout(t);
+	}
+
 	static bool hasBasesInfoMetadata(llvm::StructType* t, const llvm::Module & m)
 	{
 		return getBasesMetadata(t, m) != nullptr;
@@ -236,13 +275,18 @@ public:
 	 */
 	bool sizeIsRuntime() const;
 	
+	/**
+	 * Check if the allocation is an array with too many elements to be compiled as a literal
+	 */
+	bool isLargeArray() const;
+
 	/**
 	 * Check if the allocation should use a createArray function
 	 */
 	bool useCreateArrayFunc() const;
 	
 	/**
-	 * Check if the allocation should use a createTypedArray function
+	 * Check if the allocation should use the createPointerArray function
 	 */
 	bool useCreatePointerArrayFunc() const;
 	
@@ -251,6 +295,11 @@ public:
 	 */
 	bool useTypedArray() const;
 
+	/**
+	 * Constant sized arrays up to this number of elements are compiled as literals
+	 */
+	static const uint32_t MaxLiteralArrayElements = 8;
+
 private:
 	llvm::PointerType * computeCastedType() const;
 	
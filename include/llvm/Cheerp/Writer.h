@@ -15,8 +15,11 @@
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
 #include "llvm/Cheerp/NameGenerator.h"
+#include "llvm/Cheerp/OutputCache.h"
 #include "llvm/Cheerp/PointerAnalyzer.h"
+#include "llvm/Cheerp/Profile.h"
 #include "llvm/Cheerp/Registerize.h"
+#include "llvm/Cheerp/SizeReport.h"
 #include "llvm/Cheerp/SourceMaps.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/IR/Module.h"
@@ -59,7 +62,8 @@ public:
 		stream(s),
 		readableOutput(readableOutput),
 		newLine(true),
-		indentLevel(0)
+		indentLevel(0),
+		lineStart(s.tell())
 	{}
 
 	friend ostream_proxy& operator<<( ostream_proxy & os, char c )
@@ -78,6 +82,7 @@ public:
 	{
 		os.stream << handler;
 		os.newLine = true;
+		os.lineStart = os.stream.tell();
 		return os;
 	}
 
@@ -95,6 +100,26 @@ public:
 		return os;
 	}
 
+	bool isReadableOutput() const
+	{
+		return readableOutput;
+	}
+
+	uint64_t tell() const
+	{
+		return stream.tell();
+	}
+
+	// Column of the next character written in the current line
+	uint32_t getColumn() const
+	{
+		uint32_t column = stream.tell() - lineStart;
+		// The indentation is only written together with the first token of the line
+		if ( newLine && readableOutput )
+			column += indentLevel;
+		return column;
+	}
+
 private:
 
 	// Return true if we are closing a curly bracket, need to unindent by 1.
@@ -133,10 +158,13 @@ private:
 	bool readableOutput;
 	bool newLine;
 	int indentLevel;
+	uint64_t lineStart;
 };
 
 const static int V8MaxLiteralDepth = 3;
 const static int V8MaxLiteralProperties = 8;
+// Size of the ArrayBuffers used by the arena heap allocator
+const static int HeapArenaSize = 1 << 20;
 
 class CheerpWriter
 {
@@ -149,7 +177,7 @@ private:
 	const Registerize & registerize;
 
 	GlobalDepsAnalyzer & globalDeps;
-	NameGenerator namegen;
+	const NameGenerator& namegen;
 	TypeSupport types;
 	std::set<const llvm::GlobalVariable*> compiledGVars;
 
@@ -161,6 +189,52 @@ private:
 	bool useNativeJavaScriptMath;
 	// Flag to signal if we should take advantage of native 23-bit integer multiplication
 	bool useMathImul;
+	// Flag to signal if single precision float results should be rounded with Math.fround
+	bool useMathFround;
+	// Flag to signal if typed arrays and byte layout objects should be allocated from the arena heap
+	bool useArenaHeap;
+	// Flag to signal if structs should be created with a constructor function for each type, so that they all share the same shape
+	bool useStructConstructors;
+	// Initialize eligible globals on first access instead of at load time
+	bool useLazyGlobals;
+	// Maximum number of elements copied by memcpy with unrolled code and with a loop
+	uint32_t memcpyUnrollLimit;
+	uint32_t memcpyLoopLimit;
+	// Maximum number of instructions duplicated in each function to make the irreducible loops reducible
+	uint32_t relooperSplitBudget;
+	// Number of threads used to compile functions
+	uint32_t numJobs;
+	// The code of the functions is reused from here if they did not change, it may be NULL
+	const FunctionOutputCache* functionCache;
+	// The bytes generated for each function, global and type are attributed here and the costly constructs are counted, it may be NULL
+	SizeReport* sizeReport;
+	// The functions of the secondary chunk are written here when code splitting is enabled, NULL otherwise
+	llvm::raw_ostream* secondaryChunk;
+	// The file name used to load the secondary chunk at runtime
+	std::string secondaryChunkName;
+	// Constant typed arrays of at least this many bytes are encoded in binary form, 0 disables the encoding
+	uint32_t binaryConstantThreshold;
+	// Binary constants of global initializers are written here instead of being encoded in base64, it may be NULL
+	llvm::raw_ostream* binaryData;
+	// The file name used to load the binary data at runtime
+	std::string binaryDataName;
+	// Offsets of the constants stored in binaryData and the total size written so far
+	uint32_t binaryDataSize;
+	std::unordered_map<const llvm::ConstantDataSequential*, uint32_t> binaryDataOffsets;
+	// Set if any constant is encoded in base64
+	bool needBase64Decoder;
+	// Flag to signal if blocks and edges should increment the counters in cheerpProfile
+	bool instrument;
+	// The profile used to order and split the blocks, it may be NULL
+	const ProfileData* profile;
+	// Index of the first counter of each function in cheerpProfile
+	std::unordered_map<const llvm::Function*, uint32_t> profileCounterBase;
+	// The counters of the function being compiled when instrumenting, NULL otherwise
+	const ProfileCounters* currentCounters;
+	uint32_t currentCounterBase;
+
+	// The edge between blocks whose PHIs are being compiled, if any
+	NameGenerator::EdgeContext edgeContext;
 
 	/**
 	 * \addtogroup MemFunction methods to handle memcpy, memmove, mallocs and free (and alike)
@@ -168,12 +242,20 @@ private:
 	 * @{
 	 */
 
+	enum MEMFUNC_KIND { MEMFUNC_MEMCPY = 0, MEMFUNC_MEMMOVE, MEMFUNC_MEMSET };
 	/**
-	 * Compile memcpy and memmove
+	 * Compile memcpy, memmove and memset.
+	 * Small copies of a constant size are unrolled, medium ones use a loop and
+	 * only the largest ones use TypedArray.set. memset uses TypedArray.fill.
 	 */
 	void compileMemFunc(const llvm::Value* dest,
 	                    const llvm::Value* srcOrResetVal,
-	                    const llvm::Value* size);
+	                    const llvm::Value* size,
+	                    MEMFUNC_KIND kind);
+	void compileTypedArrayMemCopy(const llvm::Value* dest, const llvm::Value* src, const llvm::Value* size,
+	                              llvm::Type* pointedType, bool isMemmove);
+	void compileTypedArrayMemSet(const llvm::Value* dest, const llvm::Value* resetVal, const llvm::Value* size,
+	                             llvm::Type* pointedType);
 
 	/**
 	 * Copy baseSrc into baseDest
@@ -245,6 +327,20 @@ private:
 	 */
 	const llvm::Value* compileByteLayoutOffset(const llvm::Value* p, BYTE_LAYOUT_OFFSET_MODE offsetMode);
 
+	/**
+	 * Return the largest power of 2 which is known to divide the byte offset of the BYTE_LAYOUT pointer p.
+	 * The offset is relative to the start of the DataView, if nothing is known about it 1 is returned.
+	 */
+	uint32_t getByteLayoutOffsetAlignment(const llvm::Value* p) const;
+
+	/**
+	 * Compile an access to the value pointed by the BYTE_LAYOUT pointer p using a typed array view
+	 * over the buffer of the DataView. Returns false, without printing any code, if the access is not
+	 * known to be aligned and the DataView methods must be used.
+	 */
+	bool compileByteLayoutViewAccess(const llvm::Value* p);
+	static bool getByteLayoutView(llvm::Type* t, const char*& viewName, uint32_t& elementSize);
+
 	/**
 	 * Compile a pointer from a GEP expression, with the given pointer kind
 	 */
@@ -255,32 +351,7 @@ private:
 	/**
 	 * Compile a pointer with the specified kind
 	 */
-	void compilePointerAs(const llvm::Value* p, POINTER_KIND kind)
-	{
-		assert(p->getType()->isPointerTy());
-
-		if(kind == COMPLETE_OBJECT)
-		{
-			compileCompleteObject(p);
-		}
-		else if (llvm::isa<llvm::ConstantPointerNull>(p))
-		{
-			stream << "nullObj";
-		}
-		else if (PA.getConstantOffsetForPointer(p) || llvm::isa<llvm::Argument>(p))
-		{
-			stream << "{d:";
-			compilePointerBase(p, true);
-			stream << ",o:";
-			compilePointerOffset(p);
-			stream << "}";
-		}
-		else
-		{
-			assert(PA.getPointerKind(p) == REGULAR || PA.getPointerKind(p) == BYTE_LAYOUT);
-			compileOperand(p);
-		}
-	}
+	void compilePointerAs(const llvm::Value* p, POINTER_KIND kind);
 
 	/**
 	 * Compile a (possibly dynamic) downcast
@@ -296,14 +367,90 @@ private:
 	COMPILE_INSTRUCTION_FEEDBACK compileNotInlineableInstruction(const llvm::Instruction& I);
 	COMPILE_INSTRUCTION_FEEDBACK compileInlineableInstruction(const llvm::Instruction& I);
 
+	/**
+	 * Return true if the float result of I must be rounded with Math.fround.
+	 * Loads, PHIs, arguments and calls to compiled functions already produce rounded values.
+	 */
+	bool needsFround(const llvm::Instruction& I) const;
+	COMPILE_INSTRUCTION_FEEDBACK compileInlineableInstructionWithFround(const llvm::Instruction& I);
+
 	void compileSignedInteger(const llvm::Value* v);
 	void compileUnsignedInteger(const llvm::Value* v);
 
 	void compileMethod(const llvm::Function& F);
+	/**
+	 * Compile all the functions in module order, possibly using numJobs threads.
+	 * The output does not depend on the number of threads.
+	 * Functions found in functionCache are not compiled again, the others are added to it.
+	 */
+	void compileMethods();
+	/**
+	 * Methods implemented in OutputCache.cpp
+	 */
+	/**
+	 * Return a hash of everything which is used to compile F, the writer options included
+	 */
+	std::string getFunctionCacheKey(const llvm::Function& F) const;
+	/**
+	 * Compile the functions of the secondary chunk in a function expression which returns the entry points.
+	 * The chunk is evaluated in the scope of the core chunk, so it can use all its globals and helpers.
+	 */
+	void compileSecondaryChunk();
+	/**
+	 * Compile the synchronous loader of the secondary chunk and a stub for each entry point,
+	 * the stubs load the chunk the first time they are called and are then replaced by the real functions
+	 */
+	void compileSecondaryChunkLoader();
 	void compileGlobal(const llvm::GlobalVariable& G);
 	void compileNullPtrs();
 	void compileCreateClosure();
 	void compileHandleVAArg();
+	/**
+	 * Compile the helper used by memcpy and memmove when the size is not known
+	 */
+	void compileMemCopyHelper();
+	/**
+	 * Compile the allocator used by the arena heap mode, memory is carved out of large
+	 * ArrayBuffer arenas and freed chunks are reused through per size class free lists.
+	 * Every allocation is still a typed array or DataView object over its chunk, pointers
+	 * do not become integer offsets into a single linear memory
+	 */
+	void compileHeapAllocator();
+	/**
+	 * Returns true if any load or store is compiled with compileByteLayoutViewAccess
+	 */
+	bool needByteLayoutViews() const;
+	/**
+	 * Compile the helpers which create and cache the typed array views of DataViews
+	 */
+	void compileByteLayoutViews();
+	/**
+	 * Returns true if the constant is large enough to be encoded in binary form
+	 */
+	bool isBinaryConstant(const llvm::ConstantDataSequential* C) const;
+	/**
+	 * Find all the binary constants, write the ones used only once by global initializers to binaryData
+	 * and check if the base64 decoder is needed
+	 */
+	void collectBinaryConstants();
+	void collectBinaryConstants(const llvm::Constant* C, std::vector<const llvm::ConstantDataSequential*>& uses);
+	/**
+	 * Compile a binary constant either as a view of the binary data or as a base64 string
+	 */
+	void compileBinaryConstant(const llvm::ConstantDataSequential* C);
+	/**
+	 * Compile the helper which decodes base64 strings to an ArrayBuffer
+	 */
+	void compileBase64Decoder();
+	/**
+	 * Compile the synchronous loader of binaryData, it must be called before the globals are compiled
+	 */
+	void compileBinaryDataLoader();
+	/**
+	 * Compile the cheerpProfile counters and cheerpDumpProfile, which returns them in the llvm-profdata text format.
+	 * On node the profile is also written to cheerp.profdata on exit.
+	 */
+	void compileProfileCounters();
 	/**
 	 * This method supports both ConstantArray and ConstantDataSequential
 	 */
@@ -312,7 +459,8 @@ private:
 	/**
 	 * Methods implemented in types.cpp
 	 */
-	enum COMPILE_TYPE_STYLE { LITERAL_OBJ=0, THIS_OBJ };
+	// CONSTRUCTOR_ARGS only lists the values of the members of a struct, in order
+	enum COMPILE_TYPE_STYLE { LITERAL_OBJ=0, THIS_OBJ, CONSTRUCTOR_ARGS };
 	void compileTypedArrayType(llvm::Type* t);
 	void compileSimpleType(llvm::Type* t);
 	// varName is used for a fake assignment to break literals into smaller units.
@@ -321,6 +469,12 @@ private:
 	void compileType(llvm::Type* t, COMPILE_TYPE_STYLE style, llvm::StringRef varName = llvm::StringRef());
 	uint32_t compileClassTypeRecursive(const std::string& baseName, llvm::StructType* currentType, uint32_t baseCount);
 	void compileClassType(llvm::StructType* T);
+	/**
+	 * Compile the constructor function used to create objects of type T when useStructConstructors is set.
+	 * It takes the initial values of all the members, so that both new and constant objects share the same shape.
+	 */
+	void compileStructConstructor(llvm::StructType* T);
+	bool useStructConstructor(llvm::StructType* T) const;
 	void compileArrayClassType(llvm::Type* T);
 	void compileArrayPointerType();
 
@@ -341,15 +495,50 @@ private:
 
 	//JS interoperability support
 	void compileClassesExportedToJs();
+
+	/**
+	 * Attribute the bytes written since start to symbol, if a size report is requested
+	 */
+	void reportSize(SizeReport::EntityKind kind, llvm::StringRef symbol, uint64_t start)
+	{
+		if(sizeReport)
+			sizeReport->addEntity(kind, symbol, stream.tell() - start);
+	}
+
+	/**
+	 * Build a writer which shares the analysis results of parent and outputs on s.
+	 * Used to compile functions on worker threads, it does not support source maps.
+	 */
+	CheerpWriter(const CheerpWriter& parent, llvm::raw_ostream& s):
+		module(parent.module),targetData(&parent.module),currentFun(NULL),PA(parent.PA),registerize(parent.registerize),
+		globalDeps(parent.globalDeps),namegen(parent.namegen),types(parent.module, globalDeps.classesWithBaseInfo()),
+		sourceMapGenerator(NULL),NewLine(NULL),useNativeJavaScriptMath(parent.useNativeJavaScriptMath),
+		useMathImul(parent.useMathImul),useMathFround(parent.useMathFround),useArenaHeap(parent.useArenaHeap),useStructConstructors(parent.useStructConstructors),useLazyGlobals(parent.useLazyGlobals),
+		memcpyUnrollLimit(parent.memcpyUnrollLimit),memcpyLoopLimit(parent.memcpyLoopLimit),relooperSplitBudget(parent.relooperSplitBudget),numJobs(1),
+		functionCache(NULL),sizeReport(parent.sizeReport),secondaryChunk(NULL),binaryConstantThreshold(parent.binaryConstantThreshold),binaryData(NULL),
+		binaryDataSize(0),binaryDataOffsets(parent.binaryDataOffsets),needBase64Decoder(parent.needBase64Decoder),
+		instrument(parent.instrument),profile(parent.profile),profileCounterBase(parent.profileCounterBase),
+		currentCounters(NULL),currentCounterBase(0),
+		stream(s, parent.stream.isReadableOutput())
+	{
+	}
 public:
 	ostream_proxy stream;
 	CheerpWriter(llvm::Module& m, llvm::raw_ostream& s, cheerp::PointerAnalyzer & PA, cheerp::Registerize & registerize,
-	             cheerp::GlobalDepsAnalyzer & gda, SourceMapGenerator* sourceMapGenerator, bool ReadableOutput,
-	             bool NoRegisterize, bool UseNativeJavaScriptMath, bool useMathImul):
+	             cheerp::GlobalDepsAnalyzer & gda, const cheerp::NameGenerator& namegen, SourceMapGenerator* sourceMapGenerator,
+	             bool ReadableOutput, bool NoRegisterize, bool UseNativeJavaScriptMath, bool useMathImul, bool useMathFround,
+	             bool useArenaHeap, bool useStructConstructors, bool useLazyGlobals, uint32_t memcpyUnrollLimit, uint32_t memcpyLoopLimit,
+	             uint32_t relooperSplitBudget, llvm::raw_ostream* secondaryChunk, const std::string& secondaryChunkName, uint32_t binaryConstantThreshold,
+	             llvm::raw_ostream* binaryData, const std::string& binaryDataName, bool instrument, const ProfileData* profile,
+	             uint32_t numJobs = 1, const FunctionOutputCache* functionCache = NULL, SizeReport* sizeReport = NULL):
 		module(m),targetData(&m),currentFun(NULL),PA(PA),registerize(registerize),globalDeps(gda),
-		namegen(m, globalDeps, registerize, PA, ReadableOutput),types(m, globalDeps.classesWithBaseInfo()),
+		namegen(namegen),types(m, globalDeps.classesWithBaseInfo()),
 		sourceMapGenerator(sourceMapGenerator),NewLine(sourceMapGenerator),useNativeJavaScriptMath(UseNativeJavaScriptMath),
-		useMathImul(useMathImul),stream(s, ReadableOutput)
+		useMathImul(useMathImul),useMathFround(useMathFround),useArenaHeap(useArenaHeap),useStructConstructors(useStructConstructors),useLazyGlobals(useLazyGlobals),
+		memcpyUnrollLimit(memcpyUnrollLimit),memcpyLoopLimit(memcpyLoopLimit),relooperSplitBudget(relooperSplitBudget),numJobs(numJobs),
+		functionCache(functionCache),sizeReport(sizeReport),secondaryChunk(secondaryChunk),secondaryChunkName(secondaryChunkName),binaryConstantThreshold(binaryConstantThreshold),
+		binaryData(binaryData),binaryDataName(binaryDataName),binaryDataSize(0),needBase64Decoder(false),
+		instrument(instrument),profile(profile),currentCounters(NULL),currentCounterBase(0),stream(s, ReadableOutput)
 	{
 	}
 	void makeJS();
@@ -357,7 +546,14 @@ public:
 	void compileConstant(const llvm::Constant* c);
 	void compileOperand(const llvm::Value* v, bool allowBooleanObjects = false);
 	void compilePHIOfBlockFromOtherBlock(const llvm::BasicBlock* to, const llvm::BasicBlock* from);
+	bool hasEdgeCounter(const llvm::BasicBlock* from, const llvm::BasicBlock* to) const;
+	void compileEdgeCounter(const llvm::BasicBlock* from, const llvm::BasicBlock* to);
 	void compileOperandForIntegerPredicate(const llvm::Value* v, llvm::CmpInst::Predicate p);
+	void countConstruct(SizeReport::Construct c)
+	{
+		if(sizeReport)
+			sizeReport->countConstruct(c);
+	}
 };
 
 }
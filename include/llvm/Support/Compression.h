@@ -14,6 +14,7 @@
 #ifndef LLVM_SUPPORT_COMPRESSION_H
 #define LLVM_SUPPORT_COMPRESSION_H
 
+#include "llvm/Support/Compiler.h"
 #include "llvm/Support/DataTypes.h"
 #include <memory>
 
@@ -21,6 +22,7 @@ namespace llvm {
 
 class MemoryBuffer;
 class StringRef;
+class raw_ostream;
 
 namespace zlib {
 
@@ -52,6 +54,28 @@ Status uncompress(StringRef InputBuffer,
 
 uint32_t crc32(StringRef Buffer);
 
+/// GzipCompressor - Compress a stream of data in the gzip format. The data is
+/// compressed as it comes, and the compressed data is written to the output
+/// as soon as it is available.
+class GzipCompressor {
+public:
+  GzipCompressor(raw_ostream &Output,
+                 CompressionLevel Level = DefaultCompression);
+  ~GzipCompressor();
+
+  Status compress(StringRef Input);
+  /// Write the end of the stream. Nothing can be compressed afterwards.
+  Status finish();
+
+private:
+  GzipCompressor(const GzipCompressor &) LLVM_DELETED_FUNCTION;
+  void operator=(const GzipCompressor &) LLVM_DELETED_FUNCTION;
+
+  struct Stream;
+  raw_ostream &Output;
+  std::unique_ptr<Stream> State;
+};
+
 }  // End of namespace zlib
 
 } // End of namespace llvm
@@ -18,11 +18,15 @@
 #include "llvm/Cheerp/PointerAnalyzer.h"
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
 
 using namespace llvm;
 
 STATISTIC(NumAllocaMerged, "Number of alloca which are merged");
+STATISTIC(NumStaticFrameAllocas, "Number of alloca moved to static frames");
+STATISTIC(NumStaticFrameGlobals, "Number of globals used as static frames");
 
 namespace cheerp {
 
@@ -388,6 +392,160 @@ char AllocaArraysMerging::ID = 0;
 
 FunctionPass *createAllocaArraysMergingPass() { return new AllocaArraysMerging(); }
 
+void AllocaStaticFrames::buildCallGraph(Module& M, const std::vector<const Function*>& reentryPoints, CallGraph& callGraph)
+{
+	for(const Function& F: M)
+	{
+		if(F.isDeclaration())
+			continue;
+		std::vector<const Function*>& callees = callGraph[&F];
+		bool callsUnknown = false;
+		for(const BasicBlock& BB: F)
+		{
+			for(const Instruction& I: BB)
+			{
+				ImmutableCallSite CS(&I);
+				if(!CS)
+					continue;
+				const Function* callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCastsSafe());
+				if(callee && callee->isIntrinsic())
+					continue;
+				// Indirect calls and calls to JavaScript code may reach any callback
+				if(!callee || callee->isDeclaration())
+					callsUnknown = true;
+				else if(std::find(callees.begin(), callees.end(), callee) == callees.end())
+					callees.push_back(callee);
+			}
+		}
+		if(callsUnknown)
+			callees.insert(callees.end(), reentryPoints.begin(), reentryPoints.end());
+	}
+}
+
+void AllocaStaticFrames::collectReachable(const CallGraph& callGraph, const Function* F, FunctionSet& reachable)
+{
+	std::vector<const Function*> worklist(1, F);
+	while(!worklist.empty())
+	{
+		const Function* current = worklist.back();
+		worklist.pop_back();
+		for(const Function* callee: callGraph.at(current))
+		{
+			if(reachable.insert(callee).second)
+				worklist.push_back(callee);
+		}
+	}
+}
+
+bool AllocaStaticFrames::runOnModule(Module& M)
+{
+	// JavaScript code may call back the functions which have their address taken and the exported methods
+	std::vector<const Function*> reentryPoints;
+	for(const Function& F: M)
+	{
+		if(!F.isDeclaration() && F.hasAddressTaken())
+			reentryPoints.push_back(&F);
+	}
+	for(const NamedMDNode& namedNode: M.getNamedMDList())
+	{
+		StringRef name = namedNode.getName();
+		if(!name.endswith("_methods") || !name.startswith("class._Z"))
+			continue;
+		for(const MDNode* node: namedNode.operands())
+			reentryPoints.push_back(cast<Function>(node->getOperand(0)));
+	}
+
+	CallGraph callGraph;
+	buildCallGraph(M, reentryPoints, callGraph);
+
+	// Only the allocas executed once per call can be moved, they are all in the entry block
+	std::vector<std::pair<Function*, std::vector<AllocaInst*>>> frames;
+	std::unordered_map<const Function*, FunctionSet> reachableFunctions;
+	for(Function& F: M)
+	{
+		if(F.isDeclaration())
+			continue;
+		std::vector<AllocaInst*> allocas;
+		for(Instruction& I: F.getEntryBlock())
+		{
+			AllocaInst* AI = dyn_cast<AllocaInst>(&I);
+			if(!AI || AI->isArrayAllocation())
+				continue;
+			// Byte layout globals are compiled as plain DataViews, while allocas are accessed as REGULAR pointers
+			Type* allocatedType = AI->getAllocatedType();
+			while(ArrayType* AT = dyn_cast<ArrayType>(allocatedType))
+				allocatedType = AT->getElementType();
+			if(TypeSupport::hasByteLayout(allocatedType))
+				continue;
+			allocas.push_back(AI);
+		}
+		if(allocas.empty())
+			continue;
+		FunctionSet& reachable = reachableFunctions[&F];
+		collectReachable(callGraph, &F, reachable);
+		if(reachable.count(&F))
+		{
+			reachableFunctions.erase(&F);
+			continue;
+		}
+		frames.push_back(std::make_pair(&F, std::move(allocas)));
+	}
+
+	// Two functions can share the same globals if none of them can be called while the other is active.
+	// Each global is used by at most one alloca of each function.
+	struct StaticFrameGlobal
+	{
+		GlobalVariable* GV;
+		std::vector<const Function*> users;
+	};
+	std::unordered_map<Type*, std::vector<StaticFrameGlobal>> globals;
+	auto canShare = [&reachableFunctions](const StaticFrameGlobal& g, const Function* F) -> bool
+	{
+		const FunctionSet& reachable = reachableFunctions.at(F);
+		for(const Function* user: g.users)
+		{
+			if(user == F || reachable.count(user) || reachableFunctions.at(user).count(F))
+				return false;
+		}
+		return true;
+	};
+	for(auto& frame: frames)
+	{
+		Function* F = frame.first;
+		for(AllocaInst* AI: frame.second)
+		{
+			Type* allocatedType = AI->getAllocatedType();
+			std::vector<StaticFrameGlobal>& candidates = globals[allocatedType];
+			auto it = std::find_if(candidates.begin(), candidates.end(),
+				[&](const StaticFrameGlobal& g) { return canShare(g, F); });
+			if(it == candidates.end())
+			{
+				// The contents of an alloca are undefined on entry, so the global is never reset
+				GlobalVariable* GV = new GlobalVariable(M, allocatedType, /*isConstant*/ false, GlobalValue::InternalLinkage,
+					Constant::getNullValue(allocatedType), "staticFrame");
+				candidates.push_back(StaticFrameGlobal{GV, std::vector<const Function*>()});
+				it = candidates.end() - 1;
+				NumStaticFrameGlobals++;
+			}
+			if(it->GV->getAlignment() < AI->getAlignment())
+				it->GV->setAlignment(AI->getAlignment());
+			it->users.push_back(F);
+			AI->replaceAllUsesWith(it->GV);
+			AI->eraseFromParent();
+			NumStaticFrameAllocas++;
+		}
+	}
+	return !frames.empty();
+}
+
+const char *AllocaStaticFrames::getPassName() const {
+	return "AllocaStaticFrames";
+}
+
+char AllocaStaticFrames::ID = 0;
+
+ModulePass *createAllocaStaticFramesPass() { return new AllocaStaticFrames(); }
+
 }
 
 using namespace cheerp;
@@ -15,6 +15,7 @@
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Support/FormattedStream.h"
 
@@ -34,7 +35,8 @@ const char* GlobalDepsAnalyzer::getPassName() const
 }
 
 GlobalDepsAnalyzer::GlobalDepsAnalyzer() : ModulePass(ID),
-	hasCreateClosureUsers(false), hasVAArgs(false), hasPointerArrays(false)
+	hasCreateClosureUsers(false), hasVAArgs(false), hasPointerArrays(false),
+	hasVariableMemCopies(false)
 {
 }
 
@@ -176,6 +178,7 @@ bool GlobalDepsAnalyzer::runOnModule( llvm::Module & module )
 		varsOrder.push_back(constructorVar);
 	}
 	NumRemovedGlobals = filterModule(module);
+	computeLazyGlobals(module);
 	return true;
 }
 
@@ -301,6 +304,12 @@ void GlobalDepsAnalyzer::visitFunction(const Function* F, VisitedSet& visited)
 					if ( StructType* ST = dyn_cast<StructType>(ai.getCastedType()->getElementType()) )
 						visitStruct(ST);
 				}
+				else if ( const MemTransferInst* MT = dyn_cast<MemTransferInst>(&I) )
+				{
+					Type* pointedType = MT->getRawDest()->getType()->getPointerElementType();
+					if ( !isa<ConstantInt>(MT->getLength()) && !TypeSupport::hasByteLayout(pointedType) )
+						hasVariableMemCopies = true;
+				}
 			}
 				
 			if (I.getOpcode() == Instruction::VAArg)
@@ -411,6 +420,137 @@ int GlobalDepsAnalyzer::filterModule( llvm::Module & module )
 	return eraseQueue.size();
 }
 
+/**
+ * Return true if the constant does not use any global variable
+ */
+static bool isIndependentConstant( const Constant * c )
+{
+	if ( isa<GlobalVariable>(c) || isa<GlobalAlias>(c) )
+		return false;
+	// Functions are hoisted, they can be used at any time
+	if ( isa<Function>(c) )
+		return true;
+	for ( const Use & U : c->operands() )
+		if ( !isIndependentConstant( cast<Constant>(U) ) )
+			return false;
+	return true;
+}
+
+/**
+ * Return true if v is only used by instructions, possibly through constant expressions
+ */
+static bool isOnlyUsedByCode( const Value * v )
+{
+	for ( const User * U : v->users() )
+	{
+		if ( isa<Instruction>(U) )
+			continue;
+		if ( !isa<ConstantExpr>(U) || !isOnlyUsedByCode(U) )
+			return false;
+	}
+	return true;
+}
+
+void GlobalDepsAnalyzer::computeLazyGlobals( const llvm::Module & module )
+{
+	for ( const GlobalVariable & GV : module.getGlobalList() )
+	{
+		if ( !GV.hasInitializer() || TypeSupport::isClientGlobal(&GV) || GV.getName() == "llvm.global_ctors" )
+			continue;
+		// Only aggregates are worth it, and they are never assigned as a whole so the accessor can be replaced safely
+		Type * T = GV.getInitializer()->getType();
+		if ( !T->isArrayTy() && !T->isStructTy() )
+			continue;
+		// Classes with bases are completed after their definition
+		if ( StructType * ST = dyn_cast<StructType>(T) )
+			if ( classesWithBaseInfoNeeded.count(ST) )
+				continue;
+		if ( varsFixups.count(&GV) )
+			continue;
+		if ( !isIndependentConstant( GV.getInitializer() ) || !isOnlyUsedByCode(&GV) )
+			continue;
+		lazyGlobalsSet.insert(&GV);
+	}
+}
+
+/**
+ * Add to the worklist all the functions directly referenced by the constant c
+ */
+static void collectReferencedFunctions( const Constant * c, std::vector<const Function*>& worklist )
+{
+	if ( const Function * F = dyn_cast<Function>(c) )
+		worklist.push_back(F);
+	else if ( isa<GlobalValue>(c) )
+		return;
+	else
+	{
+		// Global variables are always in the core chunk, their initializers are roots
+		for ( const Use & U : c->operands() )
+			collectReferencedFunctions( cast<Constant>(U), worklist );
+	}
+}
+
+static void collectReferencedFunctions( const Function * F, std::vector<const Function*>& worklist )
+{
+	for ( const BasicBlock & BB : *F )
+		for ( const Instruction & I : BB )
+			for ( const Use & U : I.operands() )
+				if ( const Constant * c = dyn_cast<Constant>(U) )
+					collectReferencedFunctions( c, worklist );
+}
+
+void GlobalDepsAnalyzer::splitFunctions( const llvm::Module & module, const std::vector<const llvm::Function*>& entryPoints )
+{
+	std::unordered_set<const Function*> roots;
+	std::vector<const Function*> worklist;
+	for ( const GlobalValue * GV : externals )
+		if ( const Function * F = dyn_cast<Function>(GV) )
+			roots.insert(F);
+	roots.insert( constructorsNeeded.begin(), constructorsNeeded.end() );
+	for ( const GlobalVariable & GV : module.getGlobalList() )
+		if ( GV.hasInitializer() )
+			collectReferencedFunctions( GV.getInitializer(), worklist );
+	roots.insert( worklist.begin(), worklist.end() );
+	worklist.clear();
+
+	std::unordered_set<const Function*> secondaryEntries;
+	for ( const Function * F : entryPoints )
+		if ( !F->empty() && !roots.count(F) && secondaryEntries.insert(F).second )
+			secondaryChunkEntryPoints.push_back(F);
+
+	// Everything reachable from the entry points is a candidate for the secondary chunk
+	std::unordered_set<const Function*> candidates;
+	worklist.assign( secondaryChunkEntryPoints.begin(), secondaryChunkEntryPoints.end() );
+	while ( !worklist.empty() )
+	{
+		const Function * F = worklist.back();
+		worklist.pop_back();
+		if ( F->empty() || !candidates.insert(F).second )
+			continue;
+		collectReferencedFunctions( F, worklist );
+	}
+
+	// Functions which are not candidates are roots as well, since they may be used by the core chunk.
+	// Visit from the roots without entering the entry points, what is left is only needed by the secondary chunk
+	for ( const Function & F : module )
+		if ( !F.empty() && !candidates.count(&F) )
+			roots.insert(&F);
+	std::unordered_set<const Function*> core;
+	worklist.assign( roots.begin(), roots.end() );
+	while ( !worklist.empty() )
+	{
+		const Function * F = worklist.back();
+		worklist.pop_back();
+		if ( F->empty() || secondaryEntries.count(F) || !core.insert(F).second )
+			continue;
+		collectReferencedFunctions( F, worklist );
+	}
+
+	for ( const Function * F : candidates )
+		if ( !core.count(F) )
+			secondaryChunkFunctions.insert(F);
+}
+
 }
 
 using namespace cheerp;
@@ -0,0 +1,1085 @@
+//===-- I64Lowering.cpp - Lower i64 values to pairs of i32 -----------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2014 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "CheerpI64Lowering"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Cheerp/I64Lowering.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+STATISTIC(NumLoweredInstructions, "Number of i64 instructions lowered");
+STATISTIC(NumLoweredFunctions, "Number of functions with i64 arguments or return value lowered");
+STATISTIC(NumLoweredGlobals, "Number of i64 globals lowered");
+
+namespace llvm {
+
+static void reportUnsupported(const Value* v)
+{
+	llvm::errs() << "Unsupported i64 operation: " << *v << "\n";
+	llvm::report_fatal_error("Unsupported code found, please report a bug", false);
+}
+
+const char* I64Lowering::getPassName() const
+{
+	return "CheerpI64Lowering";
+}
+
+char I64Lowering::ID = 0;
+
+uint32_t I64Lowering::getWordCount(Type* t)
+{
+	if(t->isIntegerTy(64))
+		return 2;
+	if(ArrayType* at=dyn_cast<ArrayType>(t))
+		return at->getNumElements() * getWordCount(at->getElementType());
+	return 0;
+}
+
+bool I64Lowering::needsLowering(FunctionType* FT)
+{
+	if(FT->getReturnType()->isIntegerTy(64))
+		return true;
+	for(FunctionType::param_iterator it = FT->param_begin(); it != FT->param_end(); ++it)
+	{
+		if((*it)->isIntegerTy(64))
+			return true;
+	}
+	return false;
+}
+
+GlobalVariable* I64Lowering::getHighSlot(Module& M)
+{
+	if(!highSlot)
+	{
+		Type* int32Ty = Type::getInt32Ty(M.getContext());
+		highSlot = new GlobalVariable(M, int32Ty, false, GlobalValue::InternalLinkage, ConstantInt::get(int32Ty, 0), "cheerpI64High");
+	}
+	return highSlot;
+}
+
+Function* I64Lowering::getDivRemHelper(Module& M, bool isRem)
+{
+	Function*& helper = isRem ? uremHelper : udivHelper;
+	if(helper)
+		return helper;
+
+	// Restoring division, one bit of the quotient per iteration
+	LLVMContext& C = M.getContext();
+	Type* int32Ty = Type::getInt32Ty(C);
+	Type* params[] = { int32Ty, int32Ty, int32Ty, int32Ty };
+	FunctionType* FT = FunctionType::get(int32Ty, params, false);
+	helper = Function::Create(FT, GlobalValue::InternalLinkage, isRem ? "cheerpI64URem" : "cheerpI64UDiv", &M);
+	Function::arg_iterator args = helper->arg_begin();
+	Value* aLo = args++;
+	Value* aHi = args++;
+	LoHi d;
+	d.first = args++;
+	d.second = args++;
+
+	BasicBlock* entry = BasicBlock::Create(C, "entry", helper);
+	BasicBlock* loop = BasicBlock::Create(C, "loop", helper);
+	BasicBlock* exit = BasicBlock::Create(C, "exit", helper);
+	Builder IRB(entry);
+	IRB.CreateBr(loop);
+
+	IRB.SetInsertPoint(loop);
+	Constant* zero = ConstantInt::get(int32Ty, 0);
+	Constant* one = ConstantInt::get(int32Ty, 1);
+	Constant* thirtyOne = ConstantInt::get(int32Ty, 31);
+	PHINode* i = IRB.CreatePHI(int32Ty, 2);
+	PHINode* nLo = IRB.CreatePHI(int32Ty, 2);
+	PHINode* nHi = IRB.CreatePHI(int32Ty, 2);
+	PHINode* qLo = IRB.CreatePHI(int32Ty, 2);
+	PHINode* qHi = IRB.CreatePHI(int32Ty, 2);
+	PHINode* rLo = IRB.CreatePHI(int32Ty, 2);
+	PHINode* rHi = IRB.CreatePHI(int32Ty, 2);
+	// Shift the next bit of the dividend in the remainder
+	LoHi r(IRB.CreateOr(IRB.CreateShl(rLo, one), IRB.CreateLShr(nHi, thirtyOne)),
+		IRB.CreateOr(IRB.CreateShl(rHi, one), IRB.CreateLShr(rLo, thirtyOne)));
+	Value* nextNHi = IRB.CreateOr(IRB.CreateShl(nHi, one), IRB.CreateLShr(nLo, thirtyOne));
+	Value* nextNLo = IRB.CreateShl(nLo, one);
+	Value* nextQHi = IRB.CreateOr(IRB.CreateShl(qHi, one), IRB.CreateLShr(qLo, thirtyOne));
+	Value* nextQLo = IRB.CreateShl(qLo, one);
+	// Subtract the divisor if possible
+	Value* fits = createICmp(IRB, CmpInst::ICMP_UGE, r, d);
+	LoHi nextR = createSelect(IRB, fits, createSub(IRB, r, d), r);
+	nextQLo = IRB.CreateOr(nextQLo, IRB.CreateZExt(fits, int32Ty));
+	Value* nextI = IRB.CreateAdd(i, one);
+	IRB.CreateCondBr(IRB.CreateICmpNE(nextI, ConstantInt::get(int32Ty, 64)), loop, exit);
+
+	i->addIncoming(zero, entry);
+	i->addIncoming(nextI, loop);
+	nLo->addIncoming(aLo, entry);
+	nLo->addIncoming(nextNLo, loop);
+	nHi->addIncoming(aHi, entry);
+	nHi->addIncoming(nextNHi, loop);
+	qLo->addIncoming(zero, entry);
+	qLo->addIncoming(nextQLo, loop);
+	qHi->addIncoming(zero, entry);
+	qHi->addIncoming(nextQHi, loop);
+	rLo->addIncoming(zero, entry);
+	rLo->addIncoming(nextR.first, loop);
+	rHi->addIncoming(zero, entry);
+	rHi->addIncoming(nextR.second, loop);
+
+	IRB.SetInsertPoint(exit);
+	LoHi ret = isRem ? nextR : LoHi(nextQLo, nextQHi);
+	IRB.CreateStore(ret.second, getHighSlot(M));
+	IRB.CreateRet(ret.first);
+	return helper;
+}
+
+I64Lowering::LoHi I64Lowering::getLoHi(Value* v)
+{
+	assert(v->getType()->isIntegerTy(64));
+	Type* int32Ty = Type::getInt32Ty(v->getContext());
+	if(ConstantInt* ci=dyn_cast<ConstantInt>(v))
+	{
+		uint64_t val = ci->getZExtValue();
+		return LoHi(ConstantInt::get(int32Ty, val & 0xffffffff), ConstantInt::get(int32Ty, val >> 32));
+	}
+	if(isa<UndefValue>(v))
+		return LoHi(UndefValue::get(int32Ty), UndefValue::get(int32Ty));
+	auto it = loweredValues.find(v);
+	if(it == loweredValues.end())
+		reportUnsupported(v);
+	return it->second;
+}
+
+Value* I64Lowering::getWordPointer(Builder& IRB, Value* p)
+{
+	Type* int32PtrTy = Type::getInt32PtrTy(p->getContext());
+	if(p->getType() == int32PtrTy)
+		return p;
+	if(cheerp::isBitCast(p))
+	{
+		Value* src = cast<User>(p)->getOperand(0);
+		Type* srcType = src->getType()->getPointerElementType();
+		if(srcType->isIntegerTy(32))
+			return src;
+		if(srcType->isArrayTy() && srcType->getArrayElementType()->isIntegerTy(32))
+			return IRB.CreateConstGEP2_32(src, 0, 0);
+	}
+	else if(GEPOperator* gep=dyn_cast<GEPOperator>(p))
+	{
+		Value* base = gep->getPointerOperand();
+		if(getWordCount(base->getType()->getPointerElementType()))
+		{
+			// Linearize the indexes, all the indexed types are arrays
+			Type* int32Ty = IRB.getInt32Ty();
+			Value* offset = NULL;
+			for(gep_type_iterator it = gep_type_begin(gep), itE = gep_type_end(gep); it != itE; ++it)
+			{
+				Value* index = it.getOperand();
+				if(index->getType()->isIntegerTy(64))
+					index = getLoHi(index).first;
+				else if(!index->getType()->isIntegerTy(32))
+					index = IRB.CreateSExt(index, int32Ty);
+				uint32_t words = getWordCount(it.getIndexedType());
+				assert(words);
+				index = IRB.CreateMul(index, ConstantInt::get(int32Ty, words));
+				offset = offset ? IRB.CreateAdd(offset, index) : index;
+			}
+			Value* wordBase = getWordPointer(IRB, base);
+			return offset ? IRB.CreateGEP(wordBase, offset) : wordBase;
+		}
+		// i64 members are only supported when they are stored as bytes
+		Type* containerType = GetElementPtrInst::getIndexedType(base->getType(),
+			SmallVector<Value*, 4>(gep->idx_begin(), gep->idx_end() - 1));
+		if(containerType && containerType->isStructTy() && !cheerp::TypeSupport::hasByteLayout(containerType))
+			reportUnsupported(p);
+	}
+	return IRB.CreateBitCast(p, int32PtrTy);
+}
+
+I64Lowering::LoHi I64Lowering::createAdd(Builder& IRB, const LoHi& a, const LoHi& b)
+{
+	Value* lo = IRB.CreateAdd(a.first, b.first);
+	Value* carry = IRB.CreateZExt(IRB.CreateICmpULT(lo, a.first), IRB.getInt32Ty());
+	Value* hi = IRB.CreateAdd(IRB.CreateAdd(a.second, b.second), carry);
+	return LoHi(lo, hi);
+}
+
+I64Lowering::LoHi I64Lowering::createSub(Builder& IRB, const LoHi& a, const LoHi& b)
+{
+	Value* lo = IRB.CreateSub(a.first, b.first);
+	Value* borrow = IRB.CreateZExt(IRB.CreateICmpULT(a.first, b.first), IRB.getInt32Ty());
+	Value* hi = IRB.CreateSub(IRB.CreateSub(a.second, b.second), borrow);
+	return LoHi(lo, hi);
+}
+
+I64Lowering::LoHi I64Lowering::createNeg(Builder& IRB, const LoHi& a)
+{
+	Constant* zero = IRB.getInt32(0);
+	return createSub(IRB, LoHi(zero, zero), a);
+}
+
+I64Lowering::LoHi I64Lowering::createMul(Builder& IRB, const LoHi& a, const LoHi& b)
+{
+	// The 64-bit product of the low words is computed using 16-bit halves,
+	// so that no partial product exceeds 32 bits
+	Constant* mask = IRB.getInt32(0xffff);
+	Constant* sixteen = IRB.getInt32(16);
+	Value* a0 = IRB.CreateAnd(a.first, mask);
+	Value* a1 = IRB.CreateLShr(a.first, sixteen);
+	Value* b0 = IRB.CreateAnd(b.first, mask);
+	Value* b1 = IRB.CreateLShr(b.first, sixteen);
+	Value* p00 = IRB.CreateMul(a0, b0);
+	Value* p01 = IRB.CreateMul(a0, b1);
+	Value* p10 = IRB.CreateMul(a1, b0);
+	Value* p11 = IRB.CreateMul(a1, b1);
+	Value* mid = IRB.CreateAdd(IRB.CreateAdd(IRB.CreateLShr(p00, sixteen), IRB.CreateAnd(p01, mask)), IRB.CreateAnd(p10, mask));
+	Value* lo = IRB.CreateOr(IRB.CreateAnd(p00, mask), IRB.CreateShl(mid, sixteen));
+	Value* hi = IRB.CreateAdd(p11, IRB.CreateLShr(p01, sixteen));
+	hi = IRB.CreateAdd(hi, IRB.CreateLShr(p10, sixteen));
+	hi = IRB.CreateAdd(hi, IRB.CreateLShr(mid, sixteen));
+	// The cross products only affect the high word
+	hi = IRB.CreateAdd(hi, IRB.CreateMul(a.first, b.second));
+	hi = IRB.CreateAdd(hi, IRB.CreateMul(a.second, b.first));
+	return LoHi(lo, hi);
+}
+
+I64Lowering::LoHi I64Lowering::createShift(Builder& IRB, unsigned opcode, const LoHi& a, Value* amount)
+{
+	Constant* zero = IRB.getInt32(0);
+	Constant* thirtyOne = IRB.getInt32(31);
+	if(ConstantInt* ci=dyn_cast<ConstantInt>(amount))
+	{
+		uint32_t s = ci->getZExtValue() & 63;
+		if(s == 0)
+			return a;
+		if(s >= 32)
+		{
+			Constant* bigShift = IRB.getInt32(s - 32);
+			if(opcode == Instruction::Shl)
+				return LoHi(zero, IRB.CreateShl(a.first, bigShift));
+			else if(opcode == Instruction::LShr)
+				return LoHi(IRB.CreateLShr(a.second, bigShift), zero);
+			else
+				return LoHi(IRB.CreateAShr(a.second, bigShift), IRB.CreateAShr(a.second, thirtyOne));
+		}
+		Constant* shift = IRB.getInt32(s);
+		Constant* complement = IRB.getInt32(32 - s);
+		if(opcode == Instruction::Shl)
+			return LoHi(IRB.CreateShl(a.first, shift),
+				IRB.CreateOr(IRB.CreateShl(a.second, shift), IRB.CreateLShr(a.first, complement)));
+		Value* lo = IRB.CreateOr(IRB.CreateLShr(a.first, shift), IRB.CreateShl(a.second, complement));
+		if(opcode == Instruction::LShr)
+			return LoHi(lo, IRB.CreateLShr(a.second, shift));
+		else
+			return LoHi(lo, IRB.CreateAShr(a.second, shift));
+	}
+
+	// Shifting by 32 is undefined on i32, the bits crossing the words
+	// are moved in two steps so that the amount is at most 31
+	Constant* one = IRB.getInt32(1);
+	Value* s = IRB.CreateAnd(amount, thirtyOne);
+	Value* complement = IRB.CreateSub(thirtyOne, s);
+	Value* isBig = IRB.CreateICmpNE(IRB.CreateAnd(amount, IRB.getInt32(32)), zero);
+	LoHi small, big;
+	if(opcode == Instruction::Shl)
+	{
+		small.first = IRB.CreateShl(a.first, s);
+		small.second = IRB.CreateOr(IRB.CreateShl(a.second, s), IRB.CreateLShr(IRB.CreateLShr(a.first, one), complement));
+		big = LoHi(zero, small.first);
+	}
+	else
+	{
+		small.first = IRB.CreateOr(IRB.CreateLShr(a.first, s), IRB.CreateShl(IRB.CreateShl(a.second, one), complement));
+		if(opcode == Instruction::LShr)
+		{
+			small.second = IRB.CreateLShr(a.second, s);
+			big = LoHi(small.second, zero);
+		}
+		else
+		{
+			small.second = IRB.CreateAShr(a.second, s);
+			big = LoHi(small.second, IRB.CreateAShr(a.second, thirtyOne));
+		}
+	}
+	return createSelect(IRB, isBig, big, small);
+}
+
+I64Lowering::LoHi I64Lowering::createDivRem(Builder& IRB, unsigned opcode, const LoHi& a, const LoHi& b)
+{
+	Module& M = *IRB.GetInsertBlock()->getParent()->getParent();
+	bool isRem = opcode == Instruction::URem || opcode == Instruction::SRem;
+	bool isSigned = opcode == Instruction::SDiv || opcode == Instruction::SRem;
+	Constant* zero = IRB.getInt32(0);
+	LoHi absA = a, absB = b;
+	Value* aNeg = NULL;
+	Value* bNeg = NULL;
+	if(isSigned)
+	{
+		aNeg = IRB.CreateICmpSLT(a.second, zero);
+		bNeg = IRB.CreateICmpSLT(b.second, zero);
+		absA = createSelect(IRB, aNeg, createNeg(IRB, a), a);
+		absB = createSelect(IRB, bNeg, createNeg(IRB, b), b);
+	}
+	Value* args[] = { absA.first, absA.second, absB.first, absB.second };
+	LoHi ret;
+	ret.first = IRB.CreateCall(getDivRemHelper(M, isRem), args);
+	ret.second = IRB.CreateLoad(getHighSlot(M));
+	if(isSigned)
+	{
+		// The remainder has the sign of the dividend
+		Value* negateResult = isRem ? aNeg : IRB.CreateXor(aNeg, bNeg);
+		ret = createSelect(IRB, negateResult, createNeg(IRB, ret), ret);
+	}
+	return ret;
+}
+
+I64Lowering::LoHi I64Lowering::createSelect(Builder& IRB, Value* cond, const LoHi& a, const LoHi& b)
+{
+	return LoHi(IRB.CreateSelect(cond, a.first, b.first), IRB.CreateSelect(cond, a.second, b.second));
+}
+
+Value* I64Lowering::createICmp(Builder& IRB, CmpInst::Predicate pred, const LoHi& a, const LoHi& b)
+{
+	if(pred == CmpInst::ICMP_EQ)
+		return IRB.CreateAnd(IRB.CreateICmpEQ(a.first, b.first), IRB.CreateICmpEQ(a.second, b.second));
+	if(pred == CmpInst::ICMP_NE)
+		return IRB.CreateOr(IRB.CreateICmpNE(a.first, b.first), IRB.CreateICmpNE(a.second, b.second));
+	// The high words decide unless they are equal, then the low words are compared as unsigned
+	CmpInst::Predicate strictPred = pred;
+	CmpInst::Predicate loPred = pred;
+	switch(pred)
+	{
+		case CmpInst::ICMP_ULE: strictPred = CmpInst::ICMP_ULT; break;
+		case CmpInst::ICMP_UGE: strictPred = CmpInst::ICMP_UGT; break;
+		case CmpInst::ICMP_SLT: loPred = CmpInst::ICMP_ULT; break;
+		case CmpInst::ICMP_SLE: strictPred = CmpInst::ICMP_SLT; loPred = CmpInst::ICMP_ULE; break;
+		case CmpInst::ICMP_SGT: loPred = CmpInst::ICMP_UGT; break;
+		case CmpInst::ICMP_SGE: strictPred = CmpInst::ICMP_SGT; loPred = CmpInst::ICMP_UGE; break;
+		default: break;
+	}
+	Value* hiDecides = IRB.CreateICmp(strictPred, a.second, b.second);
+	Value* loDecides = IRB.CreateAnd(IRB.CreateICmpEQ(a.second, b.second), IRB.CreateICmp(loPred, a.first, b.first));
+	return IRB.CreateOr(hiDecides, loDecides);
+}
+
+Value* I64Lowering::createToFP(Builder& IRB, bool isSigned, const LoHi& a, Type* destType)
+{
+	Type* doubleTy = IRB.getDoubleTy();
+	Value* hi = isSigned ? IRB.CreateSIToFP(a.second, doubleTy) : IRB.CreateUIToFP(a.second, doubleTy);
+	Value* ret = IRB.CreateFAdd(IRB.CreateFMul(hi, ConstantFP::get(doubleTy, 4294967296.0)), IRB.CreateUIToFP(a.first, doubleTy));
+	if(destType != doubleTy)
+		ret = IRB.CreateFPTrunc(ret, destType);
+	return ret;
+}
+
+I64Lowering::LoHi I64Lowering::createFromFP(Builder& IRB, bool isSigned, Value* v)
+{
+	Type* doubleTy = IRB.getDoubleTy();
+	Type* int32Ty = IRB.getInt32Ty();
+	if(v->getType() != doubleTy)
+		v = IRB.CreateFPExt(v, doubleTy);
+	Value* isNeg = NULL;
+	if(isSigned)
+	{
+		isNeg = IRB.CreateFCmpOLT(v, ConstantFP::get(doubleTy, 0.0));
+		v = IRB.CreateSelect(isNeg, IRB.CreateFNeg(v), v);
+	}
+	Value* hi = IRB.CreateFPToUI(IRB.CreateFMul(v, ConstantFP::get(doubleTy, 1.0/4294967296.0)), int32Ty);
+	Value* rest = IRB.CreateFSub(v, IRB.CreateFMul(IRB.CreateUIToFP(hi, doubleTy), ConstantFP::get(doubleTy, 4294967296.0)));
+	LoHi ret(IRB.CreateFPToUI(rest, int32Ty), hi);
+	if(isSigned)
+		ret = createSelect(IRB, isNeg, createNeg(IRB, ret), ret);
+	return ret;
+}
+
+void I64Lowering::lowerGlobals(Module& M)
+{
+	std::vector<GlobalVariable*> globals;
+	for(GlobalVariable& GV: M.getGlobalList())
+	{
+		if(GV.hasInitializer() && getWordCount(GV.getType()->getElementType()))
+			globals.push_back(&GV);
+	}
+	Type* int32Ty = Type::getInt32Ty(M.getContext());
+	for(GlobalVariable* GV: globals)
+	{
+		// Flatten the initializer to words, low word first
+		SmallVector<uint32_t, 16> words;
+		SmallVector<Constant*, 16> worklist(1, GV->getInitializer());
+		while(!worklist.empty())
+		{
+			Constant* C = worklist.pop_back_val();
+			if(ConstantInt* ci=dyn_cast<ConstantInt>(C))
+			{
+				words.push_back(ci->getZExtValue() & 0xffffffff);
+				words.push_back(ci->getZExtValue() >> 32);
+			}
+			else if(isa<ConstantAggregateZero>(C) || isa<UndefValue>(C))
+				words.append(getWordCount(C->getType()), 0);
+			else if(ConstantDataSequential* cds=dyn_cast<ConstantDataSequential>(C))
+			{
+				for(uint32_t i=cds->getNumElements();i>0;i--)
+					worklist.push_back(cds->getElementAsConstant(i-1));
+			}
+			else if(ConstantArray* ca=dyn_cast<ConstantArray>(C))
+			{
+				for(uint32_t i=ca->getNumOperands();i>0;i--)
+					worklist.push_back(ca->getOperand(i-1));
+			}
+			else
+				reportUnsupported(C);
+		}
+		Constant* init = ConstantDataArray::get(M.getContext(), words);
+		GlobalVariable* newGV = new GlobalVariable(M, ArrayType::get(int32Ty, words.size()), GV->isConstant(),
+			GV->getLinkage(), init, "", GV, GV->getThreadLocalMode(), GV->getType()->getAddressSpace());
+		newGV->takeName(GV);
+		newGV->setAlignment(GV->getAlignment());
+		GV->replaceAllUsesWith(ConstantExpr::getBitCast(newGV, GV->getType()));
+		GV->eraseFromParent();
+		NumLoweredGlobals++;
+	}
+}
+
+void I64Lowering::lowerSignature(Function& F)
+{
+	// Only direct calls can be rewritten
+	for(const Use& U: F.uses())
+	{
+		ImmutableCallSite CS(U.getUser());
+		if(!CS || !CS.isCallee(&U))
+		{
+			llvm::errs() << "Function with i64 in the signature used indirectly: " << F.getName() << "\n";
+			llvm::report_fatal_error("Unsupported code found, please report a bug", false);
+		}
+	}
+
+	Type* int32Ty = Type::getInt32Ty(F.getContext());
+	FunctionType* FT = F.getFunctionType();
+	SmallVector<Type*, 8> params;
+	for(FunctionType::param_iterator it = FT->param_begin(); it != FT->param_end(); ++it)
+	{
+		Type* t = *it;
+		if(t->isIntegerTy(64))
+		{
+			params.push_back(int32Ty);
+			params.push_back(int32Ty);
+		}
+		else
+			params.push_back(t);
+	}
+	Type* retType = FT->getReturnType()->isIntegerTy(64) ? int32Ty : FT->getReturnType();
+	Function* NF = Function::Create(FunctionType::get(retType, params, FT->isVarArg()), F.getLinkage(), "", F.getParent());
+	NF->takeName(&F);
+	NF->setCallingConv(F.getCallingConv());
+	NF->addAttributes(AttributeSet::FunctionIndex, F.getAttributes().getFnAttributes());
+	NF->getBasicBlockList().splice(NF->begin(), F.getBasicBlockList());
+
+	Function::arg_iterator newArg = NF->arg_begin();
+	for(Argument& arg: F.getArgumentList())
+	{
+		if(arg.getType()->isIntegerTy(64))
+		{
+			LoHi& v = loweredValues[&arg];
+			v.first = newArg++;
+			v.second = newArg++;
+			v.first->setName(arg.getName() + "Lo");
+			v.second->setName(arg.getName() + "Hi");
+		}
+		else
+		{
+			newArg->takeName(&arg);
+			arg.replaceAllUsesWith(newArg++);
+		}
+	}
+	loweredFunctions[&F] = NF;
+	NumLoweredFunctions++;
+}
+
+Constant* I64Lowering::lowerConstant(Constant* C)
+{
+	if(!isa<ConstantExpr>(C) && !isa<ConstantArray>(C) && !isa<ConstantStruct>(C) && !isa<ConstantVector>(C))
+		return C;
+	auto it = loweredConstants.find(C);
+	if(it != loweredConstants.end())
+		return it->second;
+
+	SmallVector<Constant*, 8> ops;
+	bool changed = false;
+	for(Value* op: C->operands())
+	{
+		Constant* newOp = lowerConstant(cast<Constant>(op));
+		changed |= newOp != op;
+		ops.push_back(newOp);
+	}
+	Constant* ret = C;
+	if(changed)
+	{
+		if(ConstantExpr* CE=dyn_cast<ConstantExpr>(C))
+			ret = CE->getWithOperands(ops);
+		else if(ConstantArray* CA=dyn_cast<ConstantArray>(C))
+			ret = ConstantArray::get(CA->getType(), ops);
+		else if(ConstantStruct* CS=dyn_cast<ConstantStruct>(C))
+			ret = ConstantStruct::get(CS->getType(), ops);
+		else
+			ret = ConstantVector::get(ops);
+	}
+	GEPOperator* gep = dyn_cast<GEPOperator>(ret);
+	if(gep && getWordCount(gep->getPointerOperandType()->getPointerElementType()))
+	{
+		// All the operands are constants, so the builder folds everything and does not need an insertion point
+		Builder IRB(C->getContext());
+		ret = ConstantExpr::getBitCast(cast<Constant>(getWordPointer(IRB, gep)), gep->getType());
+	}
+	loweredConstants[C] = ret;
+	return ret;
+}
+
+bool I64Lowering::usesI64Constants(Instruction& I)
+{
+	for(Value* op: I.operands())
+	{
+		if(Constant* C = dyn_cast<Constant>(op))
+		{
+			if(lowerConstant(C) != C)
+				return true;
+		}
+	}
+	return false;
+}
+
+void I64Lowering::lowerStorage(Function& F)
+{
+	Module& M = *F.getParent();
+	Type* int32Ty = Type::getInt32Ty(M.getContext());
+	Type* int32PtrTy = Type::getInt32PtrTy(M.getContext());
+	for(BasicBlock& BB: F)
+	{
+		for(BasicBlock::iterator it = BB.begin(); it != BB.end(); )
+		{
+			Instruction* I = it++;
+			Builder IRB(I);
+			// Pointers to i64 memory in constant expressions must point to words as well
+			for(Use& U: I->operands())
+			{
+				Constant* C = dyn_cast<Constant>(U.get());
+				if(!C)
+					continue;
+				Constant* newC = lowerConstant(C);
+				if(newC != C)
+					U.set(newC);
+			}
+			if(AllocaInst* AI=dyn_cast<AllocaInst>(I))
+			{
+				uint32_t words = getWordCount(AI->getAllocatedType());
+				if(!words)
+					continue;
+				ConstantInt* arraySize = dyn_cast<ConstantInt>(AI->getArraySize());
+				if(!arraySize)
+					reportUnsupported(AI);
+				AllocaInst* newAI = IRB.CreateAlloca(ArrayType::get(int32Ty, words * arraySize->getZExtValue()));
+				newAI->setAlignment(AI->getAlignment());
+				newAI->takeName(AI);
+				AI->replaceAllUsesWith(IRB.CreateBitCast(newAI, AI->getType()));
+				AI->eraseFromParent();
+			}
+			else if(BitCastInst* BI=dyn_cast<BitCastInst>(I))
+			{
+				// Memory allocated for i64 values becomes memory for words
+				if(!getWordCount(BI->getType()->getPointerElementType()) ||
+					cheerp::DynamicAllocInfo::getAllocType(BI->getOperand(0)) == cheerp::DynamicAllocInfo::not_an_alloc)
+					continue;
+				BI->setOperand(0, IRB.CreateBitCast(BI->getOperand(0), int32PtrTy));
+			}
+			else if(IntrinsicInst* II=dyn_cast<IntrinsicInst>(I))
+			{
+				Intrinsic::ID id = II->getIntrinsicID();
+				if(id == Intrinsic::cheerp_allocate || id == Intrinsic::cheerp_reallocate)
+				{
+					if(!getWordCount(II->getType()->getPointerElementType()))
+						continue;
+					CallInst* newCall;
+					if(id == Intrinsic::cheerp_allocate)
+					{
+						Function* alloc = Intrinsic::getDeclaration(&M, id, int32PtrTy);
+						newCall = IRB.CreateCall(alloc, II->getArgOperand(0));
+					}
+					else
+					{
+						Type* types[] = { int32PtrTy, int32PtrTy };
+						Function* realloc = Intrinsic::getDeclaration(&M, id, types);
+						newCall = IRB.CreateCall2(realloc, getWordPointer(IRB, II->getArgOperand(0)), II->getArgOperand(1));
+					}
+					II->replaceAllUsesWith(IRB.CreateBitCast(newCall, II->getType()));
+					II->eraseFromParent();
+				}
+				else if(id == Intrinsic::memcpy || id == Intrinsic::memmove)
+				{
+					if(!getWordCount(II->getArgOperand(0)->getType()->getPointerElementType()))
+						continue;
+					Type* types[] = { int32PtrTy, int32PtrTy, II->getArgOperand(2)->getType() };
+					Function* memFunc = Intrinsic::getDeclaration(&M, id, types);
+					Value* args[] = { getWordPointer(IRB, II->getArgOperand(0)), getWordPointer(IRB, II->getArgOperand(1)),
+							II->getArgOperand(2), II->getArgOperand(3), II->getArgOperand(4) };
+					IRB.CreateCall(memFunc, args);
+					II->eraseFromParent();
+				}
+			}
+		}
+	}
+}
+
+void I64Lowering::lowerInstruction(Instruction& I)
+{
+	Module& M = *I.getParent()->getParent()->getParent();
+	Type* int32Ty = Type::getInt32Ty(M.getContext());
+	Builder IRB(&I);
+	bool isI64 = I.getType()->isIntegerTy(64);
+	Value* replacement = NULL;
+	LoHi result;
+
+	if(GetElementPtrInst* gep=dyn_cast<GetElementPtrInst>(&I))
+	{
+		if(!getWordCount(gep->getPointerOperandType()->getPointerElementType()))
+		{
+			// Only the low word of i64 indexes is meaningful
+			for(User::op_iterator it = gep->idx_begin(); it != gep->idx_end(); ++it)
+			{
+				if((*it)->getType()->isIntegerTy(64))
+					it->set(getLoHi(*it).first);
+			}
+			return;
+		}
+		// Pointers to i64 memory point to words, indexes must be scaled
+		replacement = IRB.CreateBitCast(getWordPointer(IRB, gep), gep->getType());
+	}
+	else if(PHINode* phi=dyn_cast<PHINode>(&I))
+	{
+		if(!isI64)
+			return;
+		result.first = IRB.CreatePHI(int32Ty, phi->getNumIncomingValues());
+		result.second = IRB.CreatePHI(int32Ty, phi->getNumIncomingValues());
+		pendingPHIs.push_back(std::make_pair(phi, result));
+	}
+	else if(LoadInst* LI=dyn_cast<LoadInst>(&I))
+	{
+		if(!isI64)
+			return;
+		Value* lo = getWordPointer(IRB, LI->getPointerOperand());
+		Value* hi = IRB.CreateConstGEP1_32(lo, 1);
+		LoadInst* loLoad = IRB.CreateLoad(lo, LI->isVolatile());
+		LoadInst* hiLoad = IRB.CreateLoad(hi, LI->isVolatile());
+		loLoad->setAlignment(std::min(LI->getAlignment(), 4u));
+		hiLoad->setAlignment(std::min(LI->getAlignment(), 4u));
+		result = LoHi(loLoad, hiLoad);
+	}
+	else if(StoreInst* SI=dyn_cast<StoreInst>(&I))
+	{
+		if(!SI->getValueOperand()->getType()->isIntegerTy(64))
+			return;
+		LoHi v = getLoHi(SI->getValueOperand());
+		Value* lo = getWordPointer(IRB, SI->getPointerOperand());
+		Value* hi = IRB.CreateConstGEP1_32(lo, 1);
+		StoreInst* loStore = IRB.CreateStore(v.first, lo, SI->isVolatile());
+		StoreInst* hiStore = IRB.CreateStore(v.second, hi, SI->isVolatile());
+		loStore->setAlignment(std::min(SI->getAlignment(), 4u));
+		hiStore->setAlignment(std::min(SI->getAlignment(), 4u));
+	}
+	else if(BinaryOperator* BO=dyn_cast<BinaryOperator>(&I))
+	{
+		if(!isI64)
+			return;
+		LoHi a = getLoHi(BO->getOperand(0));
+		unsigned opcode = BO->getOpcode();
+		if(opcode == Instruction::Shl || opcode == Instruction::LShr || opcode == Instruction::AShr)
+		{
+			Value* amount = BO->getOperand(1);
+			amount = isa<ConstantInt>(amount) ? IRB.getInt32(cast<ConstantInt>(amount)->getZExtValue()) : getLoHi(amount).first;
+			result = createShift(IRB, opcode, a, amount);
+		}
+		else
+		{
+			LoHi b = getLoHi(BO->getOperand(1));
+			switch(opcode)
+			{
+				case Instruction::Add:
+					result = createAdd(IRB, a, b);
+					break;
+				case Instruction::Sub:
+					result = createSub(IRB, a, b);
+					break;
+				case Instruction::Mul:
+					result = createMul(IRB, a, b);
+					break;
+				case Instruction::And:
+				case Instruction::Or:
+				case Instruction::Xor:
+					result.first = IRB.CreateBinOp(BO->getOpcode(), a.first, b.first);
+					result.second = IRB.CreateBinOp(BO->getOpcode(), a.second, b.second);
+					break;
+				case Instruction::UDiv:
+				case Instruction::SDiv:
+				case Instruction::URem:
+				case Instruction::SRem:
+					result = createDivRem(IRB, opcode, a, b);
+					break;
+				default:
+					reportUnsupported(&I);
+			}
+		}
+	}
+	else if(ICmpInst* CI=dyn_cast<ICmpInst>(&I))
+	{
+		if(!CI->getOperand(0)->getType()->isIntegerTy(64))
+			return;
+		replacement = createICmp(IRB, CI->getPredicate(), getLoHi(CI->getOperand(0)), getLoHi(CI->getOperand(1)));
+	}
+	else if(SelectInst* SI=dyn_cast<SelectInst>(&I))
+	{
+		if(!isI64)
+			return;
+		result = createSelect(IRB, SI->getCondition(), getLoHi(SI->getTrueValue()), getLoHi(SI->getFalseValue()));
+	}
+	else if(CastInst* CI=dyn_cast<CastInst>(&I))
+	{
+		Value* src = CI->getOperand(0);
+		switch(CI->getOpcode())
+		{
+			case Instruction::ZExt:
+			case Instruction::SExt:
+			{
+				if(!isI64)
+					return;
+				Value* lo = src->getType()->isIntegerTy(32) ? src : IRB.CreateCast(CI->getOpcode(), src, int32Ty);
+				Value* hi = CI->getOpcode() == Instruction::ZExt ? IRB.getInt32(0) : IRB.CreateAShr(lo, IRB.getInt32(31));
+				result = LoHi(lo, hi);
+				break;
+			}
+			case Instruction::Trunc:
+			{
+				if(!src->getType()->isIntegerTy(64))
+					return;
+				Value* lo = getLoHi(src).first;
+				replacement = CI->getType()->isIntegerTy(32) ? lo : IRB.CreateTrunc(lo, CI->getType());
+				break;
+			}
+			case Instruction::SIToFP:
+			case Instruction::UIToFP:
+				if(!src->getType()->isIntegerTy(64))
+					return;
+				replacement = createToFP(IRB, CI->getOpcode() == Instruction::SIToFP, getLoHi(src), CI->getType());
+				break;
+			case Instruction::FPToSI:
+			case Instruction::FPToUI:
+				if(!isI64)
+					return;
+				result = createFromFP(IRB, CI->getOpcode() == Instruction::FPToSI, src);
+				break;
+			default:
+				if(isI64 || src->getType()->isIntegerTy(64))
+					reportUnsupported(&I);
+				return;
+		}
+	}
+	else if(CallInst* CI=dyn_cast<CallInst>(&I))
+	{
+		Function* F = CI->getCalledFunction();
+		auto it = F ? loweredFunctions.find(F) : loweredFunctions.end();
+		if(it == loweredFunctions.end())
+		{
+			// Intrinsics may take constant i64 parameters, like sizes for llvm.lifetime.start
+			bool onlyConstants = F && F->isIntrinsic() && !isI64;
+			for(uint32_t i=0;i<CI->getNumArgOperands();i++)
+			{
+				Value* op = CI->getArgOperand(i);
+				if(op->getType()->isIntegerTy(64) && !(onlyConstants && isa<Constant>(op)))
+					reportUnsupported(&I);
+			}
+			if(isI64)
+				reportUnsupported(&I);
+			return;
+		}
+		SmallVector<Value*, 8> args;
+		for(uint32_t i=0;i<CI->getNumArgOperands();i++)
+		{
+			Value* op = CI->getArgOperand(i);
+			if(op->getType()->isIntegerTy(64))
+			{
+				LoHi v = getLoHi(op);
+				args.push_back(v.first);
+				args.push_back(v.second);
+			}
+			else
+				args.push_back(op);
+		}
+		CallInst* newCall = IRB.CreateCall(it->second, args);
+		newCall->setCallingConv(CI->getCallingConv());
+		if(isI64)
+			result = LoHi(newCall, IRB.CreateLoad(getHighSlot(M)));
+		else if(!CI->getType()->isVoidTy())
+			replacement = newCall;
+	}
+	else if(SwitchInst* SI=dyn_cast<SwitchInst>(&I))
+	{
+		if(!SI->getCondition()->getType()->isIntegerTy(64))
+			return;
+		lowerSwitch(SI);
+	}
+	else if(ReturnInst* RI=dyn_cast<ReturnInst>(&I))
+	{
+		Value* retVal = RI->getReturnValue();
+		if(!retVal || !retVal->getType()->isIntegerTy(64))
+			return;
+		LoHi v = getLoHi(retVal);
+		IRB.CreateStore(v.second, getHighSlot(M));
+		IRB.CreateRet(v.first);
+	}
+	else
+	{
+		if(isI64)
+			reportUnsupported(&I);
+		for(Value* op: I.operands())
+		{
+			if(op->getType()->isIntegerTy(64))
+				reportUnsupported(&I);
+		}
+		return;
+	}
+
+	if(isI64)
+	{
+		assert(result.first && result.second);
+		loweredValues[&I] = result;
+	}
+	else if(replacement)
+	{
+		replacement->takeName(&I);
+		I.replaceAllUsesWith(replacement);
+	}
+	deadInsts.push_back(&I);
+	NumLoweredInstructions++;
+}
+
+void I64Lowering::lowerSwitch(SwitchInst* SI)
+{
+	LoHi cond = getLoHi(SI->getCondition());
+	BasicBlock* BB = SI->getParent();
+	Function* F = BB->getParent();
+	BasicBlock* defaultDest = SI->getDefaultDest();
+	// Group the cases by high word, in the order of the original cases.
+	// The key is 64 bit wide since ~0U is reserved by DenseMap.
+	MapVector<uint64_t, SmallVector<std::pair<uint32_t, BasicBlock*>, 4>> groups;
+	for(SwitchInst::CaseIt it = SI->case_begin(); it != SI->case_end(); ++it)
+	{
+		uint64_t v = it.getCaseValue()->getZExtValue();
+		groups[v >> 32].push_back(std::make_pair(v & 0xffffffff, it.getCaseSuccessor()));
+	}
+
+	Builder IRB(SI);
+	SwitchInst* hiSwitch = IRB.CreateSwitch(cond.second, defaultDest, groups.size());
+	SmallVector<SwitchInst*, 4> loSwitches;
+	Function::iterator insertPoint = BB;
+	++insertPoint;
+	for(auto& g: groups)
+	{
+		BasicBlock* loBB = BasicBlock::Create(F->getContext(), BB->getName() + "Lo", F,
+			insertPoint == F->end() ? NULL : &*insertPoint);
+		Builder loIRB(loBB);
+		SwitchInst* loSwitch = loIRB.CreateSwitch(cond.first, defaultDest, g.second.size());
+		for(auto& c: g.second)
+			loSwitch->addCase(loIRB.getInt32(c.first), c.second);
+		hiSwitch->addCase(IRB.getInt32(g.first), loBB);
+		loSwitches.push_back(loSwitch);
+	}
+
+	// The PHIs of the successors now receive the same values from the new edges
+	SmallPtrSet<BasicBlock*, 8> successors;
+	for(uint32_t i=0;i<SI->getNumSuccessors();i++)
+	{
+		BasicBlock* succ = SI->getSuccessor(i);
+		if(!successors.insert(succ))
+			continue;
+		for(BasicBlock::iterator it = succ->begin(); PHINode* phi = dyn_cast<PHINode>(it); ++it)
+		{
+			int idx = phi->getBasicBlockIndex(BB);
+			// Lowered PHIs are filled at the end from the original ones
+			if(idx < 0)
+				continue;
+			Value* v = phi->getIncomingValue(idx);
+			while((idx = phi->getBasicBlockIndex(BB)) >= 0)
+				phi->removeIncomingValue(idx, /*DeletePHIIfEmpty*/ false);
+			for(uint32_t j=0;j<hiSwitch->getNumSuccessors();j++)
+			{
+				if(hiSwitch->getSuccessor(j) == succ)
+					phi->addIncoming(v, BB);
+			}
+			for(SwitchInst* loSwitch: loSwitches)
+			{
+				for(uint32_t j=0;j<loSwitch->getNumSuccessors();j++)
+				{
+					if(loSwitch->getSuccessor(j) == succ)
+						phi->addIncoming(v, loSwitch->getParent());
+				}
+			}
+		}
+	}
+}
+
+void I64Lowering::lowerFunction(Function& F)
+{
+	// Unreachable blocks may use values which are never lowered
+	removeUnreachableBlocks(F);
+	lowerStorage(F);
+
+	// Visit the blocks in reverse post order, so that all the operands are lowered
+	// before their users. PHIs are the only exception and they are filled later.
+	ReversePostOrderTraversal<Function*> RPOT(&F);
+	for(BasicBlock* BB: RPOT)
+	{
+		for(BasicBlock::iterator it = BB->begin(); it != BB->end(); )
+			lowerInstruction(*it++);
+	}
+	for(auto& it: pendingPHIs)
+	{
+		PHINode* phi = it.first;
+		for(uint32_t i=0;i<phi->getNumIncomingValues();i++)
+		{
+			LoHi v = getLoHi(phi->getIncomingValue(i));
+			cast<PHINode>(it.second.first)->addIncoming(v.first, phi->getIncomingBlock(i));
+			cast<PHINode>(it.second.second)->addIncoming(v.second, phi->getIncomingBlock(i));
+		}
+	}
+	for(Instruction* I: deadInsts)
+	{
+		if(!I->getType()->isVoidTy())
+			I->replaceAllUsesWith(UndefValue::get(I->getType()));
+	}
+	for(Instruction* I: deadInsts)
+	{
+		loweredValues.erase(I);
+		I->eraseFromParent();
+	}
+	deadInsts.clear();
+	pendingPHIs.clear();
+
+	// Splitting constants creates many operations on 0, like the high word of small constants
+	for(inst_iterator it = inst_begin(F), itE = inst_end(F); it != itE; )
+	{
+		Instruction* I = &*it++;
+		if(!isa<BinaryOperator>(I) && !isa<ICmpInst>(I) && !isa<SelectInst>(I))
+			continue;
+		if(Value* V = SimplifyInstruction(I))
+		{
+			I->replaceAllUsesWith(V);
+			I->eraseFromParent();
+		}
+	}
+}
+
+bool I64Lowering::usesI64(const Instruction& I)
+{
+	auto isI64Related = [](Type* t)
+	{
+		if(t->isIntegerTy(64))
+			return true;
+		if(!t->isPointerTy())
+			return false;
+		Type* pointedType = t->getPointerElementType();
+		if(FunctionType* FT=dyn_cast<FunctionType>(pointedType))
+			return needsLowering(FT);
+		return getWordCount(pointedType) != 0;
+	};
+	if(isI64Related(I.getType()))
+		return true;
+	for(const Value* op: I.operands())
+	{
+		if(isI64Related(op->getType()))
+			return true;
+	}
+	return false;
+}
+
+bool I64Lowering::runOnModule(Module& M)
+{
+	bool Changed = false;
+
+	for(GlobalVariable& GV: M.getGlobalList())
+	{
+		if(GV.hasInitializer() && getWordCount(GV.getType()->getElementType()))
+		{
+			Changed = true;
+			break;
+		}
+	}
+	lowerGlobals(M);
+	// Initializers may point inside the lowered globals
+	for(GlobalVariable& GV: M.getGlobalList())
+	{
+		if(!GV.hasInitializer())
+			continue;
+		Constant* init = lowerConstant(GV.getInitializer());
+		if(init != GV.getInitializer())
+		{
+			GV.setInitializer(init);
+			Changed = true;
+		}
+	}
+
+	std::vector<Function*> functions;
+	for(Function& F: M)
+	{
+		if(!F.empty())
+			functions.push_back(&F);
+	}
+	for(Function* F: functions)
+	{
+		if(needsLowering(F->getFunctionType()))
+			lowerSignature(*F);
+	}
+
+	for(Function* F: functions)
+	{
+		auto it = loweredFunctions.find(F);
+		Function& body = it == loweredFunctions.end() ? *F : *it->second;
+		bool needsWork = (&body != F);
+		for(inst_iterator I = inst_begin(body), E = inst_end(body); I != E && !needsWork; ++I)
+			needsWork = usesI64(*I) || usesI64Constants(*I);
+		if(!needsWork)
+			continue;
+		lowerFunction(body);
+		Changed = true;
+	}
+
+	for(auto& it: loweredFunctions)
+	{
+		assert(it.first->use_empty());
+		// The lowered arguments are not needed anymore
+		for(Argument& arg: it.first->getArgumentList())
+			loweredValues.erase(&arg);
+		it.first->eraseFromParent();
+	}
+	loweredFunctions.clear();
+	loweredConstants.clear();
+	assert(loweredValues.empty());
+	return Changed;
+}
+
+ModulePass *createI64LoweringPass() { return new I64Lowering(); }
+
+}
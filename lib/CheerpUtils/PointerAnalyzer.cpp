@@ -19,6 +19,8 @@
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/Debug.h"
+#include <algorithm>
+#include <iterator>
 #include <numeric>
 
 using namespace llvm;
@@ -56,6 +58,30 @@ void IndirectPointerKindConstraint::dump() const
 	}
 }
 
+void ConstraintsSet::insert(const IndirectPointerKindConstraint* c)
+{
+	assert(c->id != IndirectPointerKindConstraint::NO_ID);
+	VectorTy::iterator it = std::lower_bound(constraints.begin(), constraints.end(), c, compareById);
+	if(it == constraints.end() || *it != c)
+		constraints.insert(it, c);
+}
+
+void ConstraintsSet::insert(const ConstraintsSet& rhs)
+{
+	if(rhs.empty())
+		return;
+	if(constraints.empty())
+	{
+		constraints = rhs.constraints;
+		return;
+	}
+	VectorTy merged;
+	merged.reserve(constraints.size() + rhs.constraints.size());
+	std::set_union(constraints.begin(), constraints.end(), rhs.constraints.begin(), rhs.constraints.end(),
+			std::back_inserter(merged), compareById);
+	constraints.swap(merged);
+}
+
 PointerKindWrapper& PointerKindWrapper::operator|=(const PointerKindWrapper& rhs)
 {
 	// 1) REGULAR | Any = REGULAR
@@ -85,7 +111,7 @@ PointerKindWrapper& PointerKindWrapper::operator|=(const PointerKindWrapper& rhs
 	if (lhs==UNKNOWN || rhs==UNKNOWN)
 		lhs.kind = UNKNOWN;
 
-	lhs.constraints.insert(rhs.constraints.begin(), rhs.constraints.end());
+	lhs.constraints.insert(rhs.constraints);
 	return *this;
 }
 
@@ -141,7 +167,7 @@ PointerConstantOffsetWrapper& PointerConstantOffsetWrapper::operator|=(const Poi
 
 	// Merge the constraints, if any
 	if (rhs.hasConstraints())
-		lhs.constraints.insert(rhs.constraints.begin(), rhs.constraints.end());
+		lhs.constraints.insert(rhs.constraints);
 	else
 		assert(rhs.status != UNINITALIZED);
 
@@ -320,17 +346,12 @@ struct PointerResolverBaseVisitor
 {
 	PointerResolverBaseVisitor( const PointerAnalyzer::PointerData<T>& pointerData, PointerAnalyzer::AddressTakenMap& addressTakenCache ) :
 				pointerData(pointerData) , addressTakenCache(addressTakenCache){}
-	~PointerResolverBaseVisitor()
-	{
-		for(const IndirectPointerKindConstraint* c: closedset)
-			c->isBeingVisited = false;
-	}
 
 	const T& resolveConstraint(const IndirectPointerKindConstraint& c);
 
 	const PointerAnalyzer::PointerData<T>& pointerData;
 	PointerAnalyzer::AddressTakenMap& addressTakenCache;
-	std::vector< const IndirectPointerKindConstraint* > closedset;
+	llvm::DenseSet< const IndirectPointerKindConstraint* > closedset;
 };
 
 struct PointerResolverForKindVisitor: public PointerResolverBaseVisitor<PointerKindWrapper>
@@ -630,6 +651,7 @@ PointerKindWrapper& PointerUsageVisitor::visitUse(PointerKindWrapper& ret, const
 		{
 		case Intrinsic::memmove:
 		case Intrinsic::memcpy:
+		case Intrinsic::memset:
 		{
 			if (TypeSupport::hasByteLayout(intrinsic->getOperand(0)->getType()->getPointerElementType()))
 				return ret |= COMPLETE_OBJECT;
@@ -666,7 +688,6 @@ PointerKindWrapper& PointerUsageVisitor::visitUse(PointerKindWrapper& ret, const
 				llvm::report_fatal_error("Unreachable code in cheerp::PointerAnalyzer::visitUse, cheerp_create_closure");
 		case Intrinsic::flt_rounds:
 		case Intrinsic::cheerp_allocate:
-		case Intrinsic::memset:
 		default:
 			SmallString<128> str("Unreachable code in cheerp::PointerAnalyzer::visitUse, unhandled intrinsic: ");
 			str+=intrinsic->getCalledFunction()->getName();
@@ -843,10 +864,8 @@ const PointerKindWrapper& PointerResolverForKindVisitor::resolvePointerKind(cons
 	assert(k==INDIRECT);
 	for(const IndirectPointerKindConstraint* constraint: k.constraints)
 	{
-		if(constraint->isBeingVisited)
+		if(!closedset.insert(constraint).second)
 			continue;
-		constraint->isBeingVisited = true;
-		closedset.push_back(constraint);
 		const PointerKindWrapper& retKind=resolveConstraint(*constraint);
 		assert(retKind.isKnown());
 		if(retKind==REGULAR || retKind==BYTE_LAYOUT)
@@ -1032,10 +1051,8 @@ PointerConstantOffsetWrapper PointerResolverForOffsetVisitor::resolvePointerOffs
 	const llvm::ConstantInt* offset = o.isValid() ? o.getPointerOffset() : NULL;
 	for(const IndirectPointerKindConstraint* constraint: o.constraints)
 	{
-		if(constraint->isBeingVisited)
+		if(!closedset.insert(constraint).second)
 			continue;
-		constraint->isBeingVisited = true;
-		closedset.push_back(constraint);
 		const PointerConstantOffsetWrapper& c = resolveConstraint(*constraint);
 		if(c.isInvalid())
 			return PointerConstantOffsetWrapper::INVALID;
@@ -1073,16 +1090,19 @@ PointerConstantOffsetWrapper PointerResolverForOffsetVisitor::resolvePointerOffs
 
 struct TimerGuard
 {
-	TimerGuard(Timer & timer) : timer(timer)
+	TimerGuard(Timer & timer, bool enabled = true) : timer(timer), enabled(enabled)
 	{
-		timer.startTimer();
+		if(enabled)
+			timer.startTimer();
 	}
 	~TimerGuard()
 	{
-		timer.stopTimer();
+		if(enabled)
+			timer.stopTimer();
 	}
 
 	Timer & timer;
+	bool enabled;
 };
 
 void PointerAnalyzer::prefetchFunc(const Function& F) const
@@ -1108,7 +1128,7 @@ void PointerAnalyzer::prefetchFunc(const Function& F) const
 const PointerKindWrapper& PointerAnalyzer::getFinalPointerKindWrapper(const Value* p) const
 {
 #ifndef NDEBUG
-	TimerGuard guard(gpkTimer);
+	TimerGuard guard(gpkTimer, !concurrentQueries);
 #endif //NDEBUG
 
 	// If the values is already cached just return it
@@ -1119,6 +1139,9 @@ const PointerKindWrapper& PointerAnalyzer::getFinalPointerKindWrapper(const Valu
 		return it->second;
 	}
 
+	// Computing a new value would modify the caches while other threads are reading them
+	if(concurrentQueries)
+		llvm::report_fatal_error("Value not cached by prepareForConcurrentQueries");
 	PointerKindWrapper ret;
 	PointerKindWrapper& k = PointerUsageVisitor(pointerKindData, addressTakenCache).visitValue(ret, p, /*first*/ true);
 #ifndef NDEBUG
@@ -1133,13 +1156,15 @@ const PointerKindWrapper& PointerAnalyzer::getFinalPointerKindWrapper(const Valu
 const PointerKindWrapper& PointerAnalyzer::getFinalPointerKindWrapperForReturn(const Function* F) const
 {
 #ifndef NDEBUG
-	TimerGuard guard(gpkfrTimer);
+	TimerGuard guard(gpkfrTimer, !concurrentQueries);
 #endif //NDEBUG
 	// If the values is already cached just return it
 	auto it = pointerKindData.valueMap.find(F->begin());
 	if(it!=pointerKindData.valueMap.end())
 		return it->second;
 
+	if(concurrentQueries)
+		llvm::report_fatal_error("Return not cached by prepareForConcurrentQueries");
 	PointerKindWrapper ret;
 	PointerKindWrapper& k = PointerUsageVisitor(pointerKindData, addressTakenCache).visitReturn(ret, F, /* first*/ true);
 #ifndef NDEBUG
@@ -1160,6 +1185,8 @@ const PointerConstantOffsetWrapper& PointerAnalyzer::getFinalPointerConstantOffs
 		return it->second;
 	}
 
+	if(concurrentQueries)
+		llvm::report_fatal_error("Offset not cached by prepareForConcurrentQueries");
 	PointerConstantOffsetWrapper ret;
 	PointerConstantOffsetWrapper& o = PointerConstantOffsetVisitor(pointerOffsetData).visitValue(ret, p, /*first*/ true);
 #ifndef NDEBUG
@@ -1174,7 +1201,7 @@ const PointerConstantOffsetWrapper& PointerAnalyzer::getFinalPointerConstantOffs
 POINTER_KIND PointerAnalyzer::getPointerKind(const Value* p) const
 {
 #ifndef NDEBUG
-	TimerGuard guard(gpkTimer);
+	TimerGuard guard(gpkTimer, !concurrentQueries);
 #endif //NDEBUG
 	const PointerKindWrapper& k = getFinalPointerKindWrapper(p);
 
@@ -1188,7 +1215,7 @@ POINTER_KIND PointerAnalyzer::getPointerKind(const Value* p) const
 POINTER_KIND PointerAnalyzer::getPointerKindForReturn(const Function* F) const
 {
 #ifndef NDEBUG
-	TimerGuard guard(gpkfrTimer);
+	TimerGuard guard(gpkfrTimer, !concurrentQueries);
 #endif //NDEBUG
 	const PointerKindWrapper& k = getFinalPointerKindWrapperForReturn(F);
 	if (k!=INDIRECT)
@@ -1389,42 +1416,156 @@ void PointerAnalyzer::invalidate(const Value * v)
 	assert( !pointerOffsetData.valueMap.count(v) );
 }
 
-void PointerAnalyzer::fullResolve()
+/**
+ * Visit the strongly connected components of the graph of the unique constraints reachable from roots.
+ * getSuccessors is called once for each reached constraint and returns the set of constraints it depends on, or NULL.
+ * The components are visited after all the components they depend on.
+ */
+template<class GetSuccessors, class VisitSCC>
+static void visitConstraintsSCCs(uint32_t numConstraints, const std::vector<uint32_t>& roots, GetSuccessors getSuccessors, VisitSCC visitSCC)
 {
-	for(auto& it: pointerKindData.valueMap)
+	// Iterative version of Tarjan's algorithm, chains of constraints are too long for recursion
+	const uint32_t NOT_VISITED = 0xffffffff;
+	std::vector<uint32_t> index(numConstraints, NOT_VISITED);
+	std::vector<uint32_t> lowLink(numConstraints);
+	std::vector<bool> onStack(numConstraints, false);
+	std::vector<const ConstraintsSet*> successors(numConstraints, NULL);
+	std::vector<uint32_t> sccStack;
+	// The constraint being visited and the next successor to visit
+	std::vector<std::pair<uint32_t, uint32_t>> callStack;
+	std::vector<uint32_t> scc;
+	uint32_t nextIndex = 0;
+	auto enter = [&](uint32_t id)
+	{
+		index[id] = lowLink[id] = nextIndex++;
+		successors[id] = getSuccessors(id);
+		sccStack.push_back(id);
+		onStack[id] = true;
+		callStack.push_back(std::make_pair(id, 0u));
+	};
+	for(uint32_t root: roots)
 	{
-		if(it.second!=INDIRECT)
+		if(index[root] != NOT_VISITED)
 			continue;
-		const PointerKindWrapper& k=PointerResolverForKindVisitor(pointerKindData, addressTakenCache).resolvePointerKind(it.second);
-		assert(k==COMPLETE_OBJECT || k==BYTE_LAYOUT || k==REGULAR);
-		it.second=k;
+		enter(root);
+		while(!callStack.empty())
+		{
+			uint32_t id = callStack.back().first;
+			const ConstraintsSet* succs = successors[id];
+			if(succs && callStack.back().second < succs->size())
+			{
+				uint32_t succ = (*(succs->begin() + callStack.back().second++))->id;
+				if(index[succ] == NOT_VISITED)
+					enter(succ);
+				else if(onStack[succ])
+					lowLink[id] = std::min(lowLink[id], index[succ]);
+				continue;
+			}
+			callStack.pop_back();
+			if(!callStack.empty())
+			{
+				uint32_t parent = callStack.back().first;
+				lowLink[parent] = std::min(lowLink[parent], lowLink[id]);
+			}
+			if(lowLink[id] != index[id])
+				continue;
+			scc.clear();
+			uint32_t member;
+			do
+			{
+				member = sccStack.back();
+				sccStack.pop_back();
+				onStack[member] = false;
+				scc.push_back(member);
+			}
+			while(member != id);
+			visitSCC(scc);
+		}
 	}
+}
+
+void PointerAnalyzer::fullResolve()
+{
+	// Solve all the INDIRECT kinds at once. A constraint requires REGULAR pointers if its own kind is REGULAR
+	// or if any constraint it depends on requires them, so all the constraints in a cycle share the same result.
+	std::vector<std::pair<PointerKindWrapper*, POINTER_KIND>> resolvedKinds;
+	std::vector<uint32_t> roots;
+	auto addRoots = [&](PointerKindWrapper& k)
+	{
+		if(k!=INDIRECT)
+			return;
+		resolvedKinds.push_back(std::make_pair(&k, UNKNOWN));
+		for(const IndirectPointerKindConstraint* c: k.constraints)
+			roots.push_back(c->id);
+	};
+	for(auto& it: pointerKindData.valueMap)
+		addRoots(it.second);
 	for(auto& it: pointerKindData.argsMap)
-	{
-		if(it.second!=INDIRECT)
-			continue;
-		const PointerKindWrapper& k=PointerResolverForKindVisitor(pointerKindData, addressTakenCache).resolvePointerKind(it.second);
-		assert(k==COMPLETE_OBJECT || k==BYTE_LAYOUT || k==REGULAR);
-		it.second=k;
-	}
+		addRoots(it.second);
 	for(auto& it: pointerKindData.constraintsMap)
+		addRoots(it.second);
+	for(auto& it: pointerKindData.baseStructAndIndexMapForMembers)
+		addRoots(it.second);
+
+	PointerResolverForKindVisitor resolver(pointerKindData, addressTakenCache);
+	std::vector<const IndirectPointerKindConstraint*> constraints = pointerKindData.getConstraintsById();
+	std::vector<const PointerKindWrapper*> values(constraints.size(), NULL);
+	std::vector<bool> requiresRegular(constraints.size(), false);
+	auto getSuccessors = [&](uint32_t id) -> const ConstraintsSet*
+	{
+		const PointerKindWrapper& k = resolver.resolveConstraint(*constraints[id]);
+		assert(k.isKnown());
+		values[id] = &k;
+		return k==INDIRECT ? &k.constraints : NULL;
+	};
+	auto visitSCC = [&](const std::vector<uint32_t>& scc)
 	{
-		if(it.second!=INDIRECT)
-			continue;
-		const PointerKindWrapper& k=PointerResolverForKindVisitor(pointerKindData, addressTakenCache).resolvePointerKind(it.second);
-		assert(k==COMPLETE_OBJECT || k==BYTE_LAYOUT || k==REGULAR);
-		it.second=k;
+		// The constraints in the same component are not flagged yet, so they are ignored
+		bool regular = false;
+		for(uint32_t id: scc)
+		{
+			if(*values[id]==REGULAR)
+				regular = true;
+			else if(*values[id]==INDIRECT)
+			{
+				for(const IndirectPointerKindConstraint* c: values[id]->constraints)
+					regular |= requiresRegular[c->id];
+			}
+			if(regular)
+				break;
+		}
+		for(uint32_t id: scc)
+			requiresRegular[id] = regular;
+	};
+	visitConstraintsSCCs(constraints.size(), roots, getSuccessors, visitSCC);
+
+	for(auto& it: resolvedKinds)
+	{
+		it.second = COMPLETE_OBJECT;
+		for(const IndirectPointerKindConstraint* c: it.first->constraints)
+		{
+			const PointerKindWrapper& k = *values[c->id];
+			// Only the direct constraints may make the pointer BYTE_LAYOUT
+			if(k==REGULAR || k==BYTE_LAYOUT)
+			{
+				it.second = k.getPointerKind();
+				break;
+			}
+			if(k==INDIRECT && requiresRegular[c->id])
+			{
+				it.second = REGULAR;
+				break;
+			}
+		}
 	}
+	for(auto& it: resolvedKinds)
+		*it.first = PointerKindWrapper(it.second);
+#ifndef NDEBUG
 	for(auto& it: pointerKindData.baseStructAndIndexMapForMembers)
 	{
-		if(it.second!=INDIRECT)
-			continue;
-		const PointerKindWrapper& k=PointerResolverForKindVisitor(pointerKindData, addressTakenCache).resolvePointerKind(it.second);
 		// BYTE_LAYOUT is not expected for the kind of pointers to member
-		assert(k==COMPLETE_OBJECT || k==REGULAR);
-		it.second=k;
+		assert(it.second==COMPLETE_OBJECT || it.second==REGULAR);
 	}
-#ifndef NDEBUG
 	fullyResolved = true;
 #endif
 }
@@ -1450,6 +1591,148 @@ void PointerAnalyzer::computeConstantOffsets(const Module& M)
 	}
 }
 
+void PointerAnalyzer::prepareForConcurrentQueries(const Module& M)
+{
+#ifndef NDEBUG
+	assert(fullyResolved);
+#endif
+	// Make sure that the kind of every pointer used by the functions and the global initializers is cached,
+	// including constants which are otherwise computed lazily. A query on a value which is not cached is a fatal error.
+	SmallVector<const Constant*, 16> constants;
+	DenseSet<const Constant*> visitedConstants;
+	for(const GlobalVariable & GV : M.getGlobalList())
+	{
+		if(GV.hasInitializer())
+			constants.push_back(GV.getInitializer());
+	}
+	for(const Function & F : M)
+	{
+		addressTakenCache.checkAddressTaken(&F);
+		prefetchFunc(F);
+		for(const BasicBlock & BB : F)
+		{
+			for(const Instruction & I : BB)
+			{
+				for(const Value* op : I.operands())
+				{
+					if(const Constant* C = dyn_cast<Constant>(op))
+						constants.push_back(C);
+				}
+			}
+		}
+	}
+	while(!constants.empty())
+	{
+		const Constant* C = constants.pop_back_val();
+		if(!visitedConstants.insert(C).second)
+			continue;
+		if(C->getType()->isPointerTy())
+			getFinalPointerKindWrapper(C);
+		// The initializers of globals are already in the list
+		if(isa<GlobalValue>(C))
+			continue;
+		for(const Value* op : C->operands())
+			constants.push_back(cast<Constant>(op));
+	}
+	// The new values may be INDIRECT
+	fullResolve();
+
+	// Constant offsets are resolved on every query, store the resolved values instead.
+	// The offset of a constraint must be the same of all the constraints it depends on, so they are
+	// solved at once like the kinds.
+	struct ResolvedOffset
+	{
+		bool invalid;
+		const ConstantInt* offset;
+		ResolvedOffset():invalid(false),offset(NULL)
+		{
+		}
+		void merge(const ConstantInt* o)
+		{
+			if(o == NULL || invalid)
+				return;
+			if(offset != NULL && offset != o)
+				invalid = true;
+			offset = o;
+		}
+		void merge(const PointerConstantOffsetWrapper& o)
+		{
+			if(o.isInvalid())
+				invalid = true;
+			else if(o.isValid())
+				merge(o.getPointerOffset());
+		}
+		void merge(const ResolvedOffset& o)
+		{
+			if(o.invalid)
+				invalid = true;
+			else
+				merge(o.offset);
+		}
+	};
+	std::vector<std::pair<PointerConstantOffsetWrapper*, ResolvedOffset>> resolvedOffsets;
+	std::vector<uint32_t> roots;
+	auto addRoots = [&](PointerConstantOffsetWrapper& o)
+	{
+		if(!o.hasConstraints())
+			return;
+		assert(!o.isInvalid());
+		resolvedOffsets.push_back(std::make_pair(&o, ResolvedOffset()));
+		for(const IndirectPointerKindConstraint* c: o.constraints)
+			roots.push_back(c->id);
+	};
+	for(auto& it: pointerOffsetData.valueMap)
+		addRoots(it.second);
+	for(auto& it: pointerOffsetData.constraintsMap)
+		addRoots(it.second);
+
+	PointerResolverForOffsetVisitor resolver(pointerOffsetData, addressTakenCache);
+	std::vector<const IndirectPointerKindConstraint*> constraints = pointerOffsetData.getConstraintsById();
+	std::vector<const PointerConstantOffsetWrapper*> values(constraints.size(), NULL);
+	std::vector<ResolvedOffset> constraintOffsets(constraints.size());
+	auto getSuccessors = [&](uint32_t id) -> const ConstraintsSet*
+	{
+		const PointerConstantOffsetWrapper& o = resolver.resolveConstraint(*constraints[id]);
+		values[id] = &o;
+		return o.hasConstraints() ? &o.constraints : NULL;
+	};
+	auto visitSCC = [&](const std::vector<uint32_t>& scc)
+	{
+		// The constraints in the same component are still uninitialized, so merging them has no effect
+		ResolvedOffset sccOffset;
+		for(uint32_t id: scc)
+		{
+			sccOffset.merge(*values[id]);
+			if(values[id]->hasConstraints())
+			{
+				for(const IndirectPointerKindConstraint* c: values[id]->constraints)
+					sccOffset.merge(constraintOffsets[c->id]);
+			}
+		}
+		for(uint32_t id: scc)
+			constraintOffsets[id] = sccOffset;
+	};
+	visitConstraintsSCCs(constraints.size(), roots, getSuccessors, visitSCC);
+
+	for(auto& it: resolvedOffsets)
+	{
+		it.second.merge(*it.first);
+		for(const IndirectPointerKindConstraint* c: it.first->constraints)
+			it.second.merge(constraintOffsets[c->id]);
+	}
+	for(auto& it: resolvedOffsets)
+	{
+		if(it.second.invalid)
+			*it.first = PointerConstantOffsetWrapper(PointerConstantOffsetWrapper::INVALID);
+		else if(it.second.offset == NULL)
+			*it.first = PointerConstantOffsetWrapper(PointerConstantOffsetWrapper::UNINITALIZED);
+		else
+			*it.first = PointerConstantOffsetWrapper(it.second.offset);
+	}
+	concurrentQueries = true;
+	addressTakenCache.concurrentQueries = true;
+}
+
 #ifndef NDEBUG
 void PointerAnalyzer::dumpPointer(const Value* v, bool dumpOwnerFunc) const
 {
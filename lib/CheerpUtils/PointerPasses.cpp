@@ -27,6 +27,8 @@
 #include <map>
 
 STATISTIC(NumIndirectFun, "Number of indirect functions processed");
+STATISTIC(NumSpeculatedCalls, "Number of indirect calls speculated with guarded direct calls");
+STATISTIC(NumDevirtualizedCalls, "Number of indirect calls replaced by a direct call");
 STATISTIC(NumAllocasTransformedToArrays, "Number of allocas of values transformed to allocas of arrays");
 
 namespace llvm {
@@ -249,6 +251,230 @@ ModulePass* createIndirectCallOptimizerPass()
 	return new IndirectCallOptimizer();
 }
 
+const char* IndirectCallSpeculation::getPassName() const
+{
+	return "IndirectCallSpeculation";
+}
+
+char IndirectCallSpeculation::ID = 0;
+
+void IndirectCallSpeculation::addReachableFunctionPointers(Type* t, std::set<Type*>& openTypes, std::set<Type*>& visitedTypes)
+{
+	if (!visitedTypes.insert(t).second)
+		return;
+	if (t->isPointerTy() && t->getPointerElementType()->isFunctionTy())
+		openTypes.insert(t);
+	else if (t->isPointerTy())
+		addReachableFunctionPointers(t->getPointerElementType(), openTypes, visitedTypes);
+	else if (t->isStructTy() || t->isArrayTy() || t->isVectorTy())
+	{
+		for (Type::subtype_iterator it = t->subtype_begin(); it != t->subtype_end(); ++it)
+			addReachableFunctionPointers(*it, openTypes, visitedTypes);
+	}
+}
+
+void IndirectCallSpeculation::visitConstant(const Constant* c, std::set<Type*>& openTypes, std::set<Type*>& visitedTypes,
+                                            std::set<const Constant*>& visitedConstants)
+{
+	if (isa<GlobalValue>(c) || !visitedConstants.insert(c).second)
+		return;
+	const ConstantExpr* ce = dyn_cast<ConstantExpr>(c);
+	// Bitcasts of functions are the targets of the calls through the casted type
+	if (ce && ce->isCast() && !isa<Function>(ce->getOperand(0)))
+	{
+		addReachableFunctionPointers(ce->getType(), openTypes, visitedTypes);
+		addReachableFunctionPointers(ce->getOperand(0)->getType(), openTypes, visitedTypes);
+	}
+	for (const Value* op : c->operands())
+		visitConstant(cast<Constant>(op), openTypes, visitedTypes, visitedConstants);
+}
+
+void IndirectCallSpeculation::collectTargets(Module& M, TargetsMap& targets, std::set<Type*>& openTypes)
+{
+	std::set<Type*> visitedTypes;
+	std::set<const Constant*> visitedConstants;
+	bool allOpen = false;
+	auto addTarget = [&](Type* t, Constant* c)
+	{
+		std::vector<Constant*>& v = targets[t];
+		if (std::find(v.begin(), v.end(), c) == v.end())
+			v.push_back(c);
+	};
+	// External code can store any function pointer in the globals visible from outside
+	for (GlobalVariable & GV : M.getGlobalList())
+	{
+		if (!GV.hasLocalLinkage())
+			addReachableFunctionPointers(GV.getType(), openTypes, visitedTypes);
+		if (GV.hasInitializer())
+			visitConstant(GV.getInitializer(), openTypes, visitedTypes, visitedConstants);
+	}
+	for (Function & F : M)
+	{
+		// Function pointers returned by external code, or passed to functions visible from outside, may point anywhere.
+		// External code may also store them in the memory it receives.
+		if (F.empty() && !F.isIntrinsic())
+		{
+			FunctionType* FT = F.getFunctionType();
+			for (Type::subtype_iterator it = FT->subtype_begin(); it != FT->subtype_end(); ++it)
+				addReachableFunctionPointers(*it, openTypes, visitedTypes);
+		}
+		if (!F.empty() && !F.hasLocalLinkage())
+		{
+			for (const Argument & arg : F.getArgumentList())
+				addReachableFunctionPointers(arg.getType(), openTypes, visitedTypes);
+		}
+		// So do the function pointers read from memory of another type
+		for (const BasicBlock & BB : F)
+		{
+			for (const Instruction & I : BB)
+			{
+				if (isa<CastInst>(I))
+				{
+					addReachableFunctionPointers(I.getType(), openTypes, visitedTypes);
+					addReachableFunctionPointers(I.getOperand(0)->getType(), openTypes, visitedTypes);
+				}
+				for (const Value* op : I.operands())
+					if (const Constant* c = dyn_cast<Constant>(op))
+						visitConstant(c, openTypes, visitedTypes, visitedConstants);
+			}
+		}
+		if (F.isIntrinsic())
+			continue;
+		for (const Use & u : F.uses())
+		{
+			ImmutableCallSite cs(u.getUser());
+			if ((cs.isCall() || cs.isInvoke()) && cs.isCallee(&u))
+				continue;
+			ConstantExpr* ce = dyn_cast<ConstantExpr>(u.getUser());
+			if (!ce)
+			{
+				addTarget(F.getType(), &F);
+				continue;
+			}
+			if (ce->getOpcode() != Instruction::BitCast)
+			{
+				// We cannot follow the function through other expressions
+				allOpen = true;
+				continue;
+			}
+			bool isTaken = std::any_of(ce->use_begin(), ce->use_end(), [](const Use & ceUse)
+				{
+					ImmutableCallSite ceCs(ceUse.getUser());
+					return !(ceCs.isCall() || ceCs.isInvoke()) || !ceCs.isCallee(&ceUse);
+				});
+			if (isTaken)
+				addTarget(ce->getType(), ce);
+		}
+	}
+	if (allOpen)
+	{
+		for (auto & it : targets)
+			openTypes.insert(it.first);
+	}
+}
+
+void IndirectCallSpeculation::speculateCall(CallInst* ci, const std::vector<Constant*>& targets, bool isClosed)
+{
+	if (isClosed && targets.size() == 1)
+	{
+		ci->setCalledFunction(targets[0]);
+		return;
+	}
+	Value* callee = ci->getCalledValue();
+	BasicBlock* tailBlock = ci->getParent()->splitBasicBlock(ci, "spec.tail");
+	BasicBlock* checkBlock = tailBlock->getSinglePredecessor();
+	Function* F = checkBlock->getParent();
+	checkBlock->getTerminator()->eraseFromParent();
+	ci->removeFromParent();
+
+	PHINode* result = NULL;
+	if (!ci->getType()->isVoidTy())
+		result = PHINode::Create(ci->getType(), targets.size() + 1, "", &tailBlock->front());
+	auto addCall = [&](CallInst* newCall, BasicBlock* BB)
+	{
+		BB->getInstList().push_back(newCall);
+		BranchInst::Create(tailBlock, BB);
+		if (result)
+			result->addIncoming(newCall, BB);
+	};
+	// The last target does not need a guard if there are no other targets
+	uint32_t numGuards = isClosed ? targets.size() - 1 : targets.size();
+	for (uint32_t i = 0; i < numGuards; i++)
+	{
+		BasicBlock* directBlock = BasicBlock::Create(F->getContext(), "spec.direct", F, tailBlock);
+		BasicBlock* nextBlock = BasicBlock::Create(F->getContext(), "spec.next", F, tailBlock);
+		Value* isTarget = new ICmpInst(*checkBlock, CmpInst::ICMP_EQ, callee, targets[i]);
+		BranchInst::Create(directBlock, nextBlock, isTarget, checkBlock);
+		CallInst* directCall = cast<CallInst>(ci->clone());
+		directCall->setCalledFunction(targets[i]);
+		addCall(directCall, directBlock);
+		checkBlock = nextBlock;
+	}
+	if (isClosed)
+		ci->setCalledFunction(targets.back());
+	addCall(ci, checkBlock);
+	if (result)
+	{
+		// Uses of the call must be replaced without touching the PHI itself
+		ci->replaceAllUsesWith(result);
+		result->setIncomingValue(result->getBasicBlockIndex(checkBlock), ci);
+	}
+}
+
+bool IndirectCallSpeculation::runOnModule(Module & M)
+{
+	if (maxTargets == 0)
+		return false;
+	TargetsMap targets;
+	std::set<Type*> openTypes;
+	collectTargets(M, targets, openTypes);
+
+	std::vector<CallInst*> indirectCalls;
+	for (Function & F : M)
+	{
+		for (BasicBlock & BB : F)
+		{
+			for (Instruction & I : BB)
+			{
+				CallInst* ci = dyn_cast<CallInst>(&I);
+				if (!ci || ci->isInlineAsm())
+					continue;
+				if (isa<Constant>(ci->getCalledValue()))
+					continue;
+				indirectCalls.push_back(ci);
+			}
+		}
+	}
+
+	bool Changed = false;
+	for (CallInst* ci : indirectCalls)
+	{
+		Type* calleeType = ci->getCalledValue()->getType();
+		auto it = targets.find(calleeType);
+		if (it == targets.end() || it->second.size() > maxTargets)
+			continue;
+		bool isClosed = !openTypes.count(calleeType);
+		speculateCall(ci, it->second, isClosed);
+		if (isClosed && it->second.size() == 1)
+			NumDevirtualizedCalls++;
+		else
+			NumSpeculatedCalls++;
+		Changed = true;
+	}
+	return Changed;
+}
+
+void IndirectCallSpeculation::getAnalysisUsage(AnalysisUsage & AU) const
+{
+	AU.addPreserved<cheerp::GlobalDepsAnalyzer>();
+	llvm::Pass::getAnalysisUsage(AU);
+}
+
+ModulePass* createIndirectCallSpeculationPass(uint32_t maxTargets)
+{
+	return new IndirectCallSpeculation(maxTargets);
+}
+
 class PHIVisitor
 {
 public:
@@ -530,6 +756,9 @@ bool FreeAndDeleteRemoval::runOnFunction(Function& F)
 			if(F->getIntrinsicID()==Intrinsic::cheerp_deallocate ||
 				F->getName()=="free")
 			{
+				Type* freedType = call->getArgOperand(0)->stripPointerCastsSafe()->getType()->getPointerElementType();
+				if(keepArenaHeapFrees && cheerp::TypeSupport::mayUseArenaHeap(freedType))
+					continue;
 				deleteInstructionAndUnusedOperands(call);
 				Changed = true;
 			}
@@ -550,7 +779,7 @@ void FreeAndDeleteRemoval::getAnalysisUsage(AnalysisUsage & AU) const
 	llvm::Pass::getAnalysisUsage(AU);
 }
 
-FunctionPass *createFreeAndDeleteRemovalPass() { return new FreeAndDeleteRemoval(); }
+FunctionPass *createFreeAndDeleteRemovalPass(bool keepArenaHeapFrees) { return new FreeAndDeleteRemoval(keepArenaHeapFrees); }
 
 }
 
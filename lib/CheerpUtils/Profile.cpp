@@ -0,0 +1,111 @@
+//===-- Profile.cpp - Cheerp execution profiles ---------------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/Profile.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+using namespace llvm;
+
+namespace cheerp {
+
+ProfileCounters::ProfileCounters(const Function& F):numCounters(0)
+{
+	for(const BasicBlock& BB: F)
+		blockCounters.insert(std::make_pair(&BB, numCounters++));
+	for(const BasicBlock& BB: F)
+	{
+		const TerminatorInst* term = BB.getTerminator();
+		// Landing pads are not reached by normal control flow
+		SmallVector<const BasicBlock*, 4> successors;
+		for(uint32_t i=0;i<term->getNumSuccessors();i++)
+		{
+			const BasicBlock* succ = term->getSuccessor(i);
+			if(!succ->isLandingPad() && std::find(successors.begin(), successors.end(), succ) == successors.end())
+				successors.push_back(succ);
+		}
+		if(successors.size() < 2)
+			continue;
+		for(const BasicBlock* succ: successors)
+			edgeCounters.insert(std::make_pair(std::make_pair(&BB, succ), numCounters++));
+	}
+}
+
+uint32_t ProfileCounters::getBlockCounter(const BasicBlock* BB) const
+{
+	return blockCounters.at(BB);
+}
+
+int32_t ProfileCounters::getEdgeCounter(const BasicBlock* from, const BasicBlock* to) const
+{
+	auto it = edgeCounters.find(std::make_pair(from, to));
+	if(it == edgeCounters.end())
+		return -1;
+	return it->second;
+}
+
+bool ProfileData::load(const std::string& fileName, std::string& ErrorString)
+{
+	std::unique_ptr<MemoryBuffer> buffer;
+	if(error_code ec = MemoryBuffer::getFile(fileName, buffer))
+	{
+		ErrorString = ec.message();
+		return false;
+	}
+	SmallVector<StringRef, 16> lines;
+	buffer->getBuffer().split(lines, "\n");
+	uint32_t i = 0;
+	while(i < lines.size())
+	{
+		StringRef line = lines[i++].trim();
+		if(line.empty())
+			continue;
+		std::pair<StringRef, StringRef> header = line.rsplit(' ');
+		uint64_t numCounters;
+		if(header.second.empty() || header.second.getAsInteger(10, numCounters))
+		{
+			ErrorString = "invalid function header at line " + std::to_string(i);
+			return false;
+		}
+		std::vector<uint64_t>& counters = functions[header.first];
+		counters.clear();
+		for(uint64_t j=0;j<numCounters;j++)
+		{
+			uint64_t value;
+			if(i >= lines.size() || lines[i++].trim().getAsInteger(10, value))
+			{
+				ErrorString = "invalid counter at line " + std::to_string(i);
+				return false;
+			}
+			counters.push_back(value);
+		}
+	}
+	return true;
+}
+
+const std::vector<uint64_t>* ProfileData::getCounters(const Function& F, const ProfileCounters& layout) const
+{
+	auto it = functions.find(F.getName());
+	if(it == functions.end())
+		return NULL;
+	if(it->second.size() != layout.getNumCounters())
+	{
+		llvm::errs() << "warning: profile of " << F.getName() << " does not match its code, ignored\n";
+		return NULL;
+	}
+	return &it->second;
+}
+
+}
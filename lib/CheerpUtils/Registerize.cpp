@@ -19,6 +19,8 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Support/Debug.h"
+#include <algorithm>
+#include <iterator>
 
 using namespace llvm;
 
@@ -107,22 +109,22 @@ void Registerize::assignRegistersToInstructions(Function& F, cheerp::PointerAnal
 		// First, build live ranges for all instructions
 		LiveRangesTy liveRanges=computeLiveRanges(F, instIdMap, PA);
 		// Assign each instruction to a virtual register
-		uint32_t registersCount = assignToRegisters(liveRanges, PA);
+		uint32_t registersCount = assignToRegisters(liveRanges, instIdMap, PA);
 		// Now compute live ranges for alloca memory which is not in SSA form
 		NumRegisters += registersCount;
 		// To debug we need to know the ranges for each instructions and the assigned register
 		DEBUG(if (registersCount) dbgs() << "Function " << F.getName() << " needs " << registersCount << " registers\n");
 		// Very verbose debugging below, activate if needed
 #ifdef VERBOSEDEBUG
-		for(auto it: liveRanges)
+		for(const InstructionLiveRange& it: liveRanges)
 		{
-			if(it.first->getParent()->getParent() != &F)
+			if(!it.inst)
 				continue;
-			dbgs() << "Instruction " << *it.first << " alive in ranges ";
-			for(const Registerize::LiveRangeChunk& chunk: it.second.range)
+			dbgs() << "Instruction " << *it.inst << " alive in ranges ";
+			for(const Registerize::LiveRangeChunk& chunk: it.range)
 				dbgs() << '[' << chunk.start << ',' << chunk.end << ')';
 			dbgs() << "\n";
-			dbgs() << "\tMapped to register " << registersMap[it.first] << "\n";
+			dbgs() << "\tMapped to register " << registersMap[it.inst] << "\n";
 		}
 #endif
 	}
@@ -170,7 +172,24 @@ void Registerize::computeLiveRangeForAllocas(Function& F)
 
 Registerize::LiveRangesTy Registerize::computeLiveRanges(Function& F, const InstIdMapTy& instIdMap, cheerp::PointerAnalyzer & PA)
 {
-	BlocksState blocksState;
+	// Number the blocks and cache the edges, so that the state of the blocks can be kept in a vector
+	llvm::DenseMap<const BasicBlock*, uint32_t> blockIdMap;
+	BlocksState blocksState(F.size());
+	for(BasicBlock& BB: F)
+	{
+		uint32_t blockIndex = blockIdMap.size();
+		blockIdMap[&BB] = blockIndex;
+		blocksState[blockIndex].BB = &BB;
+	}
+	for(BlockState& blockState: blocksState)
+	{
+		for(::pred_iterator it=pred_begin(blockState.BB);it!=pred_end(blockState.BB);++it)
+			blockState.predecessors.push_back(blockIdMap.find(*it)->second);
+		TerminatorInst* term=blockState.BB->getTerminator();
+		for(uint32_t i=0;i<term->getNumSuccessors();i++)
+			blockState.successors.push_back(blockIdMap.find(term->getSuccessor(i))->second);
+	}
+	std::vector<uint32_t> worklist;
 	for(BasicBlock& BB: F)
 	{
 		for(Instruction& I: BB)
@@ -185,49 +204,54 @@ Registerize::LiveRangesTy Registerize::computeLiveRanges(Function& F, const Inst
 					// We want to set instruction I as alive at the end of the predecessor
 					// And start going up from the predecessor itself
 					useBB=phi->getIncomingBlock(U.getOperandNo());
-					BlockState& blockState=blocksState[useBB];
+					BlockState& blockState=blocksState[blockIdMap.find(useBB)->second];
 					blockState.addLiveOut(&I);
 				}
-				doUpAndMark(blocksState, useBB, &I);
+				doUpAndMark(blocksState, blockIdMap.find(useBB)->second, &I, worklist);
 			}
 		}
 	}
 	// Remove verbose debugging output
 #ifdef VERBOSEDEBUG
-	for(auto it: blocksState)
+	for(const BlockState& it: blocksState)
 	{
-		llvm::errs() << "Block:\n" << *it.first << "\n";
+		llvm::errs() << "Block:\n" << *it.BB << "\n";
 		llvm::errs() << "Inst out:\n";
-		for(Instruction* I: it.second.outSet)
+		for(Instruction* I: it.outSet)
 			llvm::errs() << *I << "\n";
 	}
 #endif
 	// Depth first analysis of blocks, starting from the entry block
-	LiveRangesTy liveRanges(instIdMap);
-	dfsLiveRangeInBlock(blocksState, liveRanges, instIdMap, F.getEntryBlock(), PA, 1, 1);
+	LiveRangesTy liveRanges(instIdMap.size() + 1);
+	dfsLiveRanges(blocksState, liveRanges, instIdMap, PA);
 	return liveRanges;
 }
 
-void Registerize::doUpAndMark(BlocksState& blocksState, BasicBlock* BB, Instruction* I)
+void Registerize::doUpAndMark(BlocksState& blocksState, uint32_t blockIndex, Instruction* I, std::vector<uint32_t>& worklist)
 {
-	// Defined here, no propagation needed
-	if(I->getParent()==BB && !isa<PHINode>(I))
-		return;
-	BlockState& blockState=blocksState[BB];
-	// Already propagated
-	if(blockState.isLiveIn(I))
-		return;
-	blockState.setLiveIn(I);
-	if(I->getParent()==BB && isa<PHINode>(I))
-		return;
-	// Run on predecessor blocks
-	for(::pred_iterator it=pred_begin(BB);it!=pred_end(BB);++it)
+	assert(worklist.empty());
+	worklist.push_back(blockIndex);
+	while(!worklist.empty())
 	{
-		BasicBlock* pred=*it;
-		BlockState& predBlockState=blocksState[pred];
-		if(!predBlockState.isLiveOut(I))
-			predBlockState.addLiveOut(I);
-		doUpAndMark(blocksState, pred, I);
+		BlockState& blockState=blocksState[worklist.back()];
+		worklist.pop_back();
+		// Defined here, no propagation needed
+		if(I->getParent()==blockState.BB && !isa<PHINode>(I))
+			continue;
+		// Already propagated
+		if(blockState.isLiveIn(I))
+			continue;
+		blockState.setLiveIn(I);
+		if(I->getParent()==blockState.BB && isa<PHINode>(I))
+			continue;
+		// Run on predecessor blocks
+		for(uint32_t pred: blockState.predecessors)
+		{
+			BlockState& predBlockState=blocksState[pred];
+			if(!predBlockState.isLiveOut(I))
+				predBlockState.addLiveOut(I);
+			worklist.push_back(pred);
+		}
 	}
 }
 
@@ -266,18 +290,54 @@ void Registerize::assignInstructionsIds(InstIdMapTy& instIdMap, const Function&
 	}
 }
 
-uint32_t Registerize::dfsLiveRangeInBlock(BlocksState& blocksState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
-					BasicBlock& BB, cheerp::PointerAnalyzer & PA, uint32_t nextIndex, uint32_t codePathId)
+void Registerize::dfsLiveRanges(BlocksState& blocksState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap, cheerp::PointerAnalyzer& PA)
+{
+	// The visit uses an explicit stack, as the CFG of huge functions is too deep for recursion
+	struct DFSFrame
+	{
+		uint32_t blockIndex;
+		uint32_t nextSuccessor;
+		uint32_t codePathId;
+		// The first index of the block, used to know if new instructions have been numbered by the successors
+		uint32_t startIndex;
+	};
+	std::vector<DFSFrame> stack;
+	// The entry block is always the first one
+	uint32_t nextIndex = computeLiveRangeInBlock(blocksState[0], liveRanges, instIdMap, PA, 1, 1);
+	stack.push_back(DFSFrame{0, 0, 1, 1});
+	while(!stack.empty())
+	{
+		DFSFrame& frame = stack.back();
+		const BlockState& blockState = blocksState[frame.blockIndex];
+		if(frame.nextSuccessor == blockState.successors.size())
+		{
+			uint32_t startIndex = frame.startIndex;
+			stack.pop_back();
+			// If any new instruction has ben added (i.e. nextIndex if changed) update codePathId
+			if(!stack.empty() && nextIndex != startIndex)
+				stack.back().codePathId = nextIndex;
+			continue;
+		}
+		uint32_t succIndex = blockState.successors[frame.nextSuccessor++];
+		BlockState& succBlockState = blocksState[succIndex];
+		if(succBlockState.completed)
+			continue;
+		uint32_t codePathId = frame.codePathId;
+		uint32_t startIndex = nextIndex;
+		nextIndex = computeLiveRangeInBlock(succBlockState, liveRanges, instIdMap, PA, nextIndex, codePathId);
+		stack.push_back(DFSFrame{succIndex, 0, codePathId, startIndex});
+	}
+}
+
+uint32_t Registerize::computeLiveRangeInBlock(BlockState& blockState, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+					cheerp::PointerAnalyzer & PA, uint32_t nextIndex, uint32_t codePathId)
 {
-	BlockState& blockState=blocksState[&BB];
-	if(blockState.completed)
-		return nextIndex;
+	assert(!blockState.completed);
 	// Iterate over instructions
 	// For each instruction start an empty range
 	// For each use used operands extend their live ranges to here
-	for (Instruction& I: BB)
+	for (Instruction& I: *blockState.BB)
 	{
-		assert(liveRanges.count(&I)==0);
 		uint32_t thisIndex = nextIndex++;
 		assert(instIdMap.count(&I));
 		assert(instIdMap.find(&I)->second==thisIndex);
@@ -288,46 +348,38 @@ uint32_t Registerize::dfsLiveRangeInBlock(BlocksState& blocksState, LiveRangesTy
 		// Void instruction and instructions without uses do not need any lifetime computation
 		if (!I.getType()->isVoidTy() && !I.use_empty())
 		{
-			InstructionLiveRange& range=liveRanges.emplace(&I,
-				InstructionLiveRange(codePathId)).first->second;
+			InstructionLiveRange& range=liveRanges[thisIndex];
+			assert(!range.inst);
+			range.inst = &I;
+			range.codePathId = codePathId;
 			range.range.push_back(LiveRangeChunk(thisIndex, thisIndex));
 		}
 		// Operands of PHIs are declared as live out from the source block.
 		// This is handled below.
 		if (isa<PHINode>(I))
 			continue;
-		extendRangeForUsedOperands(I, liveRanges, PA, thisIndex, codePathId);
+		extendRangeForUsedOperands(I, liveRanges, instIdMap, PA, thisIndex, codePathId);
 	}
 	// Extend the live range of live-out instrution to the end of the block
 	uint32_t endOfBlockIndex=nextIndex;
-	TerminatorInst* term=BB.getTerminator();
 	for(Instruction* outLiveInst: blockState.outSet)
 	{
 		// If inlineable we need to extend the life of the not-inlineable operands
 		if (isInlineable(*outLiveInst, PA))
-			extendRangeForUsedOperands(*outLiveInst, liveRanges, PA, endOfBlockIndex, codePathId);
+			extendRangeForUsedOperands(*outLiveInst, liveRanges, instIdMap, PA, endOfBlockIndex, codePathId);
 		else
 		{
-			InstructionLiveRange& range=liveRanges.find(outLiveInst)->second;
+			InstructionLiveRange& range=liveRanges[instIdMap.find(outLiveInst)->second];
+			assert(range.inst == outLiveInst);
 			range.addUse(codePathId, endOfBlockIndex);
 		}
 	}
 	blockState.completed=true;
-	// Run on successor blocks
-	for(uint32_t i=0;i<term->getNumSuccessors();i++)
-	{
-		BasicBlock* succ=term->getSuccessor(i);
-		uint32_t newNextIndex=dfsLiveRangeInBlock(blocksState, liveRanges, instIdMap, *succ, PA, nextIndex, codePathId);
-		// If any new instruction has ben added (i.e. nextIndex if changed) update codePathId
-		if(newNextIndex!=nextIndex)
-			codePathId = newNextIndex;
-		nextIndex = newNextIndex;
-	}
 	return nextIndex;
 }
 
-void Registerize::extendRangeForUsedOperands(Instruction& I, LiveRangesTy& liveRanges, cheerp::PointerAnalyzer& PA,
-						uint32_t thisIndex, uint32_t codePathId)
+void Registerize::extendRangeForUsedOperands(Instruction& I, LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+						cheerp::PointerAnalyzer& PA, uint32_t thisIndex, uint32_t codePathId)
 {
 	for(Value* op: I.operands())
 	{
@@ -337,35 +389,34 @@ void Registerize::extendRangeForUsedOperands(Instruction& I, LiveRangesTy& liveR
 			continue;
 		// Recursively traverse inlineable operands
 		if(isInlineable(*usedI, PA))
-			extendRangeForUsedOperands(*usedI, liveRanges, PA, thisIndex, codePathId);
+			extendRangeForUsedOperands(*usedI, liveRanges, instIdMap, PA, thisIndex, codePathId);
 		else
 		{
-			assert(liveRanges.count(usedI));
-			InstructionLiveRange& range=liveRanges.find(usedI)->second;
+			assert(instIdMap.count(usedI));
+			InstructionLiveRange& range=liveRanges[instIdMap.find(usedI)->second];
+			assert(range.inst == usedI);
 			if(codePathId!=thisIndex)
 				range.addUse(codePathId, thisIndex);
 		}
 	}
 }
 
-uint32_t Registerize::assignToRegisters(const LiveRangesTy& liveRanges, const PointerAnalyzer& PA)
+uint32_t Registerize::assignToRegisters(const LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap, const PointerAnalyzer& PA)
 {
 	llvm::SmallVector<RegisterRange, 4> registers;
 	// First try to assign all PHI operands to the same register as the PHI itself
-	for(auto it: liveRanges)
+	for(const InstructionLiveRange& range: liveRanges)
 	{
-		Instruction* I=it.first;
-		if(!isa<PHINode>(I))
+		if(!range.inst || !isa<PHINode>(range.inst))
 			continue;
-		handlePHI(*I, liveRanges, registers, PA);
+		handlePHI(range, liveRanges, instIdMap, registers, PA);
 	}
 	// Assign a register to the remaining instructions
-	for(auto it: liveRanges)
+	for(const InstructionLiveRange& range: liveRanges)
 	{
-		Instruction* I=it.first;
-		if(isa<PHINode>(I))
+		Instruction* I=range.inst;
+		if(!I || isa<PHINode>(I))
 			continue;
-		InstructionLiveRange& range=it.second;
 		// Move on if a register is already assigned
 		if(registersMap.count(I))
 			continue;
@@ -375,10 +426,11 @@ uint32_t Registerize::assignToRegisters(const LiveRangesTy& liveRanges, const Po
 	return registers.size();
 }
 
-void Registerize::handlePHI(Instruction& I, const LiveRangesTy& liveRanges, llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA)
+void Registerize::handlePHI(const InstructionLiveRange& PHIrange, const LiveRangesTy& liveRanges, const InstIdMapTy& instIdMap,
+				llvm::SmallVector<RegisterRange, 4>& registers, const PointerAnalyzer& PA)
 {
+	Instruction& I=*PHIrange.inst;
 	uint32_t chosenRegister=0xffffffff;
-	const InstructionLiveRange& PHIrange=liveRanges.find(&I)->second;
 	// A PHI may already have an assigned register if it's an operand to another PHI
 	if(registersMap.count(&I))
 		chosenRegister = registersMap[&I];
@@ -388,9 +440,10 @@ void Registerize::handlePHI(Instruction& I, const LiveRangesTy& liveRanges, llvm
 		for(Value* op: I.operands())
 		{
 			Instruction* usedI=dyn_cast<Instruction>(op);
-			if(!usedI || isInlineable(*usedI, PA))
+			// Pointers returned in oSlot only hold the base, they cannot share the register with the PHI
+			if(!usedI || isInlineable(*usedI, PA) || isOffsetReturnedInSlot(usedI, PA))
 				continue;
-			assert(liveRanges.count(usedI));
+			assert(instIdMap.count(usedI) && liveRanges[instIdMap.find(usedI)->second].inst == usedI);
 			if(registersMap.count(usedI)==0)
 				continue;
 			uint32_t operandRegister=registersMap[usedI];
@@ -410,13 +463,13 @@ void Registerize::handlePHI(Instruction& I, const LiveRangesTy& liveRanges, llvm
 	for(Value* op: I.operands())
 	{
 		Instruction* usedI=dyn_cast<Instruction>(op);
-		if(!usedI || isInlineable(*usedI, PA))
+		if(!usedI || isInlineable(*usedI, PA) || isOffsetReturnedInSlot(usedI, PA))
 			continue;
-		assert(liveRanges.count(usedI));
 		// Skip already assigned operands
 		if(registersMap.count(usedI))
 			continue;
-		const InstructionLiveRange& opRange=liveRanges.find(usedI)->second;
+		const InstructionLiveRange& opRange=liveRanges[instIdMap.find(usedI)->second];
+		assert(opRange.inst == usedI);
 		bool spaceFound=addRangeToRegisterIfPossible(registers[chosenRegister], opRange,
 								getRegKindFromType(usedI->getType()));
 		if (spaceFound)
@@ -454,36 +507,27 @@ Registerize::REGISTER_KIND Registerize::getRegKindFromType(llvm::Type* t)
 
 bool Registerize::LiveRange::doesInterfere(const LiveRange& other) const
 {
-	// Check if all the ranges in this range fit inside other's holes
-	llvm::SmallVector<LiveRangeChunk, 4>::const_iterator otherIt = other.begin();
-	llvm::SmallVector<LiveRangeChunk, 4>::const_iterator otherItE = other.end();
-	llvm::SmallVector<LiveRangeChunk, 4>::const_iterator thisIt = begin();
-	llvm::SmallVector<LiveRangeChunk, 4>::const_iterator thisItE = end();
-	while(otherIt!=otherItE && thisIt!=thisItE)
+	// Since the chunks are sorted and do not overlap, only the chunks of the longer range
+	// around the start of each chunk of the shorter one need to be checked
+	const LiveRange& shorter = size() <= other.size() ? *this : other;
+	const LiveRange& longer = size() <= other.size() ? other : *this;
+	for(const LiveRangeChunk& chunk: shorter)
 	{
-		// Case 1: thisRange << otherRange
-		if(thisIt->start < otherIt->start && thisIt->end <= otherIt->start)
-		{
-			// Move to the next range of this
-			++thisIt;
-			continue;
-		}
-		// Case 2: otherRange << thisRange
-		if(otherIt->start < thisIt->start && otherIt->end <= thisIt->start)
-		{
-			// Move the the next range of other
-			++otherIt;
-			continue;
-		}
-		return true;
+		const_iterator it = std::lower_bound(longer.begin(), longer.end(), chunk);
+		// Chunks starting at the same index always interfere, even if empty
+		if(it != longer.end() && (it->start == chunk.start || it->start < chunk.end))
+			return true;
+		if(it != longer.begin() && std::prev(it)->end > chunk.start)
+			return true;
 	}
 	return false;
 }
 
 void Registerize::LiveRange::merge(const LiveRange& other)
 {
-	insert(end(), other.begin(), other.end());
-	std::sort(begin(), end());
+	// Keep the chunks sorted, the new ones usually go near the end
+	for(const LiveRangeChunk& chunk: other)
+		insert(std::upper_bound(begin(), end(), chunk), chunk);
 	//TODO: Merge adjacent ranges
 }
 
@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Cheerp/StructMemFuncLowering.h"
+#include "llvm/Cheerp/Utility.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Support/raw_ostream.h"
@@ -206,13 +207,20 @@ bool StructMemFuncLowering::runOnBlock(BasicBlock& BB)
 		if(mode==NONE)
 			continue;
 		Type* pointedType = F->getFunctionType()->getParamType(0)->getPointerElementType();
-		//We want to decompose everything which is not a byte layout structure. memset is always decomposed.
+		//We want to decompose everything which is not a byte layout structure or a typed array.
+		//memset on typed arrays is compiled with TypedArray.fill, so the value must be known for floating point types.
+		//memset is always decomposed on byte layout structures.
 		if(mode != MEMSET)
 		{
 			bool isByteLayout = isa<StructType>(pointedType) && cast<StructType>(pointedType)->hasByteLayout();
-			if(isByteLayout)
+			if(isByteLayout || cheerp::TypeSupport::isTypedArrayType(pointedType, /* forceTypedArray*/ true))
 				continue;
 		}
+		else if(cheerp::TypeSupport::isTypedArrayType(pointedType, /* forceTypedArray*/ true) &&
+			(pointedType->isIntegerTy() || isa<ConstantInt>(CI->getOperand(1))))
+		{
+			continue;
+		}
 		//We have a typed mem func on a struct
 		//Decompose it in a loop
 		Value* dst=CI->getOperand(0);
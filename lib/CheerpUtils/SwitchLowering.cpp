@@ -0,0 +1,204 @@
+//===-- SwitchLowering.cpp - Cheerp switch lowering -----------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Cheerp/SwitchLowering.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
+#include <set>
+
+#define DEBUG_TYPE "SwitchToLookupTable"
+
+STATISTIC(NumLookupTables, "Number of switches converted to lookup tables");
+
+namespace llvm {
+
+// Smaller switches are cheap enough as a chain of comparisons
+static const uint32_t MinLookupTableCases = 4;
+
+bool SwitchToLookupTable::getCaseResults(SwitchInst* si, BasicBlock* succ, BasicBlock*& commonDest, SmallVectorImpl<Constant*>& results)
+{
+	BasicBlock* pred = si->getParent();
+	BasicBlock* dest = succ;
+	// Skip empty blocks which are only reached from the switch
+	BranchInst* bi = dyn_cast<BranchInst>(succ->getTerminator());
+	if(bi && bi->isUnconditional() && &succ->front() == bi && succ->getUniquePredecessor() == pred)
+	{
+		pred = succ;
+		dest = bi->getSuccessor(0);
+	}
+	if(commonDest && commonDest != dest)
+		return false;
+	if(!isa<PHINode>(dest->front()))
+		return false;
+	for(Instruction& I: *dest)
+	{
+		PHINode* phi = dyn_cast<PHINode>(&I);
+		if(!phi)
+			break;
+		Value* v = phi->getIncomingValueForBlock(pred);
+		Type* t = v->getType();
+		bool isTypedArrayElement = t->isIntegerTy(8) || t->isIntegerTy(16) || t->isIntegerTy(32) || t->isFloatTy() || t->isDoubleTy();
+		if(!isTypedArrayElement || (!isa<ConstantInt>(v) && !isa<ConstantFP>(v)))
+			return false;
+		results.push_back(cast<Constant>(v));
+	}
+	commonDest = dest;
+	return true;
+}
+
+void SwitchToLookupTable::setIncomingEdges(BasicBlock* BB, BasicBlock* pred, uint32_t numEdges)
+{
+	for(Instruction& I: *BB)
+	{
+		PHINode* phi = dyn_cast<PHINode>(&I);
+		if(!phi)
+			break;
+		int index = phi->getBasicBlockIndex(pred);
+		if(index < 0)
+			continue;
+		Value* v = phi->getIncomingValue(index);
+		while((index = phi->getBasicBlockIndex(pred)) >= 0)
+			phi->removeIncomingValue(index, /*DeletePHIIfEmpty*/ false);
+		for(uint32_t i=0;i<numEdges;i++)
+			phi->addIncoming(v, pred);
+	}
+}
+
+bool SwitchToLookupTable::convertSwitch(SwitchInst* si)
+{
+	if(si->getNumCases() < MinLookupTableCases || isa<Constant>(si->getCondition()))
+		return false;
+	IntegerType* condType = cast<IntegerType>(si->getCondition()->getType());
+	if(condType->getBitWidth() > 32)
+		return false;
+
+	BasicBlock* commonDest = NULL;
+	std::vector<std::pair<ConstantInt*, SmallVector<Constant*, 4>>> caseResults;
+	ConstantInt* minCase = si->case_begin().getCaseValue();
+	ConstantInt* maxCase = minCase;
+	for(SwitchInst::CaseIt it=si->case_begin();it!=si->case_end();++it)
+	{
+		ConstantInt* caseValue = it.getCaseValue();
+		if(caseValue->getValue().slt(minCase->getValue()))
+			minCase = caseValue;
+		if(caseValue->getValue().sgt(maxCase->getValue()))
+			maxCase = caseValue;
+		caseResults.push_back(std::make_pair(caseValue, SmallVector<Constant*, 4>()));
+		if(!getCaseResults(si, it.getCaseSuccessor(), commonDest, caseResults.back().second))
+			return false;
+	}
+	uint64_t tableSize = (maxCase->getValue() - minCase->getValue()).getLimitedValue() + 1;
+	if(!cheerp::isDenseSwitch(caseResults.size(), tableSize))
+		return false;
+
+	// The holes of the table are filled with the results of the default destination, if they are constants
+	SmallVector<Constant*, 4> defaultResults;
+	BasicBlock* defaultCommonDest = commonDest;
+	bool hasDefaultResults = getCaseResults(si, si->getDefaultDest(), defaultCommonDest, defaultResults);
+	if(caseResults.size() < tableSize && !hasDefaultResults)
+		return false;
+
+	Function* F = si->getParent()->getParent();
+	Module* M = F->getParent();
+	BasicBlock* switchBlock = si->getParent();
+	BasicBlock* defaultDest = si->getDefaultDest();
+
+	// Build a table for each PHI of the common destination
+	std::vector<PHINode*> phis;
+	for(Instruction& I: *commonDest)
+	{
+		if(PHINode* phi = dyn_cast<PHINode>(&I))
+			phis.push_back(phi);
+		else
+			break;
+	}
+	std::vector<GlobalVariable*> tables;
+	for(uint32_t i=0;i<phis.size();i++)
+	{
+		std::vector<Constant*> elements(tableSize, hasDefaultResults ? defaultResults[i] : NULL);
+		for(auto& c: caseResults)
+			elements[(c.first->getValue() - minCase->getValue()).getLimitedValue()] = c.second[i];
+		ArrayType* tableType = ArrayType::get(phis[i]->getType(), tableSize);
+		tables.push_back(new GlobalVariable(*M, tableType, /*isConstant*/ true, GlobalValue::InternalLinkage,
+			ConstantArray::get(tableType, elements), "switch.table"));
+	}
+
+	// Replace the switch with a range check, the lookups are done in a new block
+	IRBuilder<> IRB(si);
+	Value* tableIndex = IRB.CreateAdd(si->getCondition(), ConstantExpr::getNeg(minCase), "switch.tableidx");
+	Value* inRange = IRB.CreateICmpULT(tableIndex, ConstantInt::get(condType, tableSize));
+	BasicBlock* lookupBlock = BasicBlock::Create(M->getContext(), "switch.lookup", F, commonDest);
+	IRBuilder<> lookupIRB(lookupBlock);
+	if(condType->getBitWidth() < 32)
+		tableIndex = lookupIRB.CreateZExt(tableIndex, lookupIRB.getInt32Ty());
+	for(uint32_t i=0;i<phis.size();i++)
+	{
+		Value* indexes[] = { lookupIRB.getInt32(0), tableIndex };
+		Value* result = lookupIRB.CreateLoad(lookupIRB.CreateInBoundsGEP(tables[i], indexes), "switch.load");
+		phis[i]->addIncoming(result, lookupBlock);
+	}
+	lookupIRB.CreateBr(commonDest);
+
+	std::set<BasicBlock*> caseBlocks;
+	for(SwitchInst::CaseIt it=si->case_begin();it!=si->case_end();++it)
+	{
+		BasicBlock* succ = it.getCaseSuccessor();
+		if(succ != commonDest && succ != defaultDest)
+			caseBlocks.insert(succ);
+	}
+	IRB.CreateCondBr(inRange, lookupBlock, defaultDest);
+	si->eraseFromParent();
+
+	// The empty blocks of the cases are now unreachable
+	for(BasicBlock* BB: caseBlocks)
+	{
+		for(PHINode* phi: phis)
+			phi->removeIncomingValue(BB, /*DeletePHIIfEmpty*/ false);
+		BB->eraseFromParent();
+	}
+	setIncomingEdges(defaultDest, switchBlock, 1);
+	if(commonDest != defaultDest)
+		setIncomingEdges(commonDest, switchBlock, 0);
+	NumLookupTables++;
+	return true;
+}
+
+bool SwitchToLookupTable::runOnFunction(Function& F)
+{
+	bool Changed = false;
+	std::vector<SwitchInst*> switches;
+	for(BasicBlock& BB: F)
+	{
+		if(SwitchInst* si = dyn_cast<SwitchInst>(BB.getTerminator()))
+			switches.push_back(si);
+	}
+	for(SwitchInst* si: switches)
+		Changed |= convertSwitch(si);
+
+	assert( !Changed || !verifyFunction(F, &llvm::errs()) );
+	return Changed;
+}
+
+const char* SwitchToLookupTable::getPassName() const
+{
+	return "SwitchToLookupTable";
+}
+
+char SwitchToLookupTable::ID = 0;
+
+FunctionPass *createSwitchToLookupTablePass() { return new SwitchToLookupTable(); }
+
+}
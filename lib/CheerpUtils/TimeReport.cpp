@@ -0,0 +1,124 @@
+//===-- TimeReport.cpp - Cheerp per pass timing report --------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/TimeReport.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+
+namespace cheerp {
+
+TimeReport::TimeReport():lastWallTime(TimeRecord::getCurrentTime(true).getWallTime()),lastPeakRSS(getPeakRSS())
+{
+}
+
+uint64_t TimeReport::getPeakRSS()
+{
+#ifdef LLVM_ON_UNIX
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#ifdef __APPLE__
+	// Darwin reports bytes instead of kilobytes
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#else
+	return 0;
+#endif
+}
+
+void TimeReport::endPhase(const char* name, const Module& M)
+{
+	double wallTime = TimeRecord::getCurrentTime(false).getWallTime();
+	uint64_t peakRSS = getPeakRSS();
+	Phase p;
+	p.name = name;
+	p.wallTime = wallTime - lastWallTime;
+	p.peakRSSDelta = peakRSS - lastPeakRSS;
+	uint64_t numFunctions = 0;
+	for(const Function& F: M)
+	{
+		if(!F.empty())
+			numFunctions++;
+	}
+	p.counters.push_back(std::make_pair("functions", numFunctions));
+	phases.push_back(p);
+	lastWallTime = wallTime;
+	lastPeakRSS = peakRSS;
+}
+
+void TimeReport::addCounter(const char* name, uint64_t value)
+{
+	assert(!phases.empty());
+	phases.back().counters.push_back(std::make_pair(name, value));
+}
+
+bool TimeReport::writeJSON(const std::string& fileName, std::string& ErrorString) const
+{
+	tool_output_file out(fileName.c_str(), ErrorString, sys::fs::F_Text);
+	if(!ErrorString.empty())
+		return false;
+	raw_ostream& os = out.os();
+	double totalWallTime = 0;
+	os << "{\n\t\"phases\": [\n";
+	for(uint32_t i=0;i<phases.size();i++)
+	{
+		const Phase& p = phases[i];
+		totalWallTime += p.wallTime;
+		os << "\t\t{ \"name\": \"" << p.name << "\", \"wallTime\": " << format("%.6f", p.wallTime);
+		os << ", \"peakRSSDeltaKB\": " << p.peakRSSDelta;
+		for(const auto& c: p.counters)
+			os << ", \"" << c.first << "\": " << c.second;
+		os << " }";
+		if(i+1 < phases.size())
+			os << ',';
+		os << '\n';
+	}
+	os << "\t],\n\t\"totalWallTime\": " << format("%.6f", totalWallTime);
+	os << ",\n\t\"peakRSSKB\": " << lastPeakRSS << "\n}\n";
+	out.keep();
+	return true;
+}
+
+char TimeReportPass::ID = 0;
+
+const char* TimeReportPass::getPassName() const
+{
+	return "CheerpTimeReport";
+}
+
+bool TimeReportPass::runOnModule(Module& M)
+{
+	report.endPhase(phaseName, M);
+	return false;
+}
+
+void TimeReportPass::getAnalysisUsage(AnalysisUsage& AU) const
+{
+	// Analyses computed before this pass are still needed by the writer
+	AU.setPreservesAll();
+}
+
+ModulePass* createTimeReportPass(TimeReport& report, const char* phaseName)
+{
+	return new TimeReportPass(report, phaseName);
+}
+
+}
@@ -9,10 +9,13 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
+#include <limits>
 #include <sstream>
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GlobalAlias.h"
 #include "llvm/IR/Intrinsics.h"
@@ -120,6 +123,11 @@ bool isInlineable(const Instruction& I, const PointerAnalyzer& PA)
 				if(I.user_back()!=nextInst)
 					return false;
 				// To be inlineable this should be the value operand, not the pointer operand
+				// The offset of pointers returned in oSlot must be read just after the call,
+				// it can only be forwarded as it is to the caller of the current function
+				if(isOffsetReturnedInSlot(&I, PA))
+					return isa<ReturnInst>(nextInst) &&
+						PA.getPointerKindForReturn(I.getParent()->getParent()) == REGULAR;
 				if(isa<StoreInst>(nextInst))
 					return nextInst->getOperand(0)==&I;
 				return isa<ReturnInst>(nextInst);
@@ -178,6 +186,42 @@ bool isInlineable(const Instruction& I, const PointerAnalyzer& PA)
 	return false;
 }
 
+bool isOffsetReturnedInSlot(const Value* v, const PointerAnalyzer& PA)
+{
+	ImmutableCallSite cs(v);
+	if(!cs.getInstruction() || !v->getType()->isPointerTy())
+		return false;
+	// Builtins and external functions do not use the slot
+	const Function* F = cs.getCalledFunction();
+	if(F && (F->empty() || DynamicAllocInfo(cs).isValidAlloc()))
+		return false;
+	return PA.getPointerKind(v) == REGULAR;
+}
+
+int64_t getSwitchCaseValue(const ConstantInt* c)
+{
+	if(c->getBitWidth() == 32)
+		return c->getSExtValue();
+	return c->getZExtValue();
+}
+
+bool isJumpTableSwitch(const SwitchInst* si)
+{
+	// Below this a chain of comparisons is as fast and smaller
+	const uint32_t minJumpTableCases = 4;
+	if(si->getNumCases() < minJumpTableCases || si->getCondition()->getType()->getIntegerBitWidth() > 32)
+		return false;
+	int64_t minCase = std::numeric_limits<int64_t>::max();
+	int64_t maxCase = std::numeric_limits<int64_t>::min();
+	for(SwitchInst::ConstCaseIt it=si->case_begin();it!=si->case_end();++it)
+	{
+		int64_t v = getSwitchCaseValue(it.getCaseValue());
+		minCase = std::min(minCase, v);
+		maxCase = std::max(maxCase, v);
+	}
+	return isDenseSwitch(si->getNumCases(), maxCase - minCase + 1);
+}
+
 uint32_t getIntFromValue(const Value* v)
 {
 	if(!ConstantInt::classof(v))
@@ -238,6 +282,25 @@ std::string valueObjectName(const Value* v)
 	return os.str();
 }
 
+void writeJSONString(raw_ostream& out, StringRef str)
+{
+	out << '"';
+	for(unsigned char c: str)
+	{
+		if(c == '"' || c == '\\')
+			out << '\\' << c;
+		else if(c < 0x20)
+		{
+			out << "\\u00";
+			out.write_hex(c >> 4);
+			out.write_hex(c & 0xf);
+		}
+		else
+			out << c;
+	}
+	out << '"';
+}
+
 bool TypeSupport::isDerivedStructType(StructType* derivedType, StructType* baseType)
 {
 	if(derivedType->getNumElements() < baseType->getNumElements())
@@ -521,11 +584,27 @@ bool DynamicAllocInfo::sizeIsRuntime() const
 	return true;
 }
 
+bool DynamicAllocInfo::isLargeArray() const
+{
+	if ( sizeIsRuntime() )
+		return false;
+	if ( getAllocType() == calloc )
+		return cast<ConstantInt>(getNumberOfElementsArg())->getZExtValue() > MaxLiteralArrayElements;
+	const DataLayout* DL = getInstruction()->getParent()->getParent()->getParent()->getDataLayout();
+	if ( !DL )
+		return false;
+	uint64_t typeSize = DL->getTypeAllocSize( getCastedType()->getElementType() );
+	uint64_t allocatedSize = cast<ConstantInt>(getByteSizeArg())->getZExtValue();
+	return typeSize && (allocatedSize+typeSize-1)/typeSize > MaxLiteralArrayElements;
+}
+
 bool DynamicAllocInfo::useCreateArrayFunc() const
 {
-	if( !TypeSupport::isTypedArrayType( getCastedType()->getElementType(), /* forceTypedArray*/ false ) )
+	// Pointers use the shared createPointerArray function
+	Type* elementType = getCastedType()->getElementType();
+	if( !TypeSupport::isTypedArrayType( elementType, /* forceTypedArray*/ false ) && !elementType->isPointerTy() )
 	{
-		return sizeIsRuntime() || type == cheerp_reallocate;
+		return sizeIsRuntime() || type == cheerp_reallocate || isLargeArray();
 	}
 	return false;
 }
@@ -535,7 +614,7 @@ bool DynamicAllocInfo::useCreatePointerArrayFunc() const
 	if (getCastedType()->getElementType()->isPointerTy() )
 	{
 		assert( !TypeSupport::isTypedArrayType( getCastedType()->getElementType(), /* forceTypedArray*/ false ) );
-		return sizeIsRuntime() || type == cheerp_reallocate;
+		return sizeIsRuntime() || type == cheerp_reallocate || isLargeArray();
 	}
 	return false;
 }
@@ -9,20 +9,37 @@
 //
 //===----------------------------------------------------------------------===//
 
+#define DEBUG_TYPE "CheerpWriter"
 #include "Relooper.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/Cheerp/Writer.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#if LLVM_ENABLE_THREADS
+#include <thread>
+#endif
 
 using namespace llvm;
 using namespace std;
 using namespace cheerp;
 
+STATISTIC(NumRegularPointerObjects, "Number of sites which create {d,o} objects for REGULAR pointers");
+STATISTIC(NumByteLayoutViewAccesses, "Number of byte layout loads and stores compiled with typed array views");
+STATISTIC(NumBinaryConstants, "Number of constant typed arrays encoded in binary form");
+STATISTIC(NumByteLayoutDataViewAccesses, "Number of byte layout loads and stores compiled with DataView methods");
+STATISTIC(NumCachedFunctions, "Number of functions whose code was reused from the output cache");
+
 //De-comment this to debug the pointer kind of every function
 //#define CHEERP_DEBUG_POINTERS
 
@@ -40,9 +57,12 @@ public:
 	void renderIfBlockBegin(const void* privateBlock, int branchId, bool first);
 	void renderIfBlockBegin(const void* privateBlock, const vector<int>& branchId, bool first);
 	void renderElseBlockBegin();
+	void renderSwitchBlockBegin(const void* privateBlock);
+	void renderCaseBlockBegin(const void* privateBlock, int branchId);
+	void renderDefaultBlockBegin();
 	void renderBlockEnd();
 	void renderBlockPrologue(const void* privateBlockTo, const void* privateBlockFrom);
-	bool hasBlockPrologue(const void* privateBlockTo) const;
+	bool hasBlockPrologue(const void* privateBlockTo, const void* privateBlockFrom) const;
 	void renderWhileBlockBegin();
 	void renderWhileBlockBegin(int labelId);
 	void renderDoBlockBegin();
@@ -54,6 +74,8 @@ public:
 	void renderContinue(int labelId);
 	void renderLabel(int labelId);
 	void renderIfOnLabel(int labelId, bool first);
+	void renderSwitchOnLabel();
+	void renderCaseOnLabel(int labelId);
 };
 
 void CheerpWriter::handleBuiltinNamespace(const char* identifier, llvm::ImmutableCallSite callV)
@@ -199,6 +221,8 @@ void CheerpWriter::compileDowncast( ImmutableCallSite callV )
 		//Do a runtime downcast
 		if(REGULAR == result_kind)
 		{
+			NumRegularPointerObjects++;
+			countConstruct(SizeReport::POINTER_OBJECT);
 			stream << "{d:";
 			compileCompleteObject(src);
 			stream << ".a,o:";
@@ -216,19 +240,29 @@ void CheerpWriter::compileDowncast( ImmutableCallSite callV )
 	}
 }
 
-/* Method that handles memcpy and memmove.
- * Since only immutable types are handled in the backend and we use TypedArray.set to make the copy
- * there is not need to handle memmove in a special way
+/* Method that handles memcpy, memmove and memset.
+ * Since only immutable types are handled in the backend and we use TypedArray.set to make large copies
+ * there is not need to handle memmove in a special way, except for unrolled copies
 */
-void CheerpWriter::compileMemFunc(const Value* dest, const Value* src, const Value* size)
+void CheerpWriter::compileMemFunc(const Value* dest, const Value* src, const Value* size, MEMFUNC_KIND kind)
 {
 	Type* destType=dest->getType();
 	Type* pointedType = cast<PointerType>(destType)->getElementType();
-	if(!(TypeSupport::isTypedArrayType(pointedType, /* forceTypedArray*/ true) || TypeSupport::hasByteLayout(pointedType)))
+	bool typedArray = TypeSupport::isTypedArrayType(pointedType, /* forceTypedArray*/ true);
+	if(!(typedArray || (TypeSupport::hasByteLayout(pointedType) && kind != MEMFUNC_MEMSET)))
 		llvm::report_fatal_error("Unsupported memory intrinsic, please rebuild the code using an updated version of Cheerp", false);
 
 	uint64_t typeSize = targetData.getTypeAllocSize(pointedType);
 
+	if(typedArray)
+	{
+		if(kind == MEMFUNC_MEMSET)
+			compileTypedArrayMemSet(dest, src, size, pointedType);
+		else
+			compileTypedArrayMemCopy(dest, src, size, pointedType, kind == MEMFUNC_MEMMOVE);
+		return;
+	}
+
 	bool constantNumElements = false;
 	uint32_t numElem = 0;
 
@@ -287,6 +321,183 @@ void CheerpWriter::compileMemFunc(const Value* dest, const Value* src, const Val
 		stream << NewLine << '}';
 }
 
+void CheerpWriter::compileTypedArrayMemCopy(const Value* dest, const Value* src, const Value* size,
+                                            Type* pointedType, bool isMemmove)
+{
+	uint64_t typeSize = targetData.getTypeAllocSize(pointedType);
+	if(!isa<ConstantInt>(size))
+	{
+		// The helper chooses between a loop and TypedArray.set at runtime
+		stream << "cheerpMemCopy(";
+		compilePointerBase(dest);
+		stream << ',';
+		compilePointerOffset(dest);
+		stream << ',';
+		compilePointerBase(src);
+		stream << ',';
+		compilePointerOffset(src);
+		stream << ',';
+		compileOperand(size);
+		stream << '/' << typeSize << ");" << NewLine;
+		return;
+	}
+
+	uint32_t allocatedSize = getIntFromValue(size);
+	uint32_t numElem = (allocatedSize+typeSize-1)/typeSize;
+	auto compileElement = [&](const Value* p, const char* index)
+	{
+		compilePointerBase(p);
+		stream << '[';
+		compilePointerOffset(p);
+		stream << '+' << index << ']';
+	};
+	auto compileConstantElement = [&](const Value* p, uint32_t index)
+	{
+		compilePointerBase(p);
+		stream << '[';
+		compilePointerOffset(p);
+		if(index)
+			stream << '+' << index;
+		stream << ']';
+	};
+
+	if(numElem == 0)
+		return;
+	else if(numElem == 1)
+	{
+		// Do not assume we have a typed array
+		compileCopyElement(dest, src, pointedType);
+	}
+	else if(numElem <= memcpyUnrollLimit && isMemmove)
+	{
+		// The ranges may overlap, load all the values before storing them
+		for(uint32_t i = 0; i < numElem; i++)
+		{
+			stream << "var __tmp" << i << "__=";
+			compileConstantElement(src, i);
+			stream << ';' << NewLine;
+		}
+		for(uint32_t i = 0; i < numElem; i++)
+		{
+			compileConstantElement(dest, i);
+			stream << "=__tmp" << i << "__;" << NewLine;
+		}
+	}
+	else if(numElem <= memcpyUnrollLimit)
+	{
+		for(uint32_t i = 0; i < numElem; i++)
+		{
+			compileConstantElement(dest, i);
+			stream << '=';
+			compileConstantElement(src, i);
+			stream << ';' << NewLine;
+		}
+	}
+	else if(numElem <= memcpyLoopLimit && !isMemmove)
+	{
+		stream << "for(var __i__=0;__i__<" << numElem << ";__i__++)";
+		compileElement(dest, "__i__");
+		stream << '=';
+		compileElement(src, "__i__");
+		stream << ';' << NewLine;
+	}
+	else
+	{
+		// The semantics of TypedArray.set is memmove-like, no need to care about direction
+		compilePointerBase(dest);
+		stream << ".set(";
+		compilePointerBase(src);
+		stream << ".subarray(";
+		compilePointerOffset(src);
+		stream << ',';
+		compilePointerOffset(src);
+		stream << '+' << numElem << "),";
+		compilePointerOffset(dest);
+		stream << ");" << NewLine;
+	}
+}
+
+void CheerpWriter::compileTypedArrayMemSet(const Value* dest, const Value* resetVal, const Value* size, Type* pointedType)
+{
+	uint64_t typeSize = targetData.getTypeAllocSize(pointedType);
+	auto compileResetValue = [&]()
+	{
+		if(pointedType->isIntegerTy(8))
+			compileOperand(resetVal);
+		else if(pointedType->isIntegerTy() && isa<ConstantInt>(resetVal))
+		{
+			uint64_t byte = getIntFromValue(resetVal) & 255;
+			uint64_t value = 0;
+			for(uint32_t i = 0; i < typeSize; i++)
+				value = (value << 8) | byte;
+			stream << APInt(typeSize * 8, value).getSExtValue();
+		}
+		else if(pointedType->isIntegerTy())
+		{
+			// Repeat the byte in every byte of the element
+			stream << "((";
+			compileOperand(resetVal);
+			stream << "&255)*" << (typeSize == 2 ? 257 : 16843009) << "|0)";
+		}
+		else
+		{
+			// StructMemFuncLowering only keeps memsets on floating point values if the value is constant
+			uint64_t byte = getIntFromValue(resetVal) & 255;
+			uint64_t value = 0;
+			for(uint32_t i = 0; i < typeSize; i++)
+				value = (value << 8) | byte;
+			APFloat f(pointedType->isFloatTy() ? APFloat::IEEEsingle : APFloat::IEEEdouble, APInt(typeSize * 8, value));
+			if(f.isNaN())
+				stream << "NaN";
+			else if(f.isInfinity())
+				stream << (f.isNegative() ? "-Infinity" : "Infinity");
+			else
+			{
+				// Print the exact value, the shortest representation of a float would not round trip
+				bool losesInfo;
+				f.convert(APFloat::IEEEdouble, APFloat::rmNearestTiesToEven, &losesInfo);
+				SmallString<32> buf;
+				f.toString(buf);
+				stream << buf;
+			}
+		}
+	};
+
+	if(isa<ConstantInt>(size))
+	{
+		uint32_t numElem = (getIntFromValue(size)+typeSize-1)/typeSize;
+		if(numElem == 0)
+			return;
+		else if(numElem == 1)
+		{
+			// Do not assume we have a typed array
+			compileCompleteObject(dest, nullptr);
+			stream << '=';
+			compileResetValue();
+			stream << ';' << NewLine;
+			return;
+		}
+	}
+
+	// Array.prototype.fill is also available on the arrays used for single elements
+	compilePointerBase(dest);
+	stream << ".fill(";
+	compileResetValue();
+	stream << ',';
+	compilePointerOffset(dest);
+	stream << ',';
+	compilePointerOffset(dest);
+	stream << '+';
+	if(isa<ConstantInt>(size))
+		stream << (getIntFromValue(size)+typeSize-1)/typeSize;
+	else
+	{
+		compileOperand(size);
+		stream << '/' << typeSize;
+	}
+	stream << ");" << NewLine;
+}
+
 void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 {
 	assert (info.isValidAlloc());
@@ -301,6 +512,8 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 
 	if(needsRegular)
 	{
+		NumRegularPointerObjects++;
+		countConstruct(SizeReport::POINTER_OBJECT);
 		stream << "{d:";
 	}
 
@@ -323,9 +536,18 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 	
 	if (info.useTypedArray())
 	{
-		stream << "new ";
-		compileTypedArrayType(t);
-		stream << '(';
+		if (useArenaHeap)
+		{
+			stream << "cheerpHeapAlloc(";
+			compileTypedArrayType(t);
+			stream << ',';
+		}
+		else
+		{
+			stream << "new ";
+			compileTypedArrayType(t);
+			stream << '(';
+		}
 		
 		if(info.getNumberOfElementsArg())
 			compileOperand(info.getNumberOfElementsArg());
@@ -381,6 +603,7 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 	}
 	else if (info.useCreatePointerArrayFunc() )
 	{
+		countConstruct(SizeReport::CREATE_POINTER_ARRAY);
 		stream << "createPointerArray(";
 		if (info.getAllocType() == DynamicAllocInfo::cheerp_reallocate)
 		{
@@ -399,7 +622,7 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 				compileOperand( info.getByteSizeArg() );
 				stream << '/' << typeSize;
 			}
-			stream << ')';
+			stream << ',';
 		}
 		else
 		{
@@ -411,9 +634,12 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 				compileOperand( info.getByteSizeArg() );
 				stream << '/' << typeSize;
 			}
-			stream << ')';
+			stream << ',';
 		}
-	
+		// All the new slots share the same null pointer, it is never modified in place
+		compileSimpleType(t);
+		stream << ')';
+
 		assert( globalDeps.needCreatePointerArray() );
 	}
 	else if (!info.sizeIsRuntime() )
@@ -440,9 +666,15 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 		if(REGULAR == result)
 			stream << '[';
 
+		// Byte layout objects can be taken from the arena heap only if they are not wrapped in an array,
+		// otherwise the DataView would not be visible to compileFree
+		bool useHeapForByteLayout = useArenaHeap && REGULAR != result && t->isStructTy() && TypeSupport::hasByteLayout(t);
 		for(uint32_t i = 0; i < numElem;i++)
 		{
-			compileType(t, LITERAL_OBJ, !isInlineable(*info.getInstruction(), PA) ? namegen.getName(info.getInstruction()) : StringRef());
+			if(useHeapForByteLayout)
+				stream << "cheerpHeapAlloc(DataView," << typeSize << ')';
+			else
+				compileType(t, LITERAL_OBJ, !isInlineable(*info.getInstruction(), PA) ? namegen.getName(info.getInstruction()) : StringRef());
 			if((i+1) < numElem)
 				stream << ',';
 		}
@@ -464,6 +696,8 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 			//__ret__ now contains the new array, we need to copy over the data
 			//The amount of data to copy is limited by the shortest between the old and new array
 			stream << "__ret__.set(__old__.subarray(0, Math.min(__ret__.length,__old__.length)));" << NewLine;
+			if (useArenaHeap)
+				stream << "cheerpHeapFree(__old__);" << NewLine;
 			stream << "return __ret__;})()";
 		}
 	}
@@ -477,6 +711,18 @@ void CheerpWriter::compileAllocation(const DynamicAllocInfo & info)
 void CheerpWriter::compileFree(const Value* obj)
 {
 	//TODO: Clean up class related data structures
+	if (!useArenaHeap)
+		return;
+	// Only typed arrays and byte layout objects are allocated from the arena heap, everything else is left to the GC.
+	// The helper still checks at runtime that the memory comes from the heap, since i8* may point to anything
+	if (!TypeSupport::mayUseArenaHeap(obj->stripPointerCastsSafe()->getType()->getPointerElementType()))
+		return;
+	stream << "cheerpHeapFree(";
+	if (PA.getPointerKind(obj) == COMPLETE_OBJECT)
+		compileCompleteObject(obj);
+	else
+		compilePointerBase(obj);
+	stream << ')';
 }
 
 CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(ImmutableCallSite callV, const Function * func)
@@ -496,12 +742,12 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 	if(intrinsicId==Intrinsic::memmove ||
 		intrinsicId==Intrinsic::memcpy)
 	{
-		compileMemFunc(*(it), *(it+1), *(it+2));
+		compileMemFunc(*(it), *(it+1), *(it+2), intrinsicId==Intrinsic::memmove ? MEMFUNC_MEMMOVE : MEMFUNC_MEMCPY);
 		return COMPILE_EMPTY;
 	}
 	else if(intrinsicId==Intrinsic::memset)
 	{
-		llvm::report_fatal_error("Unsupported memory intrinsic, please rebuild the code using an updated version of Cheerp", false);
+		compileMemFunc(*(it), *(it+1), *(it+2), MEMFUNC_MEMSET);
 		return COMPILE_EMPTY;
 	}
 	else if(intrinsicId==Intrinsic::invariant_start)
@@ -519,6 +765,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 		return COMPILE_EMPTY;
 	else if(intrinsicId==Intrinsic::vastart)
 	{
+		countConstruct(SizeReport::POINTER_OBJECT);
 		compileCompleteObject(*it);
 		stream << "={d:arguments,o:" << namegen.getName(currentFun) << ".length}";
 		return COMPILE_OK;
@@ -565,6 +812,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 		//keeping all local variable around. The helper
 		//method is printed on demand depending on a flag
 		assert( isa<Function>( callV.getArgument(0) ) );
+		countConstruct(SizeReport::CREATE_CLOSURE);
 		stream << "cheerpCreateClosure(";
 		compileCompleteObject( callV.getArgument(0) );
 		stream << ',';
@@ -580,6 +828,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::handleBuiltinCall(Immut
 	}
 	else if(intrinsicId==Intrinsic::cheerp_make_regular)
 	{
+		NumRegularPointerObjects++;
+		countConstruct(SizeReport::POINTER_OBJECT);
 		stream << "{d:";
 		compileCompleteObject(*it);
 		stream << ",o:";
@@ -1020,7 +1270,7 @@ void CheerpWriter::compilePointerBase(const Value* p, bool forEscapingPointer)
 		return;
 	}
 
-	if(isa<Argument>(p))
+	if(isa<Argument>(p) || isOffsetReturnedInSlot(p, PA))
 	{
 		stream << namegen.getName(p);
 		return;
@@ -1107,6 +1357,147 @@ const Value* CheerpWriter::compileByteLayoutOffset(const Value* p, BYTE_LAYOUT_O
 	return NULL;
 }
 
+void CheerpWriter::compilePointerAs(const Value* p, POINTER_KIND kind)
+{
+	assert(p->getType()->isPointerTy());
+
+	if(kind == COMPLETE_OBJECT)
+	{
+		compileCompleteObject(p);
+	}
+	else if (isa<ConstantPointerNull>(p))
+	{
+		stream << "nullObj";
+	}
+	else if (PA.getConstantOffsetForPointer(p) || isa<Argument>(p) || isOffsetReturnedInSlot(p, PA))
+	{
+		NumRegularPointerObjects++;
+		countConstruct(SizeReport::POINTER_OBJECT);
+		stream << "{d:";
+		compilePointerBase(p, true);
+		stream << ",o:";
+		compilePointerOffset(p);
+		stream << "}";
+	}
+	else
+	{
+		assert(PA.getPointerKind(p) == REGULAR || PA.getPointerKind(p) == BYTE_LAYOUT);
+		compileOperand(p);
+	}
+}
+
+uint32_t CheerpWriter::getByteLayoutOffsetAlignment(const Value* p) const
+{
+	// Follow the same steps as compileByteLayoutOffset with BYTE_LAYOUT_OFFSET_FULL
+	// Every term of the summation is a known constant or a multiple of the element size
+	uint32_t alignment = 1u << 31;
+	auto addTerm = [&alignment](uint64_t term)
+	{
+		if(term)
+			alignment = std::min(alignment, uint32_t(1u << countTrailingZeros(term)));
+	};
+	while ( isBitCast(p) || isGEP(p) )
+	{
+		const User * u = cast<User>(p);
+		bool byteLayoutFromHere = PA.getPointerKind(u->getOperand(0)) != BYTE_LAYOUT;
+		Type* curType = u->getOperand(0)->getType();
+		if (isGEP(p))
+		{
+			bool skipUntilBytelayout = byteLayoutFromHere;
+			for (uint32_t i=1;i<u->getNumOperands();i++)
+			{
+				const Value* index = u->getOperand(i);
+				if (StructType* ST = dyn_cast<StructType>(curType))
+				{
+					uint32_t elementIndex = cast<ConstantInt>(index)->getZExtValue();
+					if (!skipUntilBytelayout)
+						addTerm(targetData.getStructLayout(ST)->getElementOffset(elementIndex));
+					curType = ST->getElementType(elementIndex);
+				}
+				else
+				{
+					uint64_t elementSize = targetData.getTypeAllocSize(curType->getSequentialElementType());
+					if (!skipUntilBytelayout)
+					{
+						if (const ConstantInt* CI = dyn_cast<ConstantInt>(index))
+							addTerm(CI->getSExtValue() * elementSize);
+						else
+							addTerm(elementSize);
+					}
+					curType = curType->getSequentialElementType();
+				}
+				if (skipUntilBytelayout && TypeSupport::hasByteLayout(curType))
+					skipUntilBytelayout = false;
+			}
+		}
+		if(byteLayoutFromHere)
+			return alignment;
+		p = u->getOperand(0);
+	}
+	// The offset of a BYTE_LAYOUT pointer stored in a variable is not known
+	return 1;
+}
+
+bool CheerpWriter::getByteLayoutView(Type* t, const char*& viewName, uint32_t& elementSize)
+{
+	if(t->isIntegerTy(8))
+	{
+		viewName = "cheerpViewInt8";
+		elementSize = 1;
+	}
+	else if(t->isIntegerTy(16))
+	{
+		viewName = "cheerpViewInt16";
+		elementSize = 2;
+	}
+	else if(t->isIntegerTy(32))
+	{
+		viewName = "cheerpViewInt32";
+		elementSize = 4;
+	}
+	else if(t->isFloatTy())
+	{
+		viewName = "cheerpViewFloat32";
+		elementSize = 4;
+	}
+	else if(t->isDoubleTy())
+	{
+		viewName = "cheerpViewFloat64";
+		elementSize = 8;
+	}
+	else
+		return false;
+	return true;
+}
+
+bool CheerpWriter::compileByteLayoutViewAccess(const Value* p)
+{
+	const char* viewName;
+	uint32_t elementSize;
+	if(!getByteLayoutView(p->getType()->getPointerElementType(), viewName, elementSize) ||
+		getByteLayoutOffsetAlignment(p) < elementSize)
+	{
+		NumByteLayoutDataViewAccesses++;
+		countConstruct(SizeReport::DATAVIEW_ACCESS);
+		return false;
+	}
+	NumByteLayoutViewAccesses++;
+	countConstruct(SizeReport::TYPED_ARRAY_VIEW_ACCESS);
+	stream << viewName << '(';
+	compilePointerBase(p);
+	stream << ")[";
+	if(elementSize == 1)
+		compilePointerOffset(p);
+	else
+	{
+		stream << '(';
+		compilePointerOffset(p);
+		stream << ")>>" << Log2_32(elementSize);
+	}
+	stream << ']';
+	return true;
+}
+
 void CheerpWriter::compilePointerOffset(const Value* p, bool forEscapingPointer)
 {
 	if ( PA.getPointerKind(p) == COMPLETE_OBJECT )
@@ -1138,7 +1529,7 @@ void CheerpWriter::compilePointerOffset(const Value* p, bool forEscapingPointer)
 		stream << '0';
 		return;
 	}
-	else if(isa<Argument>(p))
+	else if(isa<Argument>(p) || isOffsetReturnedInSlot(p, PA))
 	{
 		stream << namegen.getSecondaryName(p);
 		return;
@@ -1222,6 +1613,146 @@ void CheerpWriter::compileConstantArrayMembers(const Constant* C)
 	}
 }
 
+bool CheerpWriter::isBinaryConstant(const ConstantDataSequential* C) const
+{
+	if(binaryConstantThreshold == 0 || !isa<ArrayType>(C->getType()))
+		return false;
+	Type* t = C->getElementType();
+	if(!t->isIntegerTy(8) && !t->isIntegerTy(16) && !t->isIntegerTy(32) && !t->isFloatTy() && !t->isDoubleTy())
+		return false;
+	return C->getRawDataValues().size() >= binaryConstantThreshold;
+}
+
+static void writeBase64(ostream_proxy& stream, StringRef data)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string encoded;
+	encoded.reserve((data.size()+2)/3*4);
+	for(uint32_t i=0;i<data.size();i+=3)
+	{
+		uint32_t n = uint8_t(data[i]) << 16;
+		if(i+1 < data.size())
+			n |= uint8_t(data[i+1]) << 8;
+		if(i+2 < data.size())
+			n |= uint8_t(data[i+2]);
+		encoded += table[(n >> 18) & 63];
+		encoded += table[(n >> 12) & 63];
+		encoded += (i+1 < data.size()) ? table[(n >> 6) & 63] : '=';
+		encoded += (i+2 < data.size()) ? table[n & 63] : '=';
+	}
+	stream << StringRef(encoded);
+}
+
+void CheerpWriter::compileBinaryConstant(const ConstantDataSequential* C)
+{
+	NumBinaryConstants++;
+	stream << "new ";
+	compileTypedArrayType(C->getElementType());
+	auto it = binaryDataOffsets.find(C);
+	if(!currentFun && it != binaryDataOffsets.end())
+	{
+		// Every global shares the same buffer, the views do not overlap
+		stream << "(cheerpBinaryData," << it->second << ',' << C->getNumElements() << ')';
+	}
+	else
+	{
+		// The raw data is little endian like the target, typed arrays use the same order on all the supported platforms
+		assert(needBase64Decoder);
+		stream << "(cheerpDecodeBase64(\"";
+		writeBase64(stream, C->getRawDataValues());
+		stream << "\"))";
+	}
+}
+
+void CheerpWriter::collectBinaryConstants(const Constant* C, std::vector<const ConstantDataSequential*>& uses)
+{
+	if(isa<GlobalValue>(C))
+		return;
+	if(const ConstantDataSequential* CD = dyn_cast<ConstantDataSequential>(C))
+	{
+		if(isBinaryConstant(CD))
+			uses.push_back(CD);
+		return;
+	}
+	for(const Use& U: C->operands())
+		collectBinaryConstants(cast<Constant>(U), uses);
+}
+
+void CheerpWriter::collectBinaryConstants()
+{
+	if(binaryConstantThreshold == 0)
+		return;
+	// Constants are uniqued, only the ones used once by global initializers can be views of binaryData.
+	// Every other use needs its own copy of the data, which is decoded from base64.
+	std::vector<const ConstantDataSequential*> uses;
+	for(const GlobalVariable& GV: module.getGlobalList())
+	{
+		if(GV.hasInitializer() && !TypeSupport::isClientGlobal(&GV))
+			collectBinaryConstants(GV.getInitializer(), uses);
+	}
+	std::unordered_map<const ConstantDataSequential*, uint32_t> useCount;
+	for(const ConstantDataSequential* CD: uses)
+		useCount[CD]++;
+	for(const ConstantDataSequential* CD: uses)
+	{
+		if(!binaryData || useCount[CD] > 1)
+		{
+			needBase64Decoder = true;
+			continue;
+		}
+		StringRef data = CD->getRawDataValues();
+		// Keep all the constants aligned for Float64Array
+		uint32_t offset = RoundUpToAlignment(binaryDataSize, 8);
+		for(;binaryDataSize < offset;binaryDataSize++)
+			*binaryData << '\0';
+		*binaryData << data;
+		binaryDataSize += data.size();
+		binaryDataOffsets.insert(std::make_pair(CD, offset));
+	}
+	if(needBase64Decoder)
+		return;
+	std::vector<const ConstantDataSequential*> codeUses;
+	for(const Function& F: module)
+		for(const BasicBlock& BB: F)
+			for(const Instruction& I: BB)
+				for(const Use& U: I.operands())
+					if(const Constant* C = dyn_cast<Constant>(U))
+						collectBinaryConstants(C, codeUses);
+	needBase64Decoder = !codeUses.empty();
+}
+
+void CheerpWriter::compileBase64Decoder()
+{
+	stream << "function cheerpDecodeBase64(s){" << NewLine;
+	stream << "var b=typeof atob!=='undefined'?atob(s):Buffer.from(s,'base64').toString('latin1');" << NewLine;
+	stream << "var r=new Uint8Array(b.length);" << NewLine;
+	stream << "for(var i=0;i<b.length;i++)" << NewLine;
+	stream << "r[i]=b.charCodeAt(i);" << NewLine;
+	stream << "return r.buffer;" << NewLine;
+	stream << '}' << NewLine;
+}
+
+void CheerpWriter::compileBinaryDataLoader()
+{
+	stream << "function cheerpLoadBinaryData(){" << NewLine;
+	stream << "if(typeof XMLHttpRequest!=='undefined'){" << NewLine;
+	stream << "var x=new XMLHttpRequest();" << NewLine;
+	stream << "x.open('GET','" << binaryDataName << "',false);" << NewLine;
+	// Synchronous requests cannot return an ArrayBuffer, use a string of bytes instead
+	stream << "x.overrideMimeType('text/plain; charset=x-user-defined');" << NewLine;
+	stream << "x.send();" << NewLine;
+	stream << "var s=x.responseText;" << NewLine;
+	stream << "var r=new Uint8Array(s.length);" << NewLine;
+	stream << "for(var i=0;i<s.length;i++)" << NewLine;
+	stream << "r[i]=s.charCodeAt(i);" << NewLine;
+	stream << "return r.buffer;" << NewLine;
+	stream << '}' << NewLine;
+	stream << "var b=require('fs').readFileSync(__dirname+'/" << binaryDataName << "');" << NewLine;
+	stream << "return b.buffer.slice(b.byteOffset,b.byteOffset+b.length);" << NewLine;
+	stream << '}' << NewLine;
+	stream << "var cheerpBinaryData=cheerpLoadBinaryData();" << NewLine;
+}
+
 bool CheerpWriter::doesConstantDependOnUndefined(const Constant* C) const
 {
 	if(isa<ConstantExpr>(C) && C->getOperand(0)->getType()->isPointerTy())
@@ -1244,6 +1775,10 @@ void CheerpWriter::compileConstant(const Constant* c)
 	{
 		compileConstantExpr(cast<ConstantExpr>(c));
 	}
+	else if(isa<ConstantDataSequential>(c) && isBinaryConstant(cast<ConstantDataSequential>(c)))
+	{
+		compileBinaryConstant(cast<ConstantDataSequential>(c));
+	}
 	else if(isa<ConstantDataSequential>(c))
 	{
 		const ConstantDataSequential* d=cast<ConstantDataSequential>(c);
@@ -1265,12 +1800,18 @@ void CheerpWriter::compileConstant(const Constant* c)
 	else if(isa<ConstantStruct>(c))
 	{
 		const ConstantStruct* d=cast<ConstantStruct>(c);
-		stream << '{';
+		// Constant objects must have the same shape of the ones created at runtime
+		bool useConstructor = useStructConstructor(d->getType());
+		if(useConstructor)
+			stream << "new C" << namegen.getTypeName(d->getType()) << '(';
+		else
+			stream << '{';
 		assert(d->getType()->getNumElements() == d->getNumOperands());
 
 		for(uint32_t i=0;i<d->getNumOperands();i++)
 		{
-			stream << types.getPrefixCharForMember(PA, d->getType(), i) << i << ':';
+			if(!useConstructor)
+				stream << types.getPrefixCharForMember(PA, d->getType(), i) << i << ':';
 			bool useWrapperArray = types.useWrapperArrayForMember(PA, d->getType(), i);
 			if (useWrapperArray)
 				stream << '[';
@@ -1295,7 +1836,7 @@ void CheerpWriter::compileConstant(const Constant* c)
 				stream << ',';
 		}
 
-		stream << '}';
+		stream << (useConstructor ? ')' : '}');
 	}
 	else if(isa<ConstantFP>(c))
 	{
@@ -1312,7 +1853,15 @@ void CheerpWriter::compileConstant(const Constant* c)
 		else
 		{
 			SmallString<32> buf;
-			f->getValueAPF().toString(buf);
+			APFloat value = f->getValueAPF();
+			if(useMathFround && f->getType()->isFloatTy())
+			{
+				// Print the exact value of the float, the shortest representation of a float
+				// would not round trip when read back as a double
+				bool losesInfo;
+				value.convert(APFloat::IEEEdouble, APFloat::rmNearestTiesToEven, &losesInfo);
+			}
+			value.toString(buf);
 			stream << buf;
 		}
 	}
@@ -1344,6 +1893,9 @@ void CheerpWriter::compileConstant(const Constant* c)
 	{
 		assert(c->hasName());
 		stream << namegen.getName(c);
+		// Lazy globals are accessed through their initialization function
+		if(useLazyGlobals && isa<GlobalVariable>(c) && globalDeps.lazyGlobals().count(cast<GlobalVariable>(c)))
+			stream << "()";
 	}
 	else if(isa<ConstantAggregateZero>(c))
 	{
@@ -1383,7 +1935,7 @@ void CheerpWriter::compileOperand(const Value* v, bool allowBooleanObjects)
 			}
 			if(isBooleanObject && !allowBooleanObjects)
 				stream << '(';
-			compileInlineableInstruction(*cast<Instruction>(v));
+			compileInlineableInstructionWithFround(*cast<Instruction>(v));
 			if(isBooleanObject && !allowBooleanObjects)
 				stream << "?1:0)";
 		}
@@ -1391,14 +1943,14 @@ void CheerpWriter::compileOperand(const Value* v, bool allowBooleanObjects)
 		{
 			if(it->getType()->isIntegerTy(1))
 				stream << '(';
-			stream << namegen.getName(it);
+			stream << namegen.getName(it, edgeContext);
 			if(it->getType()->isIntegerTy(1))
 				stream << ">>0)";
 		}
 	}
 	else if(const Argument* arg=dyn_cast<Argument>(v))
 	{
-		stream << namegen.getName(arg);
+		stream << namegen.getName(arg, edgeContext);
 	}
 	else if(const InlineAsm* a=dyn_cast<InlineAsm>(v))
 	{
@@ -1429,9 +1981,7 @@ void CheerpWriter::compilePHIOfBlockFromOtherBlock(const BasicBlock* to, const B
 		const BasicBlock* toBB;
 		void handleRecursivePHIDependency(const Instruction* phi) override
 		{
-			writer.namegen.setEdgeContext(fromBB, toBB);
-			writer.stream << "var " << writer.namegen.getNameForEdge(phi);
-			writer.namegen.clearEdgeContext();
+			writer.stream << "var " << writer.namegen.getNameForEdge(phi, NameGenerator::EdgeContext(fromBB, toBB));
 			writer.stream << '=' << writer.namegen.getName(phi) << ';' << writer.NewLine;
 		}
 		void handlePHI(const Instruction* phi, const Value* incoming) override
@@ -1440,6 +1990,7 @@ void CheerpWriter::compilePHIOfBlockFromOtherBlock(const BasicBlock* to, const B
 			const Instruction* incomingInst=dyn_cast<Instruction>(incoming);
 			// We can avoid assignment from the same register if no pointer kind conversion is required
 			if(incomingInst && !isInlineable(*incomingInst, writer.PA) &&
+				!isOffsetReturnedInSlot(incomingInst, writer.PA) &&
 				writer.registerize.getRegisterId(phi)==writer.registerize.getRegisterId(incomingInst) &&
 				(!phiType->isPointerTy() || writer.PA.getPointerKind(phi)==writer.PA.getPointerKind(incoming)) &&
 				writer.PA.getConstantOffsetForPointer(phi)==writer.PA.getConstantOffsetForPointer(incoming))
@@ -1447,7 +1998,8 @@ void CheerpWriter::compilePHIOfBlockFromOtherBlock(const BasicBlock* to, const B
 				return;
 			}
 			writer.stream << "var " << writer.namegen.getName(phi) << '=';
-			writer.namegen.setEdgeContext(fromBB, toBB);
+			assert(writer.edgeContext.isNull());
+			writer.edgeContext = NameGenerator::EdgeContext(fromBB, toBB);
 			if(phiType->isPointerTy())
 			{
 				POINTER_KIND k=writer.PA.getPointerKind(phi);
@@ -1463,7 +2015,7 @@ void CheerpWriter::compilePHIOfBlockFromOtherBlock(const BasicBlock* to, const B
 			else
 				writer.compileOperand(incoming);
 			writer.stream << ';' << writer.NewLine;
-			writer.namegen.clearEdgeContext();
+			writer.edgeContext.clear();
 		}
 	};
 	WriterPHIHandler(*this, from, to).runOnEdge(registerize, from, to);
@@ -1568,9 +2120,21 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileTerminatorInstru
 				if(retVal->getType()->isPointerTy())
 				{
 					POINTER_KIND k=PA.getPointerKindForReturn(ri.getParent()->getParent());
-					if(k==REGULAR)
-						stream << "aSlot=";
-					compilePointerAs(retVal, k);
+					if(k==REGULAR && isOffsetReturnedInSlot(retVal, PA) && isInlineable(*cast<Instruction>(retVal), PA))
+					{
+						// The callee already sets oSlot
+						compileOperand(retVal);
+					}
+					else if(k==REGULAR)
+					{
+						// The offset is passed in oSlot, see isOffsetReturnedInSlot
+						stream << "oSlot=";
+						compilePointerOffset(retVal);
+						stream << ',';
+						compilePointerBase(retVal, true);
+					}
+					else
+						compilePointerAs(retVal, k);
 				}
 				else
 				{
@@ -1613,6 +2177,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileTerminatorInstru
 
 			compileMethodArgs(ci.op_begin(),ci.op_begin()+ci.getNumArgOperands(),&ci);
 			stream << ';' << NewLine;
+			if(namegen.hasSecondaryName(&ci))
+				stream << "var " << namegen.getSecondaryName(&ci) << "=oSlot;" << NewLine;
 			//Only consider the normal successor for PHIs here
 			//For each successor output the variables for the phi nodes
 			compilePHIOfBlockFromOtherBlock(ci.getNormalDest(), I.getParent());
@@ -1650,6 +2216,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileNotInlineableIns
 			StringRef varName = namegen.getName(&I);
 			if(PA.getPointerKind(ai) == REGULAR)
 			{
+				NumRegularPointerObjects++;
+				countConstruct(SizeReport::POINTER_OBJECT);
 				stream << "{d:[";
 				compileType(ai->getAllocatedType(), LITERAL_OBJ, varName);
 				stream << "],o:0}";
@@ -1709,7 +2277,13 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileNotInlineableIns
 			const Value* ptrOp=si.getPointerOperand();
 			const Value* valOp=si.getValueOperand();
 
-			if (PA.getPointerKind(ptrOp) == BYTE_LAYOUT)
+			if (PA.getPointerKind(ptrOp) == BYTE_LAYOUT && compileByteLayoutViewAccess(ptrOp))
+			{
+				stream << '=';
+				compileOperand(valOp);
+				return COMPILE_OK;
+			}
+			else if (PA.getPointerKind(ptrOp) == BYTE_LAYOUT)
 			{
 				//Optimize stores of single values from unions
 				compilePointerBase(ptrOp);
@@ -1759,7 +2333,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileNotInlineableIns
 		}
 		default:
 		{
-			COMPILE_INSTRUCTION_FEEDBACK ret=compileInlineableInstruction(I);
+			COMPILE_INSTRUCTION_FEEDBACK ret=compileInlineableInstructionWithFround(I);
 			if(ret == COMPILE_OK && I.getType()->isIntegerTy(1))
 			{
 				switch(I.getOpcode())
@@ -1969,6 +2543,8 @@ void CheerpWriter::compileGEP(const llvm::User* gep_inst, POINTER_KIND kind)
 			return;
 		}
 
+		NumRegularPointerObjects++;
+		countConstruct(SizeReport::POINTER_OBJECT);
 		stream << "{d:";
 		compilePointerBase( gep_inst, true);
 		stream << ",o:";
@@ -2015,6 +2591,59 @@ void CheerpWriter::compileUnsignedInteger(const llvm::Value* v)
 	}
 }
 
+static bool isNativeMathFloatFunction(StringRef ident)
+{
+	return ident=="fabsf" || ident=="acosf" || ident=="asinf" || ident=="atanf" || ident=="atan2f" ||
+		ident=="ceilf" || ident=="cosf" || ident=="expf" || ident=="floorf" || ident=="logf" ||
+		ident=="powf" || ident=="roundf" || ident=="sinf" || ident=="sqrtf" || ident=="tanf";
+}
+
+bool CheerpWriter::needsFround(const Instruction& I) const
+{
+	if(!useMathFround || !I.getType()->isFloatTy())
+		return false;
+	switch(I.getOpcode())
+	{
+		case Instruction::FAdd:
+		case Instruction::FSub:
+		case Instruction::FMul:
+		case Instruction::FDiv:
+		case Instruction::FRem:
+		case Instruction::SIToFP:
+		case Instruction::UIToFP:
+			return true;
+		case Instruction::FPTrunc:
+		{
+			// fpext from float is exact, so fptrunc(fpext(x)) is already rounded
+			const Value* src=I.getOperand(0);
+			return !(isa<FPExtInst>(src) && cast<FPExtInst>(src)->getOperand(0)->getType()->isFloatTy());
+		}
+		case Instruction::Call:
+		{
+			// Functions compiled by us return rounded values, unless they are replaced by
+			// native JavaScript math. External functions may return any double.
+			const Function* calledFunc = cast<CallInst>(I).getCalledFunction();
+			if(!calledFunc)
+				return false;
+			if(useNativeJavaScriptMath && isNativeMathFloatFunction(calledFunc->getName()))
+				return true;
+			return calledFunc->empty();
+		}
+		default:
+			return false;
+	}
+}
+
+CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstructionWithFround(const Instruction& I)
+{
+	if(!needsFround(I))
+		return compileInlineableInstruction(I);
+	stream << "Math.fround(";
+	COMPILE_INSTRUCTION_FEEDBACK ret=compileInlineableInstruction(I);
+	stream << ')';
+	return ret;
+}
+
 /*
  * This can be used for both named instructions and inlined ones
  * NOTE: Call, Ret, Invoke are NEVER inlined
@@ -2440,6 +3069,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 		case Instruction::VAArg:
 		{
 			const VAArgInst& vi=cast<VAArgInst>(I);
+			countConstruct(SizeReport::HANDLE_VAARG);
 			stream << "handleVAArg(";
 			compileCompleteObject(vi.getPointerOperand());
 			stream << ')';
@@ -2477,7 +3107,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 			const Value* ptrOp=li.getPointerOperand();
 			stream << '(';
 
-			if (PA.getPointerKind(ptrOp) == BYTE_LAYOUT)
+			if (PA.getPointerKind(ptrOp) == BYTE_LAYOUT && !compileByteLayoutViewAccess(ptrOp))
 			{
 				//Optimize loads of single values from unions
 				compilePointerBase(ptrOp);
@@ -2497,7 +3127,7 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 					stream << ",true";
 				stream << ')';
 			}
-			else
+			else if (PA.getPointerKind(ptrOp) != BYTE_LAYOUT)
 			{
 				compileCompleteObject(ptrOp);
 			}
@@ -2523,6 +3153,8 @@ CheerpWriter::COMPILE_INSTRUCTION_FEEDBACK CheerpWriter::compileInlineableInstru
 
 void CheerpWriter::compileBB(const BasicBlock& BB, const std::map<const BasicBlock*, uint32_t>& blocksMap)
 {
+	if(currentCounters)
+		stream << "cheerpProfile[" << currentCounterBase+currentCounters->getBlockCounter(&BB) << "]++;" << NewLine;
 	BasicBlock::const_iterator I=BB.begin();
 	BasicBlock::const_iterator IE=BB.end();
 	for(;I!=IE;++I)
@@ -2544,7 +3176,7 @@ void CheerpWriter::compileBB(const BasicBlock& BB, const std::map<const BasicBlo
 		}
 		const DebugLoc& debugLoc = I->getDebugLoc();
 		if(sourceMapGenerator && !debugLoc.isUnknown())
-			sourceMapGenerator->setDebugLoc(I->getDebugLoc());
+			sourceMapGenerator->setDebugLoc(I->getDebugLoc(), stream.getColumn());
 		if(!I->getType()->isVoidTy() && !I->use_empty())
 		{
 			stream << "var " << namegen.getName(I) << '=';
@@ -2560,6 +3192,9 @@ void CheerpWriter::compileBB(const BasicBlock& BB, const std::map<const BasicBlo
 			if(ret==COMPILE_OK)
 			{
 				stream << ';' << NewLine;
+				// Read the offset of a REGULAR pointer returned by the call
+				if(namegen.hasSecondaryName(I))
+					stream << "var " << namegen.getSecondaryName(I) << "=oSlot;" << NewLine;
 			}
 			else if(ret==COMPILE_UNSUPPORTED)
 			{
@@ -2652,6 +3287,58 @@ void CheerpRenderInterface::renderElseBlockBegin()
 	writer->stream << "}else{" << NewLine;
 }
 
+/**
+ * Return the smallest case of the switch, the cases are compiled relative to it
+ */
+static int64_t getSwitchMinCase(const SwitchInst* si)
+{
+	int64_t minCase = std::numeric_limits<int64_t>::max();
+	for(SwitchInst::ConstCaseIt it=si->case_begin();it!=si->case_end();++it)
+		minCase = std::min(minCase, getSwitchCaseValue(it.getCaseValue()));
+	return minCase;
+}
+
+void CheerpRenderInterface::renderSwitchBlockBegin(const void* privateBlock)
+{
+	const SwitchInst* si=cast<SwitchInst>(((const BasicBlock*)privateBlock)->getTerminator());
+	int64_t minCase = getSwitchMinCase(si);
+	writer->stream << "switch(";
+	if(minCase == 0)
+		writer->compileOperandForIntegerPredicate(si->getCondition(), CmpInst::ICMP_EQ);
+	else
+	{
+		//Normalize the cases to start from 0, so that engines can use a jump table
+		writer->stream << '(';
+		writer->compileOperandForIntegerPredicate(si->getCondition(), CmpInst::ICMP_EQ);
+		writer->stream << ')';
+		if(minCase > 0)
+			writer->stream << '-' << minCase;
+		else
+			writer->stream << '+' << -minCase;
+		writer->stream << "|0";
+	}
+	writer->stream << "){" << NewLine;
+}
+
+void CheerpRenderInterface::renderCaseBlockBegin(const void* privateBlock, int branchId)
+{
+	const SwitchInst* si=cast<SwitchInst>(((const BasicBlock*)privateBlock)->getTerminator());
+	int64_t minCase = getSwitchMinCase(si);
+	const BasicBlock* dest=si->getSuccessor(branchId);
+	//All the cases with the same destination share the code
+	for(SwitchInst::ConstCaseIt it=si->case_begin();it!=si->case_end();++it)
+	{
+		if(it.getCaseSuccessor()==dest)
+			writer->stream << "case " << getSwitchCaseValue(it.getCaseValue()) - minCase << ':';
+	}
+	writer->stream << '{' << NewLine;
+}
+
+void CheerpRenderInterface::renderDefaultBlockBegin()
+{
+	writer->stream << "default:{" << NewLine;
+}
+
 void CheerpRenderInterface::renderBlockEnd()
 {
 	writer->stream << '}' << NewLine;
@@ -2662,12 +3349,14 @@ void CheerpRenderInterface::renderBlockPrologue(const void* privateBlockTo, cons
 	const BasicBlock* bbTo=(const BasicBlock*)privateBlockTo;
 	const BasicBlock* bbFrom=(const BasicBlock*)privateBlockFrom;
 	writer->compilePHIOfBlockFromOtherBlock(bbTo, bbFrom);
+	writer->compileEdgeCounter(bbFrom, bbTo);
 }
 
-bool CheerpRenderInterface::hasBlockPrologue(const void* privateBlockTo) const
+bool CheerpRenderInterface::hasBlockPrologue(const void* privateBlockTo, const void* privateBlockFrom) const
 {
 	const BasicBlock* bbTo=(const BasicBlock*)privateBlockTo;
-	return bbTo->getFirstNonPHI()!=&bbTo->front();
+	const BasicBlock* bbFrom=(const BasicBlock*)privateBlockFrom;
+	return bbTo->getFirstNonPHI()!=&bbTo->front() || writer->hasEdgeCounter(bbFrom, bbTo);
 }
 
 void CheerpRenderInterface::renderWhileBlockBegin()
@@ -2719,20 +3408,109 @@ void CheerpRenderInterface::renderContinue(int labelId)
 
 void CheerpRenderInterface::renderLabel(int labelId)
 {
+	writer->countConstruct(SizeReport::LABEL_ASSIGNMENT);
 	writer->stream << "label=" << labelId << ';' << NewLine;
 }
 
 void CheerpRenderInterface::renderIfOnLabel(int labelId, bool first)
 {
+	writer->countConstruct(SizeReport::LABEL_CHECK);
 	if(first==false)
 		writer->stream << "else ";
 	writer->stream << "if(label===" << labelId << "){" << NewLine;
 }
 
+void CheerpRenderInterface::renderSwitchOnLabel()
+{
+	writer->stream << "switch(label|0){" << NewLine;
+}
+
+void CheerpRenderInterface::renderCaseOnLabel(int labelId)
+{
+	writer->countConstruct(SizeReport::LABEL_CHECK);
+	writer->stream << "case " << labelId << ":{" << NewLine;
+}
+
+bool CheerpWriter::hasEdgeCounter(const BasicBlock* from, const BasicBlock* to) const
+{
+	return currentCounters && currentCounters->getEdgeCounter(from, to) >= 0;
+}
+
+void CheerpWriter::compileEdgeCounter(const BasicBlock* from, const BasicBlock* to)
+{
+	if(!hasEdgeCounter(from, to))
+		return;
+	stream << "cheerpProfile[" << currentCounterBase+currentCounters->getEdgeCounter(from, to) << "]++;" << NewLine;
+}
+
+void CheerpWriter::compileProfileCounters()
+{
+	uint32_t numCounters = 0;
+	std::vector<std::pair<const Function*, uint32_t>> functions;
+	for ( const Function & F : module.getFunctionList() )
+	{
+		if (F.empty())
+			continue;
+		uint32_t n = ProfileCounters(F).getNumCounters();
+		profileCounterBase.insert(std::make_pair(&F, numCounters));
+		functions.push_back(std::make_pair(&F, n));
+		numCounters += n;
+	}
+	stream << "var cheerpProfile=new Uint32Array(" << numCounters << ");" << NewLine;
+	stream << "function cheerpDumpProfile(){" << NewLine;
+	stream << "var n=[";
+	for(uint32_t i=0;i<functions.size();i++)
+	{
+		if(i!=0)
+			stream << ',';
+		stream << '"' << functions[i].first->getName() << '"';
+	}
+	stream << "];" << NewLine << "var c=[";
+	for(uint32_t i=0;i<functions.size();i++)
+	{
+		if(i!=0)
+			stream << ',';
+		stream << functions[i].second;
+	}
+	stream << "];" << NewLine;
+	stream << "var s='',k=0;" << NewLine;
+	stream << "for(var i=0;i<n.length;i++){" << NewLine;
+	stream << "s+=n[i]+' '+c[i]+'\\n';" << NewLine;
+	stream << "for(var j=0;j<c[i];j++)s+=cheerpProfile[k++]+'\\n';" << NewLine;
+	stream << "s+='\\n';" << NewLine;
+	stream << '}' << NewLine;
+	stream << "return s;" << NewLine;
+	stream << '}' << NewLine;
+	stream << "if(typeof process!=='undefined'&&typeof require!=='undefined')";
+	stream << "process.on('exit',function(){require('fs').writeFileSync('cheerp.profdata',cheerpDumpProfile());});" << NewLine;
+}
+
 void CheerpWriter::compileMethod(const Function& F)
 {
 	currentFun = &F;
-	stream << "function " << namegen.getName(&F) << '(';
+	std::unique_ptr<ProfileCounters> counters;
+	if(instrument || profile)
+		counters.reset(new ProfileCounters(F));
+	if(instrument)
+	{
+		currentCounters = counters.get();
+		currentCounterBase = profileCounterBase.at(&F);
+	}
+	const std::vector<uint64_t>* profileCounts = profile ? profile->getCounters(F, *counters) : NULL;
+	stream << "function ";
+	if(sourceMapGenerator)
+	{
+		// Any location in the function leads to its definition
+		for(const_inst_iterator I=inst_begin(F),IE=inst_end(F);I!=IE;++I)
+		{
+			if(!I->getDebugLoc().isUnknown())
+			{
+				sourceMapGenerator->setFunctionName(I->getDebugLoc(), stream.getColumn());
+				break;
+			}
+		}
+	}
+	stream << namegen.getName(&F) << '(';
 	const Function::const_arg_iterator A=F.arg_begin();
 	const Function::const_arg_iterator AE=F.arg_end();
 	for(Function::const_arg_iterator curArg=A;curArg!=AE;++curArg)
@@ -2751,26 +3529,48 @@ void CheerpWriter::compileMethod(const Function& F)
 	else
 	{
 		//TODO: Support exceptions
-		Function::const_iterator B=F.begin();
-		Function::const_iterator BE=F.end();
+		std::vector<const BasicBlock*> orderedBlocks;
+		for(const BasicBlock& BB: F)
+		{
+			if(!BB.isLandingPad())
+				orderedBlocks.push_back(&BB);
+		}
+		uint64_t entryCount = profileCounts ? (*profileCounts)[counters->getBlockCounter(&F.getEntryBlock())] : 0;
+		auto getBlockCount = [&](const BasicBlock* BB) { return (*profileCounts)[counters->getBlockCounter(BB)]; };
+		//The relooper visits the blocks, and the branches of each block, in id order.
+		//Give the lower ids to the hottest blocks, so that their code comes first. The entry block is always the first.
+		if(entryCount)
+		{
+			std::stable_sort(orderedBlocks.begin()+1, orderedBlocks.end(),
+				[&](const BasicBlock* a, const BasicBlock* b) { return getBlockCount(a) > getBlockCount(b); });
+		}
 		//First run, create the corresponding relooper blocks
 		std::map<const BasicBlock*, /*relooper::*/Block*> relooperMap;
 		int BlockId = 0;
-		for(;B!=BE;++B)
+		for(const BasicBlock* BB: orderedBlocks)
 		{
-			if(B->isLandingPad())
-				continue;
 			//Decide if this block should be duplicated instead
 			//of actually directing the control flow to reach it
 			//Currently we just check if the block ends with a return
 			//and its small enough. This should simplify some control flows.
-			bool isSplittable = B->size()<3 && isa<ReturnInst>(B->getTerminator());
-			Block* rlBlock = new Block(&(*B), isSplittable, BlockId++);
-			relooperMap.insert(make_pair(&(*B),rlBlock));
+			//With a profile cold blocks are never duplicated, while hot ones are duplicated up to a larger size
+			//to give straight-line code to the hot paths.
+			bool isSplittable = isa<ReturnInst>(BB->getTerminator());
+			if(!entryCount)
+				isSplittable &= BB->size()<3;
+			else if(getBlockCount(BB) >= entryCount)
+				isSplittable &= BB->size()<8;
+			else
+				isSplittable &= getBlockCount(BB) && BB->size()<3;
+			Block* rlBlock = new Block(BB, isSplittable, BlockId++);
+			if(const SwitchInst* si=dyn_cast<SwitchInst>(BB->getTerminator()))
+				rlBlock->IsSwitch = isJumpTableSwitch(si);
+			rlBlock->Size = BB->size();
+			relooperMap.insert(make_pair(BB,rlBlock));
 		}
 
-		B=F.begin();
-		BE=F.end();
+		Function::const_iterator B=F.begin();
+		Function::const_iterator BE=F.end();
 		//Second run, add the branches
 		for(;B!=BE;++B)
 		{
@@ -2825,19 +3625,16 @@ void CheerpWriter::compileMethod(const Function& F)
 			}
 		}
 
-		B=F.begin();
-		BE=F.end();
 		//Third run, add the block to the relooper and run it
-		Relooper* rl=new Relooper(BlockId);
-		for(;B!=BE;++B)
-		{
-			if(B->isLandingPad())
-				continue;
-			rl->AddBlock(relooperMap[&(*B)]);
-		}
+		Relooper* rl=new Relooper(BlockId, relooperSplitBudget);
+		for(const BasicBlock* BB: orderedBlocks)
+			rl->AddBlock(relooperMap[BB]);
 		rl->Calculate(relooperMap[&F.getEntryBlock()]);
 		if(rl->needsLabel())
+		{
+			countConstruct(SizeReport::LABEL_VARIABLE);
 			stream << "var label=0;" << NewLine;
+		}
 		
 		CheerpRenderInterface ri(this, NewLine);
 		rl->Render(&ri);
@@ -2845,6 +3642,136 @@ void CheerpWriter::compileMethod(const Function& F)
 
 	stream << '}' << NewLine;
 	currentFun = NULL;
+	currentCounters = NULL;
+}
+
+void CheerpWriter::compileMethods()
+{
+	// Source maps are generated line by line while writing, so we can only compile serially and without the cache
+	if((numJobs <= 1 && !functionCache) || sourceMapGenerator)
+	{
+		for ( const Function & F : module.getFunctionList() )
+			if (!F.empty() && !globalDeps.secondaryFunctions().count(&F))
+			{
+#ifdef CHEERP_DEBUG_POINTERS
+				dumpAllPointers(F, PA);
+#endif //CHEERP_DEBUG_POINTERS
+				uint64_t start = stream.tell();
+				compileMethod(F);
+				reportSize(SizeReport::FUNCTION, F.getName(), start);
+			}
+		return;
+	}
+
+	std::vector<const Function*> functions;
+	for ( const Function & F : module.getFunctionList() )
+		if (!F.empty() && !globalDeps.secondaryFunctions().count(&F))
+		{
+#ifdef CHEERP_DEBUG_POINTERS
+			dumpAllPointers(F, PA);
+#endif //CHEERP_DEBUG_POINTERS
+			functions.push_back(&F);
+		}
+
+	// Every function is compiled in its own buffer, the buffers are then
+	// concatenated in module order so that the output is deterministic
+	std::vector<std::string> outputs(functions.size());
+	std::atomic<uint32_t> nextFunction(0);
+	auto compileFunctions = [&]()
+	{
+		std::string buffer;
+		llvm::raw_string_ostream bufferStream(buffer);
+		CheerpWriter worker(*this, bufferStream);
+		for(uint32_t i = nextFunction++; i < functions.size(); i = nextFunction++)
+		{
+			std::string cacheKey;
+			if(functionCache)
+			{
+				cacheKey = worker.getFunctionCacheKey(*functions[i]);
+				// The constructs of cached functions would not be counted, so they are compiled again for the size report.
+				// The counters of the time report only cover the functions compiled in this run.
+				if(!(sizeReport && sizeReport->attributesEntities()) && functionCache->lookup(cacheKey, outputs[i]))
+				{
+					NumCachedFunctions++;
+					continue;
+				}
+			}
+			worker.compileMethod(*functions[i]);
+			bufferStream.flush();
+			outputs[i].swap(buffer);
+			if(functionCache)
+				functionCache->store(cacheKey, outputs[i]);
+		}
+	};
+#if LLVM_ENABLE_THREADS
+	std::vector<std::thread> threads;
+	for(uint32_t i = 1; i < numJobs; i++)
+		threads.emplace_back(compileFunctions);
+	compileFunctions();
+	for(std::thread& t: threads)
+		t.join();
+#else
+	compileFunctions();
+#endif
+
+	for(uint32_t i = 0; i < functions.size(); i++)
+	{
+		if(sizeReport)
+			sizeReport->addEntity(SizeReport::FUNCTION, functions[i]->getName(), outputs[i].size());
+		stream << StringRef(outputs[i]);
+	}
+}
+
+void CheerpWriter::compileSecondaryChunk()
+{
+	std::string buffer;
+	llvm::raw_string_ostream bufferStream(buffer);
+	CheerpWriter worker(*this, bufferStream);
+	worker.stream << "(function(){" << worker.NewLine;
+	for ( const Function & F : module.getFunctionList() )
+		if (globalDeps.secondaryFunctions().count(&F))
+		{
+			uint64_t start = worker.stream.tell();
+			worker.compileMethod(F);
+			worker.reportSize(SizeReport::SECONDARY_FUNCTION, F.getName(), start);
+		}
+	worker.stream << "return {";
+	for ( const Function * F : globalDeps.secondaryEntryPoints() )
+	{
+		if ( F != globalDeps.secondaryEntryPoints().front() )
+			worker.stream << ',';
+		worker.stream << namegen.getName(F) << ':' << namegen.getName(F);
+	}
+	worker.stream << "};" << worker.NewLine << "})()" << worker.NewLine;
+	bufferStream.flush();
+	*secondaryChunk << buffer;
+}
+
+void CheerpWriter::compileSecondaryChunkLoader()
+{
+	// The chunk is evaluated with a direct eval so that it can access the globals of this scope
+	stream << "var cheerpChunkLoaded=false;" << NewLine;
+	stream << "function cheerpLoadChunk(){" << NewLine;
+	stream << "if(cheerpChunkLoaded)return;" << NewLine;
+	stream << "cheerpChunkLoaded=true;" << NewLine;
+	stream << "var __src__;" << NewLine;
+	stream << "if(typeof XMLHttpRequest!=='undefined'){" << NewLine;
+	stream << "var __xhr__=new XMLHttpRequest();" << NewLine;
+	stream << "__xhr__.open('GET','" << secondaryChunkName << "',false);" << NewLine;
+	stream << "__xhr__.send();" << NewLine;
+	stream << "__src__=__xhr__.responseText;" << NewLine;
+	stream << "}else{" << NewLine;
+	stream << "__src__=require('fs').readFileSync(__dirname+'/" << secondaryChunkName << "','utf8');" << NewLine;
+	stream << '}' << NewLine;
+	stream << "var __chunk__=eval(__src__);" << NewLine;
+	for ( const Function * F : globalDeps.secondaryEntryPoints() )
+		stream << namegen.getName(F) << "=__chunk__." << namegen.getName(F) << ';' << NewLine;
+	stream << '}' << NewLine;
+	for ( const Function * F : globalDeps.secondaryEntryPoints() )
+	{
+		StringRef name = namegen.getName(F);
+		stream << "function " << name << "(){cheerpLoadChunk();return " << name << ".apply(null,arguments);}" << NewLine;
+	}
 }
 
 void CheerpWriter::compileGlobal(const GlobalVariable& G)
@@ -2856,7 +3783,13 @@ void CheerpWriter::compileGlobal(const GlobalVariable& G)
 		//placeholders for JS calls
 		return;
 	}
-	stream  << "var " << namegen.getName(&G);
+	bool isLazy = useLazyGlobals && globalDeps.lazyGlobals().count(&G);
+	//A lazy global is a function which computes the value on the first call
+	//and then replaces itself with a function returning the cached value
+	if(isLazy)
+		stream << "function " << namegen.getName(&G) << "(){var __v__";
+	else
+		stream  << "var " << namegen.getName(&G);
 
 	if(G.hasInitializer())
 	{
@@ -2865,6 +3798,7 @@ void CheerpWriter::compileGlobal(const GlobalVariable& G)
 
 		if(PA.getPointerKind(&G) == REGULAR)
 		{
+			countConstruct(SizeReport::POINTER_OBJECT);
 			stream << "{d:[";
 			if(C->getType()->isPointerTy())
 				compilePointerAs(C, PA.getPointerKindForStoredType(C->getType()));
@@ -2881,6 +3815,8 @@ void CheerpWriter::compileGlobal(const GlobalVariable& G)
 		}
 	}
 	stream << ';' << NewLine;
+	if(isLazy)
+		stream << namegen.getName(&G) << "=function(){return __v__;};return __v__;}" << NewLine;
 
 	compiledGVars.insert(&G);
 	if(G.hasInitializer())
@@ -2888,8 +3824,11 @@ void CheerpWriter::compileGlobal(const GlobalVariable& G)
 		if(StructType* st=dyn_cast<StructType>(G.getType()->getPointerElementType()))
 		{
 			//TODO: Verify that it makes sense to assume struct with no name has no bases
+			// The struct constructors already create the downcast array
+			const Constant* init = G.getInitializer();
+			bool usedConstructor = useStructConstructor(st) && (isa<ConstantStruct>(init) || isa<ConstantAggregateZero>(init));
 			if(st->hasName() && module.getNamedMetadata(Twine(st->getName(),"_bases")) &&
-				globalDeps.classesWithBaseInfo().count(st))
+				globalDeps.classesWithBaseInfo().count(st) && !usedConstructor)
 			{
 				stream << "create" << namegen.getTypeName(st) << '(';
 				compilePointerAs(&G, COMPLETE_OBJECT);
@@ -2966,7 +3905,7 @@ void CheerpWriter::compileGlobal(const GlobalVariable& G)
 
 void CheerpWriter::compileNullPtrs()
 {
-	stream << "var aSlot=null;var nullArray=[null];var nullObj={d:nullArray,o:0};" << NewLine;
+	stream << "var aSlot=null;var oSlot=0;var nullArray=[null];var nullObj={d:nullArray,o:0};" << NewLine;
 }
 
 void CheerpWriter::compileCreateClosure()
@@ -2979,6 +3918,82 @@ void CheerpWriter::compileHandleVAArg()
 	stream << "function handleVAArg(ptr){var ret=ptr.d[ptr.o];ptr.o++;return ret;}" << NewLine;
 }
 
+void CheerpWriter::compileMemCopyHelper()
+{
+	// Short copies use a loop, which does not allocate a subarray. The direction of the loop follows memmove semantics
+	stream << "function cheerpMemCopy(d,o,s,p,n){" << NewLine;
+	stream << "if(n>" << std::max(memcpyLoopLimit, 1u) << ")d.set(s.subarray(p,p+n),o);" << NewLine;
+	stream << "else if(d!==s||o<=p)for(var i=0;i<n;i++)d[o+i]=s[p+i];" << NewLine;
+	stream << "else for(var i=n-1;i>=0;i--)d[o+i]=s[p+i];}" << NewLine;
+}
+
+void CheerpWriter::compileHeapAllocator()
+{
+	// Chunks are powers of 2 of at least 8 bytes, so that every typed array view is aligned
+	// Allocations larger than an arena get a buffer of their own, which is still reused after being freed
+	stream << "var cheerpHeapArena=null;var cheerpHeapTop=0;var cheerpHeapFreeBuffers=[];var cheerpHeapFreeOffsets=[];" << NewLine;
+	stream << "function cheerpHeapSizeClass(b){return b<=8?3:32-Math.clz32(b-1);}" << NewLine;
+	stream << "function cheerpHeapAlloc(C,n){" << NewLine;
+	stream << "var c=cheerpHeapSizeClass(C===DataView?n:n*C.BYTES_PER_ELEMENT);var s=1<<c;var a=null;var o=0;" << NewLine;
+	stream << "var l=cheerpHeapFreeBuffers[c];" << NewLine;
+	stream << "if(l!==undefined&&l.length>0){a=l.pop();o=cheerpHeapFreeOffsets[c].pop();new Uint8Array(a,o,s).fill(0);}" << NewLine;
+	stream << "else if(s>=" << HeapArenaSize << "){a=new ArrayBuffer(s);a.cheerpHeap=1;}" << NewLine;
+	stream << "else{" << NewLine;
+	stream << "if(cheerpHeapArena===null||cheerpHeapTop+s>" << HeapArenaSize << "){cheerpHeapArena=new ArrayBuffer(" << HeapArenaSize << ");cheerpHeapArena.cheerpHeap=1;cheerpHeapTop=0;}" << NewLine;
+	stream << "a=cheerpHeapArena;o=cheerpHeapTop;cheerpHeapTop+=s;" << NewLine;
+	stream << '}' << NewLine;
+	stream << "return new C(a,o,n);}" << NewLine;
+	stream << "function cheerpHeapFree(p){" << NewLine;
+	stream << "if(p===null||p===undefined||p.buffer===undefined||p.buffer.cheerpHeap!==1)return;" << NewLine;
+	stream << "var c=cheerpHeapSizeClass(p.byteLength);" << NewLine;
+	stream << "if(cheerpHeapFreeBuffers[c]===undefined){cheerpHeapFreeBuffers[c]=[];cheerpHeapFreeOffsets[c]=[];}" << NewLine;
+	stream << "cheerpHeapFreeBuffers[c].push(p.buffer);cheerpHeapFreeOffsets[c].push(p.byteOffset);}" << NewLine;
+}
+
+bool CheerpWriter::needByteLayoutViews() const
+{
+	for (const Function & F : module.getFunctionList())
+	{
+		for (const BasicBlock & BB : F)
+		{
+			for (const Instruction & I : BB)
+			{
+				const Value* ptrOp;
+				if (const LoadInst* LI = dyn_cast<LoadInst>(&I))
+					ptrOp = LI->getPointerOperand();
+				else if (const StoreInst* SI = dyn_cast<StoreInst>(&I))
+					ptrOp = SI->getPointerOperand();
+				else
+					continue;
+				if (PA.getPointerKind(ptrOp) != BYTE_LAYOUT)
+					continue;
+				const char* viewName;
+				uint32_t elementSize;
+				if (getByteLayoutView(ptrOp->getType()->getPointerElementType(), viewName, elementSize) &&
+					getByteLayoutOffsetAlignment(ptrOp) >= elementSize)
+					return true;
+			}
+		}
+	}
+	return false;
+}
+
+void CheerpWriter::compileByteLayoutViews()
+{
+	// Views are created lazily and cached on the DataView. Typed arrays use the platform byte order,
+	// which is little endian like the DataView accesses on every supported engine.
+	// DataViews always start at offsets aligned to 8, so every aligned access is aligned in the view too
+	const char* arrays[] = { "Int8Array", "Int16Array", "Int32Array", "Float32Array", "Float64Array" };
+	const char* names[] = { "cheerpViewInt8", "cheerpViewInt16", "cheerpViewInt32", "cheerpViewFloat32", "cheerpViewFloat64" };
+	const char* keys[] = { "i8", "i16", "i32", "f32", "f64" };
+	const uint32_t shifts[] = { 0, 1, 2, 2, 3 };
+	for(uint32_t i = 0; i < 5; i++)
+	{
+		stream << "function " << names[i] << "(d){var v=d." << keys[i] << ";if(v===undefined){v=new " << arrays[i];
+		stream << "(d.buffer,d.byteOffset,d.byteLength>>" << shifts[i] << ");d." << keys[i] << "=v;}return v;}" << NewLine;
+	}
+}
+
 void CheerpWriter::makeJS()
 {
 	if(sourceMapGenerator)
@@ -2988,35 +4003,118 @@ void CheerpWriter::makeJS()
 
 	compileClassesExportedToJs();
 	compileNullPtrs();
+	collectBinaryConstants();
+	uint64_t start = stream.tell();
+	if ( !binaryDataOffsets.empty() )
+		compileBinaryDataLoader();
+	reportSize(SizeReport::HELPER, "binaryDataLoader", start);
+	start = stream.tell();
+	if ( instrument )
+		compileProfileCounters();
+	reportSize(SizeReport::HELPER, "profileCounters", start);
 	
-	for ( const Function & F : module.getFunctionList() )
-		if (!F.empty())
-		{
-#ifdef CHEERP_DEBUG_POINTERS
-			dumpAllPointers(F, PA);
-#endif //CHEERP_DEBUG_POINTERS
-			compileMethod(F);
-		}
+	compileMethods();
+
+	if ( secondaryChunk )
+	{
+		compileSecondaryChunk();
+		start = stream.tell();
+		compileSecondaryChunkLoader();
+		reportSize(SizeReport::HELPER, "secondaryChunkLoader", start);
+	}
 	
 	for ( const GlobalVariable & GV : module.getGlobalList() )
+	{
+		start = stream.tell();
 		compileGlobal(GV);
+		reportSize(SizeReport::GLOBAL, GV.getName(), start);
+	}
 
 	for ( StructType * st : globalDeps.classesWithBaseInfo() )
+	{
+		start = stream.tell();
 		compileClassType(st);
+		reportSize(SizeReport::CLASS_TYPE, st->getName(), start);
+	}
+
+	if ( useStructConstructors )
+	{
+		// Sort the types by name to make the output deterministic
+		std::vector<StructType*> structTypes;
+		for ( StructType * st : globalDeps.classesUsed() )
+			if ( useStructConstructor(st) )
+				structTypes.push_back(st);
+		std::sort(structTypes.begin(), structTypes.end(), [this](StructType* a, StructType* b)
+			{
+				return namegen.getTypeName(a) < namegen.getTypeName(b);
+			});
+		for ( StructType * st : structTypes )
+		{
+			start = stream.tell();
+			compileStructConstructor(st);
+			reportSize(SizeReport::STRUCT_CONSTRUCTOR, st->getName(), start);
+		}
+	}
 
 	for ( Type * st : globalDeps.dynAllocArrays() )
+	{
+		start = stream.tell();
 		compileArrayClassType(st);
+		if ( sizeReport && sizeReport->attributesEntities() )
+		{
+			// Only structs have a name, the other types are identified by their LLVM syntax
+			std::string typeName;
+			if ( st->isStructTy() && cast<StructType>(st)->hasName() )
+				typeName = st->getStructName();
+			else
+			{
+				llvm::raw_string_ostream typeStream(typeName);
+				st->print(typeStream);
+			}
+			reportSize(SizeReport::ARRAY_CLASS_TYPE, typeName, start);
+		}
+	}
 
+	start = stream.tell();
 	if ( globalDeps.needCreatePointerArray() )
 		compileArrayPointerType();
+	reportSize(SizeReport::HELPER, "createPointerArray", start);
 	
 	//Compile the closure creation helper
+	start = stream.tell();
 	if ( globalDeps.needCreateClosure() )
 		compileCreateClosure();
+	reportSize(SizeReport::HELPER, "createClosure", start);
 	
 	//Compile handleVAArg if needed
+	start = stream.tell();
 	if( globalDeps.needHandleVAArg() )
 		compileHandleVAArg();
+	reportSize(SizeReport::HELPER, "handleVAArg", start);
+
+	//Compile the base64 decoder of binary constants if needed
+	start = stream.tell();
+	if( needBase64Decoder )
+		compileBase64Decoder();
+	reportSize(SizeReport::HELPER, "base64Decoder", start);
+
+	//Compile the memcpy helper if needed
+	start = stream.tell();
+	if( globalDeps.needMemCopy() )
+		compileMemCopyHelper();
+	reportSize(SizeReport::HELPER, "memCopy", start);
+
+	//Compile the arena heap allocator if needed
+	start = stream.tell();
+	if( useArenaHeap )
+		compileHeapAllocator();
+	reportSize(SizeReport::HELPER, "heapAllocator", start);
+
+	//Compile the typed array views of DataViews if needed
+	start = stream.tell();
+	if( needByteLayoutViews() )
+		compileByteLayoutViews();
+	reportSize(SizeReport::HELPER, "byteLayoutViews", start);
 	
 	//Call constructors
 	for (const Function * F : globalDeps.constructors() )
@@ -0,0 +1,101 @@
+//===-- CompressedStream.cpp - Cheerp gzip compressed output --------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/CompressedStream.h"
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+namespace cheerp
+{
+
+// Size of the buffers which are handed to the compression thread
+static const size_t ChunkSize = 1 << 20;
+// Maximum number of buffers waiting to be compressed
+static const size_t MaxPendingChunks = 8;
+
+CompressedOutputStream::CompressedOutputStream(llvm::raw_ostream& output):
+	compressor(output, zlib::DefaultCompression), status(zlib::StatusOK), pos(0), closed(false)
+{
+	SetBufferSize(ChunkSize);
+#if LLVM_ENABLE_THREADS
+	compressionThread = std::thread(&CompressedOutputStream::compressPendingChunks, this);
+#endif
+}
+
+CompressedOutputStream::~CompressedOutputStream()
+{
+	if(!closed)
+		close();
+}
+
+void CompressedOutputStream::compressChunk(StringRef chunk)
+{
+	if(status == zlib::StatusOK)
+		status = compressor.compress(chunk);
+}
+
+void CompressedOutputStream::write_impl(const char* ptr, size_t size)
+{
+	assert(!closed);
+	pos += size;
+#if LLVM_ENABLE_THREADS
+	std::unique_lock<std::mutex> lock(pendingChunksMutex);
+	chunkRemoved.wait(lock, [this]() { return pendingChunks.size() < MaxPendingChunks; });
+	pendingChunks.emplace_back(ptr, size);
+	lock.unlock();
+	chunkAdded.notify_one();
+#else
+	compressChunk(StringRef(ptr, size));
+#endif
+}
+
+#if LLVM_ENABLE_THREADS
+void CompressedOutputStream::compressPendingChunks()
+{
+	std::string chunk;
+	while(true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pendingChunksMutex);
+			chunkAdded.wait(lock, [this]() { return !pendingChunks.empty() || closed; });
+			// All the chunks are compressed before stopping
+			if(pendingChunks.empty())
+				return;
+			chunk.swap(pendingChunks.front());
+			pendingChunks.pop_front();
+		}
+		chunkRemoved.notify_one();
+		compressChunk(chunk);
+	}
+}
+#endif
+
+void CompressedOutputStream::close()
+{
+	flush();
+#if LLVM_ENABLE_THREADS
+	{
+		std::lock_guard<std::mutex> lock(pendingChunksMutex);
+		closed = true;
+	}
+	chunkAdded.notify_one();
+	compressionThread.join();
+#else
+	closed = true;
+#endif
+	if(status == zlib::StatusOK)
+		status = compressor.finish();
+	if(status != zlib::StatusOK)
+		llvm::report_fatal_error("Cannot compress the output", false);
+}
+
+}
@@ -14,8 +14,10 @@
 #include "llvm/Cheerp/GlobalDepsAnalyzer.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/IR/Function.h"
+#include <algorithm>
 #include <functional>
 #include <set>
+#include <unordered_set>
 
 using namespace llvm;
 
@@ -111,17 +113,37 @@ struct JSSymbols
 	}
 };
 
+/**
+ * The local names of the stable mode are chosen independently for each function,
+ * they must not hide any of the global names
+ */
+struct StableLocalJSSymbols: public JSSymbols
+{
+	const std::unordered_set<std::string>* globalNames;
+	explicit StableLocalJSSymbols(const std::unordered_set<std::string>& g):globalNames(&g)
+	{
+	}
+
+	template< class String >
+	bool is_valid( String & s ) const
+	{
+		return JSSymbols::is_valid(s) && !globalNames->count(std::string(s.begin(), s.end()));
+	}
+};
+
 NameGenerator::NameGenerator(const Module& M, const GlobalDepsAnalyzer& gda, const Registerize& r,
-				const PointerAnalyzer& PA, bool makeReadableNames):registerize(r), PA(PA)
+				const PointerAnalyzer& PA, bool makeReadableNames, bool makeStableNames):registerize(r), PA(PA)
 {
 	if ( makeReadableNames )
 		generateReadableNames(M, gda);
+	else if ( makeStableNames )
+		generateStableNames(M, gda);
 	else
 		generateCompressedNames(M, gda);
 	generateTypeNames(gda);
 }
 
-llvm::StringRef NameGenerator::getNameForEdge(const llvm::Value* v) const
+llvm::StringRef NameGenerator::getNameForEdge(const llvm::Value* v, const EdgeContext& edgeContext) const
 {
 	assert(!edgeContext.isNull());
 	if (const Instruction* I=dyn_cast<Instruction>(v))
@@ -183,45 +205,80 @@ SmallString< 4 > NameGenerator::filterLLVMName(StringRef s, NAME_FILTER_MODE fil
 	return ans;
 }
 
-void NameGenerator::generateCompressedNames(const Module& M, const GlobalDepsAnalyzer& gda)
+// Class to handle giving names to temporary variables needed for recursively dependent PHIs
+class NameGenerator::CompressedPHIHandler: public EndOfBlockPHIHandler
 {
-	typedef std::pair<unsigned, const Value *> useValuePair;
-	typedef std::pair<unsigned, std::vector<const Value *> > useValuesPair;
-	typedef std::vector<useValuesPair> useValuesVec;
-	typedef std::pair<unsigned, std::vector<InstOnEdge> > useInstsOnEdgePair;
-	typedef std::vector<useInstsOnEdgePair> useInstsOnEdgeVec;
-        
-	// Class to handle giving names to temporary variables needed for recursively dependent PHIs
-	class CompressedPHIHandler: public EndOfBlockPHIHandler
+public:
+	CompressedPHIHandler(const BasicBlock* f, const BasicBlock* t, NameGenerator& n, useInstsOnEdgeVec& a ):
+		EndOfBlockPHIHandler(n.PA), fromBB(f), toBB(t), namegen(n), allTmpPHIs(a), nextIndex(0)
 	{
-	public:
-		CompressedPHIHandler(const BasicBlock* f, const BasicBlock* t, NameGenerator& n, useInstsOnEdgeVec& a ):
-			EndOfBlockPHIHandler(n.PA), fromBB(f), toBB(t), namegen(n), allTmpPHIs(a), nextIndex(0)
-		{
-		}
-	private:
-		const BasicBlock* fromBB;
-		const BasicBlock* toBB;
-		NameGenerator& namegen;
-		useInstsOnEdgeVec& allTmpPHIs;
-		uint32_t nextIndex;
-		void handleRecursivePHIDependency(const Instruction* phi) override
+	}
+private:
+	const BasicBlock* fromBB;
+	const BasicBlock* toBB;
+	NameGenerator& namegen;
+	useInstsOnEdgeVec& allTmpPHIs;
+	uint32_t nextIndex;
+	void handleRecursivePHIDependency(const Instruction* phi) override
+	{
+		uint32_t regId=namegen.registerize.getRegisterId(phi);
+		// We don't know exactly how many times the tmpphi is going to be used in this edge
+		// but assume 1. We increment the usage count for the first not already used tmpphi
+		// and add the InstOnEdge to its list
+		if (nextIndex >= allTmpPHIs.size())
+			allTmpPHIs.resize(nextIndex+1);
+		allTmpPHIs[nextIndex].first++;
+		allTmpPHIs[nextIndex].second.emplace_back(InstOnEdge(fromBB, toBB, regId));
+		nextIndex++;
+	}
+	void handlePHI(const Instruction* phi, const Value* incoming) override
+	{
+		// Nothing to do here, we have already given names to all PHIs
+	}
+};
+
+void NameGenerator::collectLocalValues(const Function& f, useValuesVec& thisFunctionLocals, useInstsOnEdgeVec& allTmpPHIs)
+{
+	// Insert all the instructions
+	for (const BasicBlock & bb : f)
+	{
+		for (const Instruction & I : bb)
 		{
-			uint32_t regId=namegen.registerize.getRegisterId(phi);
-			// We don't know exactly how many times the tmpphi is going to be used in this edge
-			// but assume 1. We increment the usage count for the first not already used tmpphi
-			// and add the InstOnEdge to its list
-			if (nextIndex >= allTmpPHIs.size())
-				allTmpPHIs.resize(nextIndex+1);
-			allTmpPHIs[nextIndex].first++;
-			allTmpPHIs[nextIndex].second.emplace_back(InstOnEdge(fromBB, toBB, regId));
-			nextIndex++;
+			if ( needsName(I, PA) )
+			{
+				uint32_t registerId = registerize.getRegisterId(&I);
+				if (registerId >= thisFunctionLocals.size())
+					thisFunctionLocals.resize(registerId+1);
+				useValuesPair& regData = thisFunctionLocals[registerId];
+				// Add the uses for this instruction to the total count for the register
+				regData.first+=I.getNumUses();
+				// Add the instruction itself to the list of istructions
+				regData.second.push_back(&I);
+			}
 		}
-		void handlePHI(const Instruction* phi, const Value* incoming) override
+		// Handle the special names required for the edges between blocks
+		const TerminatorInst* term=bb.getTerminator();
+		for(uint32_t i=0;i<term->getNumSuccessors();i++)
 		{
-			// Nothing to do here, we have already given names to all PHIs
+			const BasicBlock* succBB=term->getSuccessor(i);
+			CompressedPHIHandler(&bb, succBB, *this, allTmpPHIs).runOnEdge(registerize, &bb, succBB);
 		}
-	};
+	}
+
+	uint32_t currentArgPos=thisFunctionLocals.size();
+	thisFunctionLocals.resize(currentArgPos+f.arg_size());
+	// Insert the arguments
+	for ( auto arg_it = f.arg_begin(); arg_it != f.arg_end(); ++arg_it, currentArgPos++ )
+	{
+		thisFunctionLocals[currentArgPos].first = f.getNumUses();
+		thisFunctionLocals[currentArgPos].second.push_back( arg_it );
+	}
+}
+
+void NameGenerator::generateCompressedNames(const Module& M, const GlobalDepsAnalyzer& gda)
+{
+	typedef std::pair<unsigned, const Value *> useValuePair;
+
 	/**
 	 * Collect the local values.
 	 * 
@@ -261,50 +318,16 @@ void NameGenerator::generateCompressedNames(const Module& M, const GlobalDepsAna
 
 		// Local values are all stored in registers
 		useValuesVec thisFunctionLocals;
-
-		// Insert all the instructions
-		for (const BasicBlock & bb : f)
-		{
-			for (const Instruction & I : bb)
-			{
-				if ( needsName(I, PA) )
-				{
-					uint32_t registerId = registerize.getRegisterId(&I);
-					if (registerId >= thisFunctionLocals.size())
-						thisFunctionLocals.resize(registerId+1);
-					useValuesPair& regData = thisFunctionLocals[registerId];
-					// Add the uses for this instruction to the total count for the register
-					regData.first+=I.getNumUses();
-					// Add the instruction itself to the list of istructions
-					regData.second.push_back(&I);
-				}
-			}
-			// Handle the special names required for the edges between blocks
-			const TerminatorInst* term=bb.getTerminator();
-			for(uint32_t i=0;i<term->getNumSuccessors();i++)
-			{
-				const BasicBlock* succBB=term->getSuccessor(i);
-				CompressedPHIHandler(&bb, succBB, *this, allTmpPHIs).runOnEdge(registerize, &bb, succBB);
-			}
-		}
-
-		uint32_t currentArgPos=thisFunctionLocals.size();
-		thisFunctionLocals.resize(currentArgPos+f.arg_size());
-		// Insert the arguments
-		for ( auto arg_it = f.arg_begin(); arg_it != f.arg_end(); ++arg_it, currentArgPos++ )
-		{
-			thisFunctionLocals[currentArgPos].first = f.getNumUses();
-			thisFunctionLocals[currentArgPos].second.push_back( arg_it );
-		}
+		collectLocalValues(f, thisFunctionLocals, allTmpPHIs);
+		std::sort(thisFunctionLocals.begin(),thisFunctionLocals.end(), std::greater<useValuesPair>());
 
 		// Resize allLocalValues so that we have empty useValuesPair at the end of the container
 		if ( thisFunctionLocals.size() > allLocalValues.size() )
 			allLocalValues.resize( thisFunctionLocals.size() );
 
-		std::sort(thisFunctionLocals.begin(),thisFunctionLocals.end());
 		auto dst_it = allLocalValues.begin();
 
-		for (auto src_it = thisFunctionLocals.rbegin(); src_it != thisFunctionLocals.rend(); ++src_it, ++dst_it )
+		for (auto src_it = thisFunctionLocals.begin(); src_it != thisFunctionLocals.end(); ++src_it, ++dst_it )
 		{
 			dst_it->first += src_it->first;
 			dst_it->second.insert(dst_it->second.end(), src_it->second.begin(), src_it->second.end());
@@ -365,11 +388,12 @@ void NameGenerator::generateCompressedNames(const Module& M, const GlobalDepsAna
 			(globalsFinished || local_it->first >= global_it->first) &&
 			(tmpPHIsFinished || local_it->first >= tmpphi_it->first))
 		{
-			// Assign this name to all the local values
+			// Assign this name to all the local values, the secondary name is also shared by all of them
+			SmallString<4> primaryName = *name_it;
+			SmallString<4> secondaryName;
 			for ( const Value * v : local_it->second )
 			{
-				namemap.emplace( v, *name_it );
-				StringRef secondaryName;
+				namemap.emplace( v, primaryName );
 				// We need to consume another name to assign the secondary one
 				if(needsSecondaryName(v, PA))
 				{
@@ -398,6 +422,79 @@ void NameGenerator::generateCompressedNames(const Module& M, const GlobalDepsAna
 	}
 }
 
+void NameGenerator::generateStableNames(const Module& M, const GlobalDepsAnalyzer& gda)
+{
+	// The global names only depend on the symbols, like in readable mode
+	std::unordered_set<std::string> globalNames;
+	for (const Function & f : M.getFunctionList() )
+	{
+		auto it = namemap.emplace( &f, filterLLVMName( f.getName(), GLOBAL ) ).first;
+		globalNames.insert( it->second.str() );
+	}
+	for (const GlobalVariable & GV : M.getGlobalList() )
+	{
+		if (TypeSupport::isClientGlobal(&GV) )
+		{
+			demangler_iterator dmg( GV.getName() );
+			assert(*dmg == "client");
+			
+			globalNames.insert( namemap.emplace( &GV, *(++dmg) ).first->second.str() );
+		}
+		else
+			globalNames.insert( namemap.emplace( &GV, filterLLVMName( GV.getName(), GLOBAL ) ).first->second.str() );
+	}
+
+	/**
+	 * The local names only depend on the function itself, so they do not change when other functions are modified.
+	 * Like in compressed mode the most used registers and tmpphis get the shortest names.
+	 */
+	for (const Function & f : M.getFunctionList() )
+	{
+		if ( f.empty() )
+			continue;
+		useValuesVec locals;
+		useInstsOnEdgeVec tmpPHIs;
+		collectLocalValues(f, locals, tmpPHIs);
+		// Registers which do not need a name are empty, ties are broken by the register order
+		locals.erase(std::remove_if(locals.begin(), locals.end(), [](const useValuesPair& p) { return p.second.empty(); }), locals.end());
+		std::stable_sort(locals.begin(), locals.end(),
+			[](const useValuesPair& lhs, const useValuesPair& rhs) { return lhs.first > rhs.first; });
+
+		name_iterator<StableLocalJSSymbols> name_it((StableLocalJSSymbols(globalNames)));
+		useValuesVec::const_iterator local_it = locals.begin();
+		useInstsOnEdgeVec::const_iterator tmpphi_it = tmpPHIs.begin();
+		for ( ; local_it != locals.end() || tmpphi_it != tmpPHIs.end(); ++name_it )
+		{
+			if ( tmpphi_it == tmpPHIs.end() || (local_it != locals.end() && local_it->first >= tmpphi_it->first) )
+			{
+				// Assign this name to all the local values of the register, the secondary name is also shared by all of them
+				SmallString<4> primaryName = *name_it;
+				SmallString<4> secondaryName;
+				for ( const Value * v : local_it->second )
+				{
+					namemap.emplace( v, primaryName );
+					if(needsSecondaryName(v, PA))
+					{
+						if(secondaryName.empty())
+						{
+							++name_it;
+							secondaryName = *name_it;
+						}
+						secondaryNamemap.emplace( v, secondaryName );
+					}
+				}
+				++local_it;
+			}
+			else
+			{
+				for ( const InstOnEdge& i : tmpphi_it->second )
+					edgeNamemap.emplace( i, StringRef(*name_it));
+				++tmpphi_it;
+			}
+		}
+	}
+}
+
 void NameGenerator::generateReadableNames(const Module& M, const GlobalDepsAnalyzer& gda)
 {
 	// Class to handle giving names to temporary variables needed for recursively dependent PHIs
@@ -453,6 +550,14 @@ void NameGenerator::generateReadableNames(const Module& M, const GlobalDepsAnaly
 							StringRef( "tmp" + std::to_string(registerId) ) ).first;
 						regmap.emplace( registerId, it->second );
 					}
+					if ( needsSecondaryName(&I, PA) )
+					{
+						// The secondary names are not shared by registers, the offset is assigned just after the call
+						if ( I.hasName() )
+							secondaryNamemap.emplace( &I, filterLLVMName(I.getName(), LOCAL_SECONDARY) );
+						else
+							secondaryNamemap.emplace( &I, StringRef( "Mtmp" + std::to_string(registerId) ) );
+					}
 				}
 			}
 			// Handle the special names required for the edges between blocks
@@ -522,6 +627,8 @@ bool NameGenerator::needsName(const Instruction & I, const PointerAnalyzer& PA)
 
 bool NameGenerator::needsSecondaryName(const Value* V, const PointerAnalyzer& PA) const
 {
+	if(isOffsetReturnedInSlot(V, PA))
+		return !PA.getConstantOffsetForPointer(V);
 	return V->getType()->isPointerTy() && isa<Argument>(V) && PA.getPointerKind(V) == REGULAR;
 }
 
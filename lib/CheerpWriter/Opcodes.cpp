@@ -9,12 +9,16 @@
 //
 //===----------------------------------------------------------------------===//
 
+#define DEBUG_TYPE "CheerpWriter"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Cheerp/Utility.h"
 #include "llvm/Cheerp/Writer.h"
 
 using namespace llvm;
 using namespace cheerp;
 
+STATISTIC(NumRegularBitCastObjects, "Number of bitcasts which create {d,o} objects for REGULAR pointers");
+
 void CheerpWriter::compileIntegerComparison(const llvm::Value* lhs, const llvm::Value* rhs, CmpInst::Predicate p)
 {
 	if(lhs->getType()->isPointerTy())
@@ -68,10 +72,12 @@ void CheerpWriter::compileBitCast(const llvm::User* bc_inst, POINTER_KIND kind)
 	{
 		if(PA.getConstantOffsetForPointer(bc_inst))
 			compilePointerBase(bc_inst);
-		else if(PA.getPointerKind(bc_inst->getOperand(0)) == REGULAR && !isa<Argument>(bc_inst->getOperand(0)))
+		else if(PA.getPointerKind(bc_inst->getOperand(0)) == REGULAR && !isa<Argument>(bc_inst->getOperand(0)) &&
+			!isOffsetReturnedInSlot(bc_inst->getOperand(0), PA))
 			compileOperand(bc_inst->getOperand(0));
 		else
 		{
+			NumRegularBitCastObjects++;
 			stream << "{d:";
 			compilePointerBase(bc_inst, true);
 			stream << ",o:";
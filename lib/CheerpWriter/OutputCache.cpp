@@ -0,0 +1,438 @@
+//===-- OutputCache.cpp - Cheerp cache of the compiled functions ----------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Cheerp/OutputCache.h"
+#include "llvm/Cheerp/Writer.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+namespace cheerp {
+
+// Increment when the format of the entries or the description of the functions change
+static const uint32_t CacheFormatVersion = 1;
+
+FunctionOutputCache::FunctionOutputCache(const std::string& d)
+{
+	std::string compilerId = getCompilerId();
+	if(compilerId.empty())
+		return;
+	SmallString<128> path(d);
+	sys::path::append(path, "v" + Twine(CacheFormatVersion) + "-" + compilerId);
+	directory = path.str();
+	// If the directory cannot be created every lookup fails and every store is ignored
+	sys::fs::create_directories(directory);
+}
+
+std::string FunctionOutputCache::getCompilerId()
+{
+	// The address identifies the shared library of the writer, on platforms which do not always use the main executable
+	std::string path = sys::fs::getMainExecutable(NULL, reinterpret_cast<void*>(&FunctionOutputCache::getCompilerId));
+	if(path.empty())
+		return std::string();
+	std::unique_ptr<MemoryBuffer> buffer;
+	if(MemoryBuffer::getFile(path, buffer))
+		return std::string();
+	MD5 hash;
+	hash.update(buffer->getBuffer());
+	MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> id;
+	MD5::stringifyResult(result, id);
+	return id.str();
+}
+
+std::string FunctionOutputCache::getEntryPath(StringRef key) const
+{
+	SmallString<128> path(directory);
+	sys::path::append(path, key + ".js");
+	return path.str();
+}
+
+bool FunctionOutputCache::lookup(StringRef key, std::string& output) const
+{
+	if(directory.empty())
+		return false;
+	std::unique_ptr<MemoryBuffer> buffer;
+	if(MemoryBuffer::getFile(getEntryPath(key), buffer))
+		return false;
+	output = buffer->getBuffer();
+	return true;
+}
+
+void FunctionOutputCache::store(StringRef key, StringRef output) const
+{
+	if(directory.empty())
+		return;
+	// Write a temporary file and rename it, so that concurrent compilations never read a partial entry
+	SmallString<128> model(directory);
+	sys::path::append(model, key + "-%%%%%%.tmp");
+	int fd;
+	SmallString<128> tmpPath;
+	if(sys::fs::createUniqueFile(model.str(), fd, tmpPath))
+		return;
+	{
+		raw_fd_ostream tmpStream(fd, /*shouldClose*/ true);
+		tmpStream << output;
+		tmpStream.close();
+		if(tmpStream.has_error())
+		{
+			tmpStream.clear_error();
+			sys::fs::remove(tmpPath.str());
+			return;
+		}
+	}
+	if(sys::fs::rename(tmpPath.str(), getEntryPath(key)))
+		sys::fs::remove(tmpPath.str());
+}
+
+/**
+ * Describe everything which is used by CheerpWriter::compileMethod: the IR of the function, the kinds,
+ * offsets and names of its values, the facts about the functions it calls and about the types it uses.
+ * Values and types are described once and then referenced by their index.
+ */
+class FunctionKeyBuilder
+{
+public:
+	FunctionKeyBuilder(raw_ostream& s, const PointerAnalyzer& PA, const Registerize& registerize, const NameGenerator& namegen,
+			const TypeSupport& types, const GlobalDepsAnalyzer& globalDeps):
+		s(s), PA(PA), registerize(registerize), namegen(namegen), types(types), globalDeps(globalDeps)
+	{
+	}
+	void addFunction(const Function& F);
+private:
+	raw_ostream& s;
+	const PointerAnalyzer& PA;
+	const Registerize& registerize;
+	const NameGenerator& namegen;
+	const TypeSupport& types;
+	const GlobalDepsAnalyzer& globalDeps;
+	// Arguments, blocks and instructions of the function
+	DenseMap<const Value*, uint32_t> localIds;
+	DenseMap<const Constant*, uint32_t> constantIds;
+	DenseMap<Type*, uint32_t> typeIds;
+	std::vector<Type*> typesList;
+
+	void addType(Type* t);
+	void addTypeFacts(Type* t);
+	void addNames(const Value* v);
+	void addPointerFacts(const Value* v);
+	void addValue(const Value* v);
+	void addConstant(const Constant* C);
+	void addInstruction(const Instruction& I);
+};
+
+void FunctionKeyBuilder::addType(Type* t)
+{
+	auto it = typeIds.insert(std::make_pair(t, typesList.size()));
+	if(it.second)
+		typesList.push_back(t);
+	s << 't' << it.first->second << ' ';
+}
+
+void FunctionKeyBuilder::addTypeFacts(Type* t)
+{
+	t->print(s);
+	s << ' ';
+	if(StructType* st = dyn_cast<StructType>(t))
+	{
+		if(namegen.hasTypeName(st))
+			s << namegen.getTypeName(st);
+		s << ' ' << st->hasByteLayout() << globalDeps.classesUsed().count(st);
+		uint32_t firstBase, baseCount;
+		if(types.hasBasesInfo(st) && types.getBasesInfo(st, firstBase, baseCount))
+			s << " bases " << firstBase << ' ' << baseCount;
+		if(st->getDirectBase())
+			addType(st->getDirectBase());
+		for(uint32_t i=0;i<st->getNumElements();i++)
+		{
+			Type* elementType = st->getElementType(i);
+			addType(elementType);
+			s << types.useWrapperArrayForMember(PA, st, i) << types.getPrefixCharForMember(PA, st, i);
+			if(elementType->isPointerTy())
+			{
+				TypeAndIndex baseAndIndex(st, i, TypeAndIndex::STRUCT_MEMBER);
+				s << PA.getPointerKindForMemberPointer(baseAndIndex);
+				if(const ConstantInt* offset = PA.getConstantOffsetForMember(baseAndIndex))
+					s << 'o' << offset->getSExtValue();
+			}
+			s << ' ';
+		}
+	}
+	else if(PointerType* pt = dyn_cast<PointerType>(t))
+	{
+		addType(pt->getElementType());
+		s << PA.getPointerKindForStoredType(pt) << PA.getPointerKindForArgumentType(pt);
+	}
+	else if(SequentialType* st = dyn_cast<SequentialType>(t))
+		addType(st->getElementType());
+	else if(FunctionType* ft = dyn_cast<FunctionType>(t))
+	{
+		addType(ft->getReturnType());
+		for(FunctionType::param_iterator it=ft->param_begin();it!=ft->param_end();++it)
+			addType(*it);
+	}
+	s << '\n';
+}
+
+void FunctionKeyBuilder::addNames(const Value* v)
+{
+	if(namegen.hasName(v))
+		s << 'n' << namegen.getName(v) << ' ';
+	if(namegen.hasSecondaryName(v))
+		s << 'm' << namegen.getSecondaryName(v) << ' ';
+}
+
+void FunctionKeyBuilder::addPointerFacts(const Value* v)
+{
+	if(!v->getType()->isPointerTy())
+		return;
+	s << 'k' << PA.getPointerKind(v) << ' ';
+	if(const ConstantInt* offset = PA.getConstantOffsetForPointer(v))
+		s << 'o' << offset->getSExtValue() << ' ';
+}
+
+void FunctionKeyBuilder::addValue(const Value* v)
+{
+	auto it = localIds.find(v);
+	if(it != localIds.end())
+		s << 'l' << it->second << ' ';
+	else if(const Constant* C = dyn_cast<Constant>(v))
+		addConstant(C);
+	else if(const InlineAsm* IA = dyn_cast<InlineAsm>(v))
+		s << "asm " << IA->getAsmString() << ' ';
+	else if(const BasicBlock* BB = dyn_cast<BasicBlock>(v))
+	{
+		// Blocks of other functions are only used by block addresses
+		s << "bb " << BB->getName() << ' ';
+	}
+	else
+	{
+		// Metadata operands of intrinsics do not change the code
+		assert(isa<MDNode>(v) || isa<MDString>(v));
+		s << "md ";
+	}
+}
+
+void FunctionKeyBuilder::addConstant(const Constant* C)
+{
+	auto it = constantIds.insert(std::make_pair(C, constantIds.size()));
+	if(!it.second)
+	{
+		s << 'c' << it.first->second << ' ';
+		return;
+	}
+	s << 'C' << C->getValueID() << ' ';
+	addType(C->getType());
+	if(const GlobalValue* GV = dyn_cast<GlobalValue>(C))
+	{
+		s << GV->getName() << ' ';
+		addNames(GV);
+		if(const GlobalVariable* GVar = dyn_cast<GlobalVariable>(GV))
+			s << globalDeps.lazyGlobals().count(GVar);
+		else if(const Function* F = dyn_cast<Function>(GV))
+		{
+			// Calls depend on the kinds of the arguments and of the returned value
+			for(const Argument& arg: F->getArgumentList())
+				addPointerFacts(&arg);
+			if(!F->empty() && F->getReturnType()->isPointerTy())
+				s << 'r' << PA.getPointerKindForReturn(F);
+		}
+		addPointerFacts(GV);
+		s << '\n';
+		return;
+	}
+	if(const ConstantInt* CI = dyn_cast<ConstantInt>(C))
+		s << CI->getValue().toString(16, /*Signed*/ false);
+	else if(const ConstantFP* CF = dyn_cast<ConstantFP>(C))
+		s << CF->getValueAPF().bitcastToAPInt().toString(16, /*Signed*/ false);
+	else if(const ConstantDataSequential* CD = dyn_cast<ConstantDataSequential>(C))
+	{
+		StringRef data = CD->getRawDataValues();
+		s << data.size() << ' ' << data;
+	}
+	else if(const ConstantExpr* CE = dyn_cast<ConstantExpr>(C))
+	{
+		s << CE->getOpcode() << ' ';
+		if(CE->isCompare())
+			s << CE->getPredicate() << ' ';
+		if(CE->hasIndices())
+		{
+			for(unsigned index: CE->getIndices())
+				s << index << ',';
+		}
+		s << CE->getRawSubclassOptionalData() << ' ';
+	}
+	s << '(';
+	for(const Value* op: C->operands())
+		addValue(op);
+	s << ')';
+	addPointerFacts(C);
+	s << '\n';
+}
+
+void FunctionKeyBuilder::addInstruction(const Instruction& I)
+{
+	s << 'I' << I.getOpcode() << ' ' << I.getRawSubclassOptionalData() << ' ';
+	addType(I.getType());
+	if(const CmpInst* ci = dyn_cast<CmpInst>(&I))
+		s << ci->getPredicate() << ' ';
+	else if(const AllocaInst* ai = dyn_cast<AllocaInst>(&I))
+	{
+		addType(ai->getAllocatedType());
+		s << ai->getAlignment() << ' ';
+	}
+	else if(const LoadInst* li = dyn_cast<LoadInst>(&I))
+		s << li->isVolatile() << li->getAlignment() << ' ' << li->getOrdering() << ' ';
+	else if(const StoreInst* si = dyn_cast<StoreInst>(&I))
+		s << si->isVolatile() << si->getAlignment() << ' ' << si->getOrdering() << ' ';
+	else if(const ExtractValueInst* evi = dyn_cast<ExtractValueInst>(&I))
+	{
+		for(unsigned index: evi->getIndices())
+			s << index << ',';
+	}
+	else if(const InsertValueInst* ivi = dyn_cast<InsertValueInst>(&I))
+	{
+		for(unsigned index: ivi->getIndices())
+			s << index << ',';
+	}
+	else if(const AtomicRMWInst* ai = dyn_cast<AtomicRMWInst>(&I))
+		s << ai->getOperation() << ' ' << ai->getOrdering() << ' ';
+	else if(const AtomicCmpXchgInst* ai = dyn_cast<AtomicCmpXchgInst>(&I))
+		s << ai->getSuccessOrdering() << ' ' << ai->getFailureOrdering() << ' ';
+	else if(const LandingPadInst* lpi = dyn_cast<LandingPadInst>(&I))
+		s << lpi->isCleanup() << ' ';
+	else if(const PHINode* phi = dyn_cast<PHINode>(&I))
+	{
+		for(uint32_t i=0;i<phi->getNumIncomingValues();i++)
+			addValue(phi->getIncomingBlock(i));
+	}
+	ImmutableCallSite CS(&I);
+	if(CS)
+	{
+		s << CS.getCallingConv() << ' ';
+		// Indirect calls use the kinds for any argument of the same type in the same position
+		if(!CS.getCalledFunction())
+		{
+			uint32_t argNo = 0;
+			for(ImmutableCallSite::arg_iterator it=CS.arg_begin();it!=CS.arg_end();++it)
+			{
+				Type* argType = (*it)->getType();
+				if(argType->isPointerTy())
+				{
+					TypeAndIndex typeAndIndex(argType->getPointerElementType(), argNo, TypeAndIndex::ARGUMENT);
+					s << PA.getPointerKindForArgumentTypeAndIndex(typeAndIndex);
+				}
+				argNo++;
+			}
+			s << ' ';
+		}
+	}
+	s << '(';
+	for(const Value* op: I.operands())
+		addValue(op);
+	s << ')';
+	s << isInlineable(I, PA) << ' ';
+	if(namegen.hasName(&I))
+		s << 'r' << registerize.getRegisterId(&I) << ' ';
+	addNames(&I);
+	addPointerFacts(&I);
+	s << '\n';
+}
+
+void FunctionKeyBuilder::addFunction(const Function& F)
+{
+	uint32_t nextId = 0;
+	for(const Argument& arg: F.getArgumentList())
+		localIds.insert(std::make_pair(&arg, nextId++));
+	for(const BasicBlock& BB: F)
+	{
+		localIds.insert(std::make_pair(&BB, nextId++));
+		for(const Instruction& I: BB)
+			localIds.insert(std::make_pair(&I, nextId++));
+	}
+
+	addNames(&F);
+	addType(F.getType());
+	if(F.getReturnType()->isPointerTy())
+		s << 'r' << PA.getPointerKindForReturn(&F);
+	s << '\n';
+	for(const Argument& arg: F.getArgumentList())
+	{
+		addNames(&arg);
+		addPointerFacts(&arg);
+		s << '\n';
+	}
+	for(const BasicBlock& BB: F)
+	{
+		s << "BB" << BB.isLandingPad() << '\n';
+		for(const Instruction& I: BB)
+			addInstruction(I);
+		// The temporary names of the PHIs on the outgoing edges
+		const TerminatorInst* term = BB.getTerminator();
+		for(uint32_t i=0;i<term->getNumSuccessors();i++)
+		{
+			const BasicBlock* succ = term->getSuccessor(i);
+			NameGenerator::EdgeContext edgeContext(&BB, succ);
+			for(const Instruction& I: *succ)
+			{
+				const PHINode* phi = dyn_cast<PHINode>(&I);
+				if(!phi)
+					break;
+				if(namegen.hasName(phi))
+					s << namegen.getNameForEdge(phi, edgeContext) << ' ';
+			}
+			s << '\n';
+		}
+	}
+	// New types may be found while describing the types
+	for(uint32_t i=0;i<typesList.size();i++)
+		addTypeFacts(typesList[i]);
+}
+
+std::string CheerpWriter::getFunctionCacheKey(const Function& F) const
+{
+	std::string description;
+	raw_string_ostream s(description);
+	// The compiler itself is identified by the directory of the cache, the code also depends on the options of the writer
+	s << stream.isReadableOutput() << useNativeJavaScriptMath << useMathImul << useMathFround << useArenaHeap;
+	s << useStructConstructors << useLazyGlobals << ' ' << memcpyUnrollLimit << ' ' << memcpyLoopLimit << ' ' << relooperSplitBudget;
+	s << ' ' << binaryConstantThreshold << ' ' << instrument << '\n';
+	if(instrument)
+		s << profileCounterBase.at(&F) << '\n';
+	if(profile)
+	{
+		if(const std::vector<uint64_t>* counts = profile->getCounters(F, ProfileCounters(F)))
+		{
+			for(uint64_t c: *counts)
+				s << c << ' ';
+		}
+		s << '\n';
+	}
+	FunctionKeyBuilder(s, PA, registerize, namegen, types, globalDeps).addFunction(F);
+	s.flush();
+
+	MD5 hash;
+	hash.update(description);
+	MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> key;
+	MD5::stringifyResult(result, key);
+	return key.str();
+}
+
+}
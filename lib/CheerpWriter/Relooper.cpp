@@ -4,11 +4,9 @@
 
 #include <string.h>
 #include <stdlib.h>
-#include <list>
+#include <algorithm>
 #include <stack>
 
-// TODO: move all set to unorderedset
-
 #if DEBUG
 static void PrintDebug(const char *Format, ...);
 #define DebugDump(x, ...) Debugging::Dump(x, __VA_ARGS__)
@@ -47,7 +45,7 @@ void Branch::Render(Block *Target, bool SetLabel, RenderInterface* renderInterfa
 // Block
 
 Block::Block(const void* b, bool s, int Id) : Parent(NULL), Id(Id), privateBlock(b), DefaultTarget(NULL),
-	IsCheckedMultipleEntry(false), IsSplittable(s) {
+	IsCheckedMultipleEntry(false), IsSplittable(s), IsSwitch(false), Size(1) {
 }
 
 Block::~Block() {
@@ -129,6 +127,9 @@ void Block::Render(bool InLoop, RenderInterface* renderInterface) {
 
   std::vector<int> emptyBranchesIds;
   bool First = true;
+  if (IsSwitch) {
+    renderInterface->renderSwitchBlockBegin(privateBlock);
+  }
   for (BlockBranchMap::iterator iter = ProcessedBranchesOut.begin();; iter++) {
     Block *Target;
     Branch *Details;
@@ -145,8 +146,17 @@ void Block::Render(bool InLoop, RenderInterface* renderInterface) {
     bool HasFusedContent = Fused && Fused->InnerMap.find(Target) != Fused->InnerMap.end();
     //Cheerp: We assume that the block has content, otherwise why it's even here?
     bool HasContent = SetCurrLabel || Details->Type != Branch::Direct ||
-                      HasFusedContent || renderInterface->hasBlockPrologue(Target->privateBlock);
-    if (iter != ProcessedBranchesOut.end()) {
+                      HasFusedContent || renderInterface->hasBlockPrologue(Target->privateBlock, privateBlock);
+    if (IsSwitch) {
+      // Every case must be rendered, otherwise its values would reach the default
+      if (iter != ProcessedBranchesOut.end()) {
+        renderInterface->renderCaseBlockBegin(privateBlock, Details->branchId);
+      } else if (HasContent) {
+        renderInterface->renderDefaultBlockBegin();
+      } else {
+        break;
+      }
+    } else if (iter != ProcessedBranchesOut.end()) {
       // If there is nothing to show in this branch, omit the condition
       if (HasContent) {
         renderInterface->renderIfBlockBegin(privateBlock, Details->branchId, First);
@@ -169,15 +179,74 @@ void Block::Render(bool InLoop, RenderInterface* renderInterface) {
     if (HasFusedContent) {
       Fused->InnerMap.find(Target)->second->Render(InLoop, renderInterface);
     }
+    if (IsSwitch) {
+      renderInterface->renderBreak();
+      renderInterface->renderBlockEnd();
+    }
     if (iter == ProcessedBranchesOut.end()) break;
   }
-  if (!First) renderInterface->renderBlockEnd();
+  if (IsSwitch || !First) renderInterface->renderBlockEnd();
 
   if (Fused) {
     Fused->RenderLoopPostfix(renderInterface);
   }
 }
 
+// BlockSet
+
+static bool CompareBlocksById(Block *lhs, Block *rhs) {
+  return lhs->Id < rhs->Id;
+}
+
+bool BlockSet::insert(Block *B) {
+  if (IsLarge) {
+    if (Large.test(B->Id)) return false;
+    Large.set(B->Id);
+    Count++;
+    return true;
+  }
+  std::vector<Block*>::iterator Pos = std::lower_bound(Small.begin(), Small.end(), B, CompareBlocksById);
+  if (Pos != Small.end() && *Pos == B) return false;
+  Count++;
+  if (Count <= MaxSmallSize) {
+    Small.insert(Pos, B);
+    return true;
+  }
+  // Too many blocks for a linear search, move to the bitset
+  Large.resize(BlocksById->size());
+  for (unsigned int i = 0; i < Small.size(); i++) Large.set(Small[i]->Id);
+  Large.set(B->Id);
+  Small.clear();
+  IsLarge = true;
+  return true;
+}
+
+bool BlockSet::erase(Block *B) {
+  if (IsLarge) {
+    if (!Large.test(B->Id)) return false;
+    Large.reset(B->Id);
+    Count--;
+    return true;
+  }
+  std::vector<Block*>::iterator Pos = std::lower_bound(Small.begin(), Small.end(), B, CompareBlocksById);
+  if (Pos == Small.end() || *Pos != B) return false;
+  Small.erase(Pos);
+  Count--;
+  return true;
+}
+
+bool BlockSet::count(Block *B) const {
+  if (IsLarge) return Large.test(B->Id);
+  return std::binary_search(Small.begin(), Small.end(), B, CompareBlocksById);
+}
+
+void BlockSet::clear() {
+  Small.clear();
+  Large.clear();
+  Count = 0;
+  IsLarge = false;
+}
+
 // MultipleShape
 
 void MultipleShape::RenderLoopPrefix(RenderInterface* renderInterface) {
@@ -198,12 +267,23 @@ void MultipleShape::RenderLoopPostfix(RenderInterface* renderInterface) {
 
 void MultipleShape::Render(bool InLoop, RenderInterface* renderInterface) {
   RenderLoopPrefix(renderInterface);
-  bool First = true;
-  for (BlockShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
-    renderInterface->renderIfOnLabel(iter->first->Id, First);
-    First = false;
-    iter->second->Render(InLoop, renderInterface);
+  if (IsSwitch) {
+    renderInterface->renderSwitchOnLabel();
+    for (BlockShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
+      renderInterface->renderCaseOnLabel(iter->first->Id);
+      iter->second->Render(InLoop, renderInterface);
+      renderInterface->renderBreak();
+      renderInterface->renderBlockEnd();
+    }
     renderInterface->renderBlockEnd();
+  } else {
+    bool First = true;
+    for (BlockShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
+      renderInterface->renderIfOnLabel(iter->first->Id, First);
+      First = false;
+      iter->second->Render(InLoop, renderInterface);
+      renderInterface->renderBlockEnd();
+    }
   }
   RenderLoopPostfix(renderInterface);
   if (Next) Next->Render(InLoop, renderInterface);
@@ -249,7 +329,7 @@ void EmulatedShape::Render(bool InLoop) {
 
 // Relooper
 
-Relooper::Relooper(int BlockCount) : Root(NULL), NeedsLabel(false), IdCounter(BlockCount) {
+Relooper::Relooper(int BlockCount, int SplitBudget) : Root(NULL), NeedsLabel(false), IdCounter(BlockCount), SplitBudget(SplitBudget) {
 }
 
 Relooper::~Relooper() {
@@ -258,6 +338,7 @@ Relooper::~Relooper() {
 }
 
 void Relooper::AddBlock(Block *New) {
+  assert(New->Id < IdCounter);
   Blocks.push_back(New);
 }
 
@@ -266,35 +347,251 @@ struct RelooperRecursor {
   RelooperRecursor(Relooper *ParentInit) : Parent(ParentInit) {}
 };
 
-typedef std::list<Block*> BlockList;
+typedef std::deque<Block*> BlockList;
 
 void Relooper::Calculate(Block *Entry) {
   // Scan and optimize the input
   struct PreOptimizer : public RelooperRecursor {
-    PreOptimizer(Relooper *Parent) : RelooperRecursor(Parent) {}
-    BlockSet Live;
+    PreOptimizer(Relooper *Parent) : RelooperRecursor(Parent), Live(Parent->IdCounter), Budget(Parent->SplitBudget), Stamp(0) {}
+    std::vector<bool> Live; // Indexed by block id
+
+    // Scratch space of SplitIrreducibleLoops, indexed by block id. A block belongs to a set if its mark is the stamp of the set
+    int Budget;
+    int Stamp;
+    std::vector<int> RegionMark, LoopMark, ReachMark, EntryMark;
+    std::vector<int> Num, Low;
+    std::vector<bool> OnStack;
+    std::vector<Block*> CloneOf;
+
+    void GrowScratch() {
+      unsigned int Size = Parent->IdCounter;
+      Live.resize(Size);
+      RegionMark.resize(Size);
+      LoopMark.resize(Size);
+      ReachMark.resize(Size);
+      EntryMark.resize(Size);
+      Num.resize(Size);
+      Low.resize(Size);
+      OnStack.resize(Size);
+      CloneOf.resize(Size);
+    }
 
     void FindLive(Block *Root) {
-      BlockList ToInvestigate;
+      std::vector<Block*> ToInvestigate;
       ToInvestigate.push_back(Root);
       while (ToInvestigate.size() > 0) {
-        Block *Curr = ToInvestigate.front();
-        ToInvestigate.pop_front();
-        if (Live.find(Curr) != Live.end()) continue;
-        Live.insert(Curr);
+        Block *Curr = ToInvestigate.back();
+        ToInvestigate.pop_back();
+        if (Live[Curr->Id]) continue;
+        Live[Curr->Id] = true;
         for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
           ToInvestigate.push_back(iter->first);
         }
       }
     }
 
+    // Find the strongly connected components of the subgraph made by the Region blocks
+    void FindSCCs(const std::vector<Block*> &Region, std::vector<std::vector<Block*> > &SCCs) {
+      int RegionStamp = ++Stamp;
+      for (unsigned int i = 0; i < Region.size(); i++) {
+        RegionMark[Region[i]->Id] = RegionStamp;
+        Num[Region[i]->Id] = 0;
+      }
+      int Counter = 0;
+      std::vector<Block*> Stack;
+      std::vector<std::pair<Block*, BlockBranchMap::iterator> > CallStack;
+      for (unsigned int i = 0; i < Region.size(); i++) {
+        Block *ToVisit = Num[Region[i]->Id] ? NULL : Region[i];
+        while (ToVisit || CallStack.size() > 0) {
+          if (ToVisit) {
+            Num[ToVisit->Id] = Low[ToVisit->Id] = ++Counter;
+            Stack.push_back(ToVisit);
+            OnStack[ToVisit->Id] = true;
+            CallStack.push_back(std::make_pair(ToVisit, ToVisit->BranchesOut.begin()));
+            ToVisit = NULL;
+            continue;
+          }
+          Block *Curr = CallStack.back().first;
+          BlockBranchMap::iterator &iter = CallStack.back().second;
+          if (iter != Curr->BranchesOut.end()) {
+            Block *Next = iter->first;
+            iter++;
+            if (RegionMark[Next->Id] != RegionStamp) continue;
+            if (!Num[Next->Id]) {
+              ToVisit = Next;
+            } else if (OnStack[Next->Id]) {
+              Low[Curr->Id] = std::min(Low[Curr->Id], Num[Next->Id]);
+            }
+            continue;
+          }
+          CallStack.pop_back();
+          if (CallStack.size() > 0) {
+            Block *Caller = CallStack.back().first;
+            Low[Caller->Id] = std::min(Low[Caller->Id], Low[Curr->Id]);
+          }
+          if (Low[Curr->Id] == Num[Curr->Id]) {
+            SCCs.push_back(std::vector<Block*>());
+            Block *Member;
+            do {
+              Member = Stack.back();
+              Stack.pop_back();
+              OnStack[Member->Id] = false;
+              SCCs.back().push_back(Member);
+            } while (Member != Curr);
+          }
+        }
+      }
+    }
+
+    // Find the blocks of the loop which are reachable from Start without going through Header.
+    // The search stops early once their size exceeds Limit. Returns the size of the reached blocks.
+    int ReachBeforeHeader(Block *Start, Block *Header, int LoopStamp, int Limit, std::vector<Block*> *Reached) {
+      int ReachStamp = ++Stamp;
+      std::vector<Block*> ToVisit;
+      ToVisit.push_back(Start);
+      ReachMark[Start->Id] = ReachStamp;
+      int Size = 0;
+      while (ToVisit.size() > 0 && Size <= Limit) {
+        Block *Curr = ToVisit.back();
+        ToVisit.pop_back();
+        Size += Curr->Size;
+        if (Reached) Reached->push_back(Curr);
+        for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
+          Block *Next = iter->first;
+          if (Next == Header || LoopMark[Next->Id] != LoopStamp || ReachMark[Next->Id] == ReachStamp) continue;
+          ReachMark[Next->Id] = ReachStamp;
+          ToVisit.push_back(Next);
+        }
+      }
+      return Size;
+    }
+
+    // Make a loop with more than one entry reducible. One entry becomes the header, and for each of the other entries
+    // the blocks it reaches before the header are duplicated. The branches from outside the loop go to the copies,
+    // which only enter the loop through the header. Returns false if the duplicated code would exceed the budget.
+    bool SplitLoopEntries(std::vector<Block*> &Entries, int LoopStamp, std::vector<std::vector<Block*> > &Regions) {
+      // Choose the header which requires the least duplication
+      Block *Header = NULL;
+      int HeaderCost = Budget + 1;
+      for (unsigned int i = 0; i < Entries.size(); i++) {
+        int Cost = 0;
+        for (unsigned int j = 0; j < Entries.size() && Cost < HeaderCost; j++) {
+          if (i != j) Cost += ReachBeforeHeader(Entries[j], Entries[i], LoopStamp, HeaderCost - Cost, NULL);
+        }
+        if (Cost < HeaderCost) {
+          Header = Entries[i];
+          HeaderCost = Cost;
+        }
+      }
+      if (!Header) return false;
+      Budget -= HeaderCost;
+      for (unsigned int i = 0; i < Entries.size(); i++) {
+        Block *Original = Entries[i];
+        if (Original == Header) continue;
+        std::vector<Block*> Reached;
+        ReachBeforeHeader(Original, Header, LoopStamp, HeaderCost, &Reached);
+        int ReachStamp = Stamp;
+        std::sort(Reached.begin(), Reached.end(), OrderBlocksById());
+        std::vector<Block*> Clones;
+        for (unsigned int j = 0; j < Reached.size(); j++) {
+          Block *Clone = new Block(Reached[j]->privateBlock, Reached[j]->IsSplittable, Parent->IdCounter++);
+          Clone->IsSwitch = Reached[j]->IsSwitch;
+          Clone->Size = Reached[j]->Size;
+          Parent->AddBlock(Clone);
+          CloneOf[Reached[j]->Id] = Clone;
+          Clones.push_back(Clone);
+        }
+        GrowScratch();
+        // The copies branch to each other, and to the same blocks as the originals outside of the copied set
+        for (unsigned int j = 0; j < Reached.size(); j++) {
+          Block *Clone = CloneOf[Reached[j]->Id];
+          Live[Clone->Id] = true;
+          for (BlockBranchMap::iterator iter = Reached[j]->BranchesOut.begin(); iter != Reached[j]->BranchesOut.end(); iter++) {
+            Block *Target = ReachMark[iter->first->Id] == ReachStamp ? CloneOf[iter->first->Id] : iter->first;
+            Clone->BranchesOut[Target] = new Branch(iter->second->branchId);
+            Target->BranchesIn[Clone] = new Branch(-1);
+          }
+        }
+        // Move the branches from outside the loop to the copy of the entry
+        Block *Clone = CloneOf[Original->Id];
+        for (BlockBranchMap::iterator iter = Original->BranchesIn.begin(); iter != Original->BranchesIn.end();) {
+          Block *Prior = iter->first;
+          if (LoopMark[Prior->Id] == LoopStamp) {
+            iter++;
+            continue;
+          }
+          Prior->BranchesOut[Clone] = Prior->BranchesOut[Original];
+          Prior->BranchesOut.erase(Original);
+          Clone->BranchesIn[Prior] = iter->second;
+          Original->BranchesIn.erase(iter++);
+        }
+        // The copies may contain inner loops
+        Regions.push_back(Clones);
+      }
+      Entries.clear();
+      Entries.push_back(Header);
+      return true;
+    }
+
+    // An irreducible loop is entered from more than one block, so the Relooper can only render it by setting a label
+    // before entering and checking it on every iteration. Make the irreducible loops reducible by node splitting, as long
+    // as the number of duplicated instructions stays within the SplitBudget of the Relooper. The loops are found as the
+    // strongly connected components of the graph, then the inner loops are found in each loop once its entries are removed.
+    void SplitIrreducibleLoops(Block *FunctionEntry) {
+      GrowScratch();
+      std::vector<std::vector<Block*> > Regions(1);
+      for (unsigned int i = 0; i < Parent->Blocks.size(); i++) {
+        if (Live[Parent->Blocks[i]->Id]) Regions[0].push_back(Parent->Blocks[i]);
+      }
+      // Once the budget is spent nothing else can be split, so there is no need to look for the inner loops
+      while (Regions.size() > 0 && Budget > 0) {
+        std::vector<Block*> Region;
+        Region.swap(Regions.back());
+        Regions.pop_back();
+        std::vector<std::vector<Block*> > Loops;
+        FindSCCs(Region, Loops);
+        for (unsigned int i = 0; i < Loops.size(); i++) {
+          std::vector<Block*> &Loop = Loops[i];
+          if (Loop.size() == 1) continue; // Not a loop, or a loop made of a single block
+          int LoopStamp = ++Stamp;
+          for (unsigned int j = 0; j < Loop.size(); j++) {
+            LoopMark[Loop[j]->Id] = LoopStamp;
+          }
+          std::vector<Block*> Entries;
+          for (unsigned int j = 0; j < Loop.size(); j++) {
+            bool IsEntry = Loop[j] == FunctionEntry;
+            for (BlockBranchMap::iterator iter = Loop[j]->BranchesIn.begin(); iter != Loop[j]->BranchesIn.end() && !IsEntry; iter++) {
+              IsEntry = LoopMark[iter->first->Id] != LoopStamp;
+            }
+            if (IsEntry) Entries.push_back(Loop[j]);
+          }
+          std::sort(Entries.begin(), Entries.end(), OrderBlocksById());
+          // The entry of the function cannot be duplicated
+          if (Entries.size() > 1 && Entries[0] != FunctionEntry) {
+            SplitLoopEntries(Entries, LoopStamp, Regions);
+          }
+          int EntryStamp = ++Stamp;
+          for (unsigned int j = 0; j < Entries.size(); j++) {
+            EntryMark[Entries[j]->Id] = EntryStamp;
+          }
+          Regions.push_back(std::vector<Block*>());
+          for (unsigned int j = 0; j < Loop.size(); j++) {
+            if (EntryMark[Loop[j]->Id] != EntryStamp) Regions.back().push_back(Loop[j]);
+          }
+        }
+      }
+    }
+
     // If a block has multiple entries but no exits, and it is small enough, it is useful to split it.
     // A common example is a C++ function where everything ends up at a final exit block and does some
     // RAII cleanup. Without splitting, we will be forced to introduce labelled loops to allow
     // reaching the final block
+    // The blocks are visited in the order they were added, so the ids of the split blocks are reproducible
     void SplitDeadEnds() {
-      for (BlockSet::iterator iter = Live.begin(); iter != Live.end(); iter++) {
-        Block *Original = *iter;
+      unsigned int NumBlocks = Parent->Blocks.size(); // The split blocks are added after these
+      for (unsigned int i = 0; i < NumBlocks; i++) {
+        Block *Original = Parent->Blocks[i];
+        if (!Live[Original->Id]) continue;
         if (Original->BranchesIn.size() <= 1 || Original->BranchesOut.size() > 0) continue;
 	if (!Original->IsSplittable) continue;
         // Split the node (for simplicity, we replace all the blocks, even though we could have reused the original)
@@ -305,7 +602,6 @@ void Relooper::Calculate(Block *Entry) {
           Prior->BranchesOut[Split] = new Branch(Prior->BranchesOut[Original]->branchId);
           Prior->BranchesOut.erase(Original);
           Parent->AddBlock(Split);
-          Live.insert(Split);
         }
       }
     }
@@ -316,18 +612,34 @@ void Relooper::Calculate(Block *Entry) {
   // Add incoming branches from live blocks, ignoring dead code
   for (unsigned int i = 0; i < Blocks.size(); i++) {
     Block *Curr = Blocks[i];
-    if (Pre.Live.find(Curr) == Pre.Live.end()) continue;
+    if (!Pre.Live[Curr->Id]) continue;
     for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
       iter->first->BranchesIn[Curr] = new Branch(-1);
     }
   }
 
+  if (SplitBudget > 0) {
+    Pre.SplitIrreducibleLoops(Entry);
+  }
   Pre.SplitDeadEnds();
 
+  // From now on the blocks are only created by splitting, so their ids are dense
+  BlocksById.assign(IdCounter, NULL);
+  for (unsigned int i = 0; i < Blocks.size(); i++) {
+    assert(!BlocksById[Blocks[i]->Id]);
+    BlocksById[Blocks[i]->Id] = Blocks[i];
+  }
+
   // Recursively process the graph
 
   struct Analyzer : public RelooperRecursor {
-    Analyzer(Relooper *Parent) : RelooperRecursor(Parent) {}
+    // Scratch space of FindIndependentGroups, indexed by block id. Owners holds the entry a block was reached from,
+    // or NULL if it was reached from more than one entry. Only the Visited blocks are cleared after each use.
+    std::vector<Block*> Owners;
+    std::vector<bool> Reached;
+    std::vector<Block*> Visited;
+
+    Analyzer(Relooper *Parent) : RelooperRecursor(Parent), Owners(Parent->BlocksById.size()), Reached(Parent->BlocksById.size()) {}
 
     // Add a shape to the list of shapes in this Relooper calculation
     void Notice(Shape *New) {
@@ -338,7 +650,7 @@ void Relooper::Calculate(Block *Entry) {
     // will appear
     void GetBlocksOut(Block *Source, BlockSet& Entries, BlockSet *LimitTo=NULL) {
       for (BlockBranchMap::iterator iter = Source->BranchesOut.begin(); iter != Source->BranchesOut.end(); iter++) {
-        if (!LimitTo || LimitTo->find(iter->first) != LimitTo->end()) {
+        if (!LimitTo || LimitTo->count(iter->first)) {
           Entries.insert(iter->first);
         }
       }
@@ -350,7 +662,7 @@ void Relooper::Calculate(Block *Entry) {
       DebugDump(From, "  relevant to solipsize: ");
       for (BlockBranchMap::iterator iter = Target->BranchesIn.begin(); iter != Target->BranchesIn.end();) {
         Block *Prior = iter->first;
-        if (From.find(Prior) == From.end()) {
+        if (!From.count(Prior)) {
           iter++;
           continue;
         }
@@ -379,7 +691,7 @@ void Relooper::Calculate(Block *Entry) {
       if (Blocks.size() > 1) {
         Blocks.erase(Inner);
         GetBlocksOut(Inner, NextEntries, &Blocks);
-        BlockSet JustInner;
+        BlockSet JustInner(Parent->BlocksById);
         JustInner.insert(Inner);
         for (BlockSet::iterator iter = NextEntries.begin(); iter != NextEntries.end(); iter++) {
           Solipsize(*iter, Branch::Direct, Simple, JustInner);
@@ -391,18 +703,20 @@ void Relooper::Calculate(Block *Entry) {
     Shape *MakeLoop(BlockSet &Blocks, BlockSet& Entries, BlockSet &NextEntries) {
       // Find the inner blocks in this loop. Proceed backwards from the entries until
       // you reach a seen block, collecting as you go.
-      BlockSet InnerBlocks;
-      BlockSet Queue = Entries;
+      BlockSet InnerBlocks(Parent->BlocksById);
+      std::vector<Block*> Queue;
+      for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
+        Queue.push_back(*iter);
+      }
       while (Queue.size() > 0) {
-        Block *Curr = *(Queue.begin());
-        Queue.erase(Queue.begin());
-        if (InnerBlocks.find(Curr) == InnerBlocks.end()) {
+        Block *Curr = Queue.back();
+        Queue.pop_back();
+        if (InnerBlocks.insert(Curr)) {
           // This element is new, mark it as inner and remove from outer
-          InnerBlocks.insert(Curr);
           Blocks.erase(Curr);
           // Add the elements prior to it
           for (BlockBranchMap::iterator iter = Curr->BranchesIn.begin(); iter != Curr->BranchesIn.end(); iter++) {
-            Queue.insert(iter->first);
+            if (!InnerBlocks.count(iter->first)) Queue.push_back(iter->first);
           }
         }
       }
@@ -412,7 +726,7 @@ void Relooper::Calculate(Block *Entry) {
         Block *Curr = *iter;
         for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
           Block *Possible = iter->first;
-          if (InnerBlocks.find(Possible) == InnerBlocks.end()) {
+          if (!InnerBlocks.count(Possible)) {
             NextEntries.insert(Possible);
           }
         }
@@ -441,6 +755,12 @@ void Relooper::Calculate(Block *Entry) {
       // Finish up
       Shape *Inner = Process(InnerBlocks, Entries, NULL);
       Loop->Inner = Inner;
+      // A loop with more than one entry is irreducible, and it could not be split. Every iteration starts by
+      // checking the label to find the entry, use a switch for that so that the engines can use a jump table
+      MultipleShape *Dispatch = Shape::IsMultiple(Inner);
+      if (Entries.size() > 1 && Dispatch && Dispatch->InnerMap.size() > 1) {
+        Dispatch->IsSwitch = true;
+      }
       return Loop;
     }
 
@@ -448,40 +768,53 @@ void Relooper::Calculate(Block *Entry) {
     // the entry itself, plus all the blocks it can reach that cannot be directly reached by another entry. Note that we
     // ignore directly reaching the entry itself by another entry.
     void FindIndependentGroups(BlockSet &Blocks, BlockSet &Entries, BlockBlockSetMap& IndependentGroups) {
-      typedef std::map<Block*, Block*> BlockBlockMap;
-
       struct HelperClass {
         BlockBlockSetMap& IndependentGroups;
-        BlockBlockMap Ownership; // For each block, which entry it belongs to. We have reached it from there.
-
-        HelperClass(BlockBlockSetMap& IndependentGroupsInit) : IndependentGroups(IndependentGroupsInit) {}
+        std::vector<Block*>& Ownership; // For each block, which entry it belongs to. We have reached it from there.
+        std::vector<bool>& Reached;
+        std::vector<Block*>& Visited;
+
+        HelperClass(BlockBlockSetMap& IndependentGroupsInit, Analyzer& A) : IndependentGroups(IndependentGroupsInit),
+          Ownership(A.Owners), Reached(A.Reached), Visited(A.Visited) {}
+        ~HelperClass() {
+          for (unsigned int i = 0; i < Visited.size(); i++) {
+            Ownership[Visited[i]->Id] = NULL;
+            Reached[Visited[i]->Id] = false;
+          }
+          Visited.clear();
+        }
+        void Reach(Block *New, Block *Owner) {
+          Ownership[New->Id] = Owner;
+          Reached[New->Id] = true;
+          Visited.push_back(New);
+        }
+        BlockSet &GetGroup(Block *Entry) {
+          return IndependentGroups.find(Entry)->second;
+        }
         void InvalidateWithChildren(Block *New) { // TODO: rename New
           BlockList ToInvalidate; // Being in the list means you need to be invalidated
           ToInvalidate.push_back(New);
           while (ToInvalidate.size() > 0) {
             Block *Invalidatee = ToInvalidate.front();
             ToInvalidate.pop_front();
-            Block *Owner = Ownership[Invalidatee];
-            if (Owner && IndependentGroups.find(Owner) != IndependentGroups.end()) { // Owner may have been invalidated, do not add to IndependentGroups!
-              IndependentGroups[Owner].erase(Invalidatee);
-            }
-            if (Ownership[Invalidatee]) { // may have been seen before and invalidated already
-              Ownership[Invalidatee] = NULL;
+            Block *Owner = Ownership[Invalidatee->Id];
+            if (Owner) { // may have been seen before and invalidated already
+              BlockBlockSetMap::iterator Group = IndependentGroups.find(Owner);
+              if (Group != IndependentGroups.end()) { // Owner may have been invalidated, do not add to IndependentGroups!
+                Group->second.erase(Invalidatee);
+              }
+              Ownership[Invalidatee->Id] = NULL;
               for (BlockBranchMap::iterator iter = Invalidatee->BranchesOut.begin(); iter != Invalidatee->BranchesOut.end(); iter++) {
                 Block *Target = iter->first;
-                BlockBlockMap::iterator Known = Ownership.find(Target);
-                if (Known != Ownership.end()) {
-                  Block *TargetOwner = Known->second;
-                  if (TargetOwner) {
-                    ToInvalidate.push_back(Target);
-                  }
+                if (Ownership[Target->Id]) {
+                  ToInvalidate.push_back(Target);
                 }
               }
             }
           }
         }
       };
-      HelperClass Helper(IndependentGroups);
+      HelperClass Helper(IndependentGroups, *this);
 
       // We flow out from each of the entries, simultaneously.
       // When we reach a new block, we add it as belonging to the one we got to it from.
@@ -492,27 +825,26 @@ void Relooper::Calculate(Block *Entry) {
       BlockList Queue; // Being in the queue means we just added this item, and we need to add its children
       for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
         Block *Entry = *iter;
-        Helper.Ownership[Entry] = Entry;
-        IndependentGroups[Entry].insert(Entry);
+        Helper.Reach(Entry, Entry);
+        IndependentGroups.insert(std::make_pair(Entry, BlockSet(Parent->BlocksById))).first->second.insert(Entry);
         Queue.push_back(Entry);
       }
       while (Queue.size() > 0) {
         Block *Curr = Queue.front();
         Queue.pop_front();
-        Block *Owner = Helper.Ownership[Curr]; // Curr must be in the ownership map if we are in the queue
+        Block *Owner = Helper.Ownership[Curr->Id]; // Curr must be reached if we are in the queue
         if (!Owner) continue; // we have been invalidated meanwhile after being reached from two entries
         // Add all children
         for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
           Block *New = iter->first;
-          BlockBlockMap::iterator Known = Helper.Ownership.find(New);
-          if (Known == Helper.Ownership.end()) {
+          if (!Helper.Reached[New->Id]) {
             // New node. Add it, and put it in the queue
-            Helper.Ownership[New] = Owner;
-            IndependentGroups[Owner].insert(New);
+            Helper.Reach(New, Owner);
+            Helper.GetGroup(Owner).insert(New);
             Queue.push_back(New);
             continue;
           }
-          Block *NewOwner = Known->second;
+          Block *NewOwner = Helper.Ownership[New->Id];
           if (!NewOwner) continue; // We reached an invalidated node
           if (NewOwner != Owner) {
             // Invalidate this and all reachable that we have seen - we reached this from two locations
@@ -529,13 +861,13 @@ void Relooper::Calculate(Block *Entry) {
       // and all its children.
 
       for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
-        BlockSet &CurrGroup = IndependentGroups[*iter];
+        BlockSet &CurrGroup = Helper.GetGroup(*iter);
         BlockList ToInvalidate;
         for (BlockSet::iterator iter = CurrGroup.begin(); iter != CurrGroup.end(); iter++) {
           Block *Child = *iter;
           for (BlockBranchMap::iterator iter = Child->BranchesIn.begin(); iter != Child->BranchesIn.end(); iter++) {
             Block *Parent = iter->first;
-            if (Helper.Ownership[Parent] != Helper.Ownership[Child]) {
+            if (Helper.Ownership[Parent->Id] != Helper.Ownership[Child->Id]) {
               ToInvalidate.push_back(Child);
             }
           }
@@ -549,7 +881,7 @@ void Relooper::Calculate(Block *Entry) {
 
       // Remove empty groups
       for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
-        if (IndependentGroups[*iter].size() == 0) {
+        if (Helper.GetGroup(*iter).size() == 0) {
           IndependentGroups.erase(*iter);
         }
       }
@@ -568,7 +900,7 @@ void Relooper::Calculate(Block *Entry) {
       Parent->NeedsLabel = true;
       MultipleShape *Multiple = new MultipleShape(Parent->IdCounter++);
       Notice(Multiple);
-      BlockSet CurrEntries;
+      BlockSet CurrEntries(Parent->BlocksById);
       for (BlockBlockSetMap::iterator iter = IndependentGroups.begin(); iter != IndependentGroups.end(); iter++) {
         Block *CurrEntry = iter->first;
         BlockSet &CurrBlocks = iter->second;
@@ -586,7 +918,7 @@ void Relooper::Calculate(Block *Entry) {
             Block *CurrTarget = iter->first;
             BlockBranchMap::iterator Next = iter;
             Next++;
-            if (CurrBlocks.find(CurrTarget) == CurrBlocks.end()) {
+            if (!CurrBlocks.count(CurrTarget)) {
               NextEntries.insert(CurrTarget);
               Solipsize(CurrTarget, Branch::Break, Multiple, CurrBlocks); 
             }
@@ -618,7 +950,7 @@ void Relooper::Calculate(Block *Entry) {
     Shape *Process(BlockSet &Blocks, BlockSet& InitialEntries, Shape *Prev) {
       PrintDebug("Process() called\n");
       BlockSet *Entries = &InitialEntries;
-      BlockSet TempEntries[2];
+      BlockSet TempEntries[2] = { BlockSet(Parent->BlocksById), BlockSet(Parent->BlocksById) };
       int CurrTempIndex = 0;
       BlockSet *NextEntries;
       Shape *Ret = NULL;
@@ -667,7 +999,7 @@ void Relooper::Calculate(Block *Entry) {
             BlockBlockSetMap::iterator curr = iter++; // iterate carefully, we may delete
             for (BlockBranchMap::iterator iterBranch = Entry->BranchesIn.begin(); iterBranch != Entry->BranchesIn.end(); iterBranch++) {
               Block *Origin = iterBranch->first;
-              if (Group.find(Origin) == Group.end()) {
+              if (!Group.count(Origin)) {
                 // Reached from outside the group, so we cannot handle this
                 PrintDebug("Cannot handle group with entry %d because of incoming branch from %d\n", Entry->Id, Origin->Id);
                 IndependentGroups.erase(curr);
@@ -700,12 +1032,12 @@ void Relooper::Calculate(Block *Entry) {
               }
               // Check if dead end
               bool DeadEnd = true;
-              BlockSet &SmallGroup = IndependentGroups[SmallEntry];
+              BlockSet &SmallGroup = IndependentGroups.find(SmallEntry)->second;
               for (BlockSet::iterator iter = SmallGroup.begin(); iter != SmallGroup.end(); iter++) {
                 Block *Curr = *iter;
                 for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
                   Block *Target = iter->first;
-                  if (SmallGroup.find(Target) == SmallGroup.end()) {
+                  if (!SmallGroup.count(Target)) {
                     DeadEnd = false;
                     break;
                   }
@@ -734,7 +1066,7 @@ void Relooper::Calculate(Block *Entry) {
 
   // Main
 
-  BlockSet AllBlocks;
+  BlockSet AllBlocks(BlocksById);
   for (unsigned int i = 0; i < Blocks.size(); i++) {
     AllBlocks.insert(Blocks[i]);
 #if DEBUG
@@ -745,7 +1077,7 @@ void Relooper::Calculate(Block *Entry) {
 #endif
   }
 
-  BlockSet Entries;
+  BlockSet Entries(BlocksById);
   Entries.insert(Entry);
   Root = Analyzer(this).Process(AllBlocks, Entries, NULL);
 
@@ -841,9 +1173,18 @@ void Relooper::Calculate(Block *Entry) {
 
         SHAPE_SWITCH(Root, {
           MultipleShape *Fused = Shape::IsMultiple(Root->Next);
-          // If we are fusing a Multiple with a loop into this Simple, then visit it now
+          bool IsSwitch = Simple->Inner->IsSwitch;
+          // If we are fusing a Multiple with a loop into this Simple, or into the cases of a switch, then visit it now
+          bool VisitFused = Fused && (Fused->NeedLoop || IsSwitch);
           if (Fused && Fused->NeedLoop) {
             LoopStack.push(Fused);
+          }
+          // An unlabeled break in a switch statement would exit the switch, so every break and continue
+          // from the cases must be labeled. The Simple is never an Ancestor, it only hides the loops below it.
+          if (IsSwitch) {
+            LoopStack.push(Simple);
+          }
+          if (VisitFused) {
             RECURSE_MULTIPLE_MANUAL(FindLabeledLoops, Fused);
           }
           for (BlockBranchMap::iterator iter = Simple->Inner->ProcessedBranchesOut.begin(); iter != Simple->Inner->ProcessedBranchesOut.end(); iter++) {
@@ -860,18 +1201,25 @@ void Relooper::Calculate(Block *Entry) {
               }
             }
           }
+          if (IsSwitch) {
+            LoopStack.pop();
+          }
           if (Fused && Fused->NeedLoop) {
             LoopStack.pop();
+          }
+          if (VisitFused) {
             Next = Fused->Next;
           } else {
             Next = Root->Next;
           }
         }, {
-          if (Multiple->NeedLoop) {
+          // As for the switch of a Simple, the breaks and continues from the cases of a switch on the label must be labeled,
+          // unless they break out of this Multiple: leaving the switch is the same as leaving the Multiple
+          if (Multiple->NeedLoop || Multiple->IsSwitch) {
             LoopStack.push(Multiple);
           }
           RECURSE_MULTIPLE(FindLabeledLoops);
-          if (Multiple->NeedLoop) {
+          if (Multiple->NeedLoop || Multiple->IsSwitch) {
             LoopStack.pop();
           }
           Next = Root->Next;
@@ -15,9 +15,9 @@ LLVM.
 
 #ifdef __cplusplus
 
+#include "llvm/ADT/BitVector.h"
 #include <map>
 #include <deque>
-#include <set>
 #include <vector>
 
 struct Block;
@@ -28,12 +28,17 @@ class RenderInterface
 public:
 	virtual void renderBlock(const void* privateBlock) = 0;
 	virtual void renderIfOnLabel(int labelId, bool first) = 0;
+	virtual void renderSwitchOnLabel() = 0;
+	virtual void renderCaseOnLabel(int labelId) = 0;
 	virtual void renderIfBlockBegin(const void* privateBlock, int branchId, bool first) = 0;
 	virtual void renderIfBlockBegin(const void* privateBlock, const std::vector<int>& skipBranchIds, bool first) = 0;
 	virtual void renderElseBlockBegin() = 0;
+	virtual void renderSwitchBlockBegin(const void* privateBlock) = 0;
+	virtual void renderCaseBlockBegin(const void* privateBlock, int branchId) = 0;
+	virtual void renderDefaultBlockBegin() = 0;
 	virtual void renderBlockEnd() = 0;
 	virtual void renderBlockPrologue(const void* privateBlockTo, const void* privateBlockFrom) = 0;
-	virtual bool hasBlockPrologue(const void* privateBlockTo) const = 0;
+	virtual bool hasBlockPrologue(const void* privateBlockTo, const void* privateBlockFrom) const = 0;
 	virtual void renderWhileBlockBegin() = 0;
 	virtual void renderWhileBlockBegin(int labelId) = 0;
 	virtual void renderDoBlockBegin() = 0;
@@ -91,6 +96,8 @@ struct Block {
                         // Since each block *must* branch somewhere, this must be set
   bool IsCheckedMultipleEntry; // If true, we are a multiple entry, so reaching us requires setting the label variable
   bool IsSplittable;
+  bool IsSwitch; // If true, the branches are rendered as the cases of a switch statement instead of a chain of ifs
+  int Size; // The number of instructions, used to bound the code duplicated by node splitting
 
   Block(const void* privateBlock, bool splittable, int Id);
   ~Block();
@@ -176,8 +183,10 @@ struct MultipleShape : public LabeledShape {
   BlockShapeMap InnerMap; // entry block -> shape
   int NeedLoop; // If we have branches, we need a loop. This is a counter of loop requirements,
                 // if we optimize it to 0, the loop is unneeded
+  bool IsSwitch; // If true, the entries are checked with a switch on the label instead of a chain of ifs.
+                 // Used to emulate the irreducible loops, which go through the checks on every iteration
 
-  MultipleShape(int Id) : LabeledShape(Multiple, Id), NeedLoop(0) {}
+  MultipleShape(int Id) : LabeledShape(Multiple, Id), NeedLoop(0), IsSwitch(false) {}
 
   void RenderLoopPrefix(RenderInterface* renderInterface);
   void RenderLoopPostfix(RenderInterface* renderInterface);
@@ -212,12 +221,14 @@ struct EmulatedShape : public Shape {
 // ownership of the blocks and shapes, and frees them when done.
 struct Relooper {
   std::deque<Block*> Blocks;
+  std::vector<Block*> BlocksById; // Filled by Calculate, after the dead ends have been split
   std::deque<Shape*> Shapes;
   Shape *Root;
   bool NeedsLabel;
   int IdCounter;
+  int SplitBudget; // The number of instructions that can be duplicated to make the irreducible loops reducible
 
-  Relooper(int BlockCount);
+  Relooper(int BlockCount, int SplitBudget = 0);
   ~Relooper();
 
   void AddBlock(Block *New);
@@ -231,7 +242,47 @@ struct Relooper {
   bool needsLabel() const { return NeedsLabel; }
 };
 
-typedef std::set<Block*> BlockSet;
+// A set of blocks of a Relooper, iterated in the order of the block ids so that the
+// shapes do not depend on where the blocks are allocated. Small sets are kept as a vector
+// sorted by id, larger ones become a bitset indexed by id, which makes membership tests
+// and removals constant time on the large sets of big functions.
+class BlockSet {
+public:
+  class iterator {
+  public:
+    iterator(const BlockSet *Set, int Pos) : Set(Set), Pos(Pos) {}
+    Block *operator*() const { return Set->IsLarge ? (*Set->BlocksById)[Pos] : Set->Small[Pos]; }
+    iterator &operator++() { Pos = Set->IsLarge ? Set->Large.find_next(Pos) : Pos + 1; return *this; }
+    iterator operator++(int) { iterator Prev = *this; ++*this; return Prev; }
+    bool operator==(const iterator &RHS) const { return Pos == RHS.Pos; }
+    bool operator!=(const iterator &RHS) const { return Pos != RHS.Pos; }
+  private:
+    const BlockSet *Set;
+    int Pos; // The index in Small, or the id of the block in Large
+  };
+
+  explicit BlockSet(const std::vector<Block*> &BlocksById) : BlocksById(&BlocksById), Count(0), IsLarge(false) {}
+
+  // Return false if the block is already in the set
+  bool insert(Block *B);
+  // Return false if the block is not in the set
+  bool erase(Block *B);
+  bool count(Block *B) const;
+  unsigned size() const { return Count; }
+  void clear();
+
+  iterator begin() const { return iterator(this, IsLarge ? Large.find_first() : 0); }
+  iterator end() const { return iterator(this, IsLarge ? -1 : (int)Small.size()); }
+
+private:
+  static const unsigned MaxSmallSize = 16;
+  const std::vector<Block*> *BlocksById;
+  std::vector<Block*> Small;
+  llvm::BitVector Large;
+  unsigned Count;
+  bool IsLarge;
+};
+
 typedef std::map<Block*, BlockSet, OrderBlocksById> BlockBlockSetMap;
 
 #if DEBUG
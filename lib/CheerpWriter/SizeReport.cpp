@@ -0,0 +1,243 @@
+//===-- SizeReport.cpp - Cheerp output size attribution -------------------===//
+//
+//                     Cheerp: The C++ compiler for the Web
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+// Copyright 2015 Leaning Technologies
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/SizeReport.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/Config/config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#if HAVE_CXXABI_H
+#include <cxxabi.h>
+#endif
+
+using namespace llvm;
+
+namespace cheerp
+{
+
+static const char* entityKindNames[SizeReport::NUM_ENTITY_KINDS] =
+	{ "function", "secondaryFunction", "global", "classType", "arrayClassType", "structConstructor", "helper" };
+
+static const char* constructNames[SizeReport::NUM_CONSTRUCTS] =
+	{ "createPointerArray", "createClosure", "handleVAArg", "pointerObject", "typedArrayViewAccess", "dataViewAccess",
+	  "labelVariable", "labelAssignment", "labelCheck" };
+
+SizeReport::SizeReport(bool attributeEntities):totalBytes(0),attributeEntities(attributeEntities)
+{
+	for(uint32_t i=0;i<NUM_CONSTRUCTS;i++)
+		constructCounts[i] = 0;
+}
+
+const char* SizeReport::getConstructName(Construct c)
+{
+	return constructNames[c];
+}
+
+std::string SizeReport::getReadableName(EntityKind kind, StringRef symbol)
+{
+	if(kind == CLASS_TYPE || kind == ARRAY_CLASS_TYPE || kind == STRUCT_CONSTRUCTOR)
+	{
+		// Types keep the clang prefix in their LLVM name
+		for(StringRef prefix: { "class.", "struct.", "union." })
+		{
+			if(symbol.startswith(prefix))
+				return symbol.substr(prefix.size());
+		}
+		return symbol;
+	}
+#if HAVE_CXXABI_H
+	if(symbol.startswith("_Z"))
+	{
+		int status = 0;
+		char* demangled = abi::__cxa_demangle(symbol.str().c_str(), NULL, NULL, &status);
+		if(demangled)
+		{
+			std::string ret(demangled);
+			free(demangled);
+			if(status == 0)
+				return ret;
+		}
+	}
+#endif
+	return symbol;
+}
+
+void SizeReport::addEntity(EntityKind kind, StringRef symbol, uint64_t bytes)
+{
+	if(bytes == 0 || !attributeEntities)
+		return;
+	entities.push_back(Entity{kind, symbol, getReadableName(kind, symbol), bytes});
+}
+
+/**
+ * Split a demangled name in its scopes, ignoring the separators inside template arguments and parameter lists
+ */
+static std::vector<std::string> splitScopes(StringRef name)
+{
+	std::vector<std::string> scopes;
+	uint32_t depth = 0;
+	size_t start = 0;
+	for(size_t i=0;i<name.size();i++)
+	{
+		char c = name[i];
+		if(c == '<')
+			depth++;
+		else if(c == '>' && depth > 0)
+			depth--;
+		else if(c == '(' && depth == 0 && i > 0)
+		{
+			// The parameters are part of the last scope, so that overloads are kept apart
+			break;
+		}
+		else if(c == ':' && depth == 0 && i + 1 < name.size() && name[i+1] == ':')
+		{
+			scopes.push_back(name.slice(start, i));
+			start = i + 2;
+			i++;
+		}
+	}
+	scopes.push_back(name.substr(start));
+	return scopes;
+}
+
+namespace
+{
+
+struct TreeNode
+{
+	TreeNode():value(0)
+	{
+	}
+	uint64_t value;
+	std::map<std::string, std::unique_ptr<TreeNode>> children;
+	TreeNode& getChild(const std::string& name)
+	{
+		std::unique_ptr<TreeNode>& child = children[name];
+		if(!child)
+			child.reset(new TreeNode);
+		return *child;
+	}
+	void write(raw_ostream& out, StringRef name, uint32_t indent) const
+	{
+		out.indent(indent) << "{ \"name\": ";
+		writeJSONString(out, name);
+		out << ", \"value\": " << value;
+		if(!children.empty())
+		{
+			out << ", \"children\": [\n";
+			bool first = true;
+			for(const auto& child: children)
+			{
+				if(!first)
+					out << ",\n";
+				first = false;
+				child.second->write(out, child.first, indent + 2);
+			}
+			out << "\n";
+			out.indent(indent) << "]";
+		}
+		out << " }";
+	}
+};
+
+}
+
+bool SizeReport::writeJSON(const std::string& fileName, std::string& ErrorString) const
+{
+	tool_output_file file(fileName.c_str(), ErrorString, sys::fs::F_None);
+	if(!ErrorString.empty())
+		return false;
+	raw_fd_ostream& out = file.os();
+
+	// Sort the entities, so that reports of different builds can be compared line by line
+	std::vector<const Entity*> sortedEntities;
+	for(const Entity& e: entities)
+		sortedEntities.push_back(&e);
+	std::sort(sortedEntities.begin(), sortedEntities.end(), [](const Entity* a, const Entity* b)
+		{
+			if(a->kind != b->kind)
+				return a->kind < b->kind;
+			if(a->name != b->name)
+				return a->name < b->name;
+			return a->symbol < b->symbol;
+		});
+
+	uint64_t kindBytes[NUM_ENTITY_KINDS] = { 0 };
+	TreeNode root;
+	for(const Entity* e: sortedEntities)
+	{
+		kindBytes[e->kind] += e->bytes;
+		TreeNode* node = &root.getChild(entityKindNames[e->kind]);
+		for(const std::string& scope: splitScopes(e->name))
+			node = &node->getChild(scope);
+		node->value += e->bytes;
+	}
+	// The values of the inner nodes are the sums of their children
+	std::function<uint64_t(TreeNode&)> computeValues = [&computeValues](TreeNode& node)
+		{
+			for(auto& child: node.children)
+				node.value += computeValues(*child.second);
+			return node.value;
+		};
+	uint64_t attributedBytes = 0;
+	for(uint32_t i=0;i<NUM_ENTITY_KINDS;i++)
+	{
+		if(i != SECONDARY_FUNCTION)
+			attributedBytes += kindBytes[i];
+	}
+	// Everything which is not part of an entity, like the code to start the program
+	if(totalBytes > attributedBytes)
+		root.getChild("other").value = totalBytes - attributedBytes;
+	computeValues(root);
+
+	out << "{\n";
+	out << "  \"totalBytes\": " << totalBytes << ",\n";
+	out << "  \"kinds\": {\n";
+	for(uint32_t i=0;i<NUM_ENTITY_KINDS;i++)
+		out << "    \"" << entityKindNames[i] << "\": " << kindBytes[i] << ",\n";
+	out << "    \"other\": " << (totalBytes > attributedBytes ? totalBytes - attributedBytes : 0) << "\n";
+	out << "  },\n";
+	out << "  \"constructs\": {\n";
+	for(uint32_t i=0;i<NUM_CONSTRUCTS;i++)
+		out << "    \"" << constructNames[i] << "\": " << constructCounts[i].load() << (i + 1 < NUM_CONSTRUCTS ? ",\n" : "\n");
+	out << "  },\n";
+	out << "  \"entities\": [\n";
+	for(uint32_t i=0;i<sortedEntities.size();i++)
+	{
+		const Entity* e = sortedEntities[i];
+		out << "    { \"kind\": \"" << entityKindNames[e->kind] << "\", \"name\": ";
+		writeJSONString(out, e->name);
+		out << ", \"symbol\": ";
+		writeJSONString(out, e->symbol);
+		out << ", \"bytes\": " << e->bytes << (i + 1 < sortedEntities.size() ? " },\n" : " }\n");
+	}
+	out << "  ],\n";
+	out << "  \"tree\":\n";
+	root.write(out, "all", 4);
+	out << "\n}\n";
+
+	if(out.has_error())
+	{
+		ErrorString = "Cannot write the size report";
+		out.clear_error();
+		return false;
+	}
+	file.keep();
+	return true;
+}
+
+}
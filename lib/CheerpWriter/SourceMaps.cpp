@@ -10,6 +10,8 @@
 //===----------------------------------------------------------------------===//
 
 #include "llvm/Cheerp/SourceMaps.h"
+#include "llvm/Cheerp/Utility.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/Support/Path.h"
 
@@ -18,100 +20,165 @@ using namespace llvm;
 namespace cheerp
 {
 
-SourceMapGenerator::SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, llvm::LLVMContext& C, std::string& ErrorString):
-	sourceMap(sourceMapName.c_str(), ErrorString, sys::fs::F_None), sourceMapName(sourceMapName), sourceMapPrefix(sourceMapPrefix),
-	Ctx(C), lastFile(0), lastLine(0), lastColoumn(0), validInfo(false), lineStart(true)
+SourceMapGenerator::SourceMapGenerator(const std::string& sourceMapName, const std::string& sourceMapPrefix, llvm::LLVMContext& C,
+                                       bool compress, std::string& ErrorString):
+	sourceMap(sourceMapName.c_str(), ErrorString, sys::fs::F_None), sourceMapStream(&sourceMap.os()), sourceMapName(sourceMapName),
+	sourceMapPrefix(sourceMapPrefix), Ctx(C), lastFile(0), lastLine(0), lastColoumn(0), lastName(0), lastGeneratedColoumn(0),
+	hasPendingSegment(false), validInfo(false), lineStart(true)
 {
+	if(compress && ErrorString.empty())
+	{
+		compressedSourceMap.reset(new CompressedOutputStream(sourceMap.os()));
+		sourceMapStream = compressedSourceMap.get();
+	}
 }
 
 static char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-void SourceMapGenerator::writeBase64VLQInt(int i)
+char* SourceMapGenerator::writeBase64VLQInt(char* out, int32_t i)
 {
 	// The sign is encoded as the least significant bit
+	uint32_t v;
 	if (i < 0)
-		i = ((-i) << 1) | 1;
+		v = (uint32_t(-int64_t(i)) << 1) | 1;
 	else
-		i = i << 1;
+		v = uint32_t(i) << 1;
 	do
 	{
 		// 5 bit of data, 1 of continuation
-		int base64Char = i & 0x1f;
-		i >>= 5;
-		if(i)
+		int base64Char = v & 0x1f;
+		v >>= 5;
+		if(v)
 			base64Char |= 0x20;
-		sourceMap.os() << base64Chars[base64Char];
+		*out++ = base64Chars[base64Char];
 	}
-	while(i);
+	while(v);
+	return out;
 }
 
-void SourceMapGenerator::setDebugLoc(const llvm::DebugLoc& debugLoc)
+uint32_t SourceMapGenerator::getFileIndex(MDNode* scope)
 {
+	assert(scope->getNumOperands()>=2);
+	MDNode* fileNamePath = cast<MDNode>(scope->getOperand(1));
+	assert(fileNamePath->getNumOperands()==2);
+	MDString* fileNameString = cast<MDString>(fileNamePath->getOperand(0));
+
+	auto fileMapIt = fileMap.find(fileNameString);
+	if (fileMapIt == fileMap.end())
+		fileMapIt = fileMap.insert(std::make_pair(fileNameString, fileMap.size())).first;
+	return fileMapIt->second;
+}
+
+void SourceMapGenerator::addSegment(const Segment& segment)
+{
+	// A later location for the same coloumn replaces the pending one
+	if(hasPendingSegment && pendingSegment.generatedColoumn != segment.generatedColoumn)
+		writeSegment(pendingSegment);
+	pendingSegment = segment;
+	hasPendingSegment = true;
+}
+
+void SourceMapGenerator::writeSegment(const Segment& segment)
+{
+	// The separator and 5 fields of at most 7 characters each
+	char buffer[36];
+	char* out = buffer;
 	if(!lineStart)
+		*out++ = ',';
+	// The generated coloumn is relative to the previous segment in the same line.
+	// Other fields are encoded as difference from the previous one in the file
+	// We can use the last value directly because it is initialized as 0
+	out = writeBase64VLQInt(out, segment.generatedColoumn - lastGeneratedColoumn);
+	// File index
+	out = writeBase64VLQInt(out, segment.file - lastFile);
+	// Line index
+	out = writeBase64VLQInt(out, segment.line - lastLine);
+	// Coloumn index
+	out = writeBase64VLQInt(out, segment.coloumn - lastColoumn);
+	// Name index, if any
+	if(segment.name >= 0)
 	{
-		//TODO: Support multi-segment
-	}
-	else
-	{
-		// Start a new line
-		MDNode* file = debugLoc.getScope(Ctx);
-		assert(file->getNumOperands()>=2);
-		MDNode* fileNamePath = cast<MDNode>(file->getOperand(1));
-		assert(fileNamePath->getNumOperands()==2);
-		MDString* fileNameString = cast<MDString>(fileNamePath->getOperand(0));
-
-		auto fileMapIt = fileMap.find(fileNameString);
-		if (fileMapIt == fileMap.end())
-			fileMapIt = fileMap.insert(std::make_pair(fileNameString, fileMap.size())).first;
-		uint32_t currentFile = fileMapIt->second;
-		uint32_t currentLine = debugLoc.getLine() - 1;
-		uint32_t currentColoumn = debugLoc.getCol();
-		// Starting coloumn in the generated code
-		writeBase64VLQInt(0);
-		// Other fields are encoded as difference from the previous one in the file
-		// We can use the last value directly because it is initialized as 0
-		// File index
-		writeBase64VLQInt(currentFile - lastFile);
-		// Line index
-		writeBase64VLQInt(currentLine - lastLine);
-		// Coloumn index
-		writeBase64VLQInt(currentColoumn - lastColoumn);
-		lastFile = currentFile;
-		lastLine = currentLine;
-		lastColoumn = currentColoumn;
+		out = writeBase64VLQInt(out, segment.name - lastName);
+		lastName = segment.name;
 	}
+	sourceMapStream->write(buffer, out - buffer);
+	lastGeneratedColoumn = segment.generatedColoumn;
+	lastFile = segment.file;
+	lastLine = segment.line;
+	lastColoumn = segment.coloumn;
 	lineStart = false;
 }
 
+void SourceMapGenerator::setDebugLoc(const llvm::DebugLoc& debugLoc, uint32_t generatedColoumn)
+{
+	Segment segment;
+	segment.generatedColoumn = generatedColoumn;
+	segment.file = getFileIndex(debugLoc.getScope(Ctx));
+	segment.line = debugLoc.getLine() - 1;
+	segment.coloumn = debugLoc.getCol();
+	segment.name = -1;
+	addSegment(segment);
+}
+
+void SourceMapGenerator::setFunctionName(const llvm::DebugLoc& debugLoc, uint32_t generatedColoumn)
+{
+	// The scope node of an inlined location is the one of the function it has been inlined into
+	DISubprogram subprogram = getDISubprogram(debugLoc.getScopeNode(Ctx));
+	if(!subprogram)
+		return;
+	StringRef name = subprogram.getDisplayName();
+	if(name.empty())
+		name = subprogram.getName();
+	if(name.empty())
+		return;
+	Segment segment;
+	segment.generatedColoumn = generatedColoumn;
+	segment.file = getFileIndex(subprogram);
+	segment.line = subprogram.getLineNumber() - 1;
+	segment.coloumn = 0;
+	segment.name = nameMap.GetOrCreateValue(name, nameMap.size()).getValue();
+	addSegment(segment);
+}
+
 void SourceMapGenerator::beginFile()
 {
 	// Output the prologue of the file
-	sourceMap.os() << "{\n";
-	sourceMap.os() << "\"version\": 3,\n";
-	sourceMap.os() << "\"names\": [],\n";
-	sourceMap.os() << "\"mappings\": \"";
+	*sourceMapStream << "{\n";
+	*sourceMapStream << "\"version\": 3,\n";
+	*sourceMapStream << "\"mappings\": \"";
 }
 
 void SourceMapGenerator::finishLine()
 {
 	assert(!validInfo);
-	sourceMap.os() << ";";
+	if(hasPendingSegment)
+	{
+		writeSegment(pendingSegment);
+		hasPendingSegment = false;
+	}
+	*sourceMapStream << ";";
 	lineStart = true;
+	lastGeneratedColoumn = 0;
 }
 
 void SourceMapGenerator::endFile()
 {
+	if(hasPendingSegment)
+	{
+		writeSegment(pendingSegment);
+		hasPendingSegment = false;
+	}
 	// Output the prologue of the file
-	sourceMap.os() << "\",\n";
+	*sourceMapStream << "\",\n";
 	// Output file names
 	SmallVector<MDString*, 10> files(fileMap.size(), NULL);
 	for(auto mapItem: fileMap)
 		files[mapItem.second] = mapItem.first;
-	sourceMap.os() << "\"sources\": [";
+	*sourceMapStream << "\"sources\": [";
 	for(uint32_t i=0;i<files.size();i++)
 	{
 		if(i!=0)
-			sourceMap.os() << ',';
+			*sourceMapStream << ',';
 		// Fix slashes in the file path
 		std::string tmp;
 		StringRef string=files[i]->getString();
@@ -126,10 +193,24 @@ void SourceMapGenerator::endFile()
 				c='/';
 			tmp.push_back(c);
 		}
-		sourceMap.os() << '"' << tmp << '"';
+		writeJSONString(*sourceMapStream, tmp);
+	}
+	*sourceMapStream << "],\n";
+	// Output function names
+	SmallVector<StringRef, 10> names(nameMap.size());
+	for(auto& mapItem: nameMap)
+		names[mapItem.getValue()] = mapItem.getKey();
+	*sourceMapStream << "\"names\": [";
+	for(uint32_t i=0;i<names.size();i++)
+	{
+		if(i!=0)
+			*sourceMapStream << ',';
+		writeJSONString(*sourceMapStream, names[i]);
 	}
-	sourceMap.os() << "]\n";
-	sourceMap.os() << "}\n";
+	*sourceMapStream << "]\n";
+	*sourceMapStream << "}\n";
+	if(compressedSourceMap)
+		compressedSourceMap->close();
 	sourceMap.keep();
 }
 
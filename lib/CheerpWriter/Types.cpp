@@ -94,13 +94,23 @@ uint32_t CheerpWriter::compileComplexType(Type* t, COMPILE_TYPE_STYLE style, Str
 
 	bool useVarName = !varName.empty();
 
-	// We only need to split large objects with the LITERAL_OBJ style
-	assert(!useVarName || style == LITERAL_OBJ);
+	// We only need to split large objects with the LITERAL_OBJ style, and the members passed to their constructors
+	assert(!useVarName || style != THIS_OBJ);
 
 	uint32_t numElements = (t->getTypeID() == Type::StructTyID) ? cast<StructType>(t)->getNumElements() : 0;
 	bool shouldReturnElementsCount = true;
 
-	if(useVarName && (maxDepth == 0 || ((totalLiteralProperties + numElements) > V8MaxLiteralProperties)))
+	if(style == LITERAL_OBJ && t->isStructTy() && useStructConstructor(cast<StructType>(t)))
+	{
+		// The constructor also takes care of the downcast array.
+		// The object is not a literal, so there is no need to split it.
+		stream << "new C" << namegen.getTypeName(t) << '(';
+		compileComplexType(t, CONSTRUCTOR_ARGS, varName, maxDepth, totalLiteralProperties);
+		stream << ')';
+		return 1;
+	}
+
+	if(useVarName && style == LITERAL_OBJ && (maxDepth == 0 || ((totalLiteralProperties + numElements) > V8MaxLiteralProperties)))
 	{
 		// If this struct have more than V8MaxLiteralProperties there is no point in splitting it anyway
 		if(numElements <= V8MaxLiteralProperties)
@@ -134,10 +144,11 @@ uint32_t CheerpWriter::compileComplexType(Type* t, COMPILE_TYPE_STYLE style, Str
 			}
 			if(style==THIS_OBJ)
 				stream << "this.";
-			stream << types.getPrefixCharForMember(PA, st, i) << i;
+			if(style!=CONSTRUCTOR_ARGS)
+				stream << types.getPrefixCharForMember(PA, st, i) << i;
 			if(style==THIS_OBJ)
 				stream << '=';
-			else
+			else if(style==LITERAL_OBJ)
 				stream << ':';
 			// Create a wrapper array for all members which require REGULAR pointers, if they are not already covered by the downcast array
 			TypeAndIndex baseAndIndex(st, i, TypeAndIndex::STRUCT_MEMBER);
@@ -179,15 +190,16 @@ uint32_t CheerpWriter::compileComplexType(Type* t, COMPILE_TYPE_STYLE style, Str
 			if(addDowncastArray)
 				stream << ')';
 		}
-		else if(addDowncastArray)
+		else if(addDowncastArray && style == THIS_OBJ)
 		{
-			assert(style == THIS_OBJ);
+			if(st->getNumElements())
+				stream << ';' << NewLine;
 			stream << "create" << namegen.getTypeName(cast<StructType>(t)) << "(this)";
 		}
 	}
 	else
 	{
-		assert(style == LITERAL_OBJ);
+		assert(style != THIS_OBJ);
 		ArrayType* at=cast<ArrayType>(t);
 		Type* element = at->getElementType();
 		assert(!(types.isTypedArrayType(element, /* forceTypedArray*/ false) && at->getNumElements()>1));
@@ -258,6 +270,33 @@ void CheerpWriter::compileClassType(StructType* T)
 	stream << "return obj;}" << NewLine;
 }
 
+bool CheerpWriter::useStructConstructor(StructType* T) const
+{
+	// Only types with a name from GlobalDepsAnalyzer::classesUsed have a constructor
+	return useStructConstructors && !T->hasByteLayout() && globalDeps.classesUsed().count(T);
+}
+
+void CheerpWriter::compileStructConstructor(StructType* T)
+{
+	// The parameters have the same names as the members
+	stream << "function C" << namegen.getTypeName(T) << '(';
+	for(uint32_t i=0;i<T->getNumElements();i++)
+	{
+		if(i!=0)
+			stream << ',';
+		stream << types.getPrefixCharForMember(PA, T, i) << i;
+	}
+	stream << "){" << NewLine;
+	for(uint32_t i=0;i<T->getNumElements();i++)
+	{
+		char prefix = types.getPrefixCharForMember(PA, T, i);
+		stream << "this." << prefix << i << '=' << prefix << i << ';' << NewLine;
+	}
+	if(types.hasBasesInfo(T))
+		stream << "create" << namegen.getTypeName(T) << "(this);" << NewLine;
+	stream << '}' << NewLine;
+}
+
 void CheerpWriter::compileArrayClassType(Type* T)
 {
 	stream << "function createArray";
@@ -271,7 +310,7 @@ void CheerpWriter::compileArrayClassType(Type* T)
 
 void CheerpWriter::compileArrayPointerType()
 {
-	stream << "function createPointerArray(ret,start,end) { for(var __i__=start;__i__<end;__i__++) ret[__i__]={ d: nullArray, o: 0}; return ret; }"
+	stream << "function createPointerArray(ret,start,end,nullPtr) { for(var __i__=start;__i__<end;__i__++) ret[__i__]=nullPtr; return ret; }"
 		<< NewLine;
 }
 
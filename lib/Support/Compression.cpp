@@ -17,6 +17,7 @@
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
 #if LLVM_ENABLE_ZLIB == 1 && HAVE_ZLIB_H
 #include <zlib.h>
 #endif
@@ -84,6 +85,57 @@ uint32_t zlib::crc32(StringRef Buffer) {
   return ::crc32(0, (const Bytef *)Buffer.data(), Buffer.size());
 }
 
+struct zlib::GzipCompressor::Stream {
+  z_stream Z;
+  Status Res;
+};
+
+zlib::GzipCompressor::GzipCompressor(raw_ostream &Output,
+                                     CompressionLevel Level)
+    : Output(Output), State(new Stream()) {
+  // Adding 16 to the window bits selects the gzip header and trailer
+  State->Res = encodeZlibReturnValue(
+      ::deflateInit2(&State->Z, encodeZlibCompressionLevel(Level), Z_DEFLATED,
+                     15 + 16, 8, Z_DEFAULT_STRATEGY));
+}
+
+zlib::GzipCompressor::~GzipCompressor() {
+  // The stream is zero initialized, so this is safe even if deflateInit2 failed
+  ::deflateEnd(&State->Z);
+}
+
+static zlib::Status deflateToStream(z_stream &Z, raw_ostream &Output,
+                                    int Flush) {
+  char Buffer[16384];
+  do {
+    Z.next_out = (Bytef *)Buffer;
+    Z.avail_out = sizeof(Buffer);
+    int Ret = ::deflate(&Z, Flush);
+    if (Ret == Z_STREAM_ERROR)
+      return zlib::StatusInvalidArg;
+    // Tell MSan that memory initialized by zlib is valid.
+    __msan_unpoison(Buffer, sizeof(Buffer) - Z.avail_out);
+    Output.write(Buffer, sizeof(Buffer) - Z.avail_out);
+  } while (Z.avail_out == 0);
+  return zlib::StatusOK;
+}
+
+zlib::Status zlib::GzipCompressor::compress(StringRef Input) {
+  if (State->Res != StatusOK)
+    return State->Res;
+  State->Z.next_in = (Bytef *)Input.data();
+  State->Z.avail_in = Input.size();
+  return State->Res = deflateToStream(State->Z, Output, Z_NO_FLUSH);
+}
+
+zlib::Status zlib::GzipCompressor::finish() {
+  if (State->Res != StatusOK)
+    return State->Res;
+  State->Z.next_in = NULL;
+  State->Z.avail_in = 0;
+  return State->Res = deflateToStream(State->Z, Output, Z_FINISH);
+}
+
 #else
 bool zlib::isAvailable() { return false; }
 zlib::Status zlib::compress(StringRef InputBuffer,
@@ -99,5 +151,16 @@ zlib::Status zlib::uncompress(StringRef InputBuffer,
 uint32_t zlib::crc32(StringRef Buffer) {
   llvm_unreachable("zlib::crc32 is unavailable");
 }
+struct zlib::GzipCompressor::Stream {};
+zlib::GzipCompressor::GzipCompressor(raw_ostream &Output,
+                                     CompressionLevel Level)
+    : Output(Output) {}
+zlib::GzipCompressor::~GzipCompressor() {}
+zlib::Status zlib::GzipCompressor::compress(StringRef Input) {
+  return zlib::StatusUnsupported;
+}
+zlib::Status zlib::GzipCompressor::finish() {
+  return zlib::StatusUnsupported;
+}
 #endif
 
@@ -18,11 +18,23 @@
 #include "llvm/IR/Type.h"
 #include "llvm/Cheerp/Writer.h"
 #include "llvm/Cheerp/AllocaMerging.h"
+#include "llvm/Cheerp/CompressedStream.h"
+#include "llvm/Cheerp/I64Lowering.h"
+#include "llvm/Cheerp/NameGenerator.h"
+#include "llvm/Cheerp/OutputCache.h"
 #include "llvm/Cheerp/PointerPasses.h"
 #include "llvm/Cheerp/Registerize.h"
 #include "llvm/Cheerp/ResolveAliases.h"
+#include "llvm/Cheerp/SizeReport.h"
 #include "llvm/Cheerp/SourceMaps.h"
+#include "llvm/Cheerp/SwitchLowering.h"
+#include "llvm/Cheerp/TimeReport.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ToolOutputFile.h"
 
 using namespace llvm;
 
@@ -32,6 +44,8 @@ static cl::opt<std::string> SourceMap("cheerp-sourcemap", cl::Optional,
 static cl::opt<std::string> SourceMapPrefix("cheerp-sourcemap-prefix", cl::Optional,
   cl::desc("If specified, this prefix will be removed from source map file paths"), cl::value_desc("path"));
 
+static cl::opt<bool> CompressOutput("cheerp-compress-output", cl::desc("Compress the JavaScript output and the source map in the gzip format") );
+
 static cl::opt<bool> PrettyCode("cheerp-pretty-code", cl::desc("Generate human-readable JS") );
 
 static cl::opt<bool> NoRegisterize("cheerp-no-registerize", cl::desc("Disable registerize pass") );
@@ -39,6 +53,58 @@ static cl::opt<bool> NoRegisterize("cheerp-no-registerize", cl::desc("Disable re
 static cl::opt<bool> NoNativeJavaScriptMath("cheerp-no-native-math", cl::desc("Disable native JavaScript math functions") );
 
 static cl::opt<bool> NoJavaScriptMathImul("cheerp-no-math-imul", cl::desc("Disable JavaScript Math.imul") );
+static cl::opt<bool> JavaScriptMathFround("cheerp-math-fround", cl::desc("Round single precision float operations with JavaScript Math.fround") );
+
+static cl::opt<bool> ArenaHeap("cheerp-arena-heap", cl::desc("Allocate typed arrays and byte layout objects from ArrayBuffer arenas, pointers are still JavaScript objects") );
+
+static cl::opt<bool> StructConstructors("cheerp-struct-constructors", cl::desc("Create structs with a constructor function for each type instead of object literals") );
+
+static cl::opt<bool> StaticFrames("cheerp-static-frames", cl::desc("Preallocate the allocas of functions which are never active more than once at the same time") );
+
+static cl::opt<bool> LazyGlobals("cheerp-lazy-globals", cl::desc("Initialize aggregate globals on first access instead of at load time") );
+
+static cl::opt<unsigned> MemCpyUnrollLimit("cheerp-memcpy-unroll-limit", cl::init(8), cl::value_desc("N"),
+  cl::desc("Maximum number of elements copied by memcpy with unrolled code") );
+
+static cl::opt<unsigned> MemCpyLoopLimit("cheerp-memcpy-loop-limit", cl::init(16), cl::value_desc("N"),
+  cl::desc("Maximum number of elements copied by memcpy with a loop, larger copies use TypedArray.set") );
+
+static cl::opt<unsigned> RelooperSplitBudget("cheerp-relooper-split-budget", cl::init(200), cl::value_desc("N"),
+  cl::desc("Maximum number of instructions duplicated in each function to make the irreducible loops reducible, 0 disables it") );
+
+static cl::opt<unsigned> IndirectCallTargets("cheerp-indirect-call-targets", cl::init(0), cl::value_desc("N"),
+  cl::desc("Maximum number of possible targets of an indirect call which are tried with guarded direct calls, 0 disables it") );
+
+static cl::opt<unsigned> CheerpJobs("cheerp-jobs", cl::init(1), cl::value_desc("N"),
+  cl::desc("Number of threads used to compile functions, the output does not depend on it") );
+
+static cl::opt<std::string> OutputCacheDir("cheerp-cache-dir", cl::Optional,
+  cl::desc("If specified, reuse the code of the functions which did not change since the previous compilation from this directory. "
+           "It also enables names which only depend on each function. It is not used when generating source maps. "
+           "Entries are never removed, the subdirectories of old compiler builds can be deleted"), cl::value_desc("directory"));
+
+static cl::opt<std::string> SplitFunctions("cheerp-split-functions", cl::Optional,
+  cl::desc("If specified, the file name of a list of functions, one per line, which are moved with their dependencies to a lazily loaded chunk"), cl::value_desc("filename"));
+
+static cl::opt<std::string> SplitOutput("cheerp-split-output", cl::Optional,
+  cl::desc("The file name of the lazily loaded chunk, it must be in the same directory of the main output"), cl::value_desc("filename"));
+
+static cl::opt<unsigned> BinaryConstantThreshold("cheerp-binary-constant-threshold", cl::init(1024), cl::value_desc("bytes"),
+  cl::desc("Minimum size of constant typed arrays which are encoded in base64 or in the binary data file, 0 disables the encoding") );
+
+static cl::opt<std::string> BinaryData("cheerp-binary-data", cl::Optional,
+  cl::desc("If specified, the file name where large constants of global initializers are stored, it must be in the same directory of the main output"), cl::value_desc("filename"));
+
+static cl::opt<bool> Instrument("cheerp-instrument", cl::desc("Count the executions of each block and edge, the profile is returned by cheerpDumpProfile()") );
+
+static cl::opt<std::string> ProfileUse("cheerp-profile-use", cl::Optional,
+  cl::desc("Order and split the blocks using the profile collected with -cheerp-instrument"), cl::value_desc("filename") );
+
+static cl::opt<std::string> TimeReport("cheerp-time-report", cl::Optional,
+  cl::desc("If specified, the file name of a JSON report of the time and memory used by each pass"), cl::value_desc("filename"));
+
+static cl::opt<std::string> SizeReport("cheerp-size-report", cl::Optional,
+  cl::desc("If specified, the file name of a JSON report of the bytes generated for each function, global and type"), cl::value_desc("filename"));
 
 extern "C" void LLVMInitializeCheerpBackendTarget() {
   // Register the target.
@@ -49,11 +115,16 @@ namespace {
   class CheerpWritePass : public ModulePass {
   private:
     formatted_raw_ostream &Out;
+    // Owned by the pass, it may be NULL
+    cheerp::TimeReport* timeReport;
     static char ID;
     void getAnalysisUsage(AnalysisUsage& AU) const;
   public:
-    explicit CheerpWritePass(formatted_raw_ostream &o) :
-      ModulePass(ID), Out(o) { }
+    explicit CheerpWritePass(formatted_raw_ostream &o, cheerp::TimeReport* r) :
+      ModulePass(ID), Out(o), timeReport(r) { }
+    ~CheerpWritePass() {
+      delete timeReport;
+    }
     bool runOnModule(Module &M);
     const char *getPassName() const {
 	return "CheerpWritePass";
@@ -66,11 +137,13 @@ bool CheerpWritePass::runOnModule(Module& M)
   cheerp::PointerAnalyzer &PA = getAnalysis<cheerp::PointerAnalyzer>();
   cheerp::GlobalDepsAnalyzer &GDA = getAnalysis<cheerp::GlobalDepsAnalyzer>();
   cheerp::Registerize &registerize = getAnalysis<cheerp::Registerize>();
+  if (CompressOutput && !zlib::isAvailable())
+    llvm::report_fatal_error("-cheerp-compress-output requires zlib", false);
   cheerp::SourceMapGenerator* sourceMapGenerator = NULL;
   if (!SourceMap.empty())
   {
     std::string ErrorString;
-    sourceMapGenerator = new cheerp::SourceMapGenerator(SourceMap, SourceMapPrefix, M.getContext(), ErrorString);
+    sourceMapGenerator = new cheerp::SourceMapGenerator(SourceMap, SourceMapPrefix, M.getContext(), CompressOutput, ErrorString);
     if (!ErrorString.empty())
     {
        // An error occurred opening the source map file, bail out
@@ -81,10 +154,107 @@ bool CheerpWritePass::runOnModule(Module& M)
   }
   PA.fullResolve();
   PA.computeConstantOffsets(M);
+  if (timeReport)
+  {
+    timeReport->endPhase("PointerAnalyzer::fullResolve", M);
+    timeReport->addCounter("pointersAnalyzed", PA.getNumAnalyzedPointers());
+    timeReport->addCounter("constraintsResolved", PA.getNumConstraints());
+  }
   registerize.assignRegisters(M, PA);
-  cheerp::CheerpWriter writer(M, Out, PA, registerize, GDA, sourceMapGenerator, PrettyCode, NoRegisterize, !NoNativeJavaScriptMath, !NoJavaScriptMathImul);
+  if (timeReport)
+  {
+    timeReport->endPhase("Registerize::assignRegisters", M);
+    timeReport->addCounter("registersAssigned", registerize.getNumRegisteredInstructions());
+  }
+  std::unique_ptr<tool_output_file> secondaryChunk;
+  if (!SplitFunctions.empty())
+  {
+    if (SplitOutput.empty())
+      llvm::report_fatal_error("-cheerp-split-functions requires -cheerp-split-output", false);
+    std::unique_ptr<MemoryBuffer> list;
+    if (error_code ec = MemoryBuffer::getFile(SplitFunctions, list))
+      llvm::report_fatal_error("Cannot read " + SplitFunctions + ": " + ec.message(), false);
+    std::vector<const Function*> entryPoints;
+    SmallVector<StringRef, 16> lines;
+    list->getBuffer().split(lines, "\n", -1, false);
+    for (StringRef line: lines)
+    {
+      // Unknown names are ignored, the functions may have been removed as unused
+      if (const Function* F = M.getFunction(line.trim()))
+        entryPoints.push_back(F);
+    }
+    GDA.splitFunctions(M, entryPoints);
+    std::string ErrorString;
+    secondaryChunk.reset(new tool_output_file(SplitOutput.c_str(), ErrorString, sys::fs::F_Text));
+    if (!ErrorString.empty())
+      llvm::report_fatal_error(ErrorString.c_str(), false);
+  }
+  std::unique_ptr<tool_output_file> binaryData;
+  if (!BinaryData.empty())
+  {
+    std::string ErrorString;
+    binaryData.reset(new tool_output_file(BinaryData.c_str(), ErrorString, sys::fs::F_None));
+    if (!ErrorString.empty())
+      llvm::report_fatal_error(ErrorString.c_str(), false);
+  }
+  std::unique_ptr<cheerp::ProfileData> profile;
+  if (!ProfileUse.empty())
+  {
+    std::string ErrorString;
+    profile.reset(new cheerp::ProfileData());
+    if (!profile->load(ProfileUse, ErrorString))
+      llvm::report_fatal_error(("Cannot read profile " + ProfileUse + ": " + ErrorString).c_str(), false);
+  }
+  // The output is compressed while it is generated
+  std::unique_ptr<cheerp::CompressedOutputStream> compressedOut;
+  if (CompressOutput)
+    compressedOut.reset(new cheerp::CompressedOutputStream(Out));
+  raw_ostream& jsOut = compressedOut ? *compressedOut : static_cast<raw_ostream&>(Out);
+  uint64_t startOffset = jsOut.tell();
+  std::unique_ptr<cheerp::FunctionOutputCache> functionCache;
+  if (!OutputCacheDir.empty())
+    functionCache.reset(new cheerp::FunctionOutputCache(OutputCacheDir));
+  cheerp::NameGenerator namegen(M, GDA, registerize, PA, PrettyCode, /*makeStableNames*/ functionCache != NULL);
+  if (CheerpJobs > 1)
+    PA.prepareForConcurrentQueries(M);
+  // The time report only needs the construct counts
+  std::unique_ptr<cheerp::SizeReport> sizeReport;
+  if (!SizeReport.empty() || timeReport)
+    sizeReport.reset(new cheerp::SizeReport(/*attributeEntities*/ !SizeReport.empty()));
+  cheerp::CheerpWriter writer(M, jsOut, PA, registerize, GDA, namegen, sourceMapGenerator, PrettyCode, NoRegisterize,
+                              !NoNativeJavaScriptMath, !NoJavaScriptMathImul, JavaScriptMathFround, ArenaHeap, StructConstructors, LazyGlobals,
+                              MemCpyUnrollLimit, MemCpyLoopLimit, RelooperSplitBudget, secondaryChunk ? &secondaryChunk->os() : NULL,
+                              sys::path::filename(SplitOutput), BinaryConstantThreshold,
+                              binaryData ? &binaryData->os() : NULL, sys::path::filename(BinaryData),
+                              Instrument, profile.get(), CheerpJobs, functionCache.get(), sizeReport.get());
   writer.makeJS();
+  if (compressedOut)
+    compressedOut->close();
   delete sourceMapGenerator;
+  if (secondaryChunk)
+    secondaryChunk->keep();
+  if (binaryData)
+    binaryData->keep();
+  if (!SizeReport.empty())
+  {
+    sizeReport->setTotalBytes(jsOut.tell() - startOffset);
+    std::string ErrorString;
+    if (!sizeReport->writeJSON(SizeReport, ErrorString))
+      llvm::report_fatal_error(ErrorString.c_str(), false);
+  }
+  if (timeReport)
+  {
+    timeReport->endPhase("CheerpWriter", M);
+    timeReport->addCounter("bytesEmitted", jsOut.tell() - startOffset);
+    for (uint32_t i = 0; i < cheerp::SizeReport::NUM_CONSTRUCTS; i++)
+    {
+      cheerp::SizeReport::Construct c = (cheerp::SizeReport::Construct)i;
+      timeReport->addCounter(cheerp::SizeReport::getConstructName(c), sizeReport->getConstructCount(c));
+    }
+    std::string ErrorString;
+    if (!timeReport->writeJSON(TimeReport, ErrorString))
+      llvm::report_fatal_error(ErrorString.c_str(), false);
+  }
   return false;
 }
 
@@ -108,17 +278,32 @@ bool CheerpTargetMachine::addPassesToEmitFile(PassManagerBase &PM,
                                            AnalysisID StartAfter,
                                            AnalysisID StopAfter) {
   if (FileType != TargetMachine::CGFT_AssemblyFile) return true;
-  PM.add(createResolveAliasesPass());
-  PM.add(createFreeAndDeleteRemovalPass());
-  PM.add(cheerp::createGlobalDepsAnalyzerPass());
-  PM.add(createPointerArithmeticToArrayIndexingPass());
-  PM.add(createPointerToImmutablePHIRemovalPass());
-  PM.add(cheerp::createRegisterizePass(NoRegisterize));
-  PM.add(cheerp::createPointerAnalyzerPass());
-  PM.add(cheerp::createAllocaMergingPass());
-  PM.add(createIndirectCallOptimizerPass());
-  PM.add(createAllocaArraysPass());
-  PM.add(cheerp::createAllocaArraysMergingPass());
-  PM.add(new CheerpWritePass(o));
+  cheerp::TimeReport* timeReport = TimeReport.empty() ? NULL : new cheerp::TimeReport();
+  // When reporting, each pass is followed by a marker closing its phase.
+  // Function passes are then run one at a time on the whole module instead of being interleaved.
+  auto addPass = [&PM, timeReport](Pass* P, const char* name)
+  {
+    PM.add(P);
+    if (timeReport)
+      PM.add(cheerp::createTimeReportPass(*timeReport, name));
+  };
+  addPass(createResolveAliasesPass(), "ResolveAliases");
+  addPass(createI64LoweringPass(), "I64Lowering");
+  addPass(createSwitchToLookupTablePass(), "SwitchToLookupTable");
+  // The arena heap gives real semantics to free, the calls which may release heap memory are kept
+  addPass(createFreeAndDeleteRemovalPass(ArenaHeap), "FreeAndDeleteRemoval");
+  if (StaticFrames)
+    addPass(cheerp::createAllocaStaticFramesPass(), "AllocaStaticFrames");
+  addPass(cheerp::createGlobalDepsAnalyzerPass(), "GlobalDepsAnalyzer");
+  addPass(createIndirectCallSpeculationPass(IndirectCallTargets), "IndirectCallSpeculation");
+  addPass(createPointerArithmeticToArrayIndexingPass(), "PointerArithmeticToArrayIndexing");
+  addPass(createPointerToImmutablePHIRemovalPass(), "PointerToImmutablePHIRemoval");
+  addPass(cheerp::createRegisterizePass(NoRegisterize), "Registerize");
+  addPass(cheerp::createPointerAnalyzerPass(), "PointerAnalyzer");
+  addPass(cheerp::createAllocaMergingPass(), "AllocaMerging");
+  addPass(createIndirectCallOptimizerPass(), "IndirectCallOptimizer");
+  addPass(createAllocaArraysPass(), "AllocaArrays");
+  addPass(cheerp::createAllocaArraysMergingPass(), "AllocaArraysMerging");
+  PM.add(new CheerpWritePass(o, timeReport));
   return false;
 }
@@ -0,0 +1,92 @@
+//===- llvm/unittest/Cheerp/CheerpAllocaStaticFramesTest.cpp --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Cheerp/AllocaMerging.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/SourceMgr.h"
+#include "gtest/gtest.h"
+#include <memory>
+
+namespace llvm {
+namespace {
+
+// @f is never active more than once, so its allocas can be moved to static frames
+const char* StaticFramesModule =
+	"target datalayout = \"b-e-p:32:8-i16:8-i32:8-i64:8-f32:8-f64:8-a:0:8-f80:8-n8:16:32-S8\"\n"
+	"target triple = \"cheerp-unknown-none\"\n"
+	"%struct.S = type bytelayout { i32, i8, i16 }\n"
+	"%struct.T = type { i32, i32 }\n"
+	"define internal i32 @f(i32 %x) {\n"
+	"  %s = alloca %struct.S\n"
+	"  %sa = alloca [2 x %struct.S]\n"
+	"  %t = alloca %struct.T\n"
+	"  %a = getelementptr %struct.S* %s, i32 0, i32 0\n"
+	"  store i32 %x, i32* %a\n"
+	"  %b = getelementptr [2 x %struct.S]* %sa, i32 0, i32 1, i32 0\n"
+	"  store i32 %x, i32* %b\n"
+	"  %c = getelementptr %struct.T* %t, i32 0, i32 0\n"
+	"  store i32 %x, i32* %c\n"
+	"  %v = load i32* %a\n"
+	"  %w = load i32* %b\n"
+	"  %y = load i32* %c\n"
+	"  %r1 = add i32 %v, %w\n"
+	"  %r = add i32 %r1, %y\n"
+	"  ret i32 %r\n"
+	"}\n"
+	"define void @_Z7webMainv() {\n"
+	"  %r = call i32 @f(i32 4)\n"
+	"  ret void\n"
+	"}\n";
+
+bool hasAlloca(const Function* F, StringRef name)
+{
+	for ( const Instruction & I : F->getEntryBlock() )
+	{
+		if ( isa<AllocaInst>(I) && I.getName() == name )
+			return true;
+	}
+	return false;
+}
+
+TEST(CheerpTest, AllocaStaticFramesByteLayoutTest) {
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M( ParseAssemblyString( StaticFramesModule, NULL, Err, C ) );
+	ASSERT_TRUE( M.get() );
+
+	legacy::PassManager PM;
+	PM.add( cheerp::createAllocaStaticFramesPass() );
+	PM.run( *M );
+
+	const Function * f = M->getFunction("f");
+	ASSERT_TRUE( f );
+
+	// Byte layout objects must stay allocas, static frame globals would be plain DataViews
+	EXPECT_TRUE( hasAlloca(f, "s") );
+	EXPECT_TRUE( hasAlloca(f, "sa") );
+	// Other objects are still moved
+	EXPECT_FALSE( hasAlloca(f, "t") );
+	for ( const GlobalVariable & GV : M->getGlobalList() )
+	{
+		Type * T = GV.getType()->getPointerElementType();
+		while ( ArrayType * AT = dyn_cast<ArrayType>(T) )
+			T = AT->getElementType();
+		StructType * ST = dyn_cast<StructType>(T);
+		EXPECT_FALSE( ST && ST->hasByteLayout() );
+	}
+}
+
+}
+}
@@ -0,0 +1,101 @@
+//===- llvm/unittest/Cheerp/CheerpArrayAllocationTest.cpp -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "gtest/gtest.h"
+#include <memory>
+
+extern "C" void LLVMInitializeCheerpBackendTarget();
+extern "C" void LLVMInitializeCheerpBackendTargetInfo();
+extern "C" void LLVMInitializeCheerpBackendTargetMC();
+
+namespace llvm {
+namespace {
+
+// Allocate 1000 pointers, 2000 structs and 2 pointers with constant sizes
+const char* ArrayAllocationModule =
+	"target datalayout = \"b-e-p:32:8-i16:8-i32:8-i64:8-f32:8-f64:8-a:0:8-f80:8-n8:16:32-S8\"\n"
+	"target triple = \"cheerp-unknown-none\"\n"
+	"%struct.T = type { i32, i32* }\n"
+	"@g = global i32 5\n"
+	"declare noalias i8* @_Znaj(i32)\n"
+	"define void @_Z7webMainv() {\n"
+	"  %p = call noalias i8* @_Znaj(i32 4000)\n"
+	"  %a = bitcast i8* %p to i32**\n"
+	"  %e = getelementptr i32** %a, i32 999\n"
+	"  store i32* @g, i32** %e\n"
+	"  %q = call noalias i8* @_Znaj(i32 16000)\n"
+	"  %b = bitcast i8* %q to %struct.T*\n"
+	"  %x = getelementptr %struct.T* %b, i32 1999, i32 0\n"
+	"  store i32 7, i32* %x\n"
+	"  %r = call noalias i8* @_Znaj(i32 8)\n"
+	"  %c = bitcast i8* %r to i32**\n"
+	"  %c1 = getelementptr i32** %c, i32 1\n"
+	"  store i32* @g, i32** %c1\n"
+	"  ret void\n"
+	"}\n";
+
+unsigned countOccurrences(StringRef haystack, StringRef needle)
+{
+	unsigned count = 0;
+	for ( size_t pos = haystack.find(needle); pos != StringRef::npos; pos = haystack.find(needle, pos + needle.size()) )
+		count++;
+	return count;
+}
+
+TEST(CheerpTest, LargeArrayAllocationTest) {
+
+	LLVMInitializeCheerpBackendTargetInfo();
+	LLVMInitializeCheerpBackendTarget();
+	LLVMInitializeCheerpBackendTargetMC();
+
+	LLVMContext C;
+	SMDiagnostic Err;
+
+	std::unique_ptr<Module> M( ParseAssemblyString( ArrayAllocationModule, NULL, Err, C ) );
+	ASSERT_TRUE( M.get() );
+
+	std::string Error;
+	const Target * T = TargetRegistry::lookupTarget( M->getTargetTriple(), Error );
+	ASSERT_TRUE( T );
+	std::unique_ptr<TargetMachine> TM( T->createTargetMachine( M->getTargetTriple(), "", "", TargetOptions() ) );
+	ASSERT_TRUE( TM.get() );
+
+	std::string JS;
+	{
+		raw_string_ostream OS(JS);
+		formatted_raw_ostream FOS(OS);
+		PassManager PM;
+		PM.add( new DataLayoutPass( M.get() ) );
+		ASSERT_FALSE( TM->addPassesToEmitFile( PM, FOS, TargetMachine::CGFT_AssemblyFile ) );
+		PM.run( *M );
+	}
+
+	// Large arrays are filled by a loop, all the pointer slots share the same null object
+	EXPECT_NE( std::string::npos, JS.find("createPointerArray([],0,4000/4,nullObj)") );
+	EXPECT_NE( std::string::npos, JS.find("ret[__i__]=nullPtr") );
+	EXPECT_EQ( std::string::npos, JS.find("d: nullArray") );
+	EXPECT_NE( std::string::npos, JS.find("createArray") );
+	EXPECT_NE( std::string::npos, JS.find("([],0,16000/8)") );
+	// Small arrays are still literals
+	EXPECT_NE( std::string::npos, JS.find("[nullObj,nullObj]") );
+	EXPECT_GT( 10u, countOccurrences(JS, "nullObj") );
+}
+
+}
+}
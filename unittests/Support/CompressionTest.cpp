@@ -15,6 +15,7 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Config/config.h"
 #include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
 #include "gtest/gtest.h"
 
 using namespace llvm;
@@ -62,6 +63,36 @@ TEST(CompressionTest, Zlib) {
   TestZlibCompression(BinaryDataStr, zlib::DefaultCompression);
 }
 
+TEST(CompressionTest, GzipStream) {
+  std::string Input;
+  for (size_t i = 0; i < 100000; ++i)
+    Input += "line " + std::to_string(i % 97) + "\n";
+  std::string Compressed;
+  {
+    raw_string_ostream OS(Compressed);
+    zlib::GzipCompressor Compressor(OS, zlib::DefaultCompression);
+    // Compress in uneven pieces
+    for (size_t i = 0; i < Input.size(); i += 7919)
+      EXPECT_EQ(zlib::StatusOK,
+                Compressor.compress(StringRef(Input).substr(i, 7919)));
+    EXPECT_EQ(zlib::StatusOK, Compressor.finish());
+  }
+  ASSERT_LT(18U, Compressed.size());
+  EXPECT_LT(Compressed.size(), Input.size() / 10);
+  // The gzip magic number
+  EXPECT_EQ(0x1f, (unsigned char)Compressed[0]);
+  EXPECT_EQ(0x8b, (unsigned char)Compressed[1]);
+  // The trailer is the CRC32 and the size of the input, in little endian
+  const unsigned char *Trailer =
+      (const unsigned char *)Compressed.data() + Compressed.size() - 8;
+  uint32_t CRC = Trailer[0] | Trailer[1] << 8 | Trailer[2] << 16 |
+                 (uint32_t)Trailer[3] << 24;
+  uint32_t Size = Trailer[4] | Trailer[5] << 8 | Trailer[6] << 16 |
+                  (uint32_t)Trailer[7] << 24;
+  EXPECT_EQ(zlib::crc32(Input), CRC);
+  EXPECT_EQ(Input.size(), Size);
+}
+
 TEST(CompressionTest, ZlibCRC32) {
   EXPECT_EQ(
       0x414FA339U,